@@ -0,0 +1,80 @@
+#include "BatchDecoder.hh"
+
+BatchDecoder::BatchDecoder(TPLexPrefixTree &lexicon, Vocabulary &vocabulary,
+                           int num_threads) :
+  m_lexicon(lexicon),
+  m_vocabulary(vocabulary),
+  m_thread_pool(num_threads),
+  m_frames_per_step(10)
+{
+}
+
+BatchDecoder::~BatchDecoder()
+{
+  for (int i = 0; i < m_streams.size(); i++)
+    if (m_streams[i].owned)
+      delete m_streams[i].search;
+}
+
+int BatchDecoder::add_stream(Acoustics *acoustics)
+{
+  Stream stream;
+  stream.search = new TokenPassSearch(m_lexicon, m_vocabulary, acoustics);
+  stream.owned = true;
+  stream.finished = true;
+  m_streams.push_back(stream);
+  return m_streams.size() - 1;
+}
+
+int BatchDecoder::add_stream(TokenPassSearch *search)
+{
+  Stream stream;
+  stream.search = search;
+  stream.owned = false;
+  stream.finished = true;
+  m_streams.push_back(stream);
+  return m_streams.size() - 1;
+}
+
+void BatchDecoder::share_lm_lookahead_cache()
+{
+  for (int i = 0; i < m_streams.size(); i++)
+    m_streams[i].search->set_lm_lookahead_cache(&m_lm_lookahead_cache);
+}
+
+void BatchDecoder::reset(int stream, int start_frame)
+{
+  m_streams[stream].search->reset_search(start_frame);
+  m_streams[stream].finished = false;
+}
+
+int BatchDecoder::run_frames(int max_frames)
+{
+  m_running_streams.clear();
+  for (int i = 0; i < m_streams.size(); i++)
+    if (!m_streams[i].finished)
+      m_running_streams.push_back(i);
+
+  // Each task decodes one stream, so the streams never share mutable state.
+  m_thread_pool.run(m_running_streams.size(), [&](int task) {
+      Stream &stream = m_streams[m_running_streams[task]];
+      for (int frame = 0; frame < max_frames; frame++) {
+        if (!stream.search->run()) {
+          stream.finished = true;
+          break;
+        }
+      }
+    });
+
+  int num_running = 0;
+  for (int i = 0; i < m_running_streams.size(); i++)
+    if (!m_streams[m_running_streams[i]].finished)
+      num_running++;
+  return num_running;
+}
+
+void BatchDecoder::run()
+{
+  while (run_frames(m_frames_per_step) > 0)
+    ;
+}
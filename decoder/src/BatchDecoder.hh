@@ -0,0 +1,113 @@
+#ifndef BATCHDECODER_HH
+#define BATCHDECODER_HH
+
+#include <vector>
+
+#include "TPLexPrefixTree.hh"
+#include "TokenPassSearch.hh"
+#include "ThreadPool.hh"
+
+/// \brief Decodes several utterances at the same time over one lexical prefix
+/// tree.
+///
+/// Every stream has its own TokenPassSearch and Acoustics, but they all share
+/// the same TPLexPrefixTree and Vocabulary, which are not modified while
+/// decoding. The streams are decoded a few frames at a time, distributing the
+/// streams to a pool of threads.
+///
+/// The language models keep lookup state in member variables, so when more
+/// than one thread is used, each search should be given its own language
+/// model objects. Toolbox::add_stream() creates streams that read their own
+/// language models.
+///
+class BatchDecoder {
+public:
+  /// \param num_threads The number of threads used for decoding, including
+  /// the calling thread.
+  ///
+  BatchDecoder(TPLexPrefixTree &lexicon, Vocabulary &vocabulary,
+               int num_threads = 1);
+
+  /// \brief Deletes the searches that were created by add_stream(). The
+  /// acoustics are owned by the caller.
+  ///
+  ~BatchDecoder();
+
+  /// \brief Creates a search for a new stream.
+  ///
+  /// The search should be configured using search() before calling
+  /// reset().
+  ///
+  /// \return The index of the new stream.
+  ///
+  int add_stream(Acoustics *acoustics);
+
+  /// \brief Adds a stream that is decoded with a search owned by the caller.
+  ///
+  /// The search has to use the lexicon and the vocabulary of this decoder,
+  /// and it is not deleted with the decoder.
+  ///
+  /// \return The index of the new stream.
+  ///
+  int add_stream(TokenPassSearch *search);
+
+  int num_streams() const { return m_streams.size(); }
+
+  TokenPassSearch &search(int stream) { return *m_streams[stream].search; }
+
+  /// \brief Resets the search of a stream to start decoding from
+  /// \a start_frame.
+  ///
+  void reset(int stream, int start_frame = 0);
+
+  /// \brief Marks a stream unfinished without resetting its search, after
+  /// the caller has reset the search itself.
+  ///
+  void resume(int stream) { m_streams[stream].finished = false; }
+
+  /// \brief Returns true if the stream has reached the end of its input.
+  ///
+  bool finished(int stream) const { return m_streams[stream].finished; }
+
+  /// \brief Decodes up to \a max_frames frames of every unfinished stream.
+  ///
+  /// \return The number of streams that are still unfinished.
+  ///
+  int run_frames(int max_frames);
+
+  /// \brief Decodes all the streams until the end of their input.
+  ///
+  void run();
+
+  /// \brief Sets how many frames of a stream are decoded at a time in run().
+  ///
+  void set_frames_per_step(int frames) { m_frames_per_step = frames; }
+
+  /// \brief Makes the searches of all the current streams use one LM
+  /// lookahead cache, so that the score lists computed by one stream are
+  /// reused by the others.
+  ///
+  /// All the streams have to use the same lookahead language model.
+  ///
+  void share_lm_lookahead_cache();
+
+private:
+  struct Stream {
+    TokenPassSearch *search;
+    bool owned;
+    bool finished;
+  };
+
+  TPLexPrefixTree &m_lexicon;
+  Vocabulary &m_vocabulary;
+  std::vector<Stream> m_streams;
+
+  /// The unfinished streams, collected for each step.
+  std::vector<int> m_running_streams;
+
+  ThreadPool m_thread_pool;
+  LMLookaheadCache m_lm_lookahead_cache;
+  int m_frames_per_step;
+};
+
+#endif // BATCHDECODER_HH
@@ -0,0 +1,44 @@
+#include "BeamController.hh"
+
+BeamController::BeamController() :
+  m_target(NONE),
+  m_target_value(0),
+  m_min_beam(0),
+  m_max_beam(0),
+  m_hysteresis(0.1),
+  m_increase_factor(1.05),
+  m_decrease_factor(0.9),
+  m_max_steps(DEFAULT_MAX_STEPS)
+{
+}
+
+float BeamController::update(int frame, double measured, float beam,
+                             float global_beam)
+{
+  if (measured > m_target_value * (1 + m_hysteresis))
+    beam *= m_decrease_factor;
+  else if (measured < m_target_value * (1 - m_hysteresis))
+    beam *= m_increase_factor;
+
+  float max_beam = m_max_beam > 0 ? m_max_beam : global_beam;
+  if (beam > max_beam)
+    beam = max_beam;
+  if (beam < m_min_beam)
+    beam = m_min_beam;
+
+  Step step;
+  step.frame = frame;
+  step.measured = measured;
+  step.beam = beam;
+  m_trajectory.push_back(step);
+  if ((int)m_trajectory.size() > m_max_steps)
+    m_trajectory.pop_front();
+  return beam;
+}
+
+void BeamController::write_trajectory(FILE *file) const
+{
+  for (int i = 0; i < m_trajectory.size(); i++)
+    fprintf(file, "%d %g %.3f\n", m_trajectory[i].frame,
+            m_trajectory[i].measured, m_trajectory[i].beam);
+}
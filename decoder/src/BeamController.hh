@@ -0,0 +1,111 @@
+#ifndef BEAMCONTROLLER_HH
+#define BEAMCONTROLLER_HH
+
+#include <cstdio>
+#include <deque>
+
+/// \brief Adjusts the global beam of a search after every frame to keep the
+/// number of active tokens or the time per frame near a target.
+///
+/// The beam is multiplied by the increase factor when the measured value is
+/// below the target and by the decrease factor when it is above. Within the
+/// hysteresis band around the target the beam is not changed. The beam is
+/// always kept between the minimum and maximum beam.
+///
+class BeamController {
+public:
+  enum Target { NONE, TOKENS, TIME };
+
+  /// \brief The state of the controller after one frame.
+  ///
+  struct Step {
+    int frame;
+    double measured;
+    float beam;
+  };
+
+  BeamController();
+
+  /// \brief Selects what to control.
+  ///
+  /// \param target NONE to disable the controller, TOKENS for the number of
+  /// active tokens after pruning, or TIME for the seconds spent decoding a
+  /// frame.
+  ///
+  void set_target(Target target, double value)
+  {
+    m_target = target;
+    m_target_value = value;
+  }
+
+  Target target() const { return m_target; }
+  double target_value() const { return m_target_value; }
+  bool enabled() const { return m_target != NONE; }
+
+  /// \brief Sets the range of the beam.
+  ///
+  /// \param max_beam The maximum beam, or 0 to use the global beam of the
+  /// search.
+  ///
+  void set_bounds(float min_beam, float max_beam)
+  {
+    m_min_beam = min_beam;
+    m_max_beam = max_beam;
+  }
+
+  /// \brief Sets the relative width of the band around the target where the
+  /// beam is not changed, e.g. 0.1 for +-10 %.
+  ///
+  void set_hysteresis(double hysteresis) { m_hysteresis = hysteresis; }
+
+  void set_factors(double increase, double decrease)
+  {
+    m_increase_factor = increase;
+    m_decrease_factor = decrease;
+  }
+
+  /// \brief Computes the beam for the next frame and adds it to the
+  /// trajectory.
+  ///
+  /// \param measured The number of tokens or the frame time.
+  /// \param beam The current beam.
+  /// \param global_beam The global beam of the search, which is the maximum
+  /// unless set_bounds() has given another one.
+  ///
+  float update(int frame, double measured, float beam, float global_beam);
+
+  const std::deque<Step> &trajectory() const { return m_trajectory; }
+
+  /// \brief Sets the maximum number of steps kept in the trajectory. The
+  /// oldest steps are dropped first. The default is 100000 steps.
+  ///
+  void set_max_steps(int steps)
+  {
+    m_max_steps = steps;
+    while ((int)m_trajectory.size() > m_max_steps)
+      m_trajectory.pop_front();
+  }
+
+  int max_steps() const { return m_max_steps; }
+
+  void clear_trajectory() { m_trajectory.clear(); }
+
+  /// \brief Writes the trajectory, one frame per line.
+  ///
+  void write_trajectory(FILE *file) const;
+
+private:
+  enum { DEFAULT_MAX_STEPS = 100000 };
+
+  Target m_target;
+  double m_target_value;
+  float m_min_beam;
+  float m_max_beam;
+  double m_hysteresis;
+  double m_increase_factor;
+  double m_decrease_factor;
+  std::deque<Step> m_trajectory;
+  int m_max_steps;
+};
+
+#endif // BEAMCONTROLLER_HH
@@ -0,0 +1,433 @@
+#include <algorithm>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "BinaryLattice.hh"
+
+// The first byte is not ASCII, so a binary lattice can be told apart from
+// SLF by its first byte.
+const char BinaryLattice::magic[8] =
+  { '\x89', 'L', 'A', 'T', '\r', '\n', '\x1a', '\n' };
+
+static const int32_t format_version = 1;
+
+static bool host_is_little_endian()
+{
+  uint32_t value = 1;
+  return *reinterpret_cast<const char*>(&value) == 1;
+}
+
+// All the fields of the tables are four bytes long, so converting the byte
+// order of the tables means reversing every four bytes.
+static void swap_words(void *data, size_t num_words)
+{
+  char *bytes = static_cast<char*>(data);
+  for (size_t i = 0; i < num_words; i++, bytes += 4) {
+    std::swap(bytes[0], bytes[3]);
+    std::swap(bytes[1], bytes[2]);
+  }
+}
+
+static void swap_header(BinaryLattice::Header &header)
+{
+  swap_words(&header.version,
+             (sizeof(BinaryLattice::Header) - sizeof(header.magic)) / 4);
+}
+
+BinaryLattice::BinaryLattice()
+{
+  clear();
+}
+
+void BinaryLattice::clear()
+{
+  start_node = -1;
+  end_node = -1;
+  lm_scale = 1;
+  insertion_penalty = 0;
+  nodes.clear();
+  arcs.clear();
+  strings.clear();
+  m_word_offsets.clear();
+}
+
+int BinaryLattice::add_node(int frame)
+{
+  Node node;
+  node.frame = frame;
+  nodes.push_back(node);
+  return nodes.size() - 1;
+}
+
+int BinaryLattice::add_word(const std::string &word)
+{
+  std::map<std::string, int>::iterator it = m_word_offsets.find(word);
+  if (it != m_word_offsets.end())
+    return it->second;
+  int offset = strings.size();
+  strings.insert(strings.end(), word.begin(), word.end());
+  strings.push_back('\0');
+  m_word_offsets[word] = offset;
+  return offset;
+}
+
+void BinaryLattice::add_arc(int source_node, int target_node, int word,
+                            float am_log_prob, float lm_log_prob)
+{
+  Arc arc;
+  arc.source_node = source_node;
+  arc.target_node = target_node;
+  arc.word = word;
+  arc.am_log_prob = am_log_prob;
+  arc.lm_log_prob = lm_log_prob;
+  arcs.push_back(arc);
+}
+
+void BinaryLattice::write(FILE *file) const
+{
+  Header header;
+  memcpy(header.magic, magic, sizeof(magic));
+  header.version = format_version;
+  header.num_nodes = nodes.size();
+  header.num_arcs = arcs.size();
+  header.string_table_size = strings.size();
+  header.start_node = start_node;
+  header.end_node = end_node;
+  header.lm_scale = lm_scale;
+  header.insertion_penalty = insertion_penalty;
+
+  if (host_is_little_endian()) {
+    fwrite(&header, sizeof(Header), 1, file);
+    if (!nodes.empty())
+      fwrite(nodes.data(), sizeof(Node), nodes.size(), file);
+    if (!arcs.empty())
+      fwrite(arcs.data(), sizeof(Arc), arcs.size(), file);
+  }
+  else {
+    std::vector<Node> swapped_nodes(nodes);
+    std::vector<Arc> swapped_arcs(arcs);
+    swap_header(header);
+    swap_words(swapped_nodes.data(), nodes.size() * sizeof(Node) / 4);
+    swap_words(swapped_arcs.data(), arcs.size() * sizeof(Arc) / 4);
+    fwrite(&header, sizeof(Header), 1, file);
+    if (!nodes.empty())
+      fwrite(swapped_nodes.data(), sizeof(Node), nodes.size(), file);
+    if (!arcs.empty())
+      fwrite(swapped_arcs.data(), sizeof(Arc), arcs.size(), file);
+  }
+  if (!strings.empty())
+    fwrite(strings.data(), 1, strings.size(), file);
+
+  if (ferror(file))
+    throw IOError("BinaryLattice::write: Unable to write the lattice.");
+}
+
+// The table is read in chunks, so that a corrupt size in the header makes
+// the read fail at the end of the file instead of allocating the whole size.
+template <class T>
+static void read_table(FILE *file, std::vector<T> &table, int size)
+{
+  const int chunk_size = (1 << 20) / sizeof(T);
+  table.clear();
+  while (table.size() < size) {
+    int old_size = table.size();
+    int count = std::min(size - old_size, chunk_size);
+    table.resize(old_size + count);
+    if (fread(&table[old_size], sizeof(T), count, file) != count)
+      throw BinaryLattice::FormatError(
+        "BinaryLattice::read: The lattice is truncated.");
+  }
+}
+
+void BinaryLattice::read(FILE *file)
+{
+  clear();
+
+  Header header;
+  if (fread(&header, sizeof(Header), 1, file) != 1 ||
+      memcmp(header.magic, magic, sizeof(magic)) != 0)
+  {
+    throw FormatError("BinaryLattice::read: Not a binary lattice.");
+  }
+  bool swap = !host_is_little_endian();
+  if (swap)
+    swap_header(header);
+  if (header.version != format_version)
+    throw FormatError("BinaryLattice::read: Unsupported version.");
+  if (header.num_nodes < 0 || header.num_arcs < 0 ||
+      header.string_table_size < 0)
+  {
+    throw FormatError("BinaryLattice::read: Invalid header.");
+  }
+
+  read_table(file, nodes, header.num_nodes);
+  read_table(file, arcs, header.num_arcs);
+  read_table(file, strings, header.string_table_size);
+  if (swap) {
+    swap_words(nodes.data(), nodes.size() * sizeof(Node) / 4);
+    swap_words(arcs.data(), arcs.size() * sizeof(Arc) / 4);
+  }
+  start_node = header.start_node;
+  end_node = header.end_node;
+  lm_scale = header.lm_scale;
+  insertion_penalty = header.insertion_penalty;
+
+  // Validate the indices, so that the lattice can be used safely.
+  int num_nodes = nodes.size();
+  if (start_node < -1 || start_node >= num_nodes ||
+      end_node < -1 || end_node >= num_nodes ||
+      (!strings.empty() && strings.back() != '\0'))
+  {
+    throw FormatError("BinaryLattice::read: Invalid lattice.");
+  }
+  for (int i = 0; i < arcs.size(); i++) {
+    const Arc &arc = arcs[i];
+    if (arc.source_node < 0 || arc.source_node >= num_nodes ||
+        arc.target_node < 0 || arc.target_node >= num_nodes ||
+        arc.word < 0 || arc.word >= strings.size())
+    {
+      throw FormatError("BinaryLattice::read: Invalid arc.");
+    }
+  }
+
+  for (int offset = 0; offset < strings.size();
+       offset += strlen(&strings[offset]) + 1)
+    m_word_offsets[&strings[offset]] = offset;
+}
+
+void BinaryLattice::write_slf(FILE *file) const
+{
+  fprintf(file, "VERSION=1.1\n"
+          "base=10\n"
+          "dir=f\n"
+          "lmscale=%f wdpenalty=%f\n"
+          "N=%d\tL=%d\n"
+          "start=%d end=%d\n", lm_scale, insertion_penalty,
+          (int)nodes.size(), (int)arcs.size(), start_node, end_node);
+  for (int n = 0; n < nodes.size(); n++)
+    fprintf(file, "I=%d\tt=%d\n", n, nodes[n].frame);
+  for (int a = 0; a < arcs.size(); a++) {
+    const Arc &arc = arcs[a];
+    fprintf(file, "J=%d\tS=%d\tE=%d\tW=%s\tv=0\ta=%e\tl=%e\n", a,
+            arc.source_node, arc.target_node, word(arc), arc.am_log_prob,
+            arc.lm_log_prob);
+  }
+}
+
+static bool read_line(FILE *file, std::string &line)
+{
+  char buffer[4096];
+  line.clear();
+  while (fgets(buffer, sizeof(buffer), file) != NULL) {
+    line += buffer;
+    if (line[line.size() - 1] == '\n')
+      return true;
+  }
+  return !line.empty();
+}
+
+static int parse_int(const std::string &value)
+{
+  char *end;
+  long result = strtol(value.c_str(), &end, 10);
+  if (value.empty() || *end != '\0')
+    throw BinaryLattice::FormatError("BinaryLattice::read_slf: Invalid "
+                                     "number: " + value);
+  return result;
+}
+
+static float parse_float(const std::string &value)
+{
+  char *end;
+  double result = strtod(value.c_str(), &end);
+  if (value.empty() || *end != '\0')
+    throw BinaryLattice::FormatError("BinaryLattice::read_slf: Invalid "
+                                     "number: " + value);
+  return result;
+}
+
+void BinaryLattice::read_slf(FILE *file)
+{
+  clear();
+
+  // The nodes are numbered in the order they are defined, and the arcs are
+  // mapped to the new numbers at the end.
+  std::map<int, int> node_numbers;
+  int start_label = -1;
+  int end_label = -1;
+  std::string line;
+  std::vector<std::pair<std::string, std::string> > fields;
+  while (read_line(file, line)) {
+    std::string::size_type comment = line.find('#');
+    if (comment != std::string::npos)
+      line.erase(comment);
+
+    fields.clear();
+    const char *whitespace = " \t\r\n";
+    std::string::size_type begin = line.find_first_not_of(whitespace);
+    while (begin != std::string::npos) {
+      std::string::size_type end = line.find_first_of(whitespace, begin);
+      std::string field = line.substr(begin, end - begin);
+      std::string::size_type equals = field.find('=');
+      if (equals == std::string::npos)
+        throw FormatError("BinaryLattice::read_slf: Invalid field: " + field);
+      fields.push_back(std::make_pair(field.substr(0, equals),
+                                      field.substr(equals + 1)));
+      begin = line.find_first_not_of(whitespace, end);
+    }
+    if (fields.empty())
+      continue;
+
+    if (fields[0].first == "I") {
+      int label = parse_int(fields[0].second);
+      // The node times are frame numbers, as written by the decoder. The
+      // initial node of a word graph is at frame -1. HTK gives the times in
+      // seconds, which cannot be converted without the frame rate, so
+      // fractional times are rejected.
+      float time = 0;
+      for (int i = 1; i < fields.size(); i++)
+        if (fields[i].first == "t")
+          time = parse_float(fields[i].second);
+      if (time != floor(time) || time < -1 || time > 0x7fffffff)
+        throw FormatError("BinaryLattice::read_slf: The time of node " +
+                          fields[0].second + " is not a frame number.");
+      node_numbers[label] = add_node((int)time);
+    }
+    else if (fields[0].first == "J") {
+      Arc arc;
+      arc.source_node = -1;
+      arc.target_node = -1;
+      arc.word = -1;
+      arc.am_log_prob = 0;
+      arc.lm_log_prob = 0;
+      for (int i = 1; i < fields.size(); i++) {
+        const std::string &key = fields[i].first;
+        const std::string &value = fields[i].second;
+        if (key == "S")
+          arc.source_node = parse_int(value);
+        else if (key == "E")
+          arc.target_node = parse_int(value);
+        else if (key == "W")
+          arc.word = add_word(value);
+        else if (key == "a")
+          arc.am_log_prob = parse_float(value);
+        else if (key == "l")
+          arc.lm_log_prob = parse_float(value);
+      }
+      if (arc.source_node < 0 || arc.target_node < 0 || arc.word < 0)
+        throw FormatError("BinaryLattice::read_slf: Arc without S, E or W.");
+      arcs.push_back(arc);
+    }
+    else {
+      for (int i = 0; i < fields.size(); i++) {
+        const std::string &key = fields[i].first;
+        const std::string &value = fields[i].second;
+        if (key == "start")
+          start_label = parse_int(value);
+        else if (key == "end")
+          end_label = parse_int(value);
+        else if (key == "lmscale")
+          lm_scale = parse_float(value);
+        else if (key == "wdpenalty")
+          insertion_penalty = parse_float(value);
+      }
+    }
+  }
+
+  std::map<int, int>::const_iterator it;
+  for (int i = 0; i < arcs.size(); i++) {
+    Arc &arc = arcs[i];
+    it = node_numbers.find(arc.source_node);
+    if (it == node_numbers.end())
+      throw FormatError("BinaryLattice::read_slf: Undefined node.");
+    arc.source_node = it->second;
+    it = node_numbers.find(arc.target_node);
+    if (it == node_numbers.end())
+      throw FormatError("BinaryLattice::read_slf: Undefined node.");
+    arc.target_node = it->second;
+  }
+  it = node_numbers.find(start_label);
+  start_node = it != node_numbers.end() ? it->second : -1;
+  it = node_numbers.find(end_label);
+  end_node = it != node_numbers.end() ? it->second : -1;
+}
+
+MappedBinaryLattice::MappedBinaryLattice() :
+  m_map(NULL),
+  m_map_size(0),
+  m_header(NULL),
+  m_nodes(NULL),
+  m_arcs(NULL),
+  m_strings(NULL)
+{
+}
+
+void MappedBinaryLattice::open(const std::string &path)
+{
+  close();
+
+  if (!host_is_little_endian())
+    throw BinaryLattice::FormatError(
+      "MappedBinaryLattice::open: Big-endian hosts are not supported.");
+
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw BinaryLattice::IOError("MappedBinaryLattice::open: Unable to open " +
+                                 path);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    ::close(fd);
+    throw BinaryLattice::IOError("MappedBinaryLattice::open: Unable to stat " +
+                                 path);
+  }
+  if (st.st_size < sizeof(BinaryLattice::Header)) {
+    ::close(fd);
+    throw BinaryLattice::FormatError("MappedBinaryLattice::open: " + path +
+                                     " is too short.");
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED)
+    throw BinaryLattice::IOError("MappedBinaryLattice::open: Unable to map " +
+                                 path);
+
+  const BinaryLattice::Header *header =
+    static_cast<const BinaryLattice::Header*>(map);
+  size_t expected_size = sizeof(BinaryLattice::Header)
+    + (size_t)header->num_nodes * sizeof(BinaryLattice::Node)
+    + (size_t)header->num_arcs * sizeof(BinaryLattice::Arc)
+    + header->string_table_size;
+  if (memcmp(header->magic, BinaryLattice::magic, sizeof(header->magic)) != 0
+      || header->version != format_version || header->num_nodes < 0
+      || header->num_arcs < 0 || header->string_table_size < 0
+      || expected_size != st.st_size)
+  {
+    munmap(map, st.st_size);
+    throw BinaryLattice::FormatError("MappedBinaryLattice::open: " + path +
+                                     " is not a valid binary lattice.");
+  }
+
+  m_map = map;
+  m_map_size = st.st_size;
+  m_header = header;
+  m_nodes = reinterpret_cast<const BinaryLattice::Node*>(header + 1);
+  m_arcs = reinterpret_cast<const BinaryLattice::Arc*>(
+    m_nodes + header->num_nodes);
+  m_strings = reinterpret_cast<const char*>(m_arcs + header->num_arcs);
+}
+
+void MappedBinaryLattice::close()
+{
+  if (m_map != NULL)
+    munmap(m_map, m_map_size);
+  m_map = NULL;
+  m_map_size = 0;
+  m_header = NULL;
+  m_nodes = NULL;
+  m_arcs = NULL;
+  m_strings = NULL;
+}
@@ -0,0 +1,185 @@
+#ifndef BINARYLATTICE_HH
+#define BINARYLATTICE_HH
+
+#include <stdint.h>
+#include <stdio.h>
+#include <map>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+/// \brief A lattice in a compact binary format.
+///
+/// The format is an alternative to the Standard Lattice Format (SLF) that
+/// can be written and read with a few block reads and writes, and used in
+/// place from a memory-mapped file. All the values are little-endian:
+///
+/// - the header (see Header)
+/// - the node table: the frame of each node as int32
+/// - the arc table: the source node, target node and word of each arc as
+///   int32, and the acoustic and language model log probabilities as float
+/// - the string table: the words, each terminated by a zero byte
+///
+/// The word of an arc is its offset in the string table, so the file
+/// contains no pointers. The log probabilities are the same as in the
+/// "a" and "l" fields of SLF.
+///
+/// The file does not depend on the rest of the decoder, so the tools that
+/// read lattices compile it from the decoder sources.
+///
+class BinaryLattice {
+public:
+  struct IOError: public std::runtime_error
+  {
+    IOError(const std::string & message) :
+      std::runtime_error(message)
+    {
+    }
+  };
+
+  struct FormatError: public std::runtime_error
+  {
+    FormatError(const std::string & message) :
+      std::runtime_error(message)
+    {
+    }
+  };
+
+  struct Header {
+    char magic[8];
+    int32_t version;
+    int32_t num_nodes;
+    int32_t num_arcs;
+    int32_t string_table_size;
+    int32_t start_node;
+    int32_t end_node;
+    float lm_scale;
+    float insertion_penalty;
+  };
+
+  struct Node {
+    int32_t frame;
+  };
+
+  struct Arc {
+    int32_t source_node;
+    int32_t target_node;
+    int32_t word; //!< The offset of the word in the string table.
+    float am_log_prob;
+    float lm_log_prob;
+  };
+
+  BinaryLattice();
+
+  void clear();
+
+  /// \brief Returns true if \a c is the first byte of a binary lattice. It
+  /// cannot be the first byte of an SLF file.
+  ///
+  static bool is_binary(int c) { return c == (unsigned char)magic[0]; }
+
+  int add_node(int frame);
+
+  /// \brief Adds a word to the string table, unless it is there already.
+  ///
+  /// \return The offset of the word.
+  ///
+  int add_word(const std::string &word);
+
+  void add_arc(int source_node, int target_node, int word, float am_log_prob,
+               float lm_log_prob);
+
+  void add_arc(int source_node, int target_node, const std::string &word,
+               float am_log_prob, float lm_log_prob)
+  {
+    add_arc(source_node, target_node, add_word(word), am_log_prob,
+            lm_log_prob);
+  }
+
+  const char *word(const Arc &arc) const { return &strings[arc.word]; }
+
+  /// \brief Writes the lattice in the binary format.
+  ///
+  /// \exception IOError If unable to write the file.
+  ///
+  void write(FILE *file) const;
+
+  /// \brief Reads a lattice in the binary format. The file does not have to
+  /// be seekable.
+  ///
+  /// \exception FormatError If the file is not a valid binary lattice.
+  ///
+  void read(FILE *file);
+
+  /// \brief Writes the lattice in SLF.
+  ///
+  void write_slf(FILE *file) const;
+
+  /// \brief Reads a lattice in SLF. Only the node times and the S, E, W, a
+  /// and l fields of the arcs are read.
+  ///
+  /// The node times have to be frame numbers, as in the lattices written by
+  /// the decoder, where the initial node is at frame -1. Lattices with times in seconds, as in standard HTK SLF, are
+  /// not accepted.
+  ///
+  /// \exception FormatError If the file is not valid SLF, or a node time is
+  /// not a frame number.
+  ///
+  void read_slf(FILE *file);
+
+  int start_node;
+  int end_node;
+  float lm_scale;
+  float insertion_penalty;
+  std::vector<Node> nodes;
+  std::vector<Arc> arcs;
+  std::vector<char> strings; //!< The string table.
+
+  static const char magic[8];
+
+private:
+  std::map<std::string, int> m_word_offsets;
+};
+
+/// \brief A read-only binary lattice that is used in place from a
+/// memory-mapped file, so that opening it takes constant time.
+///
+/// The tables can be used in place only on little-endian hosts. The indices
+/// in the file are not validated.
+///
+class MappedBinaryLattice {
+public:
+  MappedBinaryLattice();
+  ~MappedBinaryLattice() { close(); }
+
+  /// \exception BinaryLattice::IOError If unable to map the file.
+  /// \exception BinaryLattice::FormatError If the file is not a binary
+  /// lattice, or the host is big-endian.
+  ///
+  void open(const std::string &path);
+  void close();
+
+  const BinaryLattice::Header &header() const { return *m_header; }
+  int num_nodes() const { return m_header->num_nodes; }
+  int num_arcs() const { return m_header->num_arcs; }
+  const BinaryLattice::Node &node(int index) const { return m_nodes[index]; }
+  const BinaryLattice::Arc &arc(int index) const { return m_arcs[index]; }
+  const char *word(const BinaryLattice::Arc &arc) const
+  {
+    return m_strings + arc.word;
+  }
+
+private:
+  // Mapped files cannot be copied.
+  MappedBinaryLattice(const MappedBinaryLattice&);
+  MappedBinaryLattice &operator=(const MappedBinaryLattice&);
+
+  void *m_map;
+  size_t m_map_size;
+  const BinaryLattice::Header *m_header;
+  const BinaryLattice::Node *m_nodes;
+  const BinaryLattice::Arc *m_arcs;
+  const char *m_strings;
+};
+
+#endif // BINARYLATTICE_HH
@@ -0,0 +1,93 @@
+#ifndef HISTORYARENA_HH
+#define HISTORYARENA_HH
+
+#include <new>
+#include <vector>
+
+/// \brief Slab allocator for reference counted history structures.
+///
+/// Storage is allocated in blocks of \a block_size objects and never given
+/// back to the system until the arena is destroyed. Objects that are freed
+/// by hist::unlink() are put in the free list returned by pool(), and
+/// reset() frees all the objects at once, starting a new generation.
+///
+/// The objects are constructed by the caller using placement new, and their
+/// destructors are never called, so T must be trivially destructible.
+///
+template <class T>
+class HistoryArena {
+public:
+  HistoryArena(int block_size = 1024)
+    : m_block_size(block_size), m_peak_live(0), m_generation(0) { }
+
+  ~HistoryArena()
+  {
+    for (int i = 0; i < m_blocks.size(); i++)
+      ::operator delete(m_blocks[i]);
+  }
+
+  /// \brief Returns uninitialized storage for one object.
+  ///
+  void *allocate()
+  {
+    if (m_free.empty())
+      add_block();
+    T *t = m_free.back();
+    m_free.pop_back();
+    if (num_live() > m_peak_live)
+      m_peak_live = num_live();
+    return t;
+  }
+
+  /// \brief The free list, to be passed to hist::unlink().
+  ///
+  std::vector<T*> *pool() { return &m_free; }
+
+  /// \brief Frees all the objects and resets the peak counter.
+  ///
+  /// Any pointers to the objects become invalid.
+  ///
+  void reset()
+  {
+    m_free.clear();
+    for (int i = m_blocks.size() - 1; i >= 0; i--)
+      for (int j = m_block_size - 1; j >= 0; j--)
+        m_free.push_back(&m_blocks[i][j]);
+    m_peak_live = 0;
+    m_generation++;
+  }
+
+  /// \brief Returns the number of objects currently allocated.
+  ///
+  int num_live() const { return m_blocks.size() * m_block_size - m_free.size(); }
+
+  /// \brief Returns the maximum number of objects allocated at the same time
+  /// since the last reset.
+  ///
+  int peak_live() const { return m_peak_live; }
+
+  /// \brief Returns the number of objects that fit in the allocated blocks.
+  ///
+  int capacity() const { return m_blocks.size() * m_block_size; }
+
+  /// \brief Returns the number of times reset() has been called.
+  ///
+  unsigned int generation() const { return m_generation; }
+
+private:
+  void add_block()
+  {
+    T *block = static_cast<T*>(::operator new(m_block_size * sizeof(T)));
+    m_blocks.push_back(block);
+    for (int i = m_block_size - 1; i >= 0; i--)
+      m_free.push_back(&block[i]);
+  }
+
+  int m_block_size;
+  std::vector<T*> m_blocks;
+  std::vector<T*> m_free;
+  int m_peak_live;
+  unsigned int m_generation;
+};
+
+#endif // HISTORYARENA_HH
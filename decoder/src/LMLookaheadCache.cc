@@ -0,0 +1,83 @@
+#include "LMLookaheadCache.hh"
+
+LMLookaheadCache::LMLookaheadCache(int max_items, int num_shards) :
+  m_shards(num_shards > 0 ? num_shards : 1),
+  m_max_items(max_items),
+  m_num_hits(0),
+  m_num_misses(0)
+{
+}
+
+LMLookaheadCache::ScoreList LMLookaheadCache::find(int key)
+{
+  Shard &s = shard(key);
+  std::lock_guard<std::mutex> lock(s.mutex);
+  std::unordered_map<int, ScoreList>::const_iterator iter = s.items.find(key);
+  if (iter == s.items.end()) {
+    m_num_misses++;
+    return ScoreList();
+  }
+  m_num_hits++;
+  return iter->second;
+}
+
+LMLookaheadCache::ScoreList LMLookaheadCache::insert(int key,
+                                                     const ScoreList &scores)
+{
+  Shard &s = shard(key);
+  std::lock_guard<std::mutex> lock(s.mutex);
+  std::unordered_map<int, ScoreList>::const_iterator iter = s.items.find(key);
+  if (iter != s.items.end())
+    return iter->second;
+
+  evict(s, shard_max_items() - 1);
+  s.items[key] = scores;
+  s.order.push_back(key);
+  return scores;
+}
+
+void LMLookaheadCache::clear()
+{
+  for (int i = 0; i < m_shards.size(); i++) {
+    std::lock_guard<std::mutex> lock(m_shards[i].mutex);
+    m_shards[i].items.clear();
+    m_shards[i].order.clear();
+  }
+}
+
+void LMLookaheadCache::set_max_items(int max_items)
+{
+  m_max_items = max_items;
+  for (int i = 0; i < m_shards.size(); i++) {
+    std::lock_guard<std::mutex> lock(m_shards[i].mutex);
+    evict(m_shards[i], shard_max_items());
+  }
+}
+
+int LMLookaheadCache::num_items()
+{
+  int result = 0;
+  for (int i = 0; i < m_shards.size(); i++) {
+    std::lock_guard<std::mutex> lock(m_shards[i].mutex);
+    result += m_shards[i].items.size();
+  }
+  return result;
+}
+
+void LMLookaheadCache::evict(Shard &shard, int max_items)
+{
+  if (max_items < 0)
+    max_items = 0;
+  while (shard.items.size() > max_items) {
+    shard.items.erase(shard.order.front());
+    shard.order.pop_front();
+  }
+}
+
+int LMLookaheadCache::shard_max_items() const
+{
+  // Round up so that every shard can hold at least one list.
+  int num_shards = m_shards.size();
+  int result = (m_max_items + num_shards - 1) / num_shards;
+  return result > 0 ? result : 1;
+}
@@ -0,0 +1,99 @@
+#ifndef LMLOOKAHEADCACHE_HH
+#define LMLOOKAHEADCACHE_HH
+
+#include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+
+/// \brief A cache of LM lookahead score lists that can be shared by several
+/// searches running in different threads.
+///
+/// A score list contains the lookahead LM score of every word of the
+/// lexicon after a context, which is identified by an integer key, arranged
+/// by the search for range maximum queries. The
+/// cache is divided into shards by the key, and each shard is protected by
+/// its own mutex, so threads that look up different contexts rarely wait for
+/// each other. Once inserted, a score list is never modified, and the
+/// searches keep using it through a shared pointer even if it is evicted
+/// from the cache.
+///
+/// The searches that share a cache have to use the same lexicon, vocabulary
+/// and lookahead language model.
+///
+class LMLookaheadCache {
+public:
+  typedef std::shared_ptr<const std::vector<float> > ScoreList;
+
+  /// \param max_items The maximum number of score lists kept in the cache.
+  /// \param num_shards The number of independently locked parts.
+  ///
+  LMLookaheadCache(int max_items = 512, int num_shards = 16);
+
+  /// \brief Returns the score list of the context \a key, or an empty
+  /// pointer if it is not in the cache.
+  ///
+  ScoreList find(int key);
+
+  /// \brief Adds the score list of the context \a key to the cache, removing
+  /// the oldest list of the shard if it is full.
+  ///
+  /// If another thread has inserted a list for the same key first, that list
+  /// is kept and returned instead.
+  ///
+  ScoreList insert(int key, const ScoreList &scores);
+
+  /// \brief Removes all the score lists from the cache.
+  ///
+  void clear();
+
+  /// \brief Sets the maximum number of score lists, removing the oldest
+  /// lists if necessary.
+  ///
+  void set_max_items(int max_items);
+
+  int max_items() const { return m_max_items; }
+
+  /// \brief Returns the number of score lists currently in the cache.
+  ///
+  int num_items();
+
+  /// \brief Returns the number of find() calls that found a score list.
+  ///
+  long num_hits() const { return m_num_hits; }
+
+  /// \brief Returns the number of find() calls that did not find a score
+  /// list.
+  ///
+  long num_misses() const { return m_num_misses; }
+
+  void reset_counters() { m_num_hits = 0; m_num_misses = 0; }
+
+private:
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_map<int, ScoreList> items;
+
+    /// The keys in the order they were inserted.
+    std::list<int> order;
+  };
+
+  Shard &shard(int key)
+  {
+    return m_shards[static_cast<unsigned int>(key) % m_shards.size()];
+  }
+
+  /// Removes the oldest lists until the shard has room for \a max_items.
+  void evict(Shard &shard, int max_items);
+
+  int shard_max_items() const;
+
+  std::vector<Shard> m_shards;
+  std::atomic<int> m_max_items;
+  std::atomic<long> m_num_hits;
+  std::atomic<long> m_num_misses;
+};
+
+#endif // LMLOOKAHEADCACHE_HH
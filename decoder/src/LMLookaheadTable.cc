@@ -0,0 +1,165 @@
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "LMLookaheadTable.hh"
+
+static const char table_magic[8] = { 'L', 'M', 'L', 'A', 'T', 'A', 'B', '2' };
+
+// Scores below this are treated as impossible and stored as code zero.
+static const float min_possible_score = -1e9;
+
+LMLookaheadTable::LMLookaheadTable() :
+  m_map(NULL),
+  m_map_size(0),
+  m_data(NULL),
+  m_num_words(0),
+  m_num_nodes(0),
+  m_bytes_per_score(1),
+  m_checksum(0),
+  m_offset(0),
+  m_step(0)
+{
+}
+
+LMLookaheadTable::~LMLookaheadTable()
+{
+  close();
+}
+
+void LMLookaheadTable::open(const std::string &path)
+{
+  close();
+
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw IOError("LMLookaheadTable::open: Unable to open " + path);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    ::close(fd);
+    throw IOError("LMLookaheadTable::open: Unable to stat " + path);
+  }
+  if (st.st_size < sizeof(Header)) {
+    ::close(fd);
+    throw FormatError("LMLookaheadTable::open: " + path + " is too short.");
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED)
+    throw IOError("LMLookaheadTable::open: Unable to map " + path);
+
+  Header header;
+  memcpy(&header, map, sizeof(Header));
+  size_t expected_size = sizeof(Header) + (size_t)header.num_words
+    * header.num_nodes * header.bytes_per_score;
+  if (memcmp(header.magic, table_magic, sizeof(table_magic)) != 0
+      || (header.bytes_per_score != 1 && header.bytes_per_score != 2)
+      || header.num_words < 0 || header.num_nodes < 0
+      || expected_size != st.st_size)
+  {
+    munmap(map, st.st_size);
+    throw FormatError("LMLookaheadTable::open: " + path +
+                      " is not a valid lookahead table.");
+  }
+
+  m_map = map;
+  m_map_size = st.st_size;
+  m_data = (const char*)map + sizeof(Header);
+  m_num_words = header.num_words;
+  m_num_nodes = header.num_nodes;
+  m_bytes_per_score = header.bytes_per_score;
+  m_checksum = header.checksum;
+  m_offset = header.offset;
+  m_step = header.step;
+}
+
+void LMLookaheadTable::close()
+{
+  if (m_map != NULL)
+    munmap(m_map, m_map_size);
+  m_map = NULL;
+  m_map_size = 0;
+  m_data = NULL;
+  m_num_words = 0;
+  m_num_nodes = 0;
+}
+
+void LMLookaheadTable::write(const std::string &path, int num_words,
+                             int num_nodes, int bytes_per_score,
+                             uint32_t checksum, const RowFunction &compute_row)
+{
+  if (bytes_per_score != 1 && bytes_per_score != 2)
+    throw std::invalid_argument(
+      "LMLookaheadTable::write: bytes_per_score must be 1 or 2.");
+
+  std::vector<float> scores;
+
+  // Find the range of the scores.
+  float min_score = 0;
+  float max_score = min_possible_score;
+  for (int w = 0; w < num_words; w++) {
+    scores.assign(num_nodes, 0);
+    compute_row(w, scores);
+    for (int n = 0; n < num_nodes; n++) {
+      if (scores[n] < min_possible_score)
+        continue;
+      if (scores[n] < min_score)
+        min_score = scores[n];
+      if (scores[n] > max_score)
+        max_score = scores[n];
+    }
+  }
+  if (max_score < min_score)
+    max_score = min_score;
+
+  int max_code = bytes_per_score == 1 ? 0xff : 0xffff;
+  Header header;
+  memcpy(header.magic, table_magic, sizeof(table_magic));
+  header.num_words = num_words;
+  header.num_nodes = num_nodes;
+  header.bytes_per_score = bytes_per_score;
+  header.checksum = checksum;
+  header.offset = min_score;
+  header.step = (max_score - min_score) / (max_code - 1);
+
+  FILE *file = fopen(path.c_str(), "wb");
+  if (file == NULL)
+    throw IOError("LMLookaheadTable::write: Unable to open " + path);
+  fwrite(&header, sizeof(Header), 1, file);
+
+  std::vector<uint8_t> row8(num_nodes);
+  std::vector<uint16_t> row16(num_nodes);
+  for (int w = 0; w < num_words; w++) {
+    scores.assign(num_nodes, 0);
+    compute_row(w, scores);
+    for (int n = 0; n < num_nodes; n++) {
+      int code = 0;
+      if (scores[n] >= min_possible_score) {
+        code = 1;
+        if (header.step > 0 && scores[n] > min_score)
+          code += (int)floor((scores[n] - min_score) / header.step + 0.5);
+        if (code > max_code)
+          code = max_code;
+      }
+      row8[n] = code;
+      row16[n] = code;
+    }
+    if (num_nodes == 0)
+      continue;
+    if (bytes_per_score == 1)
+      fwrite(&row8[0], 1, num_nodes, file);
+    else
+      fwrite(&row16[0], 2, num_nodes, file);
+  }
+
+  if (ferror(file)) {
+    fclose(file);
+    throw IOError("LMLookaheadTable::write: Unable to write " + path);
+  }
+  if (fclose(file) != 0)
+    throw IOError("LMLookaheadTable::write: Unable to write " + path);
+}
@@ -0,0 +1,121 @@
+#ifndef LMLOOKAHEADTABLE_HH
+#define LMLOOKAHEADTABLE_HH
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <functional>
+
+/// \brief A precomputed table of bigram LM lookahead scores, read from a
+/// memory-mapped file.
+///
+/// The table contains the lookahead score of every lookahead node of a
+/// lexical prefix tree after every previous word of the vocabulary. The
+/// scores are quantized linearly to 8 or 16 bits. Code zero is reserved for
+/// the nodes whose words the LM rules out, and the possible scores are
+/// quantized to the other codes. The rows of the table are
+/// the previous words and the columns are the lookahead nodes, so the scores
+/// needed after one word are close to each other.
+///
+/// The file is tied to one lexical prefix tree and vocabulary through a
+/// checksum computed by the caller.
+///
+class LMLookaheadTable {
+public:
+  struct IOError: public std::runtime_error
+  {
+    IOError(const std::string & message) :
+      std::runtime_error(message)
+    {
+    }
+  };
+
+  struct FormatError: public std::runtime_error
+  {
+    FormatError(const std::string & message) :
+      std::runtime_error(message)
+    {
+    }
+  };
+
+  /// \brief Computes the scores of one row, i.e. the scores of all the
+  /// lookahead nodes after the given previous word.
+  ///
+  typedef std::function<void(int word, std::vector<float> &scores)>
+  RowFunction;
+
+  LMLookaheadTable();
+
+  /// \brief Unmaps the file.
+  ///
+  ~LMLookaheadTable();
+
+  /// \brief Maps a table file into memory.
+  ///
+  /// \exception IOError If unable to open or map the file.
+  /// \exception FormatError If the file is not a valid table.
+  ///
+  void open(const std::string &path);
+
+  void close();
+
+  bool is_open() const { return m_data != NULL; }
+
+  int num_words() const { return m_num_words; }
+
+  int num_nodes() const { return m_num_nodes; }
+
+  uint32_t checksum() const { return m_checksum; }
+
+  /// \brief Returns the lookahead score of the node with index \a node
+  /// after the previous word \a word.
+  ///
+  float score(int word, int node) const
+  {
+    size_t index = (size_t)word * m_num_nodes + node;
+    int code = m_bytes_per_score == 1 ? ((const uint8_t*)m_data)[index]
+      : ((const uint16_t*)m_data)[index];
+    if (code == 0)
+      return -1e10; // The same as for impossible nodes without the table.
+    return m_offset + m_step * (code - 1);
+  }
+
+  /// \brief Computes the scores of every row and writes a quantized table
+  /// file.
+  ///
+  /// The rows are computed twice: first to find the range of the scores and
+  /// then to quantize them.
+  ///
+  /// \param bytes_per_score 1 or 2.
+  ///
+  /// \exception IOError If unable to write the file.
+  ///
+  static void write(const std::string &path, int num_words, int num_nodes,
+                    int bytes_per_score, uint32_t checksum,
+                    const RowFunction &compute_row);
+
+private:
+  struct Header {
+    char magic[8];
+    int32_t num_words;
+    int32_t num_nodes;
+    int32_t bytes_per_score;
+    uint32_t checksum;
+    float offset;
+    float step;
+  };
+
+  void *m_map;
+  size_t m_map_size;
+  const void *m_data;
+
+  int m_num_words;
+  int m_num_nodes;
+  int m_bytes_per_score;
+  uint32_t m_checksum;
+  float m_offset;
+  float m_step;
+};
+
+#endif // LMLOOKAHEADTABLE_HH
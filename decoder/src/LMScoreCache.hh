@@ -0,0 +1,119 @@
+#ifndef LMSCORECACHE_HH
+#define LMSCORECACHE_HH
+
+#include <vector>
+#include <stdint.h>
+
+/// \brief A fixed-capacity cache of n-gram scores keyed by word histories.
+///
+/// The cache is two-way set associative: a key can be stored in either of
+/// the two entries of the set selected by its hash, and the entry that was
+/// used less recently is replaced. The keys are stored inline, so finding
+/// and inserting never allocate memory.
+///
+class LMScoreCache {
+public:
+  /// The maximum number of words in a key.
+  enum { MAX_KEY_LENGTH = 8 };
+
+  LMScoreCache() { resize(16384); }
+
+  /// \brief Sets the number of entries, rounded up to a power of two, and
+  /// clears the cache.
+  ///
+  void resize(int num_entries)
+  {
+    int num_sets = 1;
+    while (num_sets * 2 < num_entries)
+      num_sets *= 2;
+    m_sets.resize(num_sets);
+    m_set_mask = num_sets - 1;
+    clear();
+  }
+
+  int num_entries() const { return m_sets.size() * 2; }
+
+  void clear()
+  {
+    for (int i = 0; i < m_sets.size(); i++) {
+      m_sets[i].ways[0].length = -1;
+      m_sets[i].ways[1].length = -1;
+      m_sets[i].next_victim = 0;
+    }
+  }
+
+  /// \brief Finds the score of the history \a key.
+  ///
+  /// \return false if the history is not in the cache.
+  ///
+  bool find(const int *key, int length, float *score)
+  {
+    uint32_t hash = hash_key(key, length);
+    Set &set = m_sets[hash & m_set_mask];
+    for (int w = 0; w < 2; w++) {
+      if (set.ways[w].matches(hash, key, length)) {
+        set.next_victim = 1 - w;
+        *score = set.ways[w].score;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /// \brief Stores the score of the history \a key, which must not be longer
+  /// than MAX_KEY_LENGTH. An existing entry of the same key is overwritten.
+  ///
+  void insert(const int *key, int length, float score)
+  {
+    uint32_t hash = hash_key(key, length);
+    Set &set = m_sets[hash & m_set_mask];
+    int w = set.next_victim;
+    if (set.ways[1 - w].matches(hash, key, length))
+      w = 1 - w;
+    Entry &entry = set.ways[w];
+    entry.hash = hash;
+    entry.length = length;
+    entry.score = score;
+    for (int i = 0; i < length; i++)
+      entry.key[i] = key[i];
+    set.next_victim = 1 - w;
+  }
+
+private:
+  struct Entry {
+    bool matches(uint32_t h, const int *k, int l) const
+    {
+      if (hash != h || length != l)
+        return false;
+      for (int i = 0; i < l; i++)
+        if (key[i] != k[i])
+          return false;
+      return true;
+    }
+
+    uint32_t hash;
+    int length; //!< -1 for an empty entry.
+    float score;
+    int key[MAX_KEY_LENGTH];
+  };
+
+  struct Set {
+    Entry ways[2];
+    int next_victim; //!< The way that was used less recently.
+  };
+
+  static uint32_t hash_key(const int *key, int length)
+  {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+      hash ^= (uint32_t)key[i];
+      hash *= 16777619u;
+    }
+    return hash ^ (hash >> 15);
+  }
+
+  std::vector<Set> m_sets;
+  uint32_t m_set_mask;
+};
+
+#endif // LMSCORECACHE_HH
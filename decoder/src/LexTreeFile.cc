@@ -0,0 +1,303 @@
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "LexTreeFile.hh"
+
+static const char tree_magic[8] = { 'L', 'E', 'X', 'T', 'R', 'E', 'E', '1' };
+static const int tree_version = 5;
+
+uint32_t LexTreeFile::hmm_checksum(const std::vector<Hmm> &hmms)
+{
+  // FNV-1a over the labels and the state counts of the HMMs.
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < hmms.size(); i++) {
+    const std::string &label = hmms[i].label;
+    for (int j = 0; j <= label.size(); j++) {
+      hash ^= (uint8_t)label.c_str()[j];
+      hash *= 16777619u;
+    }
+    hash ^= (uint32_t)hmms[i].states.size();
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+void LexTreeFile::write(const std::string &path, const TPLexPrefixTree &tree,
+                        const Vocabulary &vocabulary,
+                        const std::vector<Hmm> &hmms)
+{
+  typedef TPLexPrefixTree::Node Node;
+  typedef TPLexPrefixTree::Arc Arc;
+
+  int num_nodes = tree.num_nodes();
+  int num_arcs = 0;
+  for (int i = 0; i < num_nodes; i++)
+    num_arcs += tree.node(i)->arcs.size();
+
+  // Build the nodes and arcs in a zeroed image, so that the padding bytes of
+  // the file are defined. The arc lists refer to the image arcs, and keep
+  // the same relative positions in the file.
+  std::vector<char> image(num_nodes * sizeof(Node) + num_arcs * sizeof(Arc), 0);
+  Node *image_nodes = (Node*)&image[0];
+  Arc *image_arcs = (Arc*)(&image[0] + num_nodes * sizeof(Node));
+  std::vector<RangeRecord> ranges;
+  int arc_index = 0;
+  for (int i = 0; i < num_nodes; i++) {
+    const Node *node = tree.node(i);
+    Node *image_node = new (&image_nodes[i]) Node(node->word_id, node->state);
+    image_node->node_id = i;
+    image_node->flags = node->flags;
+    for (int j = 0; j < node->arcs.size(); j++)
+      new (&image_arcs[arc_index + j]) Arc(node->arcs[j]);
+    if (!node->arcs.empty())
+      image_node->arcs.refer(&image_arcs[arc_index], node->arcs.size());
+    arc_index += node->arcs.size();
+
+    image_node->first_word_range = ranges.size();
+    image_node->num_word_ranges = node->num_word_ranges;
+    for (int j = 0; j < node->num_word_ranges; j++) {
+      RangeRecord range;
+      range.begin = tree.word_ranges(node)[j].begin;
+      range.end = tree.word_ranges(node)[j].end;
+      ranges.push_back(range);
+    }
+  }
+  std::vector<int32_t> word_order(tree.m_word_order.begin(),
+                                  tree.m_word_order.end());
+
+  std::vector<char> strings;
+  for (int i = 0; i < vocabulary.num_words(); i++) {
+    const std::string &word = vocabulary.word(i);
+    strings.insert(strings.end(), word.c_str(), word.c_str() + word.size() + 1);
+  }
+
+  std::vector<char> header_bytes(nodes_offset(), 0);
+  Header &header = *(Header*)&header_bytes[0];
+  memcpy(header.magic, tree_magic, sizeof(tree_magic));
+  header.version = tree_version;
+  header.hmm_checksum = hmm_checksum(hmms);
+  header.node_size = sizeof(Node);
+  header.arc_size = sizeof(Arc);
+  header.num_states = tree.m_states.size();
+  header.num_nodes = num_nodes;
+  header.num_arcs = num_arcs;
+  header.num_word_ranges = ranges.size();
+  header.num_ordered_words = word_order.size();
+  header.vocabulary_size = vocabulary.num_words();
+  header.string_table_size = strings.size();
+  header.words = tree.m_words;
+  header.root_node = tree.m_root_node->node_id;
+  header.end_node = tree.m_end_node->node_id;
+  header.start_node = tree.m_start_node->node_id;
+  header.silence_node =
+    tree.m_silence_node != NULL ? tree.m_silence_node->node_id : -1;
+  header.last_silence_node =
+    tree.m_last_silence_node != NULL ? tree.m_last_silence_node->node_id : -1;
+  header.sentence_end_node =
+    tree.m_sentence_end_node != NULL ? tree.m_sentence_end_node->node_id : -1;
+  header.word_boundary_id = tree.m_word_boundary_id;
+  header.lm_lookahead = tree.m_lm_lookahead;
+  header.cross_word_triphones = tree.m_cross_word_triphones;
+
+  FILE *file = fopen(path.c_str(), "wb");
+  if (file == NULL) {
+    for (int i = 0; i < num_nodes; i++)
+      image_nodes[i].~Node();
+    throw IOError("LexTreeFile::write: Unable to open " + path);
+  }
+  fwrite(&header_bytes[0], 1, header_bytes.size(), file);
+  if (!image.empty())
+    fwrite(&image[0], 1, image.size(), file);
+  if (!ranges.empty())
+    fwrite(&ranges[0], sizeof(RangeRecord), ranges.size(), file);
+  if (!word_order.empty())
+    fwrite(&word_order[0], sizeof(int32_t), word_order.size(), file);
+  if (!strings.empty())
+    fwrite(&strings[0], 1, strings.size(), file);
+  for (int i = 0; i < num_nodes; i++)
+    image_nodes[i].~Node();
+
+  if (ferror(file)) {
+    fclose(file);
+    throw IOError("LexTreeFile::write: Unable to write " + path);
+  }
+  if (fclose(file) != 0)
+    throw IOError("LexTreeFile::write: Unable to write " + path);
+}
+
+void LexTreeFile::read(const std::string &path, TPLexPrefixTree &tree,
+                       Vocabulary &vocabulary, const std::vector<Hmm> &hmms)
+{
+  typedef TPLexPrefixTree::Node Node;
+  typedef TPLexPrefixTree::Arc Arc;
+
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw IOError("LexTreeFile::read: Unable to open " + path);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    ::close(fd);
+    throw IOError("LexTreeFile::read: Unable to stat " + path);
+  }
+  const std::string invalid = "LexTreeFile::read: " + path +
+    " is not a valid lexical prefix tree file.";
+  if (st.st_size < nodes_offset()) {
+    ::close(fd);
+    throw FormatError(invalid);
+  }
+  // The nodes are modified in place when arcs are added to them, and the
+  // private mapping copies only the pages that are written.
+  void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                   fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED)
+    throw IOError("LexTreeFile::read: Unable to map " + path);
+
+  const char *file = (const char*)map;
+  Node *nodes = NULL;
+  Vocabulary new_vocabulary;
+  std::vector<int> new_word_order;
+  std::vector<TPLexPrefixTree::WordRange> word_ranges;
+  Node *special_nodes[6];
+  int lm_buf_count = 0;
+  Header header;
+  try {
+    memcpy(&header, file, sizeof(Header));
+    if (memcmp(header.magic, tree_magic, sizeof(tree_magic)) != 0
+        || header.version != tree_version)
+      throw FormatError(invalid);
+    if (header.node_size != sizeof(Node) || header.arc_size != sizeof(Arc))
+      throw FormatError("LexTreeFile::read: " + path + " was written by a "
+                        "build with a different memory layout.");
+    if (header.num_states < 0 || header.num_nodes <= 0 || header.num_arcs < 0
+        || header.num_word_ranges < 0 || header.num_ordered_words < 0
+        || header.vocabulary_size <= 0 || header.string_table_size < 0
+        || st.st_size != nodes_offset()
+        + (size_t)header.num_nodes * sizeof(Node)
+        + (size_t)header.num_arcs * sizeof(Arc)
+        + (size_t)header.num_word_ranges * sizeof(RangeRecord)
+        + (size_t)header.num_ordered_words * sizeof(int32_t)
+        + header.string_table_size)
+      throw FormatError(invalid);
+    if (header.words < 0 || header.words > header.vocabulary_size
+        || header.word_boundary_id < -1
+        || header.word_boundary_id >= header.vocabulary_size
+        || header.lm_lookahead < 0 || header.lm_lookahead > 2)
+      throw FormatError(invalid);
+    tree.create_state_table();
+    if (header.hmm_checksum != hmm_checksum(hmms)
+        || header.num_states != tree.m_states.size())
+      throw FormatError("LexTreeFile::read: " + path +
+                        " was written with different HMMs.");
+
+    nodes = (Node*)((char*)map + nodes_offset());
+    const Arc *arcs = (const Arc*)(nodes + header.num_nodes);
+    const RangeRecord *range_records =
+      (const RangeRecord*)(arcs + header.num_arcs);
+    const int32_t *word_order =
+      (const int32_t*)(range_records + header.num_word_ranges);
+    const char *strings = (const char*)(word_order + header.num_ordered_words);
+
+    // Read the vocabulary first, so that the word IDs can be checked.
+    const char *strings_end = strings + header.string_table_size;
+    if (header.string_table_size == 0 || strings_end[-1] != '\0')
+      throw FormatError(invalid);
+    const char *word = strings;
+    for (int i = 0; i < header.vocabulary_size; i++) {
+      if (word >= strings_end)
+        throw FormatError(invalid);
+      if (i == 0)
+        new_vocabulary.set_oov(word);
+      else if (new_vocabulary.add_word(word) != i)
+        throw FormatError(invalid);
+      word += strlen(word) + 1;
+    }
+    if (word != strings_end)
+      throw FormatError(invalid);
+
+    new_word_order.assign(word_order, word_order + header.num_ordered_words);
+    for (int i = 0; i < new_word_order.size(); i++)
+      if (new_word_order[i] < 0
+          || new_word_order[i] >= header.vocabulary_size)
+        throw FormatError(invalid);
+
+    word_ranges.resize(header.num_word_ranges);
+    for (int i = 0; i < header.num_word_ranges; i++) {
+      if (range_records[i].begin < 0
+          || range_records[i].begin >= range_records[i].end
+          || range_records[i].end > header.num_ordered_words)
+        throw FormatError(invalid);
+      word_ranges[i].begin = range_records[i].begin;
+      word_ranges[i].end = range_records[i].end;
+    }
+
+    // Check the nodes, since they are used as they are.
+    for (int i = 0; i < header.num_nodes; i++) {
+      const Node &node = nodes[i];
+      if (node.node_id != i
+          || node.word_id < -1 || node.word_id >= header.vocabulary_size
+          || node.state < -1 || node.state >= header.num_states
+          || !node.arcs.refers_within(arcs, header.num_arcs)
+          || node.first_word_range < 0
+          || node.first_word_range
+          > header.num_word_ranges - node.num_word_ranges)
+        throw FormatError(invalid);
+      for (int j = 0; j < node.arcs.size(); j++)
+        if (node.arcs[j].next < -1 || node.arcs[j].next >= header.num_nodes)
+          throw FormatError(invalid);
+      if (node.num_word_ranges > 0)
+        lm_buf_count++;
+    }
+
+    const int32_t special_ids[] = { header.root_node, header.end_node,
+                                    header.start_node, header.silence_node,
+                                    header.last_silence_node,
+                                    header.sentence_end_node };
+    for (int s = 0; s < 6; s++) {
+      if (special_ids[s] < -1 || special_ids[s] >= header.num_nodes
+          || (special_ids[s] < 0 && s < 3))
+        throw FormatError(invalid);
+      special_nodes[s] = special_ids[s] >= 0 ? &nodes[special_ids[s]] : NULL;
+    }
+  }
+  catch (...) {
+    munmap(map, st.st_size);
+    throw;
+  }
+
+  tree.delete_separate_nodes();
+  tree.release_tree_file();
+  tree.free_cross_word_network_connection_points();
+  tree.m_silence_arcs.clear();
+  std::vector<Node>().swap(tree.m_node_array);
+  std::vector<Arc>().swap(tree.m_arc_array);
+  std::vector<std::vector<int> >().swap(tree.m_possible_words);
+  tree.m_file_map = map;
+  tree.m_file_map_size = st.st_size;
+  tree.m_file_nodes = nodes;
+  tree.m_num_file_nodes = header.num_nodes;
+  tree.m_word_order.swap(new_word_order);
+  tree.m_word_ranges.swap(word_ranges);
+  tree.m_nodes.resize(header.num_nodes);
+  for (int i = 0; i < header.num_nodes; i++)
+    tree.m_nodes[i] = &nodes[i];
+  tree.m_root_node = special_nodes[0];
+  tree.m_end_node = special_nodes[1];
+  tree.m_start_node = special_nodes[2];
+  tree.m_silence_node = special_nodes[3];
+  tree.m_last_silence_node = special_nodes[4];
+  tree.m_sentence_end_node = special_nodes[5];
+  tree.m_words = header.words;
+  tree.m_word_boundary_id = header.word_boundary_id;
+  tree.m_lm_lookahead = header.lm_lookahead;
+  tree.m_cross_word_triphones = header.cross_word_triphones != 0;
+  tree.m_lm_buf_count = lm_buf_count;
+  tree.m_short_silence_state = -1;
+
+  new_vocabulary.copy_vocab_to(vocabulary);
+}
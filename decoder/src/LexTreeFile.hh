@@ -0,0 +1,123 @@
+#ifndef LEXTREEFILE_HH
+#define LEXTREEFILE_HH
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include "Hmm.hh"
+#include "TPLexPrefixTree.hh"
+#include "Vocabulary.hh"
+
+/// \brief Writes a finished lexical prefix tree and its vocabulary into a
+/// file, and reads them back, so that the decoder does not have to build the
+/// tree from the dictionary on every start.
+///
+/// The file consists of the header (see Header), followed by
+///
+/// - the nodes of the tree as TPLexPrefixTree::Node objects, starting at a
+///   16-byte boundary
+/// - the arcs of the nodes as TPLexPrefixTree::Arc objects
+/// - the word ranges of the lookahead nodes (see RangeRecord)
+/// - the word order of the tree as int32 word IDs
+/// - the vocabulary: the words in the order of their IDs, each terminated by
+///   a zero byte
+///
+/// The nodes and arcs refer to each other by their indices, and the HMM
+/// states by their indices in the state table of the tree, which has the
+/// states of all the HMMs in order. The arc list of a node stores the
+/// position of its arcs relative to itself. The tables therefore contain no
+/// pointers, and read() maps the file into memory and uses the nodes and
+/// arcs in place. The mapping is private, so the pages are shared between
+/// the processes that read the same file until a process modifies them, for
+/// example when TPLexPrefixTree::set_sentence_boundary() adds arcs.
+///
+/// Since the tables are in the memory layout of the host that wrote the
+/// file, the header records the sizes of the nodes and arcs, and a file
+/// written by a build with a different layout is rejected. The values are in
+/// the byte order of the host that wrote the file. The file is tied to the
+/// HMM definitions through a checksum of the HMM labels and state counts.
+/// Every node and arc is checked when the file is read.
+///
+class LexTreeFile {
+public:
+  struct IOError: public std::runtime_error
+  {
+    IOError(const std::string & message) :
+      std::runtime_error(message)
+    {
+    }
+  };
+
+  struct FormatError: public std::runtime_error
+  {
+    FormatError(const std::string & message) :
+      std::runtime_error(message)
+    {
+    }
+  };
+
+  /// \brief Writes the tree and the vocabulary into a file.
+  ///
+  /// \exception IOError If unable to write the file.
+  ///
+  static void write(const std::string &path, const TPLexPrefixTree &tree,
+                    const Vocabulary &vocabulary,
+                    const std::vector<Hmm> &hmms);
+
+  /// \brief Replaces the tree and the vocabulary with the ones in a file.
+  ///
+  /// The tree has to be created with the same HMMs that the file was written
+  /// with. The file is mapped into memory until the tree is destroyed or
+  /// rebuilt.
+  ///
+  /// \exception IOError If unable to open or read the file.
+  /// \exception FormatError If the file is not a valid tree file, or it was
+  /// written with different HMMs.
+  ///
+  static void read(const std::string &path, TPLexPrefixTree &tree,
+                   Vocabulary &vocabulary, const std::vector<Hmm> &hmms);
+
+private:
+  struct Header {
+    char magic[8];
+    int32_t version;
+    uint32_t hmm_checksum;
+    int32_t node_size; //!< sizeof(TPLexPrefixTree::Node) of the writer.
+    int32_t arc_size; //!< sizeof(TPLexPrefixTree::Arc) of the writer.
+    int32_t num_states; //!< The size of the state table of the tree.
+    int32_t num_nodes;
+    int32_t num_arcs;
+    int32_t num_word_ranges;
+    int32_t num_ordered_words;
+    int32_t vocabulary_size;
+    int32_t string_table_size;
+    int32_t words; //!< The largest word ID in the nodes plus one.
+    int32_t root_node;
+    int32_t end_node;
+    int32_t start_node;
+    int32_t silence_node; //!< -1 if there is none.
+    int32_t last_silence_node; //!< -1 if there is none.
+    int32_t sentence_end_node; //!< -1 if there is none.
+    int32_t word_boundary_id;
+    int32_t lm_lookahead;
+    int32_t cross_word_triphones;
+  };
+
+  struct RangeRecord {
+    int32_t begin;
+    int32_t end;
+  };
+
+  static uint32_t hmm_checksum(const std::vector<Hmm> &hmms);
+
+  /// \brief Returns the offset of the node table in the file.
+  ///
+  static size_t nodes_offset()
+  {
+    return (sizeof(Header) + 15) & ~(size_t)15;
+  }
+};
+
+#endif // LEXTREEFILE_HH
@@ -3,7 +3,9 @@
 #define NGRAM_HH
 
 #include <cstdio>
+#include <cstring>
 #include <deque>
+#include <stdint.h>
 #include <vector>
 #include <assert.h>
 #include "Vocabulary.hh"
@@ -28,6 +30,67 @@ public:
                                  std::vector<float> &result_buffer)=0;
   virtual void fetch_trigram_list(int w1, int w2,
                                   std::vector<float> &result_buffer)=0;
+
+  /// \brief Fetches the unigram log probability of every word.
+  ///
+  /// \return false if the model does not support sparse score lists.
+  ///
+  virtual bool fetch_unigram_list(std::vector<float> &log_probs)
+  {
+    return false;
+  }
+
+  /// \brief Fetches the log probabilities of the words after
+  /// \a prev_word_id in a sparse form.
+  ///
+  /// The words that have an explicit n-gram after the context are stored in
+  /// \a words in ascending order, and their log probabilities in
+  /// \a log_probs. The log probability of any other word is \a back_off
+  /// plus its unigram log probability. The results equal those of
+  /// fetch_bigram_list().
+  ///
+  /// \return false if the model does not support sparse score lists.
+  ///
+  virtual bool fetch_sparse_bigram_list(int prev_word_id, float &back_off,
+                                        std::vector<int> &words,
+                                        std::vector<float> &log_probs)
+  {
+    return false;
+  }
+
+  /// \brief Fetches the log probabilities of the words after \a w1 \a w2
+  /// in a sparse form, like fetch_sparse_bigram_list().
+  ///
+  virtual bool fetch_sparse_trigram_list(int w1, int w2, float &back_off,
+                                         std::vector<int> &words,
+                                         std::vector<float> &log_probs)
+  {
+    return false;
+  }
+  /// \brief Returns a hash of the model, for checking that data computed
+  /// from the model, such as an LM lookahead table, was computed from the
+  /// same model.
+  ///
+  /// The default implementation covers the type, the order and the
+  /// vocabulary. Models that store their n-grams override it to cover the
+  /// probabilities too.
+  ///
+  virtual uint32_t fingerprint()
+  {
+    uint32_t hash = 2166136261u;
+    hash_value(hash, m_type);
+    hash_value(hash, m_order);
+    hash_value(hash, num_words());
+    for (int i = 0; i < num_words(); i++) {
+      const std::string &w = word(i);
+      for (int j = 0; j <= w.size(); j++) {
+        hash ^= (uint8_t)w.c_str()[j];
+        hash *= 16777619u;
+      }
+    }
+    return hash;
+  }
+
   inline float log_prob(const std::vector<int> &gram) {
     assert(gram.size() > 0);
     switch (m_type) {
@@ -79,7 +142,38 @@ public:
   virtual float log_prob_bo(const Gram &gram)=0; // Keep this version lean and mean
   virtual float log_prob_i(const Gram &gram)=0; // Interpolated
 
+  /// \brief Computes the log probabilities of several words after the same
+  /// context.
+  ///
+  /// The default implementation computes the probabilities one at a time.
+  ///
+  virtual void log_prob_batch(const Gram &context, const int *words,
+                              int num_words, float *log_probs)
+  {
+    Gram gram(context);
+    gram.push_back(0);
+    for (int i = 0; i < num_words; i++) {
+      gram.back() = words[i];
+      log_probs[i] = log_prob(gram);
+    }
+  }
+
 protected:
+  /// Adds the bytes of a 32-bit value to an FNV-1a hash.
+  template <typename T>
+  static void hash_value(uint32_t &hash, T value)
+  {
+    uint32_t bits;
+    if (sizeof(T) == sizeof(uint32_t))
+      memcpy(&bits, &value, sizeof(bits));
+    else
+      bits = (uint32_t)value;
+    for (int i = 0; i < 4; i++) {
+      hash ^= (bits >> (8 * i)) & 0xff;
+      hash *= 16777619u;
+    }
+  }
+
   int m_last_order;
   int m_order;
   Type m_type;
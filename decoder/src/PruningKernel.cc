@@ -0,0 +1,166 @@
+#include <cmath>
+
+#include "PruningKernel.hh"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PRUNING_KERNEL_AVX2
+#include <immintrin.h>
+#endif
+
+namespace {
+
+int compact_scalar(float *scores, int num_scores, float limit, int *indices)
+{
+  int num_kept = 0;
+  for (int i = 0; i < num_scores; i++) {
+    if (!(scores[i] < limit)) {
+      scores[num_kept] = scores[i];
+      indices[num_kept] = i;
+      num_kept++;
+    }
+  }
+  return num_kept;
+}
+
+void histogram_scalar(const float *scores, int num_scores, float min_score,
+                      float bin_width, int *bins)
+{
+  for (int i = 0; i < num_scores; i++)
+    bins[(int) floorf((scores[i] - min_score) / bin_width)]++;
+}
+
+#ifdef PRUNING_KERNEL_AVX2
+
+// For each 8-bit mask, the lanes whose bit is set, moved to the beginning.
+struct CompactTable {
+  int lanes[256][8];
+
+  CompactTable()
+  {
+    for (int mask = 0; mask < 256; mask++) {
+      int num_set = 0;
+      for (int lane = 0; lane < 8; lane++)
+        if (mask & (1 << lane))
+          lanes[mask][num_set++] = lane;
+      while (num_set < 8)
+        lanes[mask][num_set++] = 0;
+    }
+  }
+};
+
+const CompactTable compact_table;
+
+__attribute__((target("avx2")))
+int compact_avx2(float *scores, int num_scores, float limit, int *indices)
+{
+  const __m256 limit_vec = _mm256_set1_ps(limit);
+  const __m256i step = _mm256_set1_epi32(8);
+  __m256i index_vec = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  int num_kept = 0;
+  int i = 0;
+
+  // The output never gets ahead of the input, so the full-width stores only
+  // overwrite scores that have already been loaded.
+  for (; i + 8 <= num_scores; i += 8) {
+    __m256 score_vec = _mm256_loadu_ps(scores + i);
+    // Not-less-than keeps NaNs, like the scalar comparison.
+    int mask = _mm256_movemask_ps(
+      _mm256_cmp_ps(score_vec, limit_vec, _CMP_NLT_UQ));
+    __m256i lanes = _mm256_loadu_si256(
+      (const __m256i*)compact_table.lanes[mask]);
+    _mm256_storeu_ps(scores + num_kept,
+                     _mm256_permutevar8x32_ps(score_vec, lanes));
+    _mm256_storeu_si256((__m256i*)(indices + num_kept),
+                        _mm256_permutevar8x32_epi32(index_vec, lanes));
+    num_kept += __builtin_popcount(mask);
+    index_vec = _mm256_add_epi32(index_vec, step);
+  }
+
+  for (; i < num_scores; i++) {
+    if (!(scores[i] < limit)) {
+      scores[num_kept] = scores[i];
+      indices[num_kept] = i;
+      num_kept++;
+    }
+  }
+  return num_kept;
+}
+
+__attribute__((target("avx2")))
+void histogram_avx2(const float *scores, int num_scores, float min_score,
+                    float bin_width, int *bins)
+{
+  const __m256 min_vec = _mm256_set1_ps(min_score);
+  const __m256 width_vec = _mm256_set1_ps(bin_width);
+  int bin_index[8];
+  int i = 0;
+
+  for (; i + 8 <= num_scores; i += 8) {
+    __m256 bin_vec = _mm256_floor_ps(_mm256_div_ps(
+      _mm256_sub_ps(_mm256_loadu_ps(scores + i), min_vec), width_vec));
+    _mm256_storeu_si256((__m256i*)bin_index, _mm256_cvttps_epi32(bin_vec));
+    for (int lane = 0; lane < 8; lane++)
+      bins[bin_index[lane]]++;
+  }
+
+  for (; i < num_scores; i++)
+    bins[(int) floorf((scores[i] - min_score) / bin_width)]++;
+}
+
+#endif
+
+}
+
+PruningKernel::PruningKernel() :
+  m_type(SCALAR)
+{
+  set_type(AVX2);
+}
+
+bool PruningKernel::avx2_supported()
+{
+#ifdef PRUNING_KERNEL_AVX2
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#else
+  return false;
+#endif
+}
+
+bool PruningKernel::set_type(Type type)
+{
+  if (type == AVX2 && !avx2_supported()) {
+    m_type = SCALAR;
+    return false;
+  }
+  m_type = type;
+  return true;
+}
+
+const char *PruningKernel::type_name() const
+{
+  return m_type == AVX2 ? "avx2" : "scalar";
+}
+
+int PruningKernel::compact(float *scores, int num_scores, float limit,
+                           int *indices) const
+{
+#ifdef PRUNING_KERNEL_AVX2
+  if (m_type == AVX2)
+    return compact_avx2(scores, num_scores, limit, indices);
+#endif
+  return compact_scalar(scores, num_scores, limit, indices);
+}
+
+void PruningKernel::histogram(const float *scores, int num_scores,
+                              float min_score, float bin_width,
+                              int *bins) const
+{
+#ifdef PRUNING_KERNEL_AVX2
+  if (m_type == AVX2) {
+    histogram_avx2(scores, num_scores, min_score, bin_width, bins);
+    return;
+  }
+#endif
+  histogram_scalar(scores, num_scores, min_score, bin_width, bins);
+}
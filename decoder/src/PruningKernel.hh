@@ -0,0 +1,54 @@
+#ifndef PRUNINGKERNEL_HH
+#define PRUNINGKERNEL_HH
+
+/// \brief Bulk operations on token score arrays used in pruning.
+///
+/// The operations are implemented with AVX2 instructions and as plain
+/// scalar loops. The AVX2 implementation is used if the processor supports
+/// it, unless the scalar implementation is selected with set_type(). Both
+/// implementations produce exactly the same results.
+///
+class PruningKernel {
+public:
+  enum Type { SCALAR, AVX2 };
+
+  /// \brief Selects the fastest implementation that the processor supports.
+  ///
+  PruningKernel();
+
+  /// \brief Returns true if the processor and the compiler support AVX2.
+  ///
+  static bool avx2_supported();
+
+  /// \brief Selects the implementation.
+  ///
+  /// \return false if the implementation is not supported, in which case the
+  /// scalar implementation is selected.
+  ///
+  bool set_type(Type type);
+  Type type() const { return m_type; }
+  const char *type_name() const;
+
+  /// \brief Removes the scores that are below \a limit.
+  ///
+  /// The remaining scores are moved to the beginning of \a scores, keeping
+  /// their order, and their original indices are written to \a indices.
+  ///
+  /// \param indices An array with space for at least \a num_scores values.
+  /// \return The number of remaining scores.
+  ///
+  int compact(float *scores, int num_scores, float limit, int *indices) const;
+
+  /// \brief Adds the scores to histogram bins.
+  ///
+  /// Score s is counted in bin floor((s - \a min_score) / \a bin_width). The
+  /// caller is responsible for making sure that the bin indices are valid.
+  ///
+  void histogram(const float *scores, int num_scores, float min_score,
+                 float bin_width, int *bins) const;
+
+private:
+  Type m_type;
+};
+
+#endif // PRUNINGKERNEL_HH
@@ -0,0 +1,208 @@
+#ifndef RECOMBINATIONTABLE_HH
+#define RECOMBINATIONTABLE_HH
+
+#include <vector>
+#include <stdint.h>
+#include "TPLexPrefixTree.hh"
+
+/// \brief Assigns a dense id to each distinct LM state, which is a sequence
+/// of LM ids.
+///
+/// The ids are stable until clear() is called, so two tokens have the same
+/// LM state exactly when they have the same id. The table only grows, so the
+/// owner rebuilds it from the states that are still in use from time to
+/// time.
+///
+class LMStateTable {
+public:
+  LMStateTable() { clear(); }
+
+  void clear()
+  {
+    m_keys.clear();
+    m_key_offsets.assign(1, 0);
+    m_hashes.clear();
+    m_slots.assign(1024, -1);
+  }
+
+  void swap(LMStateTable &other)
+  {
+    m_keys.swap(other.m_keys);
+    m_key_offsets.swap(other.m_key_offsets);
+    m_hashes.swap(other.m_hashes);
+    m_slots.swap(other.m_slots);
+  }
+
+  /// \brief Returns the number of states.
+  ///
+  int size() const { return m_hashes.size(); }
+
+  const int *key(int id) const { return m_keys.data() + m_key_offsets[id]; }
+
+  int key_length(int id) const
+  {
+    return m_key_offsets[id + 1] - m_key_offsets[id];
+  }
+
+  /// \brief Returns the id of the state \a key, adding it if it is new.
+  ///
+  int find_or_insert(const int *key, int length)
+  {
+    uint32_t hash = hash_key(key, length);
+    uint32_t mask = m_slots.size() - 1;
+    for (uint32_t i = hash & mask; ; i = (i + 1) & mask) {
+      int id = m_slots[i];
+      if (id < 0)
+        break;
+      if (m_hashes[id] == hash && matches(id, key, length))
+        return id;
+    }
+
+    int id = m_hashes.size();
+    m_hashes.push_back(hash);
+    m_keys.insert(m_keys.end(), key, key + length);
+    m_key_offsets.push_back(m_keys.size());
+    if (m_hashes.size() * 2 > m_slots.size())
+      rehash(m_slots.size() * 2);
+    else
+      insert_slot(id);
+    return id;
+  }
+
+private:
+  bool matches(int id, const int *key, int length) const
+  {
+    int begin = m_key_offsets[id];
+    if (m_key_offsets[id + 1] - begin != length)
+      return false;
+    for (int i = 0; i < length; i++)
+      if (m_keys[begin + i] != key[i])
+        return false;
+    return true;
+  }
+
+  void insert_slot(int id)
+  {
+    uint32_t mask = m_slots.size() - 1;
+    uint32_t i = m_hashes[id] & mask;
+    while (m_slots[i] >= 0)
+      i = (i + 1) & mask;
+    m_slots[i] = id;
+  }
+
+  void rehash(int num_slots)
+  {
+    m_slots.assign(num_slots, -1);
+    for (int id = 0; id < m_hashes.size(); id++)
+      insert_slot(id);
+  }
+
+  static uint32_t hash_key(const int *key, int length)
+  {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+      hash ^= (uint32_t)key[i];
+      hash *= 16777619u;
+    }
+    return hash ^ (hash >> 15);
+  }
+
+  std::vector<int> m_keys; //!< The keys of all the states.
+  std::vector<int> m_key_offsets; //!< Where the key of each state begins.
+  std::vector<uint32_t> m_hashes;
+  std::vector<int> m_slots; //!< State ids, or -1 for an empty slot.
+};
+
+/// \brief Finds the token of a lexicon node that has a given LM state.
+///
+/// Used for recombining the tokens of a frame without walking the token
+/// lists of the nodes. The tokens are not owned by the table.
+///
+class RecombinationTable {
+public:
+  RecombinationTable() : m_num_items(0) { m_slots.resize(1024); }
+
+  /// \brief Removes all the tokens. Takes time proportional to the number
+  /// of tokens that were added.
+  ///
+  void clear()
+  {
+    for (int i = 0; i < m_used_slots.size(); i++)
+      m_slots[m_used_slots[i]].token = NULL;
+    m_used_slots.clear();
+    m_num_items = 0;
+  }
+
+  /// \brief Returns the token that was added with the same node and state,
+  /// or NULL.
+  ///
+  TPLexPrefixTree::Token *find(int node_id, int lm_state) const
+  {
+    uint64_t key = make_key(node_id, lm_state);
+    uint32_t mask = m_slots.size() - 1;
+    for (uint32_t i = hash_key(key) & mask; ; i = (i + 1) & mask) {
+      const Slot &slot = m_slots[i];
+      if (slot.token == NULL)
+        return NULL;
+      if (slot.key == key)
+        return slot.token;
+    }
+  }
+
+  /// \brief Adds a token, which must not have been added before with the
+  /// same node and state.
+  ///
+  void insert(int node_id, int lm_state, TPLexPrefixTree::Token *token)
+  {
+    if ((m_num_items + 1) * 2 > m_slots.size())
+      grow();
+    insert_slot(make_key(node_id, lm_state), token);
+    m_num_items++;
+  }
+
+private:
+  struct Slot {
+    Slot() : key(0), token(NULL) {}
+    uint64_t key;
+    TPLexPrefixTree::Token *token; //!< NULL for an empty slot.
+  };
+
+  static uint64_t make_key(int node_id, int lm_state)
+  {
+    return ((uint64_t)(uint32_t)node_id << 32) | (uint32_t)lm_state;
+  }
+
+  static uint32_t hash_key(uint64_t key)
+  {
+    key *= 0x9e3779b97f4a7c15ull;
+    return (uint32_t)(key >> 32);
+  }
+
+  void insert_slot(uint64_t key, TPLexPrefixTree::Token *token)
+  {
+    uint32_t mask = m_slots.size() - 1;
+    uint32_t i = hash_key(key) & mask;
+    while (m_slots[i].token != NULL)
+      i = (i + 1) & mask;
+    m_slots[i].key = key;
+    m_slots[i].token = token;
+    m_used_slots.push_back(i);
+  }
+
+  void grow()
+  {
+    std::vector<Slot> old_slots;
+    old_slots.swap(m_slots);
+    m_slots.resize(old_slots.size() * 2);
+    m_used_slots.clear();
+    for (int i = 0; i < old_slots.size(); i++)
+      if (old_slots[i].token != NULL)
+        insert_slot(old_slots[i].key, old_slots[i].token);
+  }
+
+  std::vector<Slot> m_slots;
+  std::vector<int> m_used_slots;
+  int m_num_items;
+};
+
+#endif // RECOMBINATIONTABLE_HH
@@ -0,0 +1,71 @@
+#include "SearchProfile.hh"
+
+void SearchProfile::write(FILE *file, Format format) const
+{
+  if (format == CHROME_TRACE)
+    write_chrome_trace(file);
+  else
+    write_json_lines(file);
+}
+
+SearchProfile::Format SearchProfile::parse_format(const std::string &name)
+{
+  if (name == "jsonl" || name == "json")
+    return JSON_LINES;
+  if (name == "chrome")
+    return CHROME_TRACE;
+  throw std::invalid_argument("SearchProfile: unknown format: " + name);
+}
+
+void SearchProfile::write_json_lines(FILE *file) const
+{
+  for (int i = 0; i < m_frames.size(); i++) {
+    const Frame &f = m_frames[i];
+    fprintf(file, "{\"utterance\": %d, \"frame\": %d, \"active_tokens\": %d, "
+            "\"new_tokens\": %d, \"word_end_tokens\": %d, "
+            "\"word_graph_nodes\": %d, \"lm_cache_hits\": %d, "
+            "\"lm_cache_misses\": %d, \"lookahead_hits\": %d, "
+            "\"lookahead_misses\": %d, \"start_time\": %.6f, "
+            "\"propagate_time\": %.6f, \"prune_time\": %.6f, "
+            "\"lm_time\": %.6f}\n",
+            f.utterance, f.frame, f.active_tokens, f.new_tokens,
+            f.word_end_tokens, f.word_graph_nodes, f.lm_cache_hits,
+            f.lm_cache_misses, f.lookahead_hits, f.lookahead_misses,
+            f.start_time, f.propagate_time, f.prune_time, f.lm_time);
+  }
+}
+
+void SearchProfile::write_chrome_trace(FILE *file) const
+{
+  // Timestamps and durations are in microseconds. Propagation and pruning
+  // are complete events, the counters are counter events.
+  fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  for (int i = 0; i < m_frames.size(); i++) {
+    const Frame &f = m_frames[i];
+    double ts = f.start_time * 1e6;
+    double prune_ts = ts + f.propagate_time * 1e6;
+    fprintf(file, "{\"name\": \"propagate\", \"ph\": \"X\", \"pid\": 1, "
+            "\"tid\": 1, \"ts\": %.3f, \"dur\": %.3f, \"args\": "
+            "{\"utterance\": %d, \"frame\": %d, \"lm_time_us\": %.3f}},\n",
+            ts, f.propagate_time * 1e6, f.utterance,
+            f.frame, f.lm_time * 1e6);
+    fprintf(file, "{\"name\": \"prune\", \"ph\": \"X\", \"pid\": 1, "
+            "\"tid\": 1, \"ts\": %.3f, \"dur\": %.3f, \"args\": "
+            "{\"utterance\": %d, \"frame\": %d}},\n",
+            prune_ts, f.prune_time * 1e6, f.utterance, f.frame);
+    fprintf(file, "{\"name\": \"tokens\", \"ph\": \"C\", \"pid\": 1, "
+            "\"ts\": %.3f, \"args\": {\"active\": %d, \"new\": %d, "
+            "\"word_end\": %d}},\n",
+            ts, f.active_tokens, f.new_tokens, f.word_end_tokens);
+    fprintf(file, "{\"name\": \"lm_cache\", \"ph\": \"C\", \"pid\": 1, "
+            "\"ts\": %.3f, \"args\": {\"hits\": %d, \"misses\": %d}},\n",
+            ts, f.lm_cache_hits, f.lm_cache_misses);
+    fprintf(file, "{\"name\": \"lookahead\", \"ph\": \"C\", \"pid\": 1, "
+            "\"ts\": %.3f, \"args\": {\"hits\": %d, \"misses\": %d}},\n",
+            ts, f.lookahead_hits, f.lookahead_misses);
+    fprintf(file, "{\"name\": \"word_graph\", \"ph\": \"C\", \"pid\": 1, "
+            "\"ts\": %.3f, \"args\": {\"nodes\": %d}}%s\n",
+            ts, f.word_graph_nodes, i + 1 < m_frames.size() ? "," : "");
+  }
+  fprintf(file, "]}\n");
+}
@@ -0,0 +1,142 @@
+#ifndef SEARCHPROFILE_HH
+#define SEARCHPROFILE_HH
+
+#include <cstdio>
+#include <deque>
+#include <string>
+#include <chrono>
+#include <stdexcept>
+
+/// \brief Per-frame counters and timings collected by TokenPassSearch.
+///
+/// The frames of all the utterances are collected until clear() is called,
+/// keeping at most the last max_frames() frames, and can be written as JSON lines (one object per frame) or in the Chrome
+/// trace event format, which can be viewed in chrome://tracing or Perfetto.
+///
+class SearchProfile {
+public:
+  enum Format { JSON_LINES, CHROME_TRACE };
+
+  struct Frame {
+    Frame() { clear(); }
+
+    void clear()
+    {
+      utterance = frame = 0;
+      active_tokens = new_tokens = word_end_tokens = word_graph_nodes = 0;
+      lm_cache_hits = lm_cache_misses = 0;
+      lookahead_hits = lookahead_misses = 0;
+      start_time = propagate_time = prune_time = lm_time = 0;
+    }
+
+    int utterance;
+    int frame;
+
+    /// Tokens left after pruning.
+    int active_tokens;
+
+    /// Tokens created by propagation, including the word end tokens.
+    int new_tokens;
+
+    int word_end_tokens;
+    int word_graph_nodes;
+    int lm_cache_hits;
+    int lm_cache_misses;
+    int lookahead_hits;
+    int lookahead_misses;
+
+    /// Seconds from the creation or clearing of the profile.
+    double start_time;
+
+    double propagate_time;
+    double prune_time;
+
+    /// Time spent computing LM scores, which is included in the
+    /// propagation time.
+    double lm_time;
+  };
+
+  /// \brief Adds the elapsed time to a total when it goes out of scope.
+  ///
+  class Timer {
+  public:
+    /// \param total Where the time is added, or NULL to disable the timer.
+    ///
+    Timer(double *total) : m_total(total)
+    {
+      if (m_total)
+        m_start = std::chrono::steady_clock::now();
+    }
+
+    ~Timer()
+    {
+      if (m_total)
+        *m_total += std::chrono::duration<double>(
+          std::chrono::steady_clock::now() - m_start).count();
+    }
+
+  private:
+    double *m_total;
+    std::chrono::steady_clock::time_point m_start;
+  };
+
+  SearchProfile() : m_max_frames(DEFAULT_MAX_FRAMES) { clear(); }
+
+  void clear()
+  {
+    m_frames.clear();
+    m_start = std::chrono::steady_clock::now();
+  }
+
+  /// \brief Returns the number of seconds since the profile was cleared.
+  ///
+  double elapsed() const
+  {
+    return std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - m_start).count();
+  }
+
+  /// \brief Adds a frame, dropping the oldest frame if the profile is full.
+  ///
+  void add(const Frame &frame)
+  {
+    m_frames.push_back(frame);
+    if ((int)m_frames.size() > m_max_frames)
+      m_frames.pop_front();
+  }
+
+  const std::deque<Frame> &frames() const { return m_frames; }
+
+  /// \brief Sets the maximum number of frames kept, so that profiling a
+  /// long session does not use more and more memory. The default is 100000
+  /// frames, about 17 minutes of audio at 100 frames per second.
+  ///
+  void set_max_frames(int frames)
+  {
+    m_max_frames = frames;
+    while ((int)m_frames.size() > m_max_frames)
+      m_frames.pop_front();
+  }
+
+  int max_frames() const { return m_max_frames; }
+
+  void write(FILE *file, Format format) const;
+
+  /// \brief Converts "jsonl" or "chrome" to a format.
+  ///
+  /// \exception std::invalid_argument If the name is not recognized.
+  ///
+  static Format parse_format(const std::string &name);
+
+private:
+  enum { DEFAULT_MAX_FRAMES = 100000 };
+
+  void write_json_lines(FILE *file) const;
+  void write_chrome_trace(FILE *file) const;
+
+  std::deque<Frame> m_frames;
+  int m_max_frames;
+  std::chrono::steady_clock::time_point m_start;
+};
+
+#endif // SEARCHPROFILE_HH
@@ -0,0 +1,187 @@
+#include <algorithm>
+#include "SparseLMLookahead.hh"
+
+// The number of contexts kept in the cache, a power of two. The node
+// lookahead buffers cache the scores, so the contexts are needed only while
+// the scores of the nodes are first computed.
+#define NUM_CACHED_CONTEXTS 256
+
+SparseLMLookahead::SparseLMLookahead() :
+  m_ngram(NULL),
+  m_lexicon(NULL),
+  m_num_lookups(0),
+  m_num_misses(0)
+{
+}
+
+bool SparseLMLookahead::build(
+  NGram *ngram, const std::vector<int> &lm_ids,
+  const TPLexPrefixTree &lexicon,
+  const std::vector<const TPLexPrefixTree::Node*> &nodes)
+{
+  m_ngram = NULL;
+  clear_cache();
+  if (ngram == NULL || !ngram->fetch_unigram_list(m_unigrams))
+    return false;
+
+  m_lexicon = &lexicon;
+  const std::vector<int> &word_order = lexicon.word_order();
+  m_lm_ids.resize(word_order.size());
+  for (int i = 0; i < word_order.size(); i++)
+    m_lm_ids[i] = lm_ids[word_order[i]];
+  m_nodes = nodes;
+  int num_nodes = nodes.size();
+  m_unigram_max.assign(num_nodes, -1e10);
+  m_node_buffer.assign(num_nodes, -1e10);
+
+  // Index the lookahead nodes by the lookahead LM IDs of their words. A node
+  // is listed once for each ID, since the nodes are visited in order.
+  std::vector<int> counts(m_unigrams.size() + 1, 0);
+  std::vector<int> last_node(m_unigrams.size(), -1);
+  for (int n = 0; n < num_nodes; n++) {
+    const TPLexPrefixTree::WordRange *ranges = lexicon.word_ranges(nodes[n]);
+    for (int r = 0; r < nodes[n]->num_word_ranges; r++) {
+      for (int i = ranges[r].begin; i < ranges[r].end; i++) {
+        int id = m_lm_ids[i];
+        if (m_unigrams[id] > m_unigram_max[n])
+          m_unigram_max[n] = m_unigrams[id];
+        if (last_node[id] != n) {
+          last_node[id] = n;
+          counts[id + 1]++;
+        }
+      }
+    }
+  }
+  m_lm_id_node_offsets.resize(counts.size());
+  m_lm_id_node_offsets[0] = 0;
+  for (int i = 1; i < counts.size(); i++)
+    m_lm_id_node_offsets[i] = m_lm_id_node_offsets[i - 1] + counts[i];
+  m_lm_id_nodes.resize(m_lm_id_node_offsets.back());
+  std::vector<int> next(m_lm_id_node_offsets.begin(),
+                        m_lm_id_node_offsets.end() - 1);
+  last_node.assign(m_unigrams.size(), -1);
+  for (int n = 0; n < num_nodes; n++) {
+    const TPLexPrefixTree::WordRange *ranges = lexicon.word_ranges(nodes[n]);
+    for (int r = 0; r < nodes[n]->num_word_ranges; r++) {
+      for (int i = ranges[r].begin; i < ranges[r].end; i++) {
+        int id = m_lm_ids[i];
+        if (last_node[id] != n) {
+          last_node[id] = n;
+          m_lm_id_nodes[next[id]++] = n;
+        }
+      }
+    }
+  }
+
+  m_ngram = ngram;
+  return true;
+}
+
+void SparseLMLookahead::clear_cache()
+{
+  m_contexts.clear();
+  m_contexts.resize(NUM_CACHED_CONTEXTS);
+  m_num_lookups = 0;
+  m_num_misses = 0;
+}
+
+float SparseLMLookahead::score(int w1, int w2, int node)
+{
+  Context &context = find_context(w1, w2);
+  if (!context.bounded)
+    return scan_node(context, node);
+
+  if (!context.corrected)
+    compute_corrections(context);
+  float score = context.back_off + m_unigram_max[node];
+  std::vector<int>::const_iterator it = std::lower_bound(
+    context.nodes.begin(), context.nodes.end(), node);
+  if (it != context.nodes.end() && *it == node) {
+    float correction = context.node_scores[it - context.nodes.begin()];
+    if (correction > score)
+      score = correction;
+  }
+  return score;
+}
+
+SparseLMLookahead::Context &SparseLMLookahead::find_context(int w1, int w2)
+{
+  m_num_lookups++;
+  uint32_t hash = (uint32_t)w1 * 2654435761u ^ (uint32_t)w2 * 40503u;
+  Context &context =
+    m_contexts[(hash ^ (hash >> 16)) & (NUM_CACHED_CONTEXTS - 1)];
+  if (context.w1 == w1 && context.w2 == w2)
+    return context;
+
+  m_num_misses++;
+  context.w1 = w1;
+  context.w2 = w2;
+  if (w1 < 0)
+    m_ngram->fetch_sparse_bigram_list(w2, context.back_off, context.words,
+                                      context.log_probs);
+  else
+    m_ngram->fetch_sparse_trigram_list(w1, w2, context.back_off,
+                                       context.words, context.log_probs);
+  context.bounded = true;
+  for (int i = 0; i < context.words.size(); i++) {
+    if (context.log_probs[i]
+        < context.back_off + m_unigrams[context.words[i]])
+    {
+      context.bounded = false;
+      break;
+    }
+  }
+  context.corrected = false;
+  context.nodes.clear();
+  context.node_scores.clear();
+  return context;
+}
+
+void SparseLMLookahead::compute_corrections(Context &context)
+{
+  // Collect the maximum score of the explicit words of each node into
+  // m_node_buffer, and the nodes into context.nodes.
+  for (int i = 0; i < context.words.size(); i++) {
+    int id = context.words[i];
+    float log_prob = context.log_probs[i];
+    for (int j = m_lm_id_node_offsets[id]; j < m_lm_id_node_offsets[id + 1];
+         j++)
+    {
+      int node = m_lm_id_nodes[j];
+      if (m_node_buffer[node] <= -1e10)
+        context.nodes.push_back(node);
+      if (log_prob > m_node_buffer[node])
+        m_node_buffer[node] = log_prob;
+    }
+  }
+
+  std::sort(context.nodes.begin(), context.nodes.end());
+  context.node_scores.resize(context.nodes.size());
+  for (int i = 0; i < context.nodes.size(); i++) {
+    context.node_scores[i] = m_node_buffer[context.nodes[i]];
+    m_node_buffer[context.nodes[i]] = -1e10;
+  }
+  context.corrected = true;
+}
+
+float SparseLMLookahead::scan_node(const Context &context, int node) const
+{
+  const TPLexPrefixTree::WordRange *ranges =
+    m_lexicon->word_ranges(m_nodes[node]);
+  float score = -1e10;
+  for (int r = 0; r < m_nodes[node]->num_word_ranges; r++) {
+    for (int i = ranges[r].begin; i < ranges[r].end; i++) {
+      int id = m_lm_ids[i];
+      float log_prob;
+      std::vector<int>::const_iterator it = std::lower_bound(
+        context.words.begin(), context.words.end(), id);
+      if (it != context.words.end() && *it == id)
+        log_prob = context.log_probs[it - context.words.begin()];
+      else
+        log_prob = context.back_off + m_unigrams[id];
+      if (log_prob > score)
+        score = log_prob;
+    }
+  }
+  return score;
+}
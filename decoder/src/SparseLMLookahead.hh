@@ -0,0 +1,123 @@
+#ifndef SPARSELMLOOKAHEAD_HH
+#define SPARSELMLOOKAHEAD_HH
+
+#include <vector>
+#include <stdint.h>
+#include "NGram.hh"
+#include "TPLexPrefixTree.hh"
+
+/// \brief Computes LM lookahead scores from the backoff structure of the
+/// lookahead LM, without computing the score of every word after a context.
+///
+/// After a context, the score of a word is the backoff weight of the context
+/// plus the unigram log probability of the word, except for the words that
+/// have an explicit n-gram after the context. The lookahead score of a node
+/// is therefore the backoff weight plus the maximum unigram log probability
+/// of the possible words of the node, which is precomputed, corrected by the
+/// explicit n-grams. The corrections are found by following each explicit
+/// word to the lookahead nodes where it is possible, so a context takes time
+/// proportional to the number of its n-grams times the number of lookahead
+/// nodes on a path, instead of the size of the vocabulary.
+///
+/// The scores are the same as the maxima of the full score lists, as long as
+/// no explicit n-gram has a lower score than its backoff estimate. The
+/// scores of the contexts that have such n-grams are computed from the
+/// possible words of each node instead.
+///
+class SparseLMLookahead {
+public:
+  SparseLMLookahead();
+
+  /// \brief Prepares the lookahead for a lexicon and a lookahead LM, and
+  /// clears the cache of contexts.
+  ///
+  /// \param ngram The lookahead LM.
+  /// \param lm_ids The lookahead LM ID of each word.
+  /// \param lexicon The finalized lexicon, which has to exist as long as the
+  /// lookahead is used.
+  /// \param nodes The lookahead nodes of the lexicon.
+  /// \return false if the LM cannot give sparse score lists.
+  ///
+  bool build(NGram *ngram, const std::vector<int> &lm_ids,
+             const TPLexPrefixTree &lexicon,
+             const std::vector<const TPLexPrefixTree::Node*> &nodes);
+
+  bool is_built() const { return m_ngram != NULL; }
+
+  void clear_cache();
+
+  /// \brief Returns the maximum score of the possible words of a lookahead
+  /// node after a context.
+  ///
+  /// \param w1 The lookahead LM ID of the word before \a w2, or -1 for a
+  /// bigram context.
+  /// \param w2 The lookahead LM ID of the previous word.
+  /// \param node The index of the lookahead node.
+  ///
+  float score(int w1, int w2, int node);
+
+  /// \brief Returns the number of contexts that were looked up and the
+  /// number of those that were not in the cache.
+  ///
+  long num_lookups() const { return m_num_lookups; }
+  long num_misses() const { return m_num_misses; }
+
+private:
+  struct Context {
+    Context() : w1(-2), w2(-2) { }
+    int w1;
+    int w2;
+    float back_off;
+
+    /// No explicit n-gram has a lower score than its backoff estimate.
+    bool bounded;
+
+    /// The corrections of the nodes have been computed.
+    bool corrected;
+
+    /// The lookahead LM IDs of the explicit n-grams in ascending order, and
+    /// their log probabilities.
+    std::vector<int> words;
+    std::vector<float> log_probs;
+
+    /// The nodes that have explicit words in ascending order, and the
+    /// maximum log probability of their explicit words.
+    std::vector<int> nodes;
+    std::vector<float> node_scores;
+  };
+
+  Context &find_context(int w1, int w2);
+  void compute_corrections(Context &context);
+
+  /// Computes the score of a node from all its possible words.
+  float scan_node(const Context &context, int node) const;
+
+  NGram *m_ngram;
+  const TPLexPrefixTree *m_lexicon;
+
+  /// The lookahead LM ID of each word in the word order of the lexicon.
+  std::vector<int> m_lm_ids;
+
+  /// The unigram log probability of each lookahead LM ID.
+  std::vector<float> m_unigrams;
+
+  /// The lookahead nodes and their maximum unigram log probabilities.
+  std::vector<const TPLexPrefixTree::Node*> m_nodes;
+  std::vector<float> m_unigram_max;
+
+  /// The lookahead nodes where each lookahead LM ID is possible, as offsets
+  /// to \ref m_lm_id_nodes.
+  std::vector<int> m_lm_id_node_offsets;
+  std::vector<int> m_lm_id_nodes;
+
+  /// Recently used contexts, indexed by a hash of the context.
+  std::vector<Context> m_contexts;
+
+  /// The corrections of the context being computed, indexed by node.
+  std::vector<float> m_node_buffer;
+
+  long m_num_lookups;
+  long m_num_misses;
+};
+
+#endif // SPARSELMLOOKAHEAD_HH
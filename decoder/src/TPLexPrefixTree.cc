@@ -2,10 +2,14 @@
 #include <cstdio>
 #include <cmath>
 #include <algorithm>
+#include <map>
+#include <set>
 #include <stdexcept>
 #include <iostream>
+#include <sys/mman.h>
 
 #include "TPLexPrefixTree.hh"
+#include "ThreadPool.hh"
 
 using namespace std;
 
@@ -48,30 +52,47 @@ TPLexPrefixTree::TPLexPrefixTree(std::map<std::string,int> &hmm_map,
     m_hmm_map(hmm_map),
     m_hmms(hmms)
 {
+  m_file_nodes = NULL;
+  m_num_file_nodes = 0;
+  m_file_map = NULL;
+  m_file_map_size = 0;
   initialize_nodes();
   m_lm_buf_count = 0;
   m_cross_word_triphones = true;
   m_optional_short_silence = true;
-  m_short_silence_state = NULL;
+  m_short_silence_state = -1;
   m_word_boundary_id = -1;
   m_ignore_case = false;
 }
 
-struct delete_node
+TPLexPrefixTree::~TPLexPrefixTree()
 {
-  void operator()(TPLexPrefixTree::Node * ptr)
-  {
-    if (ptr != NULL)
-      delete ptr;
-  }
-};
+  delete_separate_nodes();
+  release_tree_file();
+}
 
-TPLexPrefixTree::~TPLexPrefixTree()
+void TPLexPrefixTree::delete_separate_nodes()
 {
-  for_each(m_nodes.begin(), m_nodes.end(), delete_node());
+  for (int i = 0; i < m_nodes.size(); i++)
+    if (m_nodes[i] != NULL && !in_node_array(m_nodes[i]))
+      delete m_nodes[i];
   m_nodes.clear();
 }
 
+void TPLexPrefixTree::release_tree_file()
+{
+  if (m_file_map == NULL)
+    return;
+  // The arcs that have been added after reading are allocated separately.
+  for (int i = 0; i < m_num_file_nodes; i++)
+    m_file_nodes[i].~Node();
+  munmap(m_file_map, m_file_map_size);
+  m_file_nodes = NULL;
+  m_num_file_nodes = 0;
+  m_file_map = NULL;
+  m_file_map_size = 0;
+}
+
 void TPLexPrefixTree::set_lm_lookahead(int lm_lookahead)
 {
   if (m_silence_node != NULL) {
@@ -94,11 +115,14 @@ void TPLexPrefixTree::initialize_lex_tree(void)
 {
   m_words = 0;
   initialize_nodes();
+  m_word_order.clear();
+  m_word_ranges.clear();
   //      m_lm_lookahead = 0;
 
   m_lm_buf_count = 0;
 
-  m_short_silence_state = NULL;
+  create_state_table();
+  m_short_silence_state = -1;
   m_word_boundary_id = -1;
 
   free_cross_word_network_connection_points();
@@ -108,7 +132,24 @@ void TPLexPrefixTree::initialize_lex_tree(void)
     create_cross_word_network();
 }
 
+void TPLexPrefixTree::create_state_table()
+{
+  m_states.clear();
+  m_hmm_first_states.resize(m_hmms.size());
+  for (int i = 0; i < m_hmms.size(); i++) {
+    m_hmm_first_states[i] = m_states.size();
+    for (int j = 0; j < m_hmms[i].states.size(); j++)
+      m_states.push_back(&m_hmms[i].states[j]);
+  }
+}
+
 void TPLexPrefixTree::add_word(std::vector<Hmm*> &hmm_list, int word_id, double prob)
+{
+  add_word(NULL, hmm_list, word_id, prob);
+}
+
+void TPLexPrefixTree::add_word(Branch *branch, std::vector<Hmm*> &hmm_list,
+                               int word_id, double prob)
 {
   double word_log_prob = safe_log(prob);
   if (word_log_prob <= -99)
@@ -133,10 +174,10 @@ void TPLexPrefixTree::add_word(std::vector<Hmm*> &hmm_list, int word_id, double
       hmm_list[0]->label == "_")
   {
     // Short silence
-    m_short_silence_state = &hmm_list[0]->state(2);
+    m_short_silence_state = state_index(hmm_list[0], 2);
     // Check the self transition
-    assert( m_short_silence_state->transitions.size() == 2 &&
-            m_short_silence_state->transitions[0].target == 2 );
+    assert( hmm_list[0]->state(2).transitions.size() == 2 &&
+            hmm_list[0]->state(2).transitions[0].target == 2 );
     return;
   }
 
@@ -146,7 +187,7 @@ void TPLexPrefixTree::add_word(std::vector<Hmm*> &hmm_list, int word_id, double
   bool link_to_cross_word_network = false;
 
   node_vector source_nodes, sink_nodes;
-  source_nodes.push_back(m_root_node);
+  source_nodes.push_back(branch != NULL ? &branch->root : m_root_node);
   source_trans_log_probs.push_back(0);
   int word_end = -1;
   for (int i = 0; i < hmm_list.size(); i++)
@@ -166,14 +207,12 @@ void TPLexPrefixTree::add_word(std::vector<Hmm*> &hmm_list, int word_id, double
       if (link_to_cross_word_network) {
         // First, add a dummy node with a word identity. This is where the word
         // is inserted into word history in decoding.
-        Node *wid_node = new Node(word_id);
-        wid_node->node_id = m_nodes.size();
+        Node *wid_node = add_node(new Node(word_id), branch);
         wid_node->flags = NODE_USE_WORD_END_BEAM;
         if (i == 0)
           wid_node->flags |= NODE_FIRST_STATE_OF_WORD;
-        m_nodes.push_back(wid_node);
         Arc temp_arc;
-        temp_arc.next = wid_node;
+        temp_arc.next = wid_node->node_id;
 
         for (int source_id = 0; source_id < source_nodes.size(); ++source_id) {
           // Transition to the dummy node that links to cross word network.
@@ -187,18 +226,11 @@ void TPLexPrefixTree::add_word(std::vector<Hmm*> &hmm_list, int word_id, double
         }
 
         // Link the dummy node to fan-out triphones in the cross word network.
-        // The fan-out triphones are created on demand, and organized so that
-        // triphones belonging to the same phoneme and having the same left
-        // context are grouped together and are allowed to share their common
-        // states. The dummy node is linked to every entry node of the
-        // corresponding group.
-        std::string temp1(hmm_list[i]->label, 0, 1);
-        std::string temp2(hmm_list[i]->label, 2, 1);
-        std::string key = temp1 + temp2;
-        std::vector<Arc> new_arcs;
-        link_node_to_fan_network(key, new_arcs, true, false, 0);
-        for (int j = 0; j < new_arcs.size(); j++)
-          wid_node->arcs.push_back(new_arcs[j]);
+        BranchAction action;
+        action.type = BranchAction::FAN_OUT_LINK;
+        action.node = wid_node;
+        action.hmm = hmm_list[i];
+        add_branch_action(branch, action);
 
         // Single phoneme words must be handled separately. The only node linked
         // to the root node is the dummy node with the word identity. This is
@@ -206,16 +238,22 @@ void TPLexPrefixTree::add_word(std::vector<Hmm*> &hmm_list, int word_id, double
         // words also another implementation of the word has to be added inside
         // the cross-word network.
         if (i == 0) {
-          add_single_hmm_word_for_cross_word_modeling(hmm_list[0],
-                                                      word_id,
-                                                      prob);
+          action.type = BranchAction::SINGLE_HMM_WORD;
+          action.node = NULL;
+          action.hmm = hmm_list[0];
+          action.word_id = word_id;
+          action.prob = prob;
+          add_branch_action(branch, action);
         }
         // Added a check that the first phone is a triphone (label is five characters).
         //   2012-05-07 / SE
         else if ((i == 1) && (hmm_list[0]->label.size() == 5)) {
           // Word has two HMMs, mark the null node as a connection
           // point for linking from cross word network
-          add_fan_in_connection_node(wid_node, hmm_list[0]->label);
+          action.type = BranchAction::FAN_IN_CONNECTION;
+          action.node = wid_node;
+          action.hmm = hmm_list[0];
+          add_branch_action(branch, action);
         }
         source_nodes.clear();
         source_trans_log_probs.clear();
@@ -242,7 +280,7 @@ void TPLexPrefixTree::add_word(std::vector<Hmm*> &hmm_list, int word_id, double
                             source_trans_log_probs[source_id],
                             word_end,
                             hmm_state_nodes,
-                            sink_nodes, sink_trans_log_probs, 0);
+                            sink_nodes, sink_trans_log_probs, 0, branch);
       }
     }
 
@@ -264,7 +302,11 @@ void TPLexPrefixTree::add_word(std::vector<Hmm*> &hmm_list, int word_id, double
       // Added a check that the first phone is a triphone (label is five characters).
       //   2012-05-07 / SE
       if (m_cross_word_triphones && (hmm_list.size() > 2) && (hmm_list[0]->label.size() == 5)) {
-        add_fan_in_connection_node(hmm_state_nodes[0], hmm_list[0]->label);
+        BranchAction action;
+        action.type = BranchAction::FAN_IN_CONNECTION;
+        action.node = hmm_state_nodes[0];
+        action.hmm = hmm_list[0];
+        add_branch_action(branch, action);
       }
     }
 
@@ -277,7 +319,7 @@ void TPLexPrefixTree::add_word(std::vector<Hmm*> &hmm_list, int word_id, double
                             state.transitions[trans_id],
                             0, word_end,
                             hmm_state_nodes,
-                            sink_nodes, sink_trans_log_probs, 0);
+                            sink_nodes, sink_trans_log_probs, 0, branch);
       }
     }
     source_nodes = sink_nodes;
@@ -293,7 +335,7 @@ void TPLexPrefixTree::add_word(std::vector<Hmm*> &hmm_list, int word_id, double
 
     Arc end_arc;
     end_arc.next = (silence && m_cross_word_triphones ? m_root_node
-                    : m_end_node);
+                    : m_end_node)->node_id;
     end_arc.log_prob = get_out_transition_log_prob(source_nodes.front());
 
     // Added pronunciation log prob.
@@ -312,7 +354,171 @@ void TPLexPrefixTree::add_word(std::vector<Hmm*> &hmm_list, int word_id, double
     }
   }
 
-  m_words = word_id + 1;
+  if (branch == NULL)
+    m_words = word_id + 1;
+}
+
+void TPLexPrefixTree::add_words(std::vector<WordEntry> &words, int num_threads)
+{
+  // Partition the words by the model of the first state. The words that do
+  // not change the tree and the long silence words, which set the silence
+  // nodes of the tree, are added one at a time while merging.
+  std::map<int, int> model_branches;
+  std::set<int> serial_models;
+  std::vector<int> word_branches(words.size(), -1);
+  bool parallel = num_threads > 1;
+  for (int w = 0; w < words.size() && parallel; w++) {
+    std::vector<Hmm*> &hmm_list = words[w].hmm_list;
+    if (hmm_list.empty() || safe_log(words[w].prob) <= -99)
+      continue;
+    HmmState &source = hmm_list[0]->state(0);
+    if (hmm_list.size() == 1
+        && (hmm_list[0]->label == "_" || hmm_list[0]->label == "__"))
+    {
+      // A serially added word shares the root arcs with the branch of the
+      // same model, so the branches would not match the serial build.
+      for (int t = 0; t < source.transitions.size(); t++)
+        if (!hmm_list[0]->is_sink(source.transitions[t].target))
+          serial_models.insert(
+            hmm_list[0]->state(source.transitions[t].target).model);
+      continue;
+    }
+    if (source.transitions.size() != 1
+        || hmm_list[0]->is_sink(source.transitions[0].target))
+    {
+      parallel = false;
+      break;
+    }
+    int model = hmm_list[0]->state(source.transitions[0].target).model;
+    std::map<int, int>::iterator it = model_branches.find(model);
+    if (it == model_branches.end())
+      it = model_branches.insert(
+        std::make_pair(model, (int)model_branches.size())).first;
+    word_branches[w] = it->second;
+  }
+  for (std::set<int>::iterator it = serial_models.begin();
+       it != serial_models.end() && parallel; ++it)
+  {
+    if (model_branches.find(*it) != model_branches.end())
+      parallel = false;
+  }
+
+  if (!parallel) {
+    for (int w = 0; w < words.size(); w++)
+      add_word(NULL, words[w].hmm_list, words[w].word_id, words[w].prob);
+    return;
+  }
+
+  std::vector<Branch> branches(model_branches.size());
+  std::vector<std::vector<int> > branch_words(branches.size());
+  for (int w = 0; w < words.size(); w++)
+    if (word_branches[w] >= 0)
+      branch_words[word_branches[w]].push_back(w);
+
+  ThreadPool thread_pool(num_threads);
+  thread_pool.run(branches.size(), [&](int b) {
+      Branch &branch = branches[b];
+      for (int i = 0; i < branch_words[b].size(); i++) {
+        WordEntry &word = words[branch_words[b][i]];
+        add_word(&branch, word.hmm_list, word.word_id, word.prob);
+        Branch::WordEnd word_end;
+        word_end.num_root_arcs = branch.root.arcs.size();
+        word_end.num_nodes = branch.nodes.size();
+        word_end.num_actions = branch.actions.size();
+        branch.word_ends.push_back(word_end);
+      }
+    });
+
+  // Merge the branches in the order of the words. A word creates its nodes
+  // and root arcs before it changes the fan-in and fan-out networks, so the
+  // nodes get the same IDs as when adding the words one at a time.
+  std::vector<int> next_words(branches.size(), 0);
+  for (int w = 0; w < words.size(); w++) {
+    int b = word_branches[w];
+    if (b < 0) {
+      add_word(NULL, words[w].hmm_list, words[w].word_id, words[w].prob);
+      continue;
+    }
+    Branch &branch = branches[b];
+    int i = next_words[b]++;
+    const Branch::WordEnd &end = branch.word_ends[i];
+    Branch::WordEnd begin = { 0, 0, 0 };
+    if (i > 0)
+      begin = branch.word_ends[i - 1];
+    for (int j = begin.num_nodes; j < end.num_nodes; j++) {
+      branch.nodes[j]->node_id = m_nodes.size();
+      m_nodes.push_back(branch.nodes[j]);
+    }
+    for (int j = begin.num_root_arcs; j < end.num_root_arcs; j++) {
+      m_root_node->arcs.push_back(branch.root.arcs[j]);
+      merge_arc_target(m_root_node->arcs.back(), branch);
+    }
+    for (int j = begin.num_actions; j < end.num_actions; j++)
+      apply_branch_action(branch.actions[j]);
+    m_words = words[w].word_id + 1;
+  }
+
+  // The nodes of a word may have arcs to the nodes of the later words of the
+  // branch, so the arcs are updated after all the nodes have their IDs.
+  for (int b = 0; b < branches.size(); b++) {
+    for (int j = 0; j < branches[b].nodes.size(); j++) {
+      ArcList &arcs = branches[b].nodes[j]->arcs;
+      for (int k = 0; k < arcs.size(); k++)
+        merge_arc_target(arcs[k], branches[b]);
+    }
+  }
+}
+
+TPLexPrefixTree::Node *TPLexPrefixTree::add_node(Node *node, Branch *branch)
+{
+  if (branch != NULL) {
+    node->node_id = BRANCH_NODE_ID + branch->nodes.size();
+    branch->nodes.push_back(node);
+  }
+  else {
+    node->node_id = m_nodes.size();
+    m_nodes.push_back(node);
+  }
+  return node;
+}
+
+void TPLexPrefixTree::add_branch_action(Branch *branch,
+                                        const BranchAction &action)
+{
+  if (branch != NULL)
+    branch->actions.push_back(action);
+  else
+    apply_branch_action(action);
+}
+
+void TPLexPrefixTree::apply_branch_action(const BranchAction &action)
+{
+  switch (action.type) {
+  case BranchAction::FAN_IN_CONNECTION:
+    add_fan_in_connection_node(action.node, action.hmm->label);
+    break;
+
+  case BranchAction::FAN_OUT_LINK: {
+    // The fan-out triphones are created on demand, and organized so that
+    // triphones belonging to the same phoneme and having the same left
+    // context are grouped together and are allowed to share their common
+    // states. The dummy node is linked to every entry node of the
+    // corresponding group.
+    std::string temp1(action.hmm->label, 0, 1);
+    std::string temp2(action.hmm->label, 2, 1);
+    std::string key = temp1 + temp2;
+    ArcList new_arcs;
+    link_node_to_fan_network(key, new_arcs, true, false, 0);
+    for (int j = 0; j < new_arcs.size(); j++)
+      action.node->arcs.push_back(new_arcs[j]);
+    break;
+  }
+
+  case BranchAction::SINGLE_HMM_WORD:
+    add_single_hmm_word_for_cross_word_modeling(action.hmm, action.word_id,
+                                                action.prob);
+    break;
+  }
 }
 
 
@@ -324,7 +530,8 @@ TPLexPrefixTree::expand_lexical_tree(Node *source, Hmm *hmm,
                                      node_vector &hmm_state_nodes,
                                      node_vector &sink_nodes,
                                      std::vector<float> &sink_trans_log_probs,
-                                     unsigned short flags)
+                                     unsigned short flags,
+                                     Branch *branch)
 {
   int i;
 
@@ -341,15 +548,13 @@ TPLexPrefixTree::expand_lexical_tree(Node *source, Hmm *hmm,
     {
       // Make explicit sink state for word end
       if (sink_nodes.size() == 0) {
-        Node * sink = new Node(word_end);
-        sink->node_id = m_nodes.size();
+        Node * sink = add_node(new Node(word_end), branch);
         sink->flags = NODE_USE_WORD_END_BEAM | flags;
-        m_nodes.push_back(sink);
         sink_nodes.push_back(sink);
       }
       // Add new arc and return
       Arc temp;
-      temp.next = sink_nodes.front();
+      temp.next = sink_nodes.front()->node_id;
       temp.log_prob = cur_trans_log_prob + t.log_prob;
       source->arcs.push_back(temp);
     }
@@ -359,9 +564,9 @@ TPLexPrefixTree::expand_lexical_tree(Node *source, Hmm *hmm,
   // Find out if the node is already linked
   for (i = 0; i < source->arcs.size(); i++)
   {
-    Node & target = *source->arcs[i].next;
-    if (target.state != NULL &&
-        target.state->model == hmm->state(t.target).model)
+    Node & target = *arc_target(source->arcs[i], branch);
+    if (target.state >= 0 &&
+        m_states[target.state]->model == hmm->state(t.target).model)
     {
       // Already linked to something, check the link is correct
       if (hmm_state_nodes[t.target-2] == NULL ||
@@ -381,15 +586,14 @@ TPLexPrefixTree::expand_lexical_tree(Node *source, Hmm *hmm,
     // FIXME! Can the order of processing the transitions and source states
     // affect the existence of a node?
 
-    hmm_state_nodes[t.target - 2] = new Node(-1, &hmm->state(t.target));
-    hmm_state_nodes[t.target - 2]->node_id = m_nodes.size();
+    hmm_state_nodes[t.target - 2] =
+      add_node(new Node(-1, state_index(hmm, t.target)), branch);
     hmm_state_nodes[t.target - 2]->flags = flags;
-    m_nodes.push_back(hmm_state_nodes[t.target - 2]);
   }
 
   // Add new arc
   Arc temp;
-  temp.next = hmm_state_nodes[t.target - 2];
+  temp.next = hmm_state_nodes[t.target - 2]->node_id;
   temp.log_prob = cur_trans_log_prob + t.log_prob;
   source->arcs.push_back(temp);
 }
@@ -421,8 +625,8 @@ void TPLexPrefixTree::finish_tree(void)
     // tree re-entrant.
     for (int i = 0; i < m_nodes.size(); i++) {
       for (int j = 0; j < m_nodes[i]->arcs.size(); j++) {
-        if (m_nodes[i]->arcs[j].next == m_end_node)
-          m_nodes[i]->arcs[j].next = m_root_node;
+        if (m_nodes[i]->arcs[j].next == m_end_node->node_id)
+          m_nodes[i]->arcs[j].next = m_root_node->node_id;
       }
     }
   }
@@ -430,20 +634,23 @@ void TPLexPrefixTree::finish_tree(void)
   // Link silence arcs
   for (int i = 0; i < m_silence_arcs.size(); i++) {
     m_silence_arcs[i].node->arcs[m_silence_arcs[i].arc_index].next
-      = m_silence_node;
+      = m_silence_node->node_id;
   }
   m_silence_arcs.clear();
 
   // Link start node to silence node
   Arc arc;
-  arc.next = m_silence_node;
+  arc.next = m_silence_node->node_id;
   arc.log_prob = 0;
   m_start_node->arcs.push_back(arc);
 
   // Propagate word ID:s towards the root node and add LM lookahead
-  // list to every branch (if this option is used)
+  // list to every branch (if this option is used). The lists are referred to
+  // by pointers, so the table is not resized while they are filled.
+  m_possible_words.clear();
+  m_possible_words.resize(m_nodes.size());
   for (int i = 0; i < m_root_node->arcs.size(); i++)
-    post_process_lex_branch(m_root_node->arcs[i].next, NULL);
+    post_process_lex_branch(m_nodes[m_root_node->arcs[i].next], NULL);
 
   if (m_cross_word_triphones)
   {
@@ -475,9 +682,6 @@ void TPLexPrefixTree::finish_tree(void)
       }*/
   }
 
-  // FIXME! Should the word id lists for LM lookahead be sorted to increase
-  // processor cache utility?
-
   analyze_cross_word_network();
 
   int nodes = 0, arcs = 0;
@@ -493,6 +697,242 @@ void TPLexPrefixTree::finish_tree(void)
   // debug_add_silence_loop();
 }
 
+void TPLexPrefixTree::finalize()
+{
+  int old_num_nodes = m_nodes.size();
+  size_t old_bytes = memory_usage();
+
+  create_word_ranges();
+
+  // Order the nodes depth-first, so that the first arc of a node usually
+  // leads to the next node. The root, end and silence nodes are kept even
+  // if they cannot be reached.
+  std::vector<int> new_ids(m_nodes.size(), -1);
+  node_vector order;
+  node_vector stack;
+  Node *special_nodes[] = { m_start_node, m_root_node, m_end_node,
+                            m_silence_node, m_last_silence_node,
+                            m_sentence_end_node };
+  const int num_special_nodes = sizeof(special_nodes) / sizeof(Node*);
+  for (int s = 0; s < num_special_nodes; s++) {
+    if (special_nodes[s] == NULL)
+      continue;
+    stack.push_back(special_nodes[s]);
+    while (!stack.empty()) {
+      Node *node = stack.back();
+      stack.pop_back();
+      assert(m_nodes[node->node_id] == node);
+      if (new_ids[node->node_id] >= 0)
+        continue;
+      new_ids[node->node_id] = order.size();
+      order.push_back(node);
+      for (int i = node->arcs.size() - 1; i >= 0; i--) {
+        int next = node->arcs[i].next;
+        if (next >= 0 && new_ids[next] < 0)
+          stack.push_back(m_nodes[next]);
+      }
+    }
+  }
+
+  int num_arcs = 0;
+  for (int i = 0; i < order.size(); i++)
+    num_arcs += order[i]->arcs.size();
+
+  std::vector<Node> node_array(order.size());
+  std::vector<Arc> arc_array(num_arcs);
+  int arc_index = 0;
+  for (int i = 0; i < order.size(); i++) {
+    const Node &old_node = *order[i];
+    Node &node = node_array[i];
+    node.word_id = old_node.word_id;
+    node.node_id = i;
+    node.state = old_node.state;
+    node.flags = old_node.flags;
+    node.num_word_ranges = old_node.num_word_ranges;
+    node.first_word_range = old_node.first_word_range;
+
+    for (int j = 0; j < old_node.arcs.size(); j++) {
+      Arc &arc = arc_array[arc_index + j];
+      arc.log_prob = old_node.arcs[j].log_prob;
+      if (old_node.arcs[j].next >= 0)
+        arc.next = new_ids[old_node.arcs[j].next];
+    }
+    if (!old_node.arcs.empty())
+      node.arcs.refer(&arc_array[arc_index], old_node.arcs.size());
+    arc_index += old_node.arcs.size();
+  }
+
+  for (int s = 0; s < num_special_nodes; s++) {
+    if (special_nodes[s] != NULL)
+      special_nodes[s] = &node_array[new_ids[special_nodes[s]->node_id]];
+  }
+  m_start_node = special_nodes[0];
+  m_root_node = special_nodes[1];
+  m_end_node = special_nodes[2];
+  m_silence_node = special_nodes[3];
+  m_last_silence_node = special_nodes[4];
+  m_sentence_end_node = special_nodes[5];
+
+  // The old nodes may be in the array of a previous call or in a tree file.
+  delete_separate_nodes();
+  release_tree_file();
+  m_node_array.swap(node_array);
+  m_arc_array.swap(arc_array);
+  node_vector(m_node_array.size()).swap(m_nodes);
+  for (int i = 0; i < m_node_array.size(); i++)
+    m_nodes[i] = &m_node_array[i];
+
+  if (m_verbose > 0) {
+    fprintf(stderr, "Lexical tree finalized: %d nodes, %zu bytes before, "
+            "%d nodes, %d arcs, %zu bytes after\n", old_num_nodes, old_bytes,
+            num_nodes(), num_arcs, memory_usage());
+  }
+}
+
+void TPLexPrefixTree::create_word_ranges()
+{
+  // The ranges of a previous call refer to the old word order.
+  m_possible_words.resize(m_nodes.size());
+  for (int i = 0; i < m_nodes.size(); i++) {
+    Node *node = m_nodes[i];
+    if (node != NULL && node->num_word_ranges > 0) {
+      m_possible_words[i].clear();
+      get_lookahead_words(node, m_possible_words[i]);
+      node->num_word_ranges = 0;
+    }
+  }
+
+  // Order the words depth-first from the root node. The word end nodes are
+  // not followed to the cross-word network, so the words below a node of the
+  // prefix tree are consecutive.
+  std::vector<int> positions;
+  std::vector<bool> visited(m_nodes.size(), false);
+  m_word_order.clear();
+  node_vector stack(1, m_root_node);
+  while (!stack.empty()) {
+    Node *node = stack.back();
+    stack.pop_back();
+    if (visited[node->node_id])
+      continue;
+    visited[node->node_id] = true;
+    if (node->word_id >= 0) {
+      if (node->word_id >= positions.size())
+        positions.resize(node->word_id + 1, -1);
+      if (positions[node->word_id] < 0) {
+        positions[node->word_id] = m_word_order.size();
+        m_word_order.push_back(node->word_id);
+      }
+      continue;
+    }
+    for (int i = node->arcs.size() - 1; i >= 0; i--) {
+      int next = node->arcs[i].next;
+      if (next >= 0 && !visited[next])
+        stack.push_back(m_nodes[next]);
+    }
+  }
+
+  m_word_ranges.clear();
+  std::vector<int> sorted;
+  for (int i = 0; i < m_nodes.size(); i++) {
+    Node *node = m_nodes[i];
+    if (node == NULL || m_possible_words[i].empty())
+      continue;
+
+    sorted.clear();
+    for (int j = 0; j < m_possible_words[i].size(); j++) {
+      int word_id = m_possible_words[i][j];
+      if (word_id >= positions.size())
+        positions.resize(word_id + 1, -1);
+      if (positions[word_id] < 0) {
+        // Not reachable from the root node.
+        positions[word_id] = m_word_order.size();
+        m_word_order.push_back(word_id);
+      }
+      sorted.push_back(positions[word_id]);
+    }
+    std::sort(sorted.begin(), sorted.end());
+
+    node->first_word_range = m_word_ranges.size();
+    WordRange range = { sorted[0], sorted[0] + 1 };
+    for (int j = 1; j < sorted.size(); j++) {
+      if (sorted[j] < range.end)
+        continue;
+      if (sorted[j] > range.end) {
+        m_word_ranges.push_back(range);
+        range.begin = sorted[j];
+      }
+      range.end = sorted[j] + 1;
+    }
+    m_word_ranges.push_back(range);
+
+    int num_ranges = m_word_ranges.size() - node->first_word_range;
+    if (num_ranges > 65535)
+      throw runtime_error("TPLexPrefixTree::create_word_ranges: Too many "
+                          "word ranges in a lookahead node.");
+    node->num_word_ranges = num_ranges;
+  }
+  std::vector<std::vector<int> >().swap(m_possible_words);
+  std::vector<int>(m_word_order).swap(m_word_order);
+  std::vector<WordRange>(m_word_ranges).swap(m_word_ranges);
+}
+
+int TPLexPrefixTree::num_lookahead_words(const Node *node) const
+{
+  if (node->num_word_ranges == 0)
+    return has_possible_words(node) ? m_possible_words[node->node_id].size() : 0;
+  const WordRange *ranges = word_ranges(node);
+  int count = 0;
+  for (int i = 0; i < node->num_word_ranges; i++)
+    count += ranges[i].end - ranges[i].begin;
+  return count;
+}
+
+void TPLexPrefixTree::get_lookahead_words(const Node *node,
+                                          std::vector<int> &words) const
+{
+  if (node->num_word_ranges == 0) {
+    if (has_possible_words(node))
+      words.insert(words.end(), m_possible_words[node->node_id].begin(),
+                   m_possible_words[node->node_id].end());
+    return;
+  }
+  const WordRange *ranges = word_ranges(node);
+  for (int i = 0; i < node->num_word_ranges; i++)
+    words.insert(words.end(), m_word_order.begin() + ranges[i].begin,
+                 m_word_order.begin() + ranges[i].end);
+}
+
+// Returns the number of bytes used by an allocation of \a bytes bytes, with
+// the header and alignment of a typical memory allocator.
+static size_t allocation_size(size_t bytes)
+{
+  if (bytes == 0)
+    return 0;
+  size_t size = (bytes + sizeof(size_t) + 15) & ~(size_t)15;
+  return size < 32 ? 32 : size;
+}
+
+size_t TPLexPrefixTree::memory_usage() const
+{
+  size_t bytes = allocation_size(m_nodes.capacity() * sizeof(Node*))
+    + allocation_size(m_node_array.size() * sizeof(Node))
+    + allocation_size(m_arc_array.size() * sizeof(Arc))
+    + allocation_size(m_word_order.capacity() * sizeof(int))
+    + allocation_size(m_word_ranges.capacity() * sizeof(WordRange))
+    + allocation_size(m_possible_words.capacity() * sizeof(std::vector<int>));
+  for (int i = 0; i < m_possible_words.size(); i++)
+    bytes += allocation_size(m_possible_words[i].capacity() * sizeof(int));
+  for (int i = 0; i < m_nodes.size(); i++) {
+    const Node *node = m_nodes[i];
+    if (node == NULL)
+      continue;
+    if (!in_node_array(node))
+      bytes += allocation_size(sizeof(Node));
+    bytes += allocation_size(node->arcs.allocated_bytes());
+  }
+  return bytes;
+}
+
 void TPLexPrefixTree::post_process_lex_branch(Node *node,
                                               std::vector<int> *lm_la_list)
 {
@@ -522,12 +962,12 @@ void TPLexPrefixTree::post_process_lex_branch(Node *node,
         //original_node->flags |= NODE_USE_WORD_END_BEAM;
         node->word_id = -1;
         node->flags |= NODE_AFTER_WORD_ID|NODE_USE_WORD_END_BEAM;
-        if (node->state == NULL)
+        if (node->state < 0)
         {
           if (node->arcs.size() == 1 && prev_nodes.back()->arcs.size() == 2)
           {
             // Final node was a NULL node, we don't need it anymore
-            if (prev_nodes.back()->arcs[0].next != prev_nodes.back())
+            if (prev_nodes.back()->arcs[0].next != prev_nodes.back()->node_id)
             {
               prev_nodes.back()->arcs[0].next = node->arcs[0].next;
               prev_nodes.back()->arcs[0].log_prob += node->arcs[0].log_prob;
@@ -553,9 +993,9 @@ void TPLexPrefixTree::post_process_lex_branch(Node *node,
     out_trans_count = 0;
     for (i = 0; i < node->arcs.size(); i++)
     {
-      if (node->arcs[i].next != node) // Skip self transitions
+      if (node->arcs[i].next != node->node_id) // Skip self transitions
       {
-        real_next = node->arcs[i].next;
+        real_next = m_nodes[node->arcs[i].next];
         if (++out_trans_count > 1)
           break;
       }
@@ -569,17 +1009,18 @@ void TPLexPrefixTree::post_process_lex_branch(Node *node,
       break;
   }
   for (i = 0; i < node->arcs.size(); i++) {
-    if (node->arcs[i].next != node) {
-      post_process_lex_branch(node->arcs[i].next,
-                              &original_node->possible_word_id_list);
+    if (node->arcs[i].next != node->node_id) {
+      post_process_lex_branch(m_nodes[node->arcs[i].next],
+                              &possible_words(original_node));
     }
   }
   if (m_lm_lookahead) {
-    if (original_node->possible_word_id_list.size() > 0)
+    std::vector<int> &words = possible_words(original_node);
+    if (words.size() > 0)
       m_lm_buf_count++;
     if (lm_la_list != NULL) {
-      for (i = 0; i < original_node->possible_word_id_list.size(); i++)
-        lm_la_list->push_back(original_node->possible_word_id_list[i]);
+      for (i = 0; i < words.size(); i++)
+        lm_la_list->push_back(words[i]);
     }
   }
 }
@@ -591,7 +1032,7 @@ TPLexPrefixTree::post_process_fan_triphone(Node *node,
                                            bool fan_in)
 {
   int out_trans_count, arc_count;
-  std::vector<Arc>::iterator arc_it;
+  ArcList::iterator arc_it;
   std::vector<int> *new_lm_la_list;
   int i;
 
@@ -612,17 +1053,18 @@ TPLexPrefixTree::post_process_fan_triphone(Node *node,
     // LM lookahead, as we want to reach possible word ends.
     return true;
   }
-  if (m_lm_lookahead && node->possible_word_id_list.size() > 0)
+  if (m_lm_lookahead && possible_words(node).size() > 0)
   {
     // Already filled this node's list of possible word IDs, copy it.
     if (lm_la_list != NULL)
     {
       // Add words to LM lookahead list
-      for (i = 0; i < node->possible_word_id_list.size(); i++)
+      std::vector<int> &words = possible_words(node);
+      for (i = 0; i < words.size(); i++)
       {
         if (find(lm_la_list->begin(), lm_la_list->end(),
-                 node->possible_word_id_list[i]) == lm_la_list->end())
-          lm_la_list->push_back(node->possible_word_id_list[i]);
+                 words[i]) == lm_la_list->end())
+          lm_la_list->push_back(words[i]);
       }
     }
     return true;
@@ -630,7 +1072,7 @@ TPLexPrefixTree::post_process_fan_triphone(Node *node,
 
   out_trans_count = 0;
   for (i = 0; i < node->arcs.size(); i++) {
-    if (node->arcs[i].next != node) // Skip self transitions
+    if (node->arcs[i].next != node->node_id) // Skip self transitions
     {
       if (++out_trans_count > 1)
         break;
@@ -645,15 +1087,16 @@ TPLexPrefixTree::post_process_fan_triphone(Node *node,
     new_lm_la_list = lm_la_list;
   }
   else
-    new_lm_la_list = &node->possible_word_id_list;
+    new_lm_la_list = &possible_words(node);
 
   arc_count = 0;
   arc_it = node->arcs.begin();
   while (arc_it != node->arcs.end())
   {
-    if ((*arc_it).next != node)
+    if ((*arc_it).next != node->node_id)
     {
-      if (post_process_fan_triphone((*arc_it).next, new_lm_la_list, fan_in))
+      if (post_process_fan_triphone(m_nodes[(*arc_it).next], new_lm_la_list,
+                                    fan_in))
       {
         arc_count++;
         ++arc_it;
@@ -687,19 +1130,27 @@ TPLexPrefixTree::post_process_fan_triphone(Node *node,
 void TPLexPrefixTree::set_sentence_boundary(int sentence_start_id,
                                             int sentence_end_id)
 {
+  if (m_sentence_end_node != NULL) {
+    if (m_sentence_end_node->word_id != sentence_end_id)
+      throw invalid_argument("TPLexPrefixTree::set_sentence_boundary: The "
+                             "tree has a different sentence end.");
+    return;
+  }
+
   // Add nodes containing the sentence start and end word ids
   TPLexPrefixTree::Node * sentence_end_node = new Node(sentence_end_id);
   sentence_end_node->node_id = m_nodes.size();
   sentence_end_node->flags |= NODE_FIRST_STATE_OF_WORD;
   sentence_end_node->state = m_last_silence_node->state;
   m_nodes.push_back(sentence_end_node);
+  m_sentence_end_node = sentence_end_node;
 
   Arc arc;
-  arc.next = sentence_end_node;
+  arc.next = sentence_end_node->node_id;
   arc.log_prob = get_out_transition_log_prob(m_last_silence_node);
   m_last_silence_node->arcs.push_back(arc);
 
-  arc.next = m_root_node;
+  arc.next = m_root_node->node_id;
   arc.log_prob = 0;
   sentence_end_node->arcs.push_back(arc);
 
@@ -711,8 +1162,10 @@ void TPLexPrefixTree::set_sentence_boundary(int sentence_start_id,
 
 void TPLexPrefixTree::initialize_nodes()
 {
-  for_each(m_nodes.begin(), m_nodes.end(), delete_node());
-  m_nodes.clear();
+  delete_separate_nodes();
+  release_tree_file();
+  std::vector<Node>().swap(m_node_array);
+  std::vector<Arc>().swap(m_arc_array);
   m_root_node = new Node(-1);
   m_root_node->node_id = 0;
   m_root_node->flags = NODE_USE_WORD_END_BEAM;
@@ -725,6 +1178,7 @@ void TPLexPrefixTree::initialize_nodes()
   m_nodes.push_back(m_start_node);
   m_silence_node = NULL;
   m_last_silence_node = NULL;
+  m_sentence_end_node = NULL;
 }
 
 void TPLexPrefixTree::create_cross_word_network()
@@ -755,19 +1209,21 @@ void TPLexPrefixTree::add_hmm_to_fan_network(int hmm_id, bool fan_out)
   if (fan_out)
   {
     flags = NODE_FAN_OUT | NODE_AFTER_WORD_ID | NODE_USE_WORD_END_BEAM;
-    hmm_state_nodes[0] = get_fan_out_entry_node(&hmm->state(2), hmm->label);
+    hmm_state_nodes[0] = get_fan_out_entry_node(state_index(hmm, 2),
+                                                hmm->label);
     hmm_state_nodes[0]->flags |= NODE_FAN_OUT_FIRST;
     hmm_state_nodes[hmm->states.size() - 3] = get_fan_out_last_node(
-      &hmm->state(hmm->states.size() - 1), hmm->label);
+      state_index(hmm, hmm->states.size() - 1), hmm->label);
   }
   else
   {
     flags = NODE_FAN_IN;//|NODE_USE_WORD_END_BEAM; // | NODE_AFTER_WORD_ID;
-    hmm_state_nodes[0] = get_fan_in_entry_node(&hmm->state(2), hmm->label);
+    hmm_state_nodes[0] = get_fan_in_entry_node(state_index(hmm, 2),
+                                               hmm->label);
     hmm_state_nodes[0]->flags |= NODE_FAN_IN_FIRST
       | NODE_FIRST_STATE_OF_WORD;
     hmm_state_nodes[hmm->states.size() - 3] = get_fan_in_last_node(
-      &hmm->state(hmm->states.size() - 1), hmm->label);
+      state_index(hmm, hmm->states.size() - 1), hmm->label);
   }
 
   // Expand the nodes
@@ -801,13 +1257,13 @@ void TPLexPrefixTree::link_fan_out_node_to_fan_in(Node *node,
     node->flags &= ~NODE_INSERT_WORD_BOUNDARY; // Clear this flag
     int j;
     for (j = 0; j < node->arcs.size(); j++)
-      if (node->arcs[j].next == NULL) // Silence target is NULL at the moment
+      if (node->arcs[j].next < 0) // Silence target is not linked yet
         break;
     if (j == node->arcs.size())
     {
       Arc temp_arc;
       NodeArcId temp_id;
-      temp_arc.next = NULL;
+      temp_arc.next = -1;
       temp_arc.log_prob = get_out_transition_log_prob(node);
       node->arcs.push_back(temp_arc);
       temp_id.node = node;
@@ -823,7 +1279,7 @@ void TPLexPrefixTree::link_fan_out_node_to_fan_in(Node *node,
     {
       Arc temp_arc;
       Node *silence = get_short_silence_node();
-      temp_arc.next = silence;
+      temp_arc.next = silence->node_id;
       temp_arc.log_prob = get_out_transition_log_prob(node);
       node->arcs.push_back(temp_arc);
       link_node_to_fan_network(key, silence->arcs, false, true,
@@ -835,7 +1291,7 @@ void TPLexPrefixTree::link_fan_out_node_to_fan_in(Node *node,
 
 void
 TPLexPrefixTree::link_node_to_fan_network(const std::string &key,
-                                          std::vector<Arc> &source_arcs,
+                                          ArcList &source_arcs,
                                           bool fan_out,
                                           bool ignore_length,
                                           float out_transition_log_prob)
@@ -879,12 +1335,12 @@ TPLexPrefixTree::link_node_to_fan_network(const std::string &key,
 
   for (i = 0; i < target_nodes->size(); i++) {
     for (j = 0; j < source_arcs.size(); j++) {
-      if (source_arcs[j].next == (*target_nodes)[i])
+      if (source_arcs[j].next == (*target_nodes)[i]->node_id)
         break;
     }
     if (j == source_arcs.size()) {
       // Link
-      temp_arc.next = (*target_nodes)[i];
+      temp_arc.next = (*target_nodes)[i]->node_id;
       temp_arc.log_prob = out_transition_log_prob;
       source_arcs.push_back(temp_arc);
     }
@@ -900,12 +1356,12 @@ TPLexPrefixTree::link_node_to_fan_network(const std::string &key,
                                                    m_fan_in_entry_nodes);
     for (i = 0; i < target_nodes.size(); i++) {
       for (j = 0; j < source_arcs.size(); j++) {
-        if (source_arcs[j].next == target_nodes[i])
+        if (source_arcs[j].next == target_nodes[i]->node_id)
           break;
       }
       if (j == source_arcs.size()) {
         // Link
-        temp_arc.next = target_nodes[i];
+        temp_arc.next = target_nodes[i]->node_id;
         temp_arc.log_prob = out_transition_log_prob;
         source_arcs.push_back(temp_arc);
       }
@@ -946,7 +1402,7 @@ TPLexPrefixTree::add_single_hmm_word_for_cross_word_modeling(
       wid_node->node_id = m_nodes.size();
       wid_node->flags = NODE_USE_WORD_END_BEAM;
       m_nodes.push_back(wid_node);
-      temp_arc.next = wid_node;
+      temp_arc.next = wid_node->node_id;
       const node_vector & nlist = it->second;
 
       // Pronunciation log prob added to all out transition log probs.
@@ -958,7 +1414,7 @@ TPLexPrefixTree::add_single_hmm_word_for_cross_word_modeling(
 
       if (right == "_")
       {
-        temp_arc.next = NULL;
+        temp_arc.next = -1;
         wid_node->arcs.push_back(temp_arc);
         node_arc_id.node = wid_node;
         node_arc_id.arc_index = wid_node->arcs.size() - 1;
@@ -975,7 +1431,7 @@ TPLexPrefixTree::add_single_hmm_word_for_cross_word_modeling(
         {
           Arc temp_arc;
           Node *silence = get_short_silence_node();
-          temp_arc.next = silence;
+          temp_arc.next = silence->node_id;
           temp_arc.log_prob = 0;
           wid_node->arcs.push_back(temp_arc);
           link_node_to_fan_network(in_key, silence->arcs, false, true,
@@ -1025,11 +1481,11 @@ void TPLexPrefixTree::create_lex_tree_links_from_fan_in(Node *fan_in_node,
       {
         // Check the link does not exist already
         for (k = 0; k < fan_in_node->arcs.size(); k++)
-          if (fan_in_node->arcs[k].next == it->second[j])
+          if (fan_in_node->arcs[k].next == it->second[j]->node_id)
             break;
         if (k == fan_in_node->arcs.size()) {
           // Link
-          temp_arc.next = it->second[j];
+          temp_arc.next = it->second[j]->node_id;
           temp_arc.log_prob = get_out_transition_log_prob(fan_in_node);
           fan_in_node->arcs.push_back(temp_arc);
         }
@@ -1086,8 +1542,9 @@ void TPLexPrefixTree::count_fan_size(Node *node, unsigned short flag,
   *num_nodes = 1;
   *num_arcs = node->arcs.size();
   for (i = 0; i < node->arcs.size(); i++) {
-    if (node != node->arcs[i].next) {
-      count_fan_size(node->arcs[i].next, flag, &temp_nodes, &temp_arcs);
+    if (node->node_id != node->arcs[i].next) {
+      count_fan_size(m_nodes[node->arcs[i].next], flag, &temp_nodes,
+                     &temp_arcs);
       *num_nodes += temp_nodes;
       *num_arcs += temp_arcs;
     }
@@ -1103,8 +1560,10 @@ void TPLexPrefixTree::count_prefix_tree_size(Node *node, int *num_nodes,
   (*num_nodes)++;
   (*num_arcs) += node->arcs.size();
   for (i = 0; i < node->arcs.size(); i++) {
-    if (node->arcs[i].next != node && node->arcs[i].next != m_root_node) {
-      count_prefix_tree_size(node->arcs[i].next, num_nodes, num_arcs);
+    if (node->arcs[i].next != node->node_id
+        && node->arcs[i].next != m_root_node->node_id) {
+      count_prefix_tree_size(m_nodes[node->arcs[i].next], num_nodes,
+                             num_arcs);
     }
   }
 }
@@ -1122,7 +1581,7 @@ TPLexPrefixTree::Node*
 TPLexPrefixTree::get_short_silence_node(void)
 {
   Arc temp_arc;
-  assert( m_short_silence_state != NULL );
+  assert( m_short_silence_state >= 0 );
   Node *silence = new Node(m_word_boundary_id, m_short_silence_state);
   silence->node_id = m_nodes.size();
   silence->flags = NODE_FAN_OUT | NODE_USE_WORD_END_BEAM | NODE_FINAL;
@@ -1130,15 +1589,16 @@ TPLexPrefixTree::get_short_silence_node(void)
     silence->flags |= NODE_FIRST_STATE_OF_WORD;
   m_nodes.push_back(silence);
   // Make self transition
-  temp_arc.next = silence;
-  temp_arc.log_prob = m_short_silence_state->transitions[0].log_prob;
+  temp_arc.next = silence->node_id;
+  temp_arc.log_prob =
+    m_states[m_short_silence_state]->transitions[0].log_prob;
   silence->arcs.push_back(temp_arc);
 
   return silence;
 }
 
 TPLexPrefixTree::Node*
-TPLexPrefixTree::get_fan_out_entry_node(HmmState *state,
+TPLexPrefixTree::get_fan_out_entry_node(int state,
                                         const std::string &label)
 {
   std::string temp1(label, 0, 1);
@@ -1153,7 +1613,7 @@ TPLexPrefixTree::get_fan_out_entry_node(HmmState *state,
 }
 
 TPLexPrefixTree::Node*
-TPLexPrefixTree::get_fan_out_last_node(HmmState *state,
+TPLexPrefixTree::get_fan_out_last_node(int state,
                                        const std::string &label)
 {
   std::string temp1(label, 2, 1);
@@ -1170,7 +1630,7 @@ TPLexPrefixTree::get_fan_out_last_node(HmmState *state,
 }
 
 TPLexPrefixTree::Node*
-TPLexPrefixTree::get_fan_in_entry_node(HmmState *state,
+TPLexPrefixTree::get_fan_in_entry_node(int state,
                                        const std::string &label)
 {
   std::string temp1(label, 0, 1);
@@ -1185,7 +1645,7 @@ TPLexPrefixTree::get_fan_in_entry_node(HmmState *state,
 }
 
 TPLexPrefixTree::Node*
-TPLexPrefixTree::get_fan_in_last_node(HmmState *state, const std::string &label)
+TPLexPrefixTree::get_fan_in_last_node(int state, const std::string &label)
 {
   std::string temp1(label, 2, 1);
   std::string temp2(label, 4, 1);
@@ -1199,13 +1659,13 @@ TPLexPrefixTree::get_fan_in_last_node(HmmState *state, const std::string &label)
 }
 
 TPLexPrefixTree::Node*
-TPLexPrefixTree::get_fan_state_node(HmmState *state, node_vector & nodes)
+TPLexPrefixTree::get_fan_state_node(int state, node_vector & nodes)
 {
   Node *new_node;
   for (int i = 0; i < nodes.size(); i++) {
     if (nodes[i] == NULL)
       throw logic_error("TPLexPrefixTree::get_fan_state_node");
-    if (nodes[i]->state->model == state->model) {
+    if (m_states[nodes[i]->state]->model == m_states[state]->model) {
       return nodes[i];
     }
   }
@@ -1241,7 +1701,7 @@ TPLexPrefixTree::add_fan_in_connection_node(Node *node,
 float TPLexPrefixTree::get_out_transition_log_prob(Node *node)
 {
   for (int i = 0; i < node->arcs.size(); i++)
-    if (node->arcs[i].next == node) {
+    if (node->arcs[i].next == node->node_id) {
       // Self transition, compute the out transition
       return log10(1 - pow(10, node->arcs[i].log_prob));
     }
@@ -1254,8 +1714,8 @@ void TPLexPrefixTree::prune_lookahead_buffers(int min_delta, int max_depth)
     printf("LM lookahead buffers before pruning: %d\n", m_lm_buf_count);
   m_lm_buf_count = 0;
   for (int i = 0; i < m_root_node->arcs.size(); i++)
-    prune_lm_la_buffer(min_delta, max_depth, m_root_node->arcs[i].next,
-                       -1, 0);
+    prune_lm_la_buffer(min_delta, max_depth,
+                       m_nodes[m_root_node->arcs[i].next], -1, 0);
   if (m_verbose > 1)
     printf("LM lookahead buffers after pruning: %d\n", m_lm_buf_count);
 }
@@ -1271,50 +1731,40 @@ void TPLexPrefixTree::prune_lm_la_buffer(int delta_thr, int depth_thr,
   if (node->word_id != -1)
     return; // No more LM lookahead
 
-  if (node->possible_word_id_list.size() > 0)
+  size_t size = num_lookahead_words(node);
+  if (size > 0)
   {
     // Determine if we want to remove this buffer
-    if (last_size > 0 &&
-        last_size - node->possible_word_id_list.size() <= delta_thr)
+    if (last_size > 0 && last_size - size <= delta_thr)
     {
       // Not enough change from last lookahead node, remove
-      node->possible_word_id_list.clear();
+      if (has_possible_words(node))
+        possible_words(node).clear();
+      node->num_word_ranges = 0;
     }
     else if (cur_depth >= depth_thr)
     {
       // Gone past the maximum depth
-      node->possible_word_id_list.clear();
+      if (has_possible_words(node))
+        possible_words(node).clear();
+      node->num_word_ranges = 0;
     }
     else
     {
       cur_depth++;
-      cur_size = node->possible_word_id_list.size();
+      cur_size = size;
       m_lm_buf_count++;
     }
   }
 
   for (i = 0; i < node->arcs.size(); i++) {
-    if (node->arcs[i].next != node) {
-      prune_lm_la_buffer(delta_thr, depth_thr, node->arcs[i].next,
+    if (node->arcs[i].next != node->node_id) {
+      prune_lm_la_buffer(delta_thr, depth_thr, m_nodes[node->arcs[i].next],
                          cur_size, cur_depth);
     }
   }
 }
 
-void TPLexPrefixTree::set_lm_lookahead_cache_sizes(int cache_size)
-{
-  for (int i = 0; i < m_nodes.size(); i++)
-    if (m_nodes[i]->possible_word_id_list.size() > 0)
-      m_nodes[i]->lm_lookahead_buffer.set_max_items(cache_size);
-}
-
-void TPLexPrefixTree::clear_node_token_lists(void)
-{
-  for (int i = 0; i < m_nodes.size(); i++) {
-    m_nodes[i]->token_list = NULL;
-  }
-}
-
 void TPLexPrefixTree::print_node_info(int node, const Vocabulary &voc)
 {
   int word_id = m_nodes[node]->word_id;
@@ -1325,32 +1775,32 @@ void TPLexPrefixTree::print_node_info(int node, const Vocabulary &voc)
     printf("word = %s\n", voc.word(word_id).c_str());
   }
 
-  printf("model = %d\n", (m_nodes[node]->state == NULL ? -1
-                          : m_nodes[node]->state->model));
+  printf("model = %d\n", (m_nodes[node]->state < 0 ? -1
+                          : state(m_nodes[node])->model));
   printf("flags: %04x\n", m_nodes[node]->flags);
-  printf("LM lookahead: %zd possible word(s)\n",
-         m_nodes[node]->possible_word_id_list.size());
-  printf("%zd arc(s):\n", m_nodes[node]->arcs.size());
+  printf("LM lookahead: %d possible word(s)\n",
+         num_lookahead_words(m_nodes[node]));
+  printf("%d arc(s):\n", m_nodes[node]->arcs.size());
   for (int i = 0; i < m_nodes[node]->arcs.size(); i++) {
-    printf(" -> %d (%d), transition: %.2f\n",
-           m_nodes[node]->arcs[i].next->node_id,
-           (m_nodes[node]->arcs[i].next->state == NULL ? -1
-            : m_nodes[node]->arcs[i].next->state->model),
+    const Node *next = m_nodes[m_nodes[node]->arcs[i].next];
+    printf(" -> %d (%d), transition: %.2f\n", next->node_id,
+           (next->state < 0 ? -1 : state(next)->model),
            m_nodes[node]->arcs[i].log_prob);
   }
 }
 
 void TPLexPrefixTree::print_lookahead_info(int node, const Vocabulary &voc)
 {
+  std::vector<int> words;
+  get_lookahead_words(m_nodes[node], words);
   printf("Possible word ends: ");
-  if (m_nodes[node]->possible_word_id_list.size() == 0)
+  if (words.size() == 0)
     printf("N/A\n");
   else
   {
-    printf("%zd\n", m_nodes[node]->possible_word_id_list.size());
-    for (int i = 0; i < m_nodes[node]->possible_word_id_list.size(); i++)
-      printf(" %d (%s)\n", m_nodes[node]->possible_word_id_list[i],
-             voc.word(m_nodes[node]->possible_word_id_list[i]).c_str());
+    printf("%zd\n", words.size());
+    for (int i = 0; i < words.size(); i++)
+      printf(" %d (%s)\n", words[i], voc.word(words[i]).c_str());
   }
 }
 
@@ -1358,7 +1808,7 @@ void TPLexPrefixTree::debug_prune_dead_ends(Node *node)
 {
   for (int i = 0; i < node->arcs.size(); i++) {
     node->flags |= NODE_DEBUG_PRUNED;
-    Node *target = node->arcs[i].next;
+    Node *target = m_nodes[node->arcs[i].next];
     if (!(target->flags & NODE_DEBUG_PRUNED))
       debug_prune_dead_ends(target);
     if (target->arcs.empty()) {
@@ -1367,7 +1817,7 @@ void TPLexPrefixTree::debug_prune_dead_ends(Node *node)
       i--;
     }
   }
-  if (node->arcs.size() == 1 && node->arcs[0].next == node)
+  if (node->arcs.size() == 1 && node->arcs[0].next == node->node_id)
     node->arcs.clear();
 
   /*if (node->arcs.empty() && !(node->flags & NODE_FINAL))
@@ -1382,8 +1832,8 @@ void TPLexPrefixTree::debug_add_silence_loop()
   for (int i = 0; i < 2; i++) {
     prev_node = node;
     for (int a = 0; a < node->arcs.size(); a++) {
-      if (node->arcs[a].next != node) {
-        node = node->arcs[a].next;
+      if (node->arcs[a].next != node->node_id) {
+        node = m_nodes[node->arcs[a].next];
         break;
       }
     }
@@ -1391,6 +1841,6 @@ void TPLexPrefixTree::debug_add_silence_loop()
   }
   Arc arc;
   arc.log_prob = 0;
-  arc.next = prev_node;
+  arc.next = prev_node->node_id;
   node->arcs.push_back(arc);
 }
@@ -2,13 +2,14 @@
 #define TPLEXPREFIXTREE_HH
 
 #include <cstddef>  // NULL
+#include <stdint.h>
 #include <vector>
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 
 #include "config.hh"
 #include "HashCache.hh"
-#include "SimpleHashCache.hh"
 #include "LMHistory.hh"
 
 #include "history.hh"
@@ -134,6 +135,9 @@ public:
 
     StateHistory *state_history;
 
+    // Index in the token list the token was added to in propagation.
+    int list_index;
+
     unsigned char depth;
     unsigned char dur;
 
@@ -153,6 +157,7 @@ public:
       word_start_frame(0),
       word_count(0),
       state_history(NULL),
+      list_index(0),
       depth(0),
       dur(0)
     { }
@@ -162,29 +167,186 @@ public:
   class Arc {
   public:
     float log_prob;
-    Node *next;
+    int next; //!< The ID of the target node, or -1 while it is not linked.
 
     Arc():
       log_prob(0.0f),
-      next(NULL)
+      next(-1)
     {}
   };
 
+  /// \brief The arcs leaving a node.
+  ///
+  /// While the tree is constructed, every list allocates its own arcs.
+  /// finalize() moves the arcs of all the nodes into one array, and the lists
+  /// only refer to their part of it. A list that refers to the array copies
+  /// its arcs into memory of its own when an arc is added.
+  ///
+  /// The list stores the position of its arcs relative to itself, so a list
+  /// that refers to an array is valid wherever the nodes and the array are
+  /// mapped together (see LexTreeFile).
+  ///
+  class ArcList {
+  public:
+    typedef Arc *iterator;
+    typedef const Arc *const_iterator;
+
+    ArcList() : m_offset(0), m_size(0), m_capacity(0) { }
+    ArcList(const ArcList &other) : m_offset(0), m_size(0), m_capacity(0)
+    {
+      *this = other;
+    }
+    ~ArcList() { release(); }
+
+    ArcList &operator=(const ArcList &other)
+    {
+      if (this != &other) {
+        m_size = 0;
+        reserve(other.m_size);
+        std::copy(other.begin(), other.end(), begin());
+        m_size = other.m_size;
+      }
+      return *this;
+    }
+
+    int size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    Arc &operator[](int index) { return begin()[index]; }
+    const Arc &operator[](int index) const { return begin()[index]; }
+    iterator begin() { return arcs(); }
+    iterator end() { return arcs() + m_size; }
+    const_iterator begin() const { return arcs(); }
+    const_iterator end() const { return arcs() + m_size; }
+    Arc &back() { return begin()[m_size - 1]; }
+
+    void push_back(const Arc &arc)
+    {
+      if (m_size >= m_capacity)
+        reserve(m_size < 2 ? 2 : 2 * m_size);
+      begin()[m_size++] = arc;
+    }
+
+    void pop_back() { m_size--; }
+    void clear() { m_size = 0; }
+
+    iterator erase(iterator pos)
+    {
+      std::copy(pos + 1, end(), pos);
+      m_size--;
+      return pos;
+    }
+
+    /// \brief Makes sure that the list has memory of its own for at least
+    /// \a capacity arcs.
+    ///
+    void reserve(int capacity)
+    {
+      if (capacity <= m_capacity)
+        return;
+      Arc *arcs = new Arc[capacity];
+      std::copy(begin(), end(), arcs);
+      release();
+      set_arcs(arcs);
+      m_capacity = capacity;
+    }
+
+    /// \brief Frees the memory of the list, and refers to \a size arcs at
+    /// \a arcs instead. The arcs are not copied.
+    ///
+    void refer(Arc *arcs, int size)
+    {
+      release();
+      set_arcs(arcs);
+      m_size = size;
+    }
+
+    /// \brief Returns true if the list refers to arcs within the \a
+    /// num_arcs arcs at \a arcs, or is empty and has no memory of its own.
+    /// Used for checking the lists of a tree file.
+    ///
+    bool refers_within(const Arc *arcs, int num_arcs) const
+    {
+      if (m_capacity != 0 || m_size < 0)
+        return false;
+      if (m_size == 0)
+        return true;
+      // Unsigned arithmetic, since the offset is not trusted.
+      uintptr_t position = reinterpret_cast<uintptr_t>(this)
+        + static_cast<uintptr_t>(m_offset) - reinterpret_cast<uintptr_t>(arcs);
+      return position % sizeof(Arc) == 0
+        && position / sizeof(Arc) <= (uintptr_t)num_arcs
+        && m_size <= num_arcs - (int)(position / sizeof(Arc));
+    }
+
+    /// \brief Returns the number of bytes allocated by the list itself.
+    ///
+    size_t allocated_bytes() const { return m_capacity * sizeof(Arc); }
+
+  private:
+    // The address is computed as an integer, since the arcs are not a part
+    // of the list object, and the compiler may assume that a pointer derived
+    // from this stays within the object.
+    Arc *arcs() const
+    {
+      return reinterpret_cast<Arc*>(reinterpret_cast<uintptr_t>(this)
+                                    + m_offset);
+    }
+
+    void set_arcs(Arc *arcs)
+    {
+      m_offset = arcs != NULL ? reinterpret_cast<uintptr_t>(arcs)
+        - reinterpret_cast<uintptr_t>(this) : 0;
+    }
+
+    void release()
+    {
+      if (m_capacity > 0)
+        delete[] arcs();
+      set_arcs(NULL);
+      m_capacity = 0;
+    }
+
+    ptrdiff_t m_offset; // The position of the arcs relative to the list.
+    int m_size;
+    int m_capacity; // Zero if the list refers to the arc array of the tree.
+  };
+
+  /// \brief A range of positions in word_order(), from \a begin up to but not
+  /// including \a end.
+  ///
+  struct WordRange {
+    int begin;
+    int end;
+  };
+
+  /// \brief A node of the tree.
+  ///
+  /// The arcs and the state refer to the other nodes and the HMM states by
+  /// their indices in the tree, so the nodes and arcs do not contain
+  /// pointers to each other, and a tree file can be used in place.
+  ///
   class Node {
   public:
-    inline Node() : word_id(-1), node_id(0), state(NULL), token_list(NULL), flags(NODE_NORMAL) { }
-    inline Node(int wid) : word_id(wid), state(NULL), token_list(NULL), flags(NODE_NORMAL) { }
-    inline Node(int wid, HmmState *s) : word_id(wid), state(s), token_list(NULL), flags(NODE_NORMAL) { }
+    inline Node() : word_id(-1), node_id(0), state(-1), flags(NODE_NORMAL),
+                    num_word_ranges(0), first_word_range(0) { }
+    inline Node(int wid) : word_id(wid), state(-1), flags(NODE_NORMAL),
+                           num_word_ranges(0), first_word_range(0) { }
+    inline Node(int wid, int s) : word_id(wid), state(s),
+                                  flags(NODE_NORMAL),
+                                  num_word_ranges(0),
+                                  first_word_range(0) { }
     int word_id; // -1 for nodes without word identity.
-    int node_id;
-    HmmState *state;
-    Token *token_list;
-    std::vector<Arc> arcs;
+    int node_id; // Index of the node in m_nodes.
+    int state; // Index in the state table of the tree, -1 for no state.
+    ArcList arcs;
 
     unsigned short flags;
 
-    std::vector<int> possible_word_id_list;
-    SimpleHashCache<float> lm_lookahead_buffer;
+    /// The possible word ends of a lookahead node, as ranges in the word
+    /// range array of the tree. Nonzero only for the lookahead nodes of a
+    /// finalized tree.
+    unsigned short num_word_ranges;
+    int first_word_range;
   };
 
   struct NodeArcId {
@@ -218,6 +380,22 @@ public:
 
   inline int words() const { return m_words; }
 
+  /// \brief Returns the number of nodes. Node IDs are between 0 and
+  /// num_nodes() - 1.
+  ///
+  inline int num_nodes() const { return m_nodes.size(); }
+
+  inline const Node *node(int node_id) const { return m_nodes[node_id]; }
+  inline Node *node(int node_id) { return m_nodes[node_id]; }
+
+  /// \brief Returns the HMM state of a node, or NULL if the node has no
+  /// state.
+  ///
+  inline HmmState *state(const Node *node) const
+  {
+    return node->state >= 0 ? m_states[node->state] : NULL;
+  }
+
   void set_verbose(int verbose) { m_verbose = verbose; }
 
   /// \brief Enables or disables lookahead language model.
@@ -261,16 +439,94 @@ public:
   ///
   void add_word(std::vector<Hmm*> &hmm_list, int word_id, double prob);
 
+  /// \brief A word to be added by add_words().
+  ///
+  struct WordEntry {
+    std::vector<Hmm*> hmm_list;
+    int word_id;
+    double prob;
+  };
+
+  /// \brief Adds words to the lexical prefix tree, building the branches of
+  /// the root node in parallel.
+  ///
+  /// The branches below different children of the root node are disjoint, so
+  /// the words are partitioned by the model of the first state of their
+  /// first HMM, and the words of each partition are added to a separate
+  /// branch in \a num_threads threads. The fan-in and fan-out networks are
+  /// shared, so the changes to them are recorded and applied after the
+  /// branches have been built, when the branches are merged into the tree in
+  /// the order of the words. The tree is the same as if add_word() had been
+  /// called for each word in order.
+  ///
+  /// If the first HMM of a word has other transitions from the source state
+  /// than the one to the first state, the words are added one at a time.
+  ///
+  void add_words(std::vector<WordEntry> &words, int num_threads);
+
   void finish_tree(void);
+
+  /// \brief Renumbers the nodes in depth-first order from the start node, and
+  /// moves them into one array and their arcs into another.
+  ///
+  /// The nodes that a token passing through a node will visit next are then
+  /// stored close to it, which is faster to search than nodes allocated one
+  /// at a time. The nodes that cannot be reached from the start node are
+  /// removed. Node pointers and IDs from before the call are invalidated.
+  /// The tree can still be modified afterwards, but the new nodes and arcs
+  /// are allocated separately.
+  ///
+  /// The lists of possible word ends of the lookahead nodes are replaced by
+  /// ranges of word_order(). The words are ordered depth-first from the root
+  /// node, so the possible words of a node in the prefix tree form a single
+  /// range. Only the lookahead nodes of the cross-word network need several
+  /// ranges.
+  ///
+  void finalize();
+
+  /// \brief Returns the word IDs of the words in the tree in the order that
+  /// the word ranges of the lookahead nodes refer to.
+  ///
+  const std::vector<int> &word_order() const { return m_word_order; }
+
+  /// \brief Returns the first word range of a lookahead node. The node has
+  /// \ref Node::num_word_ranges ranges.
+  ///
+  const WordRange *word_ranges(const Node *node) const
+  {
+    return &m_word_ranges[node->first_word_range];
+  }
+
+  /// \brief Returns the number of possible word ends of a lookahead node.
+  ///
+  int num_lookahead_words(const Node *node) const;
+
+  /// \brief Appends the word IDs of the possible word ends of a node to \a
+  /// words.
+  ///
+  void get_lookahead_words(const Node *node, std::vector<int> &words) const;
+
+  /// \brief Returns an estimate of the memory used by the nodes, their arcs
+  /// and word lists, including the overhead of the memory allocator.
+  ///
+  size_t memory_usage() const;
   
   void prune_lookahead_buffers(int min_delta, int max_depth);
-  void set_lm_lookahead_cache_sizes(int cache_size);
 
   void set_word_boundary_id(int id) { m_word_boundary_id = id; }
   void set_optional_short_silence(bool state) { m_optional_short_silence = state; }
-  void set_sentence_boundary(int sentence_start_id, int sentence_end_id);
 
-  void clear_node_token_lists(void);
+  /// \brief Adds the sentence end node after the long silence.
+  ///
+  /// The tree may be shared by several searches, which all call this, so
+  /// the node is created only once. Nodes cannot be added to a tree that is
+  /// being searched, so the first call has to be made before any search over
+  /// the tree is started.
+  ///
+  /// \exception invalid_argument If the tree already has a sentence end
+  /// node with a different word ID.
+  ///
+  void set_sentence_boundary(int sentence_start_id, int sentence_end_id);
 
   void print_node_info(int node, const Vocabulary &voc);
   void print_lookahead_info(int node, const Vocabulary &voc);
@@ -279,6 +535,45 @@ public:
   
   
 private:
+  enum { BRANCH_NODE_ID = 1 << 30 };
+
+  /// \brief A change to the fan-in or fan-out network made by add_word().
+  ///
+  struct BranchAction {
+    enum Type {
+      FAN_IN_CONNECTION, //!< add_fan_in_connection_node() for \a node
+      FAN_OUT_LINK, //!< Link \a node to the fan-out network.
+      SINGLE_HMM_WORD //!< add_single_hmm_word_for_cross_word_modeling()
+    };
+
+    Type type;
+    Node *node;
+    Hmm *hmm;
+    int word_id;
+    double prob;
+  };
+
+  /// \brief The nodes and arcs of the words added to one branch by
+  /// add_words().
+  ///
+  struct Branch {
+    /// The node that stands for the root node while adding the words.
+    Node root;
+
+    /// The nodes created for the words, and the actions to be applied to the
+    /// tree, in the order they were created.
+    node_vector nodes;
+    std::vector<BranchAction> actions;
+
+    /// The number of root arcs, nodes and actions after each word.
+    struct WordEnd {
+      int num_root_arcs;
+      int num_nodes;
+      int num_actions;
+    };
+    std::vector<WordEnd> word_ends;
+  };
+
   /// \brief Creates a transition from source node, if it doesn't exist already.
   ///
   void expand_lexical_tree(Node *source, Hmm *hmm, HmmTransition &t,
@@ -287,7 +582,58 @@ private:
                            node_vector &hmm_state_nodes,
                            node_vector &sink_nodes,
                            std::vector<float> &sink_trans_log_probs,
-                           unsigned short flags);
+                           unsigned short flags,
+                           Branch *branch = NULL);
+
+  /// \brief Adds a word to \a branch, or to the tree if \a branch is NULL.
+  ///
+  void add_word(Branch *branch, std::vector<Hmm*> &hmm_list, int word_id,
+                double prob);
+
+  /// \brief Stores \a node in \a branch, or in the tree if \a branch is
+  /// NULL, and gives it the next node ID. The IDs of the nodes in a branch
+  /// start from \ref BRANCH_NODE_ID, and are replaced with tree node IDs
+  /// when the branch is merged.
+  ///
+  Node *add_node(Node *node, Branch *branch);
+
+  /// \brief Returns the target node of an arc of a node in \a branch, or
+  /// of a node in the tree if \a branch is NULL.
+  ///
+  Node *arc_target(const Arc &arc, Branch *branch)
+  {
+    if (branch != NULL && arc.next >= BRANCH_NODE_ID)
+      return branch->nodes[arc.next - BRANCH_NODE_ID];
+    return m_nodes[arc.next];
+  }
+
+  /// \brief Replaces a branch node ID of an arc with the tree node ID the
+  /// node got when it was merged.
+  ///
+  void merge_arc_target(Arc &arc, const Branch &branch)
+  {
+    if (arc.next >= BRANCH_NODE_ID)
+      arc.next = branch.nodes[arc.next - BRANCH_NODE_ID]->node_id;
+  }
+
+  /// \brief Creates the table of all the HMM states, which the nodes refer
+  /// to, in the order of the HMMs.
+  ///
+  void create_state_table();
+
+  /// \brief Returns the index of a state of an HMM in the state table.
+  ///
+  int state_index(const Hmm *hmm, int state) const
+  {
+    return m_hmm_first_states[hmm - &m_hmms[0]] + state;
+  }
+
+  /// \brief Records \a action in \a branch, or applies it to the tree if
+  /// \a branch is NULL.
+  ///
+  void add_branch_action(Branch *branch, const BranchAction &action);
+
+  void apply_branch_action(const BranchAction &action);
 
   void post_process_lex_branch(Node *node, std::vector<int> *lm_la_list);
   bool post_process_fan_triphone(Node *node, std::vector<int> *lm_la_list,
@@ -298,6 +644,38 @@ private:
   ///
   void initialize_nodes();
 
+  /// \brief Deletes the nodes that are not in \ref m_node_array or in the
+  /// mapped tree file.
+  ///
+  void delete_separate_nodes();
+
+  bool in_node_array(const Node *node) const
+  {
+    return (!m_node_array.empty() && node >= &m_node_array[0]
+            && node < &m_node_array[0] + m_node_array.size())
+      || (node >= m_file_nodes && node < m_file_nodes + m_num_file_nodes);
+  }
+
+  /// \brief Frees the arcs that the nodes of the mapped tree file have
+  /// allocated after reading, and unmaps the file.
+  ///
+  void release_tree_file();
+
+  /// \brief Returns the list of possible word ends of a lookahead node
+  /// while the tree is constructed. finalize() converts the lists into word
+  /// ranges.
+  ///
+  std::vector<int> &possible_words(const Node *node)
+  {
+    return m_possible_words[node->node_id];
+  }
+
+  bool has_possible_words(const Node *node) const
+  {
+    return node->node_id < (int)m_possible_words.size()
+      && !m_possible_words[node->node_id].empty();
+  }
+
   /// \brief Creates fan in HMMs
   ///
   /// The construction of the search network starts by creating the fan-in
@@ -333,7 +711,7 @@ private:
   /// together and are allowed to share their common states.
   ///
   void link_node_to_fan_network(const std::string &key,
-                                std::vector<Arc> &source_arcs,
+                                ArcList &source_arcs,
                                 bool fan_out,
                                 bool ignore_length,
                                 float out_transition_log_prob);
@@ -375,20 +753,20 @@ private:
   
   void free_cross_word_network_connection_points(void);
   Node* get_short_silence_node(void);
-  Node* get_fan_out_entry_node(HmmState *state, const std::string &label);
-  Node* get_fan_out_last_node(HmmState *state, const std::string &label);
-  Node* get_fan_in_entry_node(HmmState *state, const std::string &label);
+  Node* get_fan_out_entry_node(int state, const std::string &label);
+  Node* get_fan_out_last_node(int state, const std::string &label);
+  Node* get_fan_in_entry_node(int state, const std::string &label);
 
   /// \brief Returns a node for the last HMM state of a fan-in triphone.
   ///
   /// If the node doesn't exist, creates it, and saves in m_fan_in_last_nodes.
   ///
-  Node* get_fan_in_last_node(HmmState *state, const std::string &label);
+  Node* get_fan_in_last_node(int state, const std::string &label);
 
   /// \brief Finds the node with given state model, creating a new node if
   /// necessary.
   ///
-  Node* get_fan_state_node(HmmState *state, node_vector & nodes);
+  Node* get_fan_state_node(int state, node_vector & nodes);
 
   /// \brief Returns a reference to the entry of \ref nmap with given key,
   /// creating a new node_vector if necessary.
@@ -407,14 +785,46 @@ private:
   void prune_lm_la_buffer(int delta_thr, int depth_thr,
                           Node *node, int last_size, int cur_depth);
 
+  /// \brief Orders the words depth-first from the root node and converts the
+  /// possible word lists of the nodes into word ranges.
+  ///
+  void create_word_ranges();
+
 private:
+  // Writes and reads the nodes and the private state of the tree.
+  friend class LexTreeFile;
+
   int m_words; // Largest word_id in the nodes plus one
   Node *m_root_node;
   Node *m_end_node;
   Node *m_start_node;
   Node *m_silence_node;
   Node *m_last_silence_node;
+  Node *m_sentence_end_node; //!< NULL until set_sentence_boundary().
   node_vector m_nodes;
+
+  /// The nodes and arcs moved by finalize() in depth-first order. These are
+  /// never resized, since the nodes and arcs are referred to by pointers.
+  std::vector<Node> m_node_array;
+  std::vector<Arc> m_arc_array;
+
+  /// The nodes of a tree file that LexTreeFile::read() has mapped into
+  /// memory. They are used in place, so the processes that read the same
+  /// file share the pages that are not modified.
+  Node *m_file_nodes;
+  int m_num_file_nodes;
+  void *m_file_map;
+  size_t m_file_map_size;
+
+  /// The possible word ends of the lookahead nodes by node ID while the tree
+  /// is constructed.
+  std::vector<std::vector<int> > m_possible_words;
+
+  /// The word IDs in the order created by finalize(), and the word ranges of
+  /// the lookahead nodes in that order.
+  std::vector<int> m_word_order;
+  std::vector<WordRange> m_word_ranges;
+
   int m_verbose;
   int m_lm_lookahead; // 0=None, 1=Only in first subtree nodes,
                       // 2=Full
@@ -425,12 +835,17 @@ private:
   bool m_silence_is_word;
   bool m_ignore_case;
   bool m_optional_short_silence;
-  HmmState *m_short_silence_state;
+  int m_short_silence_state; // -1 if there is none.
   int m_word_boundary_id;
 
   std::map<std::string,int> &m_hmm_map;
   std::vector<Hmm> &m_hmms;
 
+  /// The states of all the HMMs, and the index of the first state of each
+  /// HMM in the table.
+  std::vector<HmmState*> m_states;
+  std::vector<int> m_hmm_first_states;
+
   string_to_nodes_map m_fan_out_entry_nodes;
   string_to_nodes_map m_fan_out_last_nodes;
   string_to_nodes_map m_fan_in_entry_nodes;
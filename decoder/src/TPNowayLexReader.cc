@@ -15,7 +15,8 @@ TPNowayLexReader::TPNowayLexReader(
     m_hmms(hmms),
     m_lexicon(lex_tree),
     m_vocabulary(vocab),
-    m_silence_is_word(true)
+    m_silence_is_word(true),
+    m_num_threads(1)
 {
 }
 
@@ -73,6 +74,7 @@ TPNowayLexReader::read(FILE *file, const std::string &word_boundary)
 {
   int word_id;
   vector<Hmm*> hmm_list;
+  vector<TPLexPrefixTree::WordEntry> words;
   m_word.reserve(128); // The size is not necessary, just for efficiency
 
   m_vocabulary.reset();
@@ -155,14 +157,31 @@ TPNowayLexReader::read(FILE *file, const std::string &word_boundary)
       word_id = m_vocabulary.add_word(m_word);
       if (m_word == word_boundary)
       {
+        // The words before the word boundary are linked to the cross word
+        // network without the word boundary ID.
+        if (!words.empty()) {
+          m_lexicon.add_words(words, m_num_threads);
+          words.clear();
+        }
         m_lexicon.set_word_boundary_id(word_id);
       }
     }
     else
       word_id = 0;
 
-    if (hmm_list.size() > 0)
-      m_lexicon.add_word(hmm_list, word_id, prob);
+    if (hmm_list.size() > 0) {
+      if (m_num_threads > 1) {
+        words.push_back(TPLexPrefixTree::WordEntry());
+        words.back().hmm_list = hmm_list;
+        words.back().word_id = word_id;
+        words.back().prob = prob;
+      }
+      else
+        m_lexicon.add_word(hmm_list, word_id, prob);
+    }
   }
+  if (!words.empty())
+    m_lexicon.add_words(words, m_num_threads);
   m_lexicon.finish_tree();
+  m_lexicon.finalize();
 }
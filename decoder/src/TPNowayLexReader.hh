@@ -39,6 +39,12 @@ public:
 
   void set_silence_is_word(bool b) { m_silence_is_word = b; }
 
+  /// \brief Sets the number of threads used for building the lexical prefix
+  /// tree. If more than one, the whole lexicon is read before adding the
+  /// words to the tree with TPLexPrefixTree::add_words().
+  ///
+  void set_num_threads(int num_threads) { m_num_threads = num_threads; }
+
   // Current state for error diagnosis
   inline const std::string &word() const { return m_word; }
   inline const std::string &phone() const { return m_phone; }
@@ -84,6 +90,7 @@ protected:
   std::string m_phone;
 
   bool m_silence_is_word;
+  int m_num_threads;
 };
 
 #endif /* TPNOWAYLEXREADER_HH */
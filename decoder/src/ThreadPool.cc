@@ -0,0 +1,70 @@
+#include "ThreadPool.hh"
+
+ThreadPool::ThreadPool(int num_threads) :
+  m_task(NULL),
+  m_num_tasks(0),
+  m_next_task(0),
+  m_tasks_done(0),
+  m_batch(0),
+  m_stop(false)
+{
+  for (int i = 1; i < num_threads; i++)
+    m_workers.push_back(std::thread(&ThreadPool::worker_loop, this));
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_batch_started.notify_all();
+  for (int i = 0; i < m_workers.size(); i++)
+    m_workers[i].join();
+}
+
+void ThreadPool::run(int num_tasks, const Task &task)
+{
+  if (num_tasks <= 0)
+    return;
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_task = &task;
+  m_num_tasks = num_tasks;
+  m_next_task = 0;
+  m_tasks_done = 0;
+  m_batch++;
+  m_batch_started.notify_all();
+
+  execute_tasks(lock);
+  while (m_tasks_done < m_num_tasks)
+    m_batch_finished.wait(lock);
+  m_task = NULL;
+}
+
+void ThreadPool::worker_loop()
+{
+  unsigned int last_batch = 0;
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while (true) {
+    while (!m_stop && m_batch == last_batch)
+      m_batch_started.wait(lock);
+    if (m_stop)
+      return;
+    last_batch = m_batch;
+    execute_tasks(lock);
+  }
+}
+
+void ThreadPool::execute_tasks(std::unique_lock<std::mutex> &lock)
+{
+  while (m_task != NULL && m_next_task < m_num_tasks) {
+    int index = m_next_task++;
+    const Task &task = *m_task;
+    lock.unlock();
+    task(index);
+    lock.lock();
+    if (++m_tasks_done == m_num_tasks)
+      m_batch_finished.notify_all();
+  }
+}
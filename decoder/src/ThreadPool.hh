@@ -0,0 +1,64 @@
+#ifndef THREADPOOL_HH
+#define THREADPOOL_HH
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+/// \brief A fixed set of worker threads that execute batches of tasks.
+///
+/// run() hands out the task indices of one batch to the workers and blocks
+/// until all of them have been executed. The calling thread executes tasks
+/// too, so a pool of N threads creates N-1 worker threads.
+///
+class ThreadPool
+{
+public:
+  typedef std::function<void(int)> Task;
+
+  ThreadPool(int num_threads);
+
+  /// \brief Stops and joins the worker threads.
+  ///
+  ~ThreadPool();
+
+  /// \brief Returns the number of threads executing tasks, including the
+  /// calling thread.
+  ///
+  int num_threads() const { return m_workers.size() + 1; }
+
+  /// \brief Calls \a task with every index 0 ... \a num_tasks - 1 and returns
+  /// when all the calls have returned.
+  ///
+  /// The order of the calls is undefined, so the tasks should write their
+  /// results to separate locations.
+  ///
+  void run(int num_tasks, const Task &task);
+
+private:
+  void worker_loop();
+
+  /// \brief Executes tasks of the current batch until there are none left.
+  ///
+  /// Expects \ref m_mutex to be locked by \a lock.
+  ///
+  void execute_tasks(std::unique_lock<std::mutex> &lock);
+
+  std::vector<std::thread> m_workers;
+  std::mutex m_mutex;
+  std::condition_variable m_batch_started;
+  std::condition_variable m_batch_finished;
+
+  const Task *m_task;
+  int m_num_tasks;
+  int m_next_task;
+  int m_tasks_done;
+
+  /// Incremented for every batch, so that the workers notice a new batch.
+  unsigned int m_batch;
+  bool m_stop;
+};
+
+#endif // THREADPOOL_HH
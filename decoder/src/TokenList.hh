@@ -0,0 +1,117 @@
+#ifndef TOKENLIST_HH
+#define TOKENLIST_HH
+
+#include <vector>
+#include "TPLexPrefixTree.hh"
+
+/// \brief A list of search tokens that keeps the fields needed in pruning in
+/// contiguous arrays.
+///
+/// The total log probability and the lexicon node ID of each token are
+/// stored in arrays of their own, and the tokens, which hold the histories
+/// and the rest of the search state, in a side table. Pruning and the
+/// searches for the best token sweep over the arrays without touching the
+/// tokens, so the tokens that are pruned are only read when they are
+/// released.
+///
+/// The score array has to be kept in sync with the tokens. A token records
+/// its index in Token::list_index when it is added to the list, so that
+/// set_score() can find its entry while new tokens are being propagated.
+/// The index is not updated when the list is compacted.
+///
+class TokenList {
+public:
+  typedef TPLexPrefixTree::Token Token;
+
+  int size() const { return m_tokens.size(); }
+  bool empty() const { return m_tokens.empty(); }
+
+  Token *operator[](int index) const { return m_tokens[index]; }
+  Token *at(int index) const { return m_tokens.at(index); }
+
+  float score(int index) const { return m_scores[index]; }
+  int node_id(int index) const { return m_node_ids[index]; }
+
+  /// \brief Returns the scores as a contiguous array of size() values.
+  ///
+  float *scores() { return m_scores.data(); }
+  const float *scores() const { return m_scores.data(); }
+
+  /// \brief Adds a token to the end of the list, taking the score and the
+  /// node ID from the token.
+  ///
+  void push_back(Token *token)
+  {
+    token->list_index = m_tokens.size();
+    push_back(token, token->total_log_prob, token->node->node_id);
+  }
+
+  /// \brief Adds a token whose score and node ID are already known to the
+  /// end of the list, without reading the token.
+  ///
+  void push_back(Token *token, float score, int node_id)
+  {
+    m_tokens.push_back(token);
+    m_scores.push_back(score);
+    m_node_ids.push_back(node_id);
+  }
+
+  /// \brief Sets the total log probability of a token that was added to this
+  /// list after the last compaction.
+  ///
+  void set_score(Token *token, float score)
+  {
+    token->total_log_prob = score;
+    m_scores[token->list_index] = score;
+  }
+
+  /// \brief Sets the total log probability of the token at \a index.
+  ///
+  void set_score(int index, float score)
+  {
+    m_tokens[index]->total_log_prob = score;
+    m_scores[index] = score;
+  }
+
+  /// \brief Moves the entry at \a from to \a to, overwriting the entry that
+  /// was there.
+  ///
+  void move(int from, int to)
+  {
+    m_tokens[to] = m_tokens[from];
+    m_scores[to] = m_scores[from];
+    m_node_ids[to] = m_node_ids[from];
+  }
+
+  /// \brief Moves the token and the node ID at \a from to \a to, but not the
+  /// score, for when the scores have been compacted already.
+  ///
+  void move_token(int from, int to)
+  {
+    m_tokens[to] = m_tokens[from];
+    m_node_ids[to] = m_node_ids[from];
+  }
+
+  /// \brief Truncates the list to \a size entries.
+  ///
+  void resize(int size)
+  {
+    m_tokens.resize(size);
+    m_scores.resize(size);
+    m_node_ids.resize(size);
+  }
+
+  void clear()
+  {
+    m_tokens.clear();
+    m_scores.clear();
+    m_node_ids.clear();
+  }
+
+private:
+  std::vector<Token*> m_tokens;
+  std::vector<float> m_scores;
+  std::vector<int> m_node_ids;
+};
+
+#endif // TOKENLIST_HH
@@ -7,11 +7,18 @@
 #include <iostream>
 #include <string>
 #include <cctype>
+#include <chrono>
+#include <cstring>
+#include <unordered_map>
+#include <queue>
 
 #include "TokenPassSearch.hh"
 
 #define NUM_HISTOGRAM_BINS 100
-#define TOKEN_RESERVE_BLOCK 1024
+
+// How much the beams are tightened when the token memory budget is
+// exhausted.
+#define BUDGET_BEAM_FACTOR 0.8
 
 #define DEFAULT_MAX_LOOKAHEAD_SCORE_LIST_SIZE 512
 //1031
@@ -19,10 +26,24 @@
 
 #define DEFAULT_MAX_LM_CACHE_SIZE 15000
 
+// How much of the token memory is kept when the search is reset.
+#define DEFAULT_TOKEN_MEMORY_RETAINED (64 << 20)
+
+// How many nodes without HMM states are followed when collecting the word
+// ends of a frame for batch LM scoring.
+#define MAX_LM_QUERY_DEPTH 4
+
 #define MAX_TREE_DEPTH 60
 
 #define MAX_STATE_DURATION 80
 
+// The LM state table is rebuilt when it has at least this many states and
+// twice as many as there are active tokens.
+#define MIN_LM_STATES_TO_COMPACT 16384
+
+// Propagate in parallel only if there are enough tokens per thread.
+#define MIN_TOKENS_PER_THREAD 50
+
 //#define PRUNING_EXTENSIONS
 //#define FAN_IN_PRUNING
 //#define EQ_WC_PRUNING
@@ -30,20 +51,51 @@
 //#define STATE_PRUNING
 //#define FAN_OUT_PRUNING
 
-//#define COUNT_LM_LA_CACHE_MISS
 
 using namespace std;
 
 TokenPassSearch::TokenPassSearch(TPLexPrefixTree &lex, Vocabulary &vocab,
                                  Acoustics *acoustics) :
+  m_word_graph_flush_interval(0),
+  m_posterior_scale(0),
+  m_word_graph_cut_node(-1),
+  m_word_graph_output_nodes(0),
+  m_word_graph_output_arcs(0),
+  m_word_graph_node_file(NULL),
+  m_word_graph_arc_file(NULL),
   m_lexicon(lex),
   m_vocabulary(vocab),
 #ifdef ENABLE_WORDCLASS_SUPPORT
   m_word_classes(NULL),
 #endif
   m_acoustics(acoustics),
+  m_token_memory_retained(DEFAULT_TOKEN_MEMORY_RETAINED),
+  m_budget_pruning_frame(-1),
+  m_budget_dropped_tokens(0),
+  m_token_expansion(1),
+  m_budget_survivors(0),
+  m_budget_dropped_at_prune(0),
+  m_lm_lookahead_mode(DENSE_LM_LOOKAHEAD),
+  m_prune_time(0),
+  m_profiling(false),
+  m_utterance_count(0),
+  m_last_stable_history(NULL),
+  m_end_of_utterance(false),
+  m_result_listener(NULL),
+  m_endpoint_silence_frames(0),
+  m_endpoint_margin(0),
+  m_reset_on_endpoint(false),
+  m_endpoint_silence_count(0),
+  m_endpoint_detected(false),
+  m_restart_pending(false),
+  m_num_threads(1),
+  m_thread_pool(NULL),
+  m_lm_lookahead_cache(&m_own_lm_lookahead_cache),
+  m_lm_cache_type(HASH_CACHE),
+  m_batch_lm_scoring(false),
   m_end_frame(-1),
   m_frame(0),
+  m_segment_start_frame(0),
   m_best_log_prob(0),
   m_worst_log_prob(0),
   m_best_we_log_prob(0),
@@ -58,6 +110,7 @@ TokenPassSearch::TokenPassSearch(TPLexPrefixTree &lex, Vocabulary &vocab,
   m_global_beam(1e10),
   m_word_end_beam(1e10),
   m_similar_lm_hist_span(0),
+  m_recombination_mode(HISTORY_RECOMBINATION),
   m_lm_scale(1),
   m_duration_scale(0),
   m_transition_scale(1),
@@ -90,26 +143,34 @@ TokenPassSearch::TokenPassSearch(TPLexPrefixTree &lex, Vocabulary &vocab,
   m_fan_out_last_log_prob(0),
   m_lm_lookahead_initialized(false)
 {
-  m_active_token_list = new std::vector<TPLexPrefixTree::Token*>;
-  m_new_token_list = new std::vector<TPLexPrefixTree::Token*>;
-  m_word_end_token_list = new std::vector<TPLexPrefixTree::Token*>;
+  m_active_token_list = new token_list_type;
+  m_new_token_list = new token_list_type;
+  m_word_end_token_list = new token_list_type;
 #ifdef ENABLE_MULTIWORD_SUPPORT
   m_split_multiwords = false;
 #endif
 }
 
 TokenPassSearch::~TokenPassSearch() {
+  clear_flushed_word_graph();
+  delete m_thread_pool;
   delete m_active_token_list;
   delete m_new_token_list;
   delete m_word_end_token_list;
-  for (std::vector<LMHistory *>::iterator it=m_lmhist_dealloc_table.begin();
-       it!=m_lmhist_dealloc_table.end();++it) {
-    delete[] *it;
-  }
-  for (std::vector<TPLexPrefixTree::Token *>::iterator it=m_token_dealloc_table.begin();
-       it!=m_token_dealloc_table.end();++it) {
-    delete[] *it;
-  }
+}
+
+void TokenPassSearch::set_num_threads(int num_threads)
+{
+  if (num_threads < 1)
+    num_threads = 1;
+  if (num_threads == m_num_threads)
+    return;
+
+  delete m_thread_pool;
+  m_thread_pool = NULL;
+  m_num_threads = num_threads;
+  if (num_threads > 1)
+    m_thread_pool = new ThreadPool(num_threads);
 }
 
 void TokenPassSearch::set_word_boundary(const std::string &word)
@@ -163,11 +224,54 @@ void TokenPassSearch::add_hesitation_word(const std::string & word)
 }
 
 void TokenPassSearch::reset_search(int start_frame)
+{
+  m_end_frame = -1;
+  start_segment(start_frame);
+
+  // Delete the LM lookahead cache, unless it is shared with other searches.
+  if (m_lm_lookahead_cache == &m_own_lm_lookahead_cache)
+    m_own_lm_lookahead_cache.clear();
+
+  if ((!m_lm_lookahead_initialized
+       || m_lookahead_buffer_index.size() != m_lexicon.num_nodes())
+      && (m_lm_lookahead > 0))
+  {
+    m_own_lm_lookahead_cache.set_max_items(m_max_lookahead_score_list_size);
+    create_lookahead_buffers();
+    if (m_lm_lookahead_mode == SPARSE_LM_LOOKAHEAD)
+      create_sparse_lm_lookahead();
+    if (m_lm_lookahead_table.is_open()
+        && m_lm_lookahead_table.checksum() != lm_lookahead_table_checksum())
+      throw InvalidSetup("The LM lookahead table does not match the lexicon, "
+                         "the vocabulary and the lookahead LM.");
+    m_lm_lookahead_initialized = true;
+  }
+
+  if (m_lm_lookahead > 0) {
+    assert( m_lookahead_ngram != NULL);
+  }
+
+  if (m_lm_score_cache.get_num_items() > 0) {
+    LMScoreInfo *info;
+    while (m_lm_score_cache.remove_last_item(&info))
+      delete info;
+  }
+  m_lm_score_cache.set_max_items(DEFAULT_MAX_LM_CACHE_SIZE);
+  if (m_lm_cache_type == OPEN_ADDRESSING_CACHE)
+    m_open_lm_score_cache.clear();
+}
+
+void TokenPassSearch::start_segment(int start_frame)
 {
   TPLexPrefixTree::Token *t;
   m_frame = start_frame;
-  m_end_frame = -1;
+  m_segment_start_frame = start_frame;
   m_best_final_token = NULL;
+  m_last_stable_history = NULL;
+  m_end_of_utterance = false;
+  m_endpoint_detected = false;
+  m_restart_pending = false;
+  m_endpoint_silence_count = 0;
 
   if (m_verbose > 0) {
     cerr << m_hesitation_ids.size() << " hesitation words." << endl;
@@ -180,7 +284,27 @@ void TokenPassSearch::reset_search(int start_frame)
   }
   m_active_token_list->clear();
 
-  m_lexicon.clear_node_token_lists();
+  // Return the token memory of a long utterance to the system.
+  if (m_token_pool.num_live() == 0)
+    m_token_pool.trim(m_token_memory_retained);
+  m_token_pool.reset_peak();
+  m_budget_pruning_frame = -1;
+  m_budget_dropped_tokens = 0;
+  m_token_expansion = 1;
+  m_budget_survivors = 0;
+  m_budget_dropped_at_prune = 0;
+
+  m_node_token_lists.assign(m_lexicon.num_nodes(), NULL);
+  m_utterance_count++;
+  m_beam_controller.clear_trajectory();
+
+  // All the tokens have been released, so nothing refers to the history
+  // structures of the previous utterance anymore.
+  if (m_verbose > 0)
+    print_history_statistics(stderr);
+  m_lmh_arena.reset();
+  m_word_history_arena.reset();
+  m_state_history_arena.reset();
 
   t = acquire_token();
   t->node = m_lexicon.start_node();
@@ -193,11 +317,13 @@ void TokenPassSearch::reset_search(int start_frame)
   hist::link(t->lm_history);
 
   if (m_generate_word_graph) {
-    t->word_history = new TPLexPrefixTree::WordHistory(-1, -1, NULL);
+    t->word_history = new (m_word_history_arena.allocate())
+        TPLexPrefixTree::WordHistory(-1, -1, NULL);
     t->word_history->lex_node_id = t->node->node_id;
     hist::link(t->word_history);
 
     word_graph.reset();
+    clear_flushed_word_graph();
     int node_index = word_graph.add_node(-1, -1, t->node->node_id, 0);
     word_graph.link(node_index);
     t->recent_word_graph_node = node_index;
@@ -205,6 +331,7 @@ void TokenPassSearch::reset_search(int start_frame)
     m_recent_word_graph_info.resize(m_word_repository.size());
   }
 
+  m_lm_states.clear();
   t->lm_hist_code = 0;
   t->dur = 0;
   t->word_start_frame = -1;
@@ -216,7 +343,7 @@ void TokenPassSearch::reset_search(int start_frame)
   if (m_use_sentence_boundary) {
     LMHistory * sentence_start = acquire_lmhist(
       &m_word_repository[m_sentence_start_id], t->lm_history);
-    hist::unlink(t->lm_history, &m_lmh_pool);
+    hist::unlink(t->lm_history, m_lmh_arena.pool());
     t->lm_history = sentence_start;
     hist::link(t->lm_history);
   }
@@ -232,7 +359,6 @@ void TokenPassSearch::reset_search(int start_frame)
   m_min_word_count = 0;
 #endif
 
-#ifdef COUNT_LM_LA_CACHE_MISS
   for (int i = 0; i < MAX_LEX_TREE_DEPTH; i++)
   {
     lm_la_cache_count[i] = 0;
@@ -240,7 +366,6 @@ void TokenPassSearch::reset_search(int start_frame)
   }
   lm_la_word_cache_count = 0;
   lm_la_word_cache_miss = 0;
-#endif
 
   t->depth = 0;
   //t->token_path = new TPLexPrefixTree::PathHistory(0,0,0,NULL);
@@ -248,7 +373,8 @@ void TokenPassSearch::reset_search(int start_frame)
   t->word_count = 0;
 
   if (m_keep_state_segmentation) {
-    t->state_history = new TPLexPrefixTree::StateHistory(0, 0, NULL);
+    t->state_history = new (m_state_history_arena.allocate())
+        TPLexPrefixTree::StateHistory(0, 0, NULL);
     hist::link(t->state_history);
   }
   else {
@@ -257,30 +383,6 @@ void TokenPassSearch::reset_search(int start_frame)
 
   m_active_token_list->push_back(t);
 
-  if (lm_lookahead_score_list.get_num_items() > 0) {
-    // Delete the LM lookahead cache
-    LMLookaheadScoreList *score_list;
-    while (lm_lookahead_score_list.remove_last_item(&score_list))
-      delete score_list;
-  }
-
-  if (!m_lm_lookahead_initialized && (m_lm_lookahead > 0)) {
-    lm_lookahead_score_list.set_max_items(m_max_lookahead_score_list_size);
-    m_lexicon.set_lm_lookahead_cache_sizes(m_max_node_lookahead_buffer_size);
-    m_lm_lookahead_initialized = true;
-  }
-
-  if (m_lm_lookahead > 0) {
-    assert( m_lookahead_ngram != NULL);
-  }
-
-  if (m_lm_score_cache.get_num_items() > 0) {
-    LMScoreInfo *info;
-    while (m_lm_score_cache.remove_last_item(&info))
-      delete info;
-  }
-  m_lm_score_cache.set_max_items(DEFAULT_MAX_LM_CACHE_SIZE);
-
   m_current_glob_beam = m_global_beam;
   m_current_we_beam = m_word_end_beam;
 }
@@ -301,6 +403,10 @@ TokenPassSearch::run(void)
     }
   }
 
+  if (m_restart_pending)
+    start_segment(m_frame);
+  m_endpoint_detected = false;
+
   if (m_verbose > 1)
     printf("run() in frame %d\n", m_frame);
   if ((m_end_frame != -1 && m_frame >= m_end_frame) ||
@@ -308,6 +414,7 @@ TokenPassSearch::run(void)
   {
     if (m_generate_word_graph || m_require_sentence_end)
       update_final_tokens();
+    m_end_of_utterance = true;
 
     if (m_print_text_result)
       print_lm_history(stdout, true);
@@ -315,22 +422,97 @@ TokenPassSearch::run(void)
     if (m_print_state_segmentation)
       print_state_history();
 
+    if (m_result_listener != NULL)
+      report_results();
+
     return false;
   }
 
-  propagate_tokens();
+  std::chrono::steady_clock::time_point start_time;
+  if (m_beam_controller.target() == BeamController::TIME)
+    start_time = std::chrono::steady_clock::now();
+  m_frame_profile.clear();
+  if (m_profiling) {
+    m_frame_profile.utterance = m_utterance_count - 1;
+    m_frame_profile.frame = m_frame;
+    m_frame_profile.start_time = m_profile.elapsed();
+  }
+  {
+    SearchProfile::Timer timer(
+      m_profiling ? &m_frame_profile.propagate_time : NULL);
+    propagate_tokens();
+  }
   prune_tokens();
+  if (m_beam_controller.enabled())
+    update_beams(start_time);
+  if (m_generate_word_graph && m_word_graph_flush_interval > 0
+      && m_frame % m_word_graph_flush_interval == 0)
+    flush_word_graph();
+  if (m_endpoint_silence_frames > 0 && detect_endpoint()) {
+    m_endpoint_detected = true;
+    if (m_reset_on_endpoint) {
+      // Finish the segment like at the end of the utterance, so that the
+      // results can be read before the next call.
+      if (m_generate_word_graph || m_require_sentence_end)
+        update_final_tokens();
+      m_end_of_utterance = true;
+      m_restart_pending = true;
+    }
+  }
+  if (m_profiling) {
+    m_frame_profile.prune_time = m_prune_time;
+    m_frame_profile.active_tokens = m_active_token_list->size();
+    m_frame_profile.word_graph_nodes = word_graph.nodes.size();
+    m_profile.add(m_frame_profile);
+  }
 #ifdef PRUNING_MEASUREMENT
   analyze_tokens();
 #endif
   /*if ((m_frame%5) == 0)
     save_token_statistics(filecount++);*/
   if (m_print_text_result)
-    print_lm_history(stdout, false);
+    print_lm_history(stdout, m_end_of_utterance);
+  if (m_result_listener != NULL) {
+    report_results();
+    if (m_endpoint_detected)
+      m_result_listener->endpoint(m_frame);
+  }
   m_frame++;
   return true;
 }
 
+bool TokenPassSearch::detect_endpoint()
+{
+  int best = -1;
+  int best_final = -1;
+  for (int i = 0; i < m_active_token_list->size(); i++) {
+    float score = m_active_token_list->score(i);
+    if (best == -1 || score > m_active_token_list->score(best))
+      best = i;
+    if ((m_lexicon.node(m_active_token_list->node_id(i))->flags & NODE_FINAL)
+        && (best_final == -1
+            || score > m_active_token_list->score(best_final)))
+      best_final = i;
+  }
+  const TPLexPrefixTree::Token *best_token =
+    best == -1 ? NULL : (*m_active_token_list)[best];
+  const TPLexPrefixTree::Token *best_final_token =
+    best_final == -1 ? NULL : (*m_active_token_list)[best_final];
+
+  // Silence before the first word is not an endpoint.
+  if (best_final_token == NULL || best_final_token->word_count == 0
+      || best_final_token->total_log_prob
+      < best_token->total_log_prob - m_endpoint_margin)
+  {
+    m_endpoint_silence_count = 0;
+    return false;
+  }
+
+  // Detect the endpoint only once in a silence.
+  m_endpoint_silence_count++;
+  return m_endpoint_silence_count == m_endpoint_silence_frames;
+}
+
 #ifdef PRUNING_MEASUREMENT
 void
 TokenPassSearch::analyze_tokens(void)
@@ -388,7 +570,7 @@ TokenPassSearch::analyze_tokens(void)
       /*if (!((*m_active_token_list)[i]->node->flags&(NODE_FAN_IN|NODE_FAN_OUT)))
         {
         float log_prob = (*m_active_token_list)[i]->total_log_prob;
-        TPLexPrefixTree::Token *cur_token = (*m_active_token_list)[i]->node->token_list;
+        TPLexPrefixTree::Token *cur_token = m_node_token_lists[(*m_active_token_list)[i]->node->node_id];
         temp = 0;
         while (cur_token != NULL)
         {
@@ -404,7 +586,7 @@ TokenPassSearch::analyze_tokens(void)
         if ((*m_active_token_list)[i]->node->flags&NODE_FAN_OUT)
         {
         float log_prob = (*m_active_token_list)[i]->total_log_prob;
-        TPLexPrefixTree::Token *cur_token = (*m_active_token_list)[i]->node->token_list;
+        TPLexPrefixTree::Token *cur_token = m_node_token_lists[(*m_active_token_list)[i]->node->node_id];
         temp = 0;
         while (cur_token != NULL)
         {
@@ -420,7 +602,7 @@ TokenPassSearch::analyze_tokens(void)
         if ((*m_active_token_list)[i]->node->flags&NODE_FAN_IN)
         {
         float log_prob = (*m_active_token_list)[i]->total_log_prob;
-        TPLexPrefixTree::Token *cur_token = (*m_active_token_list)[i]->node->token_list;
+        TPLexPrefixTree::Token *cur_token = m_node_token_lists[(*m_active_token_list)[i]->node->node_id];
         temp = 0;
         while (cur_token != NULL)
         {
@@ -572,22 +754,96 @@ void TokenPassSearch::print_lm_history(FILE *file, bool get_best_path)
     fprintf(out, "meas%i: %.3g\n", i, (*m_active_token_list)[best_token]->meas[i]);
 #endif
 
-#ifdef COUNT_LM_LA_CACHE_MISS
-  fprintf(out, "Count: ");
-  for (i = 0; i < MAX_LEX_TREE_DEPTH; i++)
-    fprintf(out, "%i ", lm_la_cache_count[i]);
-  fprintf(out, "\n");
-  fprintf(out, "Miss: ");
-  for (i = 0; i < MAX_LEX_TREE_DEPTH; i++)
-    fprintf(out, "%i ", lm_la_cache_miss[i]);
-  fprintf(out, "\n");
-  fprintf(out, "WordCount: %d\n", lm_la_word_cache_count);
-  fprintf(out, "WordMiss: %d\n", lm_la_word_cache_miss);
-#endif
-
   fflush(file);
 }
 
+const std::vector<TokenPassSearch::ResultWord> &
+TokenPassSearch::get_stable_words()
+{
+  m_stable_words.clear();
+
+  // After the last frame, the best path is final.
+  const TPLexPrefixTree::Token & token =
+    m_end_of_utterance ? get_best_final_token() : get_first_token();
+
+  // Collect the last continuous sequence of history nodes whose previous
+  // node has reference_count one, like in print_lm_history().
+  m_result_history_stack.clear();
+  LMHistory * lm_history = token.lm_history;
+  bool collect = m_end_of_utterance;
+  while (lm_history != NULL) {
+    if (!m_end_of_utterance && collect && lm_history->reference_count > 1) {
+      m_result_history_stack.clear();
+      collect = false;
+    }
+    if (lm_history == m_last_stable_history)
+      break;
+    if (lm_history->previous != NULL &&
+        lm_history->previous->reference_count == 1)
+      collect = true;
+    if (collect)
+      m_result_history_stack.push_back(lm_history);
+    lm_history = lm_history->previous;
+  }
+
+  if (m_result_history_stack.empty())
+    return m_stable_words;
+  m_last_stable_history = m_result_history_stack.front();
+
+  for (int i = m_result_history_stack.size() - 1; i >= 0; i--) {
+    LMHistory *history = m_result_history_stack[i];
+    if (history->last().word_id() < 0)
+      continue;
+    ResultWord word;
+    word.word_id = history->last().word_id();
+    word.start_frame = history->word_start_frame;
+    m_stable_words.push_back(word);
+  }
+  return m_stable_words;
+}
+
+const std::vector<TokenPassSearch::ResultWord> &
+TokenPassSearch::get_partial_hypothesis()
+{
+  m_partial_words.clear();
+
+  int best = -1;
+  for (int i = 0; i < m_active_token_list->size(); i++) {
+    if (best == -1
+        || m_active_token_list->score(i) > m_active_token_list->score(best))
+      best = i;
+  }
+  if (best == -1)
+    return m_partial_words;
+  const TPLexPrefixTree::Token * best_token = (*m_active_token_list)[best];
+
+  m_result_history_stack.clear();
+  LMHistory * lm_history = best_token->lm_history;
+  while (lm_history != NULL && lm_history != m_last_stable_history) {
+    m_result_history_stack.push_back(lm_history);
+    lm_history = lm_history->previous;
+  }
+
+  for (int i = m_result_history_stack.size() - 1; i >= 0; i--) {
+    LMHistory *history = m_result_history_stack[i];
+    if (history->last().word_id() < 0)
+      continue;
+    ResultWord word;
+    word.word_id = history->last().word_id();
+    word.start_frame = history->word_start_frame;
+    m_partial_words.push_back(word);
+  }
+  return m_partial_words;
+}
+
+void TokenPassSearch::report_results()
+{
+  const std::vector<ResultWord> &stable_words = get_stable_words();
+  for (int i = 0; i < stable_words.size(); i++)
+    m_result_listener->stable_word(stable_words[i]);
+  m_result_listener->partial_hypothesis(get_partial_hypothesis());
+}
+
 float TokenPassSearch::get_am_log_prob(bool get_best_path) const
 {
   const TPLexPrefixTree::Token & token =
@@ -633,45 +889,52 @@ const NGram * TokenPassSearch::get_ngram() const
   return m_ngram;
 }
 
+NGram * TokenPassSearch::get_lookahead_ngram() const
+{
+  return m_lookahead_ngram;
+}
+
+float TokenPassSearch::compute_lm_bigram_lookahead(
+  int prev_word_id, const TPLexPrefixTree::Node *node)
+{
+  std::vector<float> lm_scores;
+  compute_lm_bigram_scores(prev_word_id, lm_scores);
+  return max_lm_score(lm_scores, node);
+}
+
 const TPLexPrefixTree::Token &
 TokenPassSearch::get_best_final_token() const
 {
   if (m_best_final_token != NULL)
     return *m_best_final_token;
 
-  const TPLexPrefixTree::Token * best_final_token = NULL;
-  const TPLexPrefixTree::Token * best_nonfinal_token = NULL;
+  int best_final = -1;
+  int best_nonfinal = -1;
 
-  token_list_type::const_iterator iter = m_active_token_list->begin();
-  for (; iter != m_active_token_list->end(); ++iter) {
-    TPLexPrefixTree::Token * token = *iter;
-
-    if (token == NULL) {
-      continue;
-    }
+  for (int i = 0; i < m_active_token_list->size(); i++) {
+    float score = m_active_token_list->score(i);
 
-    if (token->node->flags & NODE_FINAL) {
-      if ((best_final_token == NULL)
-          || (token->total_log_prob > best_final_token->total_log_prob)) {
-        best_final_token = token;
+    if (m_lexicon.node(m_active_token_list->node_id(i))->flags & NODE_FINAL) {
+      if ((best_final == -1)
+          || (score > m_active_token_list->score(best_final))) {
+        best_final = i;
       }
     }
     else {
-      if ((best_nonfinal_token == NULL)
-          || (token->total_log_prob
-              > best_nonfinal_token->total_log_prob)) {
-        best_nonfinal_token = token;
+      if ((best_nonfinal == -1)
+          || (score > m_active_token_list->score(best_nonfinal))) {
+        best_nonfinal = i;
       }
     }
   }
 
-  if (best_final_token != NULL) {
-    return *best_final_token;
+  if (best_final != -1) {
+    return *(*m_active_token_list)[best_final];
   }
-  else if (best_nonfinal_token != NULL) {
+  else if (best_nonfinal != -1) {
     fprintf(stderr,
             "WARNING: No tokens in final nodes. The result will be incomplete. Try increasing beam.\n");
-    return *best_nonfinal_token;
+    return *(*m_active_token_list)[best_nonfinal];
   }
   else {
     assert(false);
@@ -760,6 +1023,22 @@ void TokenPassSearch::propagate_tokens(void)
   //m_lexicon.clear_node_token_lists();
   clear_active_node_token_lists();
 
+  if (m_batch_lm_scoring && m_use_lm_cache
+      && m_lm_cache_type == OPEN_ADDRESSING_CACHE
+      && m_ngram != NULL && m_ngram->order() > 0)
+  {
+#ifdef ENABLE_MULTIWORD_SUPPORT
+    if (!m_split_multiwords)
+#endif
+      score_word_ends_in_batch();
+  }
+
+  if (m_thread_pool != NULL
+      && m_active_token_list->size() >= MIN_TOKENS_PER_THREAD * m_num_threads) {
+    propagate_tokens_parallel();
+    return;
+  }
+
   for (i = 0; i < m_active_token_list->size(); i++) {
     TPLexPrefixTree::Token *token = (*m_active_token_list)[i];
     if (token) {
@@ -768,15 +1047,81 @@ void TokenPassSearch::propagate_tokens(void)
   }
 }
 
-void TokenPassSearch::propagate_token(TPLexPrefixTree::Token *token)
+void TokenPassSearch::propagate_tokens_parallel(void)
+{
+  const int num_tokens = m_active_token_list->size();
+
+  // Reserve space for one move per arc of each active token.
+  m_token_move_offsets.resize(num_tokens + 1);
+  int num_moves = 0;
+  for (int i = 0; i < num_tokens; i++) {
+    m_token_move_offsets[i] = num_moves;
+    TPLexPrefixTree::Token *token = (*m_active_token_list)[i];
+    if (token)
+      num_moves += token->node->arcs.size();
+  }
+  m_token_move_offsets[num_tokens] = num_moves;
+  if (m_token_moves.size() < num_moves)
+    m_token_moves.resize(num_moves);
+
+  // Split the tokens into ranges with roughly the same number of arcs.
+  const int num_tasks = m_num_threads;
+  m_thread_pool->run(num_tasks, [&](int task) {
+      std::vector<int>::const_iterator first = std::lower_bound(
+        m_token_move_offsets.begin(), m_token_move_offsets.end() - 1,
+        (long long)num_moves * task / num_tasks);
+      std::vector<int>::const_iterator last = std::lower_bound(
+        m_token_move_offsets.begin(), m_token_move_offsets.end() - 1,
+        (long long)num_moves * (task + 1) / num_tasks);
+      for (int i = first - m_token_move_offsets.begin();
+           i < last - m_token_move_offsets.begin(); i++)
+      {
+        const TPLexPrefixTree::Token *token = (*m_active_token_list)[i];
+        if (token == NULL)
+          continue;
+        const TPLexPrefixTree::ArcList &arcs = token->node->arcs;
+        TokenMove *moves = &m_token_moves[m_token_move_offsets[i]];
+        for (int j = 0; j < arcs.size(); j++)
+          compute_simple_move(token, m_lexicon.node(arcs[j].next),
+                              arcs[j].log_prob, moves[j]);
+      }
+    });
+
+  // Add the tokens to the nodes in the original order.
+  for (int i = 0; i < num_tokens; i++) {
+    TPLexPrefixTree::Token *token = (*m_active_token_list)[i];
+    if (token) {
+      propagate_token(token, &m_token_moves[m_token_move_offsets[i]]);
+    }
+  }
+}
+
+void TokenPassSearch::propagate_token(TPLexPrefixTree::Token *token,
+                                      const TokenMove *moves)
 {
   TPLexPrefixTree::Node *source_node = token->node;
   int i;
 
+  if (m_generate_word_graph && token->word_history->lex_node_id !=
+      word_graph.nodes[token->recent_word_graph_node].lex_node_id)
+  {
+    fprintf(stderr, 
+            "frame %d: word_history->lex_node_id (%d) != recent (%d)\n",
+            m_frame, token->word_history->lex_node_id,
+            word_graph.nodes[token->recent_word_graph_node].lex_node_id);
+    debug_print_token_lm_history(stderr, *token);
+  }
+
   // Iterate all the arcs leaving the token's node.
   for (i = 0; i < source_node->arcs.size(); i++) {
-    move_token_to_node(token, source_node->arcs[i].next,
-                       source_node->arcs[i].log_prob);
+    if (moves == NULL || moves[i].status == MOVE_COMPLEX) {
+      move_token_to_node(token, m_lexicon.node(source_node->arcs[i].next),
+                         source_node->arcs[i].log_prob);
+    }
+    else if (moves[i].status == MOVE_READY) {
+      apply_simple_move(token, m_lexicon.node(source_node->arcs[i].next),
+                        moves[i]);
+    }
   }
 
   //XXX
@@ -801,13 +1146,14 @@ void TokenPassSearch::propagate_token(TPLexPrefixTree::Token *token)
 
       // Iterate all the arcs leaving the token's node.
       for (i = 0; i < source_node->arcs.size(); i++) {
-        if (source_node->arcs[i].next != source_node) // Skip self transitions
-          move_token_to_node(token, source_node->arcs[i].next,
+        // Skip self transitions
+        if (source_node->arcs[i].next != source_node->node_id)
+          move_token_to_node(token, m_lexicon.node(source_node->arcs[i].next),
                              source_node->arcs[i].log_prob);
       }
 
-      hist::unlink(token->lm_history->previous, &m_lmh_pool);
-      hist::unlink(token->lm_history, &m_lmh_pool);
+      hist::unlink(token->lm_history->previous, m_lmh_arena.pool());
+      hist::unlink(token->lm_history, m_lmh_arena.pool());
       token->lm_history = temp_lm_history;
     }
   }
@@ -835,12 +1181,13 @@ void TokenPassSearch::propagate_token(TPLexPrefixTree::Token *token)
 
       // Iterate all the arcs leaving the token's node.
       for (i = 0; i < source_node->arcs.size(); i++) {
-        if (source_node->arcs[i].next != source_node) // Skip self transitions
-          move_token_to_node(token, source_node->arcs[i].next,
+        // Skip self transitions
+        if (source_node->arcs[i].next != source_node->node_id)
+          move_token_to_node(token, m_lexicon.node(source_node->arcs[i].next),
                              source_node->arcs[i].log_prob);
       }
 
-      hist::unlink(token->lm_history, &m_lmh_pool);
+      hist::unlink(token->lm_history, m_lmh_arena.pool());
       token->lm_history = temp_lm_history;
     }
   }
@@ -868,6 +1215,15 @@ TokenPassSearch::move_token_to_node(TPLexPrefixTree::Token *token,
   //     token->word_history->lm_log_prob);
   //   debug_print_token_lm_history(0, *token);
 
+  TokenMove move;
+  compute_simple_move(token, node, transition_score, move);
+  if (move.status == MOVE_READY) {
+    apply_simple_move(token, node, move);
+    return;
+  }
+  if (move.status == MOVE_DISCARDED)
+    return;
+
   TPLexPrefixTree::Token updated_token;
   updated_token.node = node;
   updated_token.depth = token->depth;
@@ -892,16 +1248,6 @@ TokenPassSearch::move_token_to_node(TPLexPrefixTree::Token *token,
   hist::Auto<TPLexPrefixTree::WordHistory> auto_word_history;
   hist::Auto<TPLexPrefixTree::StateHistory> auto_state_history;
 
-  if (m_generate_word_graph && token->word_history->lex_node_id !=
-      word_graph.nodes[token->recent_word_graph_node].lex_node_id)
-  {
-    fprintf(stderr, 
-            "frame %d: word_history->lex_node_id (%d) != recent (%d)\n",
-            m_frame, token->word_history->lex_node_id,
-            word_graph.nodes[token->recent_word_graph_node].lex_node_id);
-    debug_print_token_lm_history(stderr, *token);
-  }
-
   if (updated_token.node != token->node) {
     // Store old word id for possible word history generation
     int old_lm_history_word_id = token->lm_history->last().word_id();
@@ -954,7 +1300,7 @@ TokenPassSearch::move_token_to_node(TPLexPrefixTree::Token *token,
         updated_token.lm_history->word_start_frame =
           updated_token.word_start_frame;
         updated_token.word_start_frame = -1;
-        auto_lm_history.adopt(updated_token.lm_history, &m_lmh_pool);
+        auto_lm_history.adopt(updated_token.lm_history, m_lmh_arena.pool());
 
         update_lm_log_prob(updated_token);
 
@@ -981,7 +1327,7 @@ TokenPassSearch::move_token_to_node(TPLexPrefixTree::Token *token,
               updated_token.lm_history);
             updated_token.lm_history->word_start_frame = m_frame;
           }
-          auto_lm_history.adopt(updated_token.lm_history, &m_lmh_pool);
+          auto_lm_history.adopt(updated_token.lm_history, m_lmh_arena.pool());
 
           if (m_fsa_lm) {
             updated_token.fsa_lm_node = m_fsa_lm->initial_node_id();
@@ -1001,7 +1347,7 @@ TokenPassSearch::move_token_to_node(TPLexPrefixTree::Token *token,
       else {
         // LM probability not updated yet. Use either previous LM
         // probability or language model lookahead.
-        if ((updated_token.node->possible_word_id_list.size() > 0)
+        if ((updated_token.node->num_word_ranges > 0)
             && (m_lm_lookahead > 0)) {
           updated_token.cur_lm_log_prob = updated_token.lm_log_prob
             + get_lm_lookahead_score(token->lm_history,
@@ -1015,22 +1361,25 @@ TokenPassSearch::move_token_to_node(TPLexPrefixTree::Token *token,
     else
       updated_token.cur_lm_log_prob = updated_token.lm_log_prob;
 
-    if (m_keep_state_segmentation && updated_token.node->state != NULL) {
+    if (m_keep_state_segmentation && updated_token.node->state >= 0) {
       updated_token.state_history =
-        new TPLexPrefixTree::StateHistory(updated_token.node->state->model,
-                                          m_frame, token->state_history);
-      auto_state_history.adopt(updated_token.state_history);
+        new (m_state_history_arena.allocate())
+        TPLexPrefixTree::StateHistory(
+          m_lexicon.state(updated_token.node)->model, m_frame,
+          token->state_history);
+      auto_state_history.adopt(updated_token.state_history,
+                                m_state_history_arena.pool());
     }
 
     // Update duration probability
     updated_token.dur = 0;
     updated_token.depth = token->depth + 1;
     float duration_log_prob = 0;
-    if (token->node->state != NULL) {
+    if (token->node->state >= 0) {
       // Add duration probability
       int temp_dur = token->dur + 1;
       duration_log_prob = m_duration_scale
-        * token->node->state->duration.get_log_prob(temp_dur);
+        * m_lexicon.state(token->node)->duration.get_log_prob(temp_dur);
       updated_token.am_log_prob += duration_log_prob;
     }
 
@@ -1040,11 +1389,13 @@ TokenPassSearch::move_token_to_node(TPLexPrefixTree::Token *token,
         && (updated_token.node->flags & NODE_FIRST_STATE_OF_WORD)) {
       // Add symbol from the LMHistory
       updated_token.word_history = 
-        new TPLexPrefixTree::WordHistory(old_lm_history_word_id, m_frame,
+        new (m_word_history_arena.allocate())
+        TPLexPrefixTree::WordHistory(old_lm_history_word_id, m_frame,
                                          updated_token.word_history);
       updated_token.word_history->lex_node_id =
         updated_token.node->node_id;
-      auto_word_history.adopt(updated_token.word_history);
+      auto_word_history.adopt(updated_token.word_history,
+                               m_word_history_arena.pool());
       updated_token.word_history->cum_am_log_prob = token->am_log_prob
         + m_transition_scale * transition_score + duration_log_prob;
       updated_token.word_history->cum_lm_log_prob = token->lm_log_prob;
@@ -1062,8 +1413,8 @@ TokenPassSearch::move_token_to_node(TPLexPrefixTree::Token *token,
   else {
     // Self transition
     updated_token.dur = token->dur + 1;
-    if (updated_token.dur > MAX_STATE_DURATION && token->node->state != NULL
-        && token->node->state->duration.is_valid_duration_model())
+    if (updated_token.dur > MAX_STATE_DURATION && token->node->state >= 0
+        && m_lexicon.state(token->node)->duration.is_valid_duration_model())
       return; // Maximum state duration exceeded, discard token
     updated_token.depth = token->depth;
     updated_token.cur_am_log_prob = token->cur_am_log_prob
@@ -1082,7 +1433,7 @@ TokenPassSearch::move_token_to_node(TPLexPrefixTree::Token *token,
     updated_token.lm_history->word_first_silence_frame = m_frame;
   }
 
-  if (updated_token.node->state == NULL) {
+  if (updated_token.node->state < 0) {
 
     // Moving to a node without HMM state, pass through immediately.
 
@@ -1132,240 +1483,377 @@ TokenPassSearch::move_token_to_node(TPLexPrefixTree::Token *token,
 
     propagate_token(&temp_token);
     //TPLexPrefixTree::PathHistory::unlink(temp_token.token_path);
+    if (m_generate_word_graph)
+      word_graph.unlink(temp_token.recent_word_graph_node);
   }
   else
   {
     // Normal propagation
-    TPLexPrefixTree::Token *new_token;
-    TPLexPrefixTree::Token *similar_lm_hist;
     float ac_log_prob = m_acoustics->log_prob(
-      updated_token.node->state->model);
+      m_lexicon.state(updated_token.node)->model);
 
     updated_token.am_log_prob += ac_log_prob;
     updated_token.cur_am_log_prob += ac_log_prob;
     updated_token.total_log_prob = 
       get_token_log_prob(updated_token.cur_am_log_prob,
                          updated_token.cur_lm_log_prob);
-    
-    // Apply beam pruning
-    if (updated_token.node->flags & NODE_USE_WORD_END_BEAM) {
-      if (updated_token.total_log_prob
-          < m_best_we_log_prob - m_current_we_beam) {
+    add_token_to_node(token, updated_token);
+  }
+}
+
+void
+TokenPassSearch::compute_simple_move(const TPLexPrefixTree::Token *token,
+                                     const TPLexPrefixTree::Node *node,
+                                     float transition_score,
+                                     TokenMove &move) const
+{
+  move.status = MOVE_COMPLEX;
+
+  // Moves that create history structures, compute LM lookahead scores or
+  // pass through the node have to be done by move_token_to_node().
+  if (node->state < 0 || (node->flags & NODE_SILENCE_FIRST))
+    return;
+
+  const bool node_change = node != token->node;
+  if (node_change) {
+    if (!(node->flags & NODE_AFTER_WORD_ID)) {
+      if (node->word_id != -1)
         return;
-      }
+      if ((node->num_word_ranges > 0) && (m_lm_lookahead > 0))
+        return;
+    }
+    if (m_keep_state_segmentation)
+      return;
+    if (m_generate_word_graph && (node->flags & NODE_FIRST_STATE_OF_WORD))
+      return;
+  }
+
+  move.am_log_prob = token->am_log_prob + m_transition_scale * transition_score;
+  move.word_start_frame = token->word_start_frame;
+
+  if (node_change) {
+    if (node->flags & NODE_FIRST_STATE_OF_WORD) {
+      assert(move.word_start_frame < 0);
+      move.word_start_frame = m_frame;
+    }
+
+    if (!(node->flags & NODE_AFTER_WORD_ID))
+      move.cur_lm_log_prob = token->cur_lm_log_prob;
+    else
+      move.cur_lm_log_prob = token->lm_log_prob;
+
+    // Update duration probability
+    move.dur = 0;
+    move.depth = token->depth + 1;
+    if (token->node->state >= 0) {
+      int temp_dur = token->dur + 1;
+      move.am_log_prob += m_duration_scale
+        * m_lexicon.state(token->node)->duration.get_log_prob(temp_dur);
     }
+    move.cur_am_log_prob = move.am_log_prob;
+  }
+  else {
+    // Self transition
+    move.dur = token->dur + 1;
+    if (move.dur > MAX_STATE_DURATION && token->node->state >= 0
+        && m_lexicon.state(token->node)->duration.is_valid_duration_model()) {
+      move.status = MOVE_DISCARDED; // Maximum state duration exceeded
+      return;
+    }
+    move.depth = token->depth;
+    move.cur_am_log_prob = token->cur_am_log_prob
+      + m_transition_scale * transition_score;
+    move.cur_lm_log_prob = token->cur_lm_log_prob;
+  }
+
+  if ((node->flags & NODE_FAN_IN_FIRST) || node == m_lexicon.root())
+    move.depth = 0;
+
+  float ac_log_prob = m_acoustics->log_prob(m_lexicon.state(node)->model);
+  move.am_log_prob += ac_log_prob;
+  move.cur_am_log_prob += ac_log_prob;
+  move.total_log_prob = get_token_log_prob(move.cur_am_log_prob,
+                                           move.cur_lm_log_prob);
+  move.status = MOVE_READY;
+}
+
+void
+TokenPassSearch::apply_simple_move(TPLexPrefixTree::Token *token,
+                                   TPLexPrefixTree::Node *node,
+                                   const TokenMove &move)
+{
+  TPLexPrefixTree::Token updated_token;
+  updated_token.node = node;
+  updated_token.depth = move.depth;
+  updated_token.dur = move.dur;
+  updated_token.am_log_prob = move.am_log_prob;
+  updated_token.cur_am_log_prob = move.cur_am_log_prob;
+  updated_token.lm_log_prob = token->lm_log_prob;
+  updated_token.cur_lm_log_prob = move.cur_lm_log_prob;
+  updated_token.total_log_prob = move.total_log_prob;
+  updated_token.word_count = token->word_count;
+  updated_token.fsa_lm_node = token->fsa_lm_node;
+  updated_token.lm_hist_code = token->lm_hist_code;
+  updated_token.lm_history = token->lm_history;
+  updated_token.word_history = token->word_history;
+  updated_token.state_history = token->state_history;
+  updated_token.word_start_frame = move.word_start_frame;
+  add_token_to_node(token, updated_token);
+}
+
+void
+TokenPassSearch::add_token_to_node(TPLexPrefixTree::Token *token,
+                                   TPLexPrefixTree::Token &updated_token)
+{
+  TPLexPrefixTree::Token *new_token;
+  TPLexPrefixTree::Token *similar_lm_hist;
+
+  // Apply beam pruning
+  if (updated_token.node->flags & NODE_USE_WORD_END_BEAM) {
     if (updated_token.total_log_prob
-        < m_best_log_prob
-        - m_current_glob_beam
+        < m_best_we_log_prob - m_current_we_beam) {
+      return;
+    }
+  }
+  if (updated_token.total_log_prob
+      < m_best_log_prob
+      - m_current_glob_beam
 #ifdef PRUNING_EXTENSIONS
-        || ((updated_token.node->flags&NODE_FAN_IN)?
-            (updated_token.total_log_prob < m_fan_in_log_prob - m_fan_in_beam) :
-            ((!(updated_token.node->flags&(NODE_FAN_IN|NODE_FAN_OUT)) &&
-              (updated_token.total_log_prob<m_wc_llh[updated_token.word_count-m_min_word_count]-
-               m_eq_wc_beam ||
-               (!(updated_token.node->flags&(NODE_AFTER_WORD_ID)) &&
-                updated_token.total_log_prob<m_depth_llh[updated_token.depth/2]-m_eq_depth_beam)))))
+      || ((updated_token.node->flags&NODE_FAN_IN)?
+          (updated_token.total_log_prob < m_fan_in_log_prob - m_fan_in_beam) :
+          ((!(updated_token.node->flags&(NODE_FAN_IN|NODE_FAN_OUT)) &&
+            (updated_token.total_log_prob<m_wc_llh[updated_token.word_count-m_min_word_count]-
+             m_eq_wc_beam ||
+             (!(updated_token.node->flags&(NODE_AFTER_WORD_ID)) &&
+              updated_token.total_log_prob<m_depth_llh[updated_token.depth/2]-m_eq_depth_beam)))))
 #endif
 #ifdef FAN_IN_PRUNING
-        || ((updated_token.node->flags&NODE_FAN_IN) &&
-            updated_token.total_log_prob < m_fan_in_log_prob - m_fan_in_beam)
+      || ((updated_token.node->flags&NODE_FAN_IN) &&
+          updated_token.total_log_prob < m_fan_in_log_prob - m_fan_in_beam)
 #endif
 #ifdef EQ_WC_PRUNING
-        || (!(updated_token.node->flags&(NODE_FAN_IN|NODE_FAN_OUT)) &&
-            (updated_token.total_log_prob<m_wc_llh[updated_token.word_count-m_min_word_count]-
-             m_eq_wc_beam))
+      || (!(updated_token.node->flags&(NODE_FAN_IN|NODE_FAN_OUT)) &&
+          (updated_token.total_log_prob<m_wc_llh[updated_token.word_count-m_min_word_count]-
+           m_eq_wc_beam))
 #endif
 #ifdef EQ_DEPTH_PRUNING
-        || ((!(updated_token.node->flags&(NODE_FAN_IN|NODE_FAN_OUT|NODE_AFTER_WORD_ID)) &&
-             updated_token.total_log_prob<m_depth_llh[updated_token.depth/2]-m_eq_depth_beam))
+      || ((!(updated_token.node->flags&(NODE_FAN_IN|NODE_FAN_OUT|NODE_AFTER_WORD_ID)) &&
+           updated_token.total_log_prob<m_depth_llh[updated_token.depth/2]-m_eq_depth_beam))
 #endif
 #ifdef FAN_OUT_PRUNING
-        || ((updated_token.node->flags&NODE_FAN_OUT) &&
-            updated_token.total_log_prob < m_fan_out_log_prob - m_fan_out_beam)
+      || ((updated_token.node->flags&NODE_FAN_OUT) &&
+          updated_token.total_log_prob < m_fan_out_log_prob - m_fan_out_beam)
 #endif
-      ) {
-      return;
-    }
+    ) {
+    return;
+  }
+
+  TPLexPrefixTree::Token *&node_tokens =
+    m_node_token_lists[updated_token.node->node_id];
 
 #ifdef STATE_PRUNING
-    if (updated_token.node->flags&(NODE_FAN_OUT|NODE_FAN_IN))
+  if (updated_token.node->flags&(NODE_FAN_OUT|NODE_FAN_IN))
+  {
+    TPLexPrefixTree::Token *cur_token = node_tokens;
+    while (cur_token != NULL)
     {
-      TPLexPrefixTree::Token *cur_token = updated_token.node->token_list;
-      while (cur_token != NULL)
+      if (updated_token.total_log_prob <
+          cur_token->total_log_prob - m_state_beam)
       {
-        if (updated_token.total_log_prob <
-            cur_token->total_log_prob - m_state_beam)
-        {
-          return;
-        }
-        cur_token = cur_token->next_node_token;
+        return;
       }
+      cur_token = cur_token->next_node_token;
     }
+  }
 #endif
 
-    if (updated_token.node->token_list == NULL) {
-      // No tokens in the node,  create new token
-      m_active_node_list.push_back(updated_token.node); // Mark the node active
+  if (node_tokens == NULL) {
+    // No tokens in the node,  create new token
+    if (m_token_pool.full()) {
+      discard_token_for_memory();
+      return;
+    }
+    m_active_node_list.push_back(updated_token.node); // Mark the node active
+    new_token = acquire_token();
+    new_token->node = updated_token.node;
+    new_token->next_node_token = node_tokens;
+    node_tokens = new_token;
+    // Add to the list of propagated tokens
+    if (updated_token.node->flags & NODE_USE_WORD_END_BEAM)
+      m_word_end_token_list->push_back(new_token);
+    else
+      m_new_token_list->push_back(new_token);
+    if (m_recombination_mode == LM_STATE_RECOMBINATION)
+      m_recombination_table.insert(new_token->node->node_id,
+                                   recombination_state(updated_token),
+                                   new_token);
+  }
+  else {
+    // Recombination of search paths that are identical up to
+    // m_similar_lm_hist_span words.
+    if (m_recombination_mode == LM_STATE_RECOMBINATION) {
+      similar_lm_hist = m_recombination_table.find(
+        updated_token.node->node_id, recombination_state(updated_token));
+    }
+    else if (m_fsa_lm) {
+      similar_lm_hist = find_similar_fsa_token(
+        updated_token.fsa_lm_node,
+        node_tokens);
+    }
+    else {
+      similar_lm_hist = find_similar_lm_history(
+        updated_token.lm_history, updated_token.lm_hist_code,
+        node_tokens);
+    }
+
+    if (similar_lm_hist == NULL)
+    {
+      // New word history for this node, create new token
+      if (m_token_pool.full()) {
+        discard_token_for_memory();
+        return;
+      }
       new_token = acquire_token();
       new_token->node = updated_token.node;
-      new_token->next_node_token = updated_token.node->token_list;
-      updated_token.node->token_list = new_token;
+      new_token->next_node_token = node_tokens;
+      node_tokens = new_token;
       // Add to the list of propagated tokens
       if (updated_token.node->flags & NODE_USE_WORD_END_BEAM)
         m_word_end_token_list->push_back(new_token);
       else
         m_new_token_list->push_back(new_token);
+      if (m_recombination_mode == LM_STATE_RECOMBINATION)
+        m_recombination_table.insert(new_token->node->node_id,
+                                     recombination_state(updated_token),
+                                     new_token);
     }
-    else {
-      // Recombination of search paths that are identical up to
-      // m_similar_lm_hist_span words.
-      if (m_fsa_lm) {
-        similar_lm_hist = find_similar_fsa_token(
-          updated_token.fsa_lm_node,
-          updated_token.node->token_list);
-      }
-      else {
-        similar_lm_hist = find_similar_lm_history(
-          updated_token.lm_history, updated_token.lm_hist_code,
-          updated_token.node->token_list);
-      }
-
-      if (similar_lm_hist == NULL)
-      {
-        // New word history for this node, create new token
-        new_token = acquire_token();
-        new_token->node = updated_token.node;
-        new_token->next_node_token = updated_token.node->token_list;
-        updated_token.node->token_list = new_token;
-        // Add to the list of propagated tokens
-        if (updated_token.node->flags & NODE_USE_WORD_END_BEAM)
-          m_word_end_token_list->push_back(new_token);
-        else
-          m_new_token_list->push_back(new_token);
+    else
+    {
+      // Found the same word history, pick the best token.
+      if (updated_token.total_log_prob
+          > similar_lm_hist->total_log_prob) {
+        // Replace the previous token
+        new_token = similar_lm_hist;
+        hist::unlink(new_token->lm_history, m_lmh_arena.pool());
+        hist::unlink(new_token->word_history, m_word_history_arena.pool());
+        hist::unlink(new_token->state_history, m_state_history_arena.pool());
+        if (new_token->recent_word_graph_node >= 0)
+          word_graph.unlink(new_token->recent_word_graph_node);
+
+        //TPLexPrefixTree::PathHistory::unlink(new_token->token_path);
       }
       else
       {
-        // Found the same word history, pick the best token.
-        if (updated_token.total_log_prob
-            > similar_lm_hist->total_log_prob) {
-          // Replace the previous token
-          new_token = similar_lm_hist;
-          hist::unlink(new_token->lm_history, &m_lmh_pool);
-          hist::unlink(new_token->word_history);
-          hist::unlink(new_token->state_history);
-
-          //TPLexPrefixTree::PathHistory::unlink(new_token->token_path);
-        }
-        else
-        {
-          // Discard this token
-          return;
-        }
+        // Discard this token
+        return;
       }
     }
-    if (updated_token.node->flags & NODE_USE_WORD_END_BEAM) {
-      if (updated_token.total_log_prob > m_best_we_log_prob)
-        m_best_we_log_prob = updated_token.total_log_prob;
-    }
-    if (updated_token.total_log_prob > m_best_log_prob)
-      m_best_log_prob = updated_token.total_log_prob;
+  }
+  if (updated_token.node->flags & NODE_USE_WORD_END_BEAM) {
+    if (updated_token.total_log_prob > m_best_we_log_prob)
+      m_best_we_log_prob = updated_token.total_log_prob;
+  }
+  if (updated_token.total_log_prob > m_best_log_prob)
+    m_best_log_prob = updated_token.total_log_prob;
 
 #if (defined PRUNING_EXTENSIONS || defined PRUNING_MEASUREMENT)
-    if (updated_token.node->flags&NODE_FAN_IN)
-    {
-      if (updated_token.total_log_prob > m_fan_in_log_prob)
-        m_fan_in_log_prob = updated_token.total_log_prob;
-      if (m_wc_llh[updated_token.word_count-m_min_word_count] < -1e19)
-        m_wc_llh[updated_token.word_count-m_min_word_count] = -1e18;
-    }
-    else if (!(updated_token.node->flags&(NODE_FAN_IN|NODE_FAN_OUT)))
-    {
-      if (!(updated_token.node->flags&NODE_AFTER_WORD_ID) &&
-          updated_token.total_log_prob > m_depth_llh[updated_token.depth/2])
-        m_depth_llh[updated_token.depth/2] = updated_token.total_log_prob;
-      if (updated_token.total_log_prob > m_wc_llh[updated_token.word_count-m_min_word_count])
-        m_wc_llh[updated_token.word_count-m_min_word_count] = updated_token.total_log_prob;
-    }
-    else if (m_wc_llh[updated_token.word_count-m_min_word_count] < -1e19)
+  if (updated_token.node->flags&NODE_FAN_IN)
+  {
+    if (updated_token.total_log_prob > m_fan_in_log_prob)
+      m_fan_in_log_prob = updated_token.total_log_prob;
+    if (m_wc_llh[updated_token.word_count-m_min_word_count] < -1e19)
       m_wc_llh[updated_token.word_count-m_min_word_count] = -1e18;
+  }
+  else if (!(updated_token.node->flags&(NODE_FAN_IN|NODE_FAN_OUT)))
+  {
+    if (!(updated_token.node->flags&NODE_AFTER_WORD_ID) &&
+        updated_token.total_log_prob > m_depth_llh[updated_token.depth/2])
+      m_depth_llh[updated_token.depth/2] = updated_token.total_log_prob;
+    if (updated_token.total_log_prob > m_wc_llh[updated_token.word_count-m_min_word_count])
+      m_wc_llh[updated_token.word_count-m_min_word_count] = updated_token.total_log_prob;
+  }
+  else if (m_wc_llh[updated_token.word_count-m_min_word_count] < -1e19)
+    m_wc_llh[updated_token.word_count-m_min_word_count] = -1e18;
 #endif
 #ifdef FAN_IN_PRUNING
-    if (updated_token.node->flags&NODE_FAN_IN)
-    {
-      if (updated_token.total_log_prob > m_fan_in_log_prob)
-        m_fan_in_log_prob = updated_token.total_log_prob;
-    }
+  if (updated_token.node->flags&NODE_FAN_IN)
+  {
+    if (updated_token.total_log_prob > m_fan_in_log_prob)
+      m_fan_in_log_prob = updated_token.total_log_prob;
+  }
 #endif
 #ifdef EQ_WC_PRUNING
-    if (!(updated_token.node->flags&(NODE_FAN_IN|NODE_FAN_OUT)))
-    {
-      if (updated_token.total_log_prob > m_wc_llh[updated_token.word_count-m_min_word_count])
-        m_wc_llh[updated_token.word_count-m_min_word_count] = updated_token.total_log_prob;
-    }
-    else if (m_wc_llh[updated_token.word_count-m_min_word_count] < -1e19)
-      m_wc_llh[updated_token.word_count-m_min_word_count] = -1e18;
+  if (!(updated_token.node->flags&(NODE_FAN_IN|NODE_FAN_OUT)))
+  {
+    if (updated_token.total_log_prob > m_wc_llh[updated_token.word_count-m_min_word_count])
+      m_wc_llh[updated_token.word_count-m_min_word_count] = updated_token.total_log_prob;
+  }
+  else if (m_wc_llh[updated_token.word_count-m_min_word_count] < -1e19)
+    m_wc_llh[updated_token.word_count-m_min_word_count] = -1e18;
 #endif
 #ifdef EQ_DEPTH_PRUNING
-    if (!(updated_token.node->flags&(NODE_FAN_IN|NODE_FAN_OUT|NODE_AFTER_WORD_ID)))
-    {
-      if (updated_token.total_log_prob > m_depth_llh[updated_token.depth/2])
-        m_depth_llh[updated_token.depth/2] = updated_token.total_log_prob;
-    }
+  if (!(updated_token.node->flags&(NODE_FAN_IN|NODE_FAN_OUT|NODE_AFTER_WORD_ID)))
+  {
+    if (updated_token.total_log_prob > m_depth_llh[updated_token.depth/2])
+      m_depth_llh[updated_token.depth/2] = updated_token.total_log_prob;
+  }
 #endif
 
 #if (defined FAN_OUT_PRUNING || defined PRUNING_MEASUREMENT)
-    if (updated_token.node->flags&NODE_FAN_OUT)
-    {
-      if (updated_token.total_log_prob > m_fan_out_log_prob)
-        m_fan_out_log_prob = updated_token.total_log_prob;
-    }
+  if (updated_token.node->flags&NODE_FAN_OUT)
+  {
+    if (updated_token.total_log_prob > m_fan_out_log_prob)
+      m_fan_out_log_prob = updated_token.total_log_prob;
+  }
 #endif
 
-    if (updated_token.total_log_prob < m_worst_log_prob)
-      m_worst_log_prob = updated_token.total_log_prob;
-
-    new_token->lm_history = updated_token.lm_history;
-    if (new_token->lm_history != NULL)
-      hist::link(new_token->lm_history);
-    new_token->lm_hist_code = updated_token.lm_hist_code;
-    new_token->fsa_lm_node = updated_token.fsa_lm_node;
-    new_token->am_log_prob = updated_token.am_log_prob;
-    new_token->cur_am_log_prob = updated_token.cur_am_log_prob;
-    new_token->lm_log_prob = updated_token.lm_log_prob;
-    new_token->cur_lm_log_prob = updated_token.cur_lm_log_prob;
-    new_token->total_log_prob = updated_token.total_log_prob;
-    new_token->dur = updated_token.dur;
-    new_token->word_count = updated_token.word_count;
-    new_token->state_history = updated_token.state_history;
-    new_token->word_history = updated_token.word_history;
-    new_token->word_start_frame = updated_token.word_start_frame;
-    if (updated_token.word_history != NULL)
-      hist::link(new_token->word_history);
-    if (updated_token.state_history != NULL)
-      hist::link(new_token->state_history);
+  if (updated_token.total_log_prob < m_worst_log_prob)
+    m_worst_log_prob = updated_token.total_log_prob;
+
+  new_token->lm_history = updated_token.lm_history;
+  if (new_token->lm_history != NULL)
+    hist::link(new_token->lm_history);
+  new_token->lm_hist_code = updated_token.lm_hist_code;
+  new_token->fsa_lm_node = updated_token.fsa_lm_node;
+  new_token->am_log_prob = updated_token.am_log_prob;
+  new_token->cur_am_log_prob = updated_token.cur_am_log_prob;
+  new_token->lm_log_prob = updated_token.lm_log_prob;
+  new_token->cur_lm_log_prob = updated_token.cur_lm_log_prob;
+  if (updated_token.node->flags & NODE_USE_WORD_END_BEAM)
+    m_word_end_token_list->set_score(new_token, updated_token.total_log_prob);
+  else
+    m_new_token_list->set_score(new_token, updated_token.total_log_prob);
+  new_token->dur = updated_token.dur;
+  new_token->word_count = updated_token.word_count;
+  new_token->state_history = updated_token.state_history;
+  new_token->word_history = updated_token.word_history;
+  new_token->word_start_frame = updated_token.word_start_frame;
+  if (updated_token.word_history != NULL)
+    hist::link(new_token->word_history);
+  if (updated_token.state_history != NULL)
+    hist::link(new_token->state_history);
 
-    if (m_generate_word_graph) {
-      copy_word_graph_info(token, new_token);
-      if ((updated_token.node->flags & NODE_FIRST_STATE_OF_WORD)
-          && updated_token.node != token->node)
-        build_word_graph(new_token);
-    }
+  if (m_generate_word_graph) {
+    copy_word_graph_info(token, new_token);
+    if ((updated_token.node->flags & NODE_FIRST_STATE_OF_WORD)
+        && updated_token.node != token->node)
+      build_word_graph(new_token);
+  }
 
 #ifdef PRUNING_MEASUREMENT
-    for (int i = 0; i < 6; i++)
-      new_token->meas[i] = token->meas[i];
+  for (int i = 0; i < 6; i++)
+    new_token->meas[i] = token->meas[i];
 #endif
 
-    new_token->depth = updated_token.depth;
-    //assert(token->token_path != NULL);
-    /*new_token->token_path = new TPLexPrefixTree::PathHistory(
-      updated_token.total_log_prob,
-      token->token_path->dll + ac_log_prob, updated_token.depth,
-      token->token_path);
-      new_token->token_path->link();*/
-    /*new_token->token_path = token->token_path;
-      new_token->token_path->link();*/
-  }
+  new_token->depth = updated_token.depth;
+  //assert(token->token_path != NULL);
+  /*new_token->token_path = new TPLexPrefixTree::PathHistory(
+    updated_token.total_log_prob,
+    token->token_path->dll + ac_log_prob, updated_token.depth,
+    token->token_path);
+    new_token->token_path->link();*/
+  /*new_token->token_path = token->token_path;
+    new_token->token_path->link();*/
 }
 
 TPLexPrefixTree::Token*
@@ -1453,12 +1941,33 @@ inline bool TokenPassSearch::is_similar_lm_history(LMHistory *wh1,
   return true;
 }
 
-int TokenPassSearch::compute_lm_hist_hash_code(LMHistory *wh) const
+int TokenPassSearch::compute_lm_hist_hash_code(LMHistory *wh)
+{
+  if (m_recombination_mode == LM_STATE_RECOMBINATION) {
+    // The same words as in the hash code below.
+    m_lm_state_key.clear();
+    LMHistory::ConstReverseIterator iter = wh->rbegin();
+    for (int i = 0; i < m_similar_lm_hist_span; ++i) {
+      if (iter->word_id == -1)
+        break;
+      m_lm_state_key.push_back(iter->lm_id);
+      if (iter->word_id == m_sentence_start_id)
+        break;
+      ++iter;
+    }
+    return m_lm_states.find_or_insert(m_lm_state_key.data(),
+                                      m_lm_state_key.size()) + 1;
+  }
+
+  return hash_lm_history(wh, m_similar_lm_hist_span);
+}
+
+int TokenPassSearch::hash_lm_history(LMHistory *wh, int num_words) const
 {
   unsigned int code = 0;
 
   LMHistory::ConstReverseIterator iter = wh->rbegin();
-  for (int i = 0; i < m_similar_lm_hist_span; ++i) {
+  for (int i = 0; i < num_words; ++i) {
     if (iter->word_id == -1)
       break;
 
@@ -1483,14 +1992,18 @@ int TokenPassSearch::compute_lm_hist_hash_code(LMHistory *wh) const
 
 void TokenPassSearch::prune_tokens()
 {
+  std::chrono::steady_clock::time_point start_time =
+    std::chrono::steady_clock::now();
   int i;
   int num_active_tokens;
   float beam_limit = m_best_log_prob - m_current_glob_beam; //m_global_beam;
   float we_beam_limit = m_best_we_log_prob - m_current_we_beam;
 
+  m_frame_profile.new_tokens =
+    m_new_token_list->size() + m_word_end_token_list->size();
+  m_frame_profile.word_end_tokens = m_word_end_token_list->size();
   if (m_verbose > 1)
-    printf("%zd new tokens\n",
-           m_new_token_list->size() + m_word_end_token_list->size());
+    printf("%d new tokens\n", m_frame_profile.new_tokens);
 
   // At first, remove inactive tokens.
   for (i = 0; i < m_active_token_list->size(); i++) {
@@ -1498,16 +2011,18 @@ void TokenPassSearch::prune_tokens()
       release_token((*m_active_token_list)[i]);
   }
   m_active_token_list->clear();
-  std::vector<TPLexPrefixTree::Token *> * temp = m_active_token_list;
+  token_list_type *temp = m_active_token_list;
   m_active_token_list = m_new_token_list;
   m_new_token_list = temp;
 
   // Prune the word end tokens and add them to m_active_token_list
   for (i = 0; i < m_word_end_token_list->size(); i++) {
-    if ((*m_word_end_token_list)[i]->total_log_prob < we_beam_limit)
+    if (m_word_end_token_list->score(i) < we_beam_limit)
       release_token((*m_word_end_token_list)[i]);
     else
-      m_active_token_list->push_back((*m_word_end_token_list)[i]);
+      m_active_token_list->push_back((*m_word_end_token_list)[i],
+                                     m_word_end_token_list->score(i),
+                                     m_word_end_token_list->node_id(i));
   }
   m_word_end_token_list->clear();
 
@@ -1529,90 +2044,134 @@ void TokenPassSearch::prune_tokens()
       }
       }*/
 
-  // Then beam prune the active tokens and find the worst accepted log prob
-  // for histogram pruning.
+  // The pruning passes below sweep over the score array of the token list,
+  // and read the tokens only to release them.
+  int num_new_tokens = m_active_token_list->size();
+  float *scores = m_active_token_list->scores();
+
+  // The token memory budget limits the tokens that survive the frame, so
+  // that the propagation of the next frame has room for the new tokens.
+  // The number of new tokens per surviving token is estimated from the
+  // recent frames, and the survivors get at most half of the budget.
+  int max_num_tokens = m_max_num_tokens;
+  int budget_tokens = 0;
+  if (m_token_pool.max_tokens() > 0) {
+    int created = m_frame_profile.new_tokens
+      + m_budget_dropped_tokens - m_budget_dropped_at_prune;
+    m_budget_dropped_at_prune = m_budget_dropped_tokens;
+    m_token_expansion *= 0.9;
+    if (m_budget_survivors > 0)
+      m_token_expansion = std::max(m_token_expansion,
+                                   (float)created / m_budget_survivors);
+    budget_tokens = std::max<int>(
+      1, m_token_pool.max_tokens() / (1 + std::max(1.0f, m_token_expansion)));
+    if (max_num_tokens <= 0 || budget_tokens < max_num_tokens)
+      max_num_tokens = budget_tokens;
+  }
+
+  bool histogram_pruning = (num_new_tokens > max_num_tokens &&
+                            max_num_tokens > 0);
+
+  // Then beam prune the active tokens. The accepted tokens and their scores
+  // are moved to the beginning of the arrays, keeping their order.
   // Note! After this, the token lists in the nodes are no longer valid.
+  m_token_indices.resize(num_new_tokens);
+  int num_accepted = m_pruning_kernel.compact(
+    scores, num_new_tokens, beam_limit, m_token_indices.data());
   num_active_tokens = 0;
-  if (m_active_token_list->size() > m_max_num_tokens &&
-      m_max_num_tokens > 0)
-  {
-    // Do also histogram pruning
-    // Approximate the worst log prob after beam pruning has been applied.
-    if (m_worst_log_prob < beam_limit)
-      m_worst_log_prob = beam_limit;
-    int bins[NUM_HISTOGRAM_BINS];
-    float bin_adv = (m_best_log_prob - m_worst_log_prob)
-      / (NUM_HISTOGRAM_BINS - 1);
-    float new_min_log_prob;
-    memset(bins, 0, NUM_HISTOGRAM_BINS * sizeof(int));
-
-    for (i = 0; i < m_active_token_list->size(); i++)
-    {
-      float total_log_prob = (*m_active_token_list)[i]->total_log_prob;
-      if (total_log_prob
-          < beam_limit
+  i = 0;
+  for (int k = 0; k < num_accepted; k++) {
+    for (; i < m_token_indices[k]; i++)
+      release_token((*m_active_token_list)[i]);
+    int index = i++;
+    float total_log_prob = scores[k];
+
+#if (defined PRUNING_EXTENSIONS || defined FAN_IN_PRUNING || defined EQ_WC_PRUNING || defined EQ_DEPTH_PRUNING || defined FAN_OUT_PRUNING)
+    TPLexPrefixTree::Token *token = (*m_active_token_list)[index];
+    int flags = token->node->flags;
+    if (false
 #ifdef PRUNING_EXTENSIONS
-          || ((flags&NODE_FAN_IN)?
-              (total_log_prob < m_fan_in_log_prob - m_fan_in_beam) :
-              ((!(flags&(NODE_FAN_IN|NODE_FAN_OUT)) &&
-                (total_log_prob < m_wc_llh[(*m_active_token_list)[i]->word_count-m_min_word_count] - m_eq_wc_beam ||
-                 (!(flags&(NODE_AFTER_WORD_ID)) &&
-                  total_log_prob < m_depth_llh[(*m_active_token_list)[i]->depth/2]-m_eq_depth_beam)))))
+        || ((flags&NODE_FAN_IN)?
+            (total_log_prob < m_fan_in_log_prob - m_fan_in_beam) :
+            ((!(flags&(NODE_FAN_IN|NODE_FAN_OUT)) &&
+              (total_log_prob < m_wc_llh[token->word_count-m_min_word_count] - m_eq_wc_beam ||
+               (!(flags&(NODE_AFTER_WORD_ID)) &&
+                total_log_prob < m_depth_llh[token->depth/2]-m_eq_depth_beam)))))
 #endif
 #ifdef FAN_IN_PRUNING
-          || ((flags&NODE_FAN_IN) &&
-              total_log_prob < m_fan_in_log_prob - m_fan_in_beam)
+        || ((flags&NODE_FAN_IN) &&
+            total_log_prob < m_fan_in_log_prob - m_fan_in_beam)
 #endif
 #ifdef EQ_WC_PRUNING
-          || (!(flags&(NODE_FAN_IN|NODE_FAN_OUT)) &&
-              (total_log_prob < m_wc_llh[(*m_active_token_list)[i]->word_count-m_min_word_count] - m_eq_wc_beam))
+        || (!(flags&(NODE_FAN_IN|NODE_FAN_OUT)) &&
+            (total_log_prob < m_wc_llh[token->word_count-m_min_word_count] - m_eq_wc_beam))
 #endif
 #ifdef EQ_DEPTH_PRUNING
-          || (!(flags&(NODE_FAN_IN|NODE_FAN_OUT|NODE_AFTER_WORD_ID)) &&
-              total_log_prob < m_depth_llh[(*m_active_token_list)[i]->depth/2]-m_eq_depth_beam)
+        || (!(flags&(NODE_FAN_IN|NODE_FAN_OUT|NODE_AFTER_WORD_ID)) &&
+            total_log_prob < m_depth_llh[token->depth/2]-m_eq_depth_beam)
 #endif
 #ifdef FAN_OUT_PRUNING
-          || ((flags&NODE_FAN_OUT) &&
-              total_log_prob < m_fan_out_log_prob - m_fan_out_beam)
+        || ((flags&NODE_FAN_OUT) &&
+            total_log_prob < m_fan_out_log_prob - m_fan_out_beam)
 #endif
-        )
-      {
-        release_token((*m_active_token_list)[i]);
-      }
-      else
-      {
-        bins[(int) floorf((total_log_prob - m_worst_log_prob) / bin_adv)]++;
-        m_new_token_list->push_back((*m_active_token_list)[i]);
-      }
+      )
+    {
+      release_token(token);
+      continue;
     }
-    m_active_token_list->clear();
-    temp = m_active_token_list;
-    m_active_token_list = m_new_token_list;
-    m_new_token_list = temp;
-    if (m_verbose > 1)
-      printf("%zd tokens after beam pruning\n",
-             m_active_token_list->size());
-    num_active_tokens = m_active_token_list->size();
-    if (num_active_tokens > m_max_num_tokens)
+#endif
+
+    m_active_token_list->move_token(index, num_active_tokens);
+    scores[num_active_tokens] = total_log_prob;
+    num_active_tokens++;
+  }
+  for (; i < num_new_tokens; i++)
+    release_token((*m_active_token_list)[i]);
+  m_active_token_list->resize(num_active_tokens);
+  if (m_verbose > 1)
+    printf("%d tokens after beam pruning\n", num_active_tokens);
+
+  if (histogram_pruning)
+  {
+    if (num_active_tokens > max_num_tokens)
     {
+      // Approximate the worst log prob after beam pruning has been applied.
+      if (m_worst_log_prob < beam_limit)
+        m_worst_log_prob = beam_limit;
+      int bins[NUM_HISTOGRAM_BINS];
+      float bin_adv = (m_best_log_prob - m_worst_log_prob)
+        / (NUM_HISTOGRAM_BINS - 1);
+      float new_min_log_prob;
+      memset(bins, 0, NUM_HISTOGRAM_BINS * sizeof(int));
+      m_pruning_kernel.histogram(m_active_token_list->scores(),
+                                 num_active_tokens,
+                                 m_worst_log_prob, bin_adv, bins);
+
       for (i = 0; i < NUM_HISTOGRAM_BINS - 1; i++) {
         num_active_tokens -= bins[i];
-        if (num_active_tokens < m_max_num_tokens)
+        if (num_active_tokens < max_num_tokens)
           break;
       }
-      int deleted = 0;
       new_min_log_prob = m_worst_log_prob + (i + 1) * bin_adv;
-      for (i = 0; i < m_active_token_list->size(); i++) {
-        if ((*m_active_token_list)[i]->total_log_prob
-            < new_min_log_prob) {
-          release_token((*m_active_token_list)[i]);
-          (*m_active_token_list)[i] = NULL;
-          deleted++;
+
+      num_new_tokens = m_active_token_list->size();
+      num_accepted = m_pruning_kernel.compact(
+        m_active_token_list->scores(), num_new_tokens, new_min_log_prob,
+        m_token_indices.data());
+      num_active_tokens = 0;
+      for (i = 0; i < num_new_tokens; i++) {
+        if (num_active_tokens < num_accepted
+            && m_token_indices[num_active_tokens] == i)
+        {
+          m_active_token_list->move_token(i, num_active_tokens);
+          num_active_tokens++;
         }
+        else
+          release_token((*m_active_token_list)[i]);
       }
+      m_active_token_list->resize(num_active_tokens);
       if (m_verbose > 1)
-        printf("%zd tokens after histogram pruning\n",
-               m_active_token_list->size() - deleted);
+        printf("%d tokens after histogram pruning\n", num_active_tokens);
 
       // Pass the new beam limit to next token propagation
       m_current_glob_beam = std::min((m_best_log_prob - new_min_log_prob),
@@ -1620,51 +2179,13 @@ void TokenPassSearch::prune_tokens()
       m_current_we_beam = m_current_glob_beam / m_global_beam
         * m_word_end_beam;
     }
+
+    // The histogram bins are approximate, but the budget is a hard limit.
+    if (budget_tokens > 0 && m_active_token_list->size() > budget_tokens)
+      keep_best_tokens(budget_tokens);
   }
-  else
+  else if (!m_beam_controller.enabled())
   {
-    // Only do the beam pruning
-    for (i = 0; i < m_active_token_list->size(); i++)
-    {
-      if ((*m_active_token_list)[i]->total_log_prob < beam_limit
-#ifdef PRUNING_EXTENSIONS
-          || ((flags&NODE_FAN_IN)?
-              (total_log_prob < m_fan_in_log_prob - m_fan_in_beam) :
-              ((!(flags&(NODE_FAN_IN|NODE_FAN_OUT)) &&
-                (total_log_prob < m_wc_llh[(*m_active_token_list)[i]->word_count-m_min_word_count] - m_eq_wc_beam ||
-                 (!(flags&(NODE_AFTER_WORD_ID)) &&
-                  total_log_prob < m_depth_llh[(*m_active_token_list)[i]->depth/2]-m_eq_depth_beam)))))
-#endif
-#ifdef FAN_IN_PRUNING
-          || ((flags&NODE_FAN_IN) &&
-              total_log_prob < m_fan_in_log_prob - m_fan_in_beam)
-#endif
-#ifdef EQ_WC_PRUNING
-          || (!(flags&(NODE_FAN_IN|NODE_FAN_OUT)) &&
-              (total_log_prob < m_wc_llh[(*m_active_token_list)[i]->word_count-m_min_word_count] - m_eq_wc_beam))
-#endif
-#ifdef EQ_DEPTH_PRUNING
-          || (!(flags&(NODE_FAN_IN|NODE_FAN_OUT|NODE_AFTER_WORD_ID)) &&
-              total_log_prob < m_depth_llh[(*m_active_token_list)[i]->depth/2]-m_eq_depth_beam)
-#endif
-#ifdef FAN_OUT_PRUNING
-          || ((flags&NODE_FAN_OUT) &&
-              total_log_prob < m_fan_out_log_prob - m_fan_out_beam)
-#endif
-        )
-      {
-        release_token((*m_active_token_list)[i]);
-      }
-      else
-        m_new_token_list->push_back((*m_active_token_list)[i]);
-    }
-    m_active_token_list->clear();
-    temp = m_active_token_list;
-    m_active_token_list = m_new_token_list;
-    m_new_token_list = temp;
-    if (m_verbose > 1)
-      printf("%zd tokens after beam pruning\n",
-             m_active_token_list->size());
     if (m_current_glob_beam < m_global_beam)
     {
       // Determine new beam
@@ -1674,16 +2195,94 @@ void TokenPassSearch::prune_tokens()
         * m_word_end_beam;
     }
   }
-  if (m_verbose > 1)
+  m_budget_survivors = m_active_token_list->size();
+  if (m_recombination_mode == LM_STATE_RECOMBINATION
+      && m_lm_states.size() >= MIN_LM_STATES_TO_COMPACT
+      && m_lm_states.size() >= 2 * m_active_token_list->size())
+    compact_lm_states();
+  m_prune_time = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start_time).count();
+
+  if (m_verbose > 1) {
     printf("Current beam: %.1f   Word end beam: %.1f\n",
            m_current_glob_beam, m_current_we_beam);
+    printf("Pruning (%s) took %.3f ms\n", m_pruning_kernel.type_name(),
+           m_prune_time * 1000);
+  }
+}
+
+void TokenPassSearch::compact_lm_states()
+{
+  // Only the active tokens refer to the states between frames.
+  LMStateTable states;
+  for (int i = 0; i < m_active_token_list->size(); i++) {
+    TPLexPrefixTree::Token *token = (*m_active_token_list)[i];
+    int id = token->lm_hist_code - 1;
+    if (id >= 0)
+      token->lm_hist_code = states.find_or_insert(
+        m_lm_states.key(id), m_lm_states.key_length(id)) + 1;
+  }
+  m_lm_states.swap(states);
+  if (m_verbose > 1)
+    printf("%d LM states after compaction\n", m_lm_states.size());
+}
+
+void TokenPassSearch::keep_best_tokens(int num_tokens)
+{
+  const float *scores = m_active_token_list->scores();
+  int size = m_active_token_list->size();
+  std::vector<float> sorted(scores, scores + size);
+  std::nth_element(sorted.begin(), sorted.begin() + num_tokens - 1,
+                   sorted.end(), std::greater<float>());
+  float limit = sorted[num_tokens - 1];
+  int num_better = 0;
+  for (int i = 0; i < size; i++)
+    if (scores[i] > limit)
+      num_better++;
+
+  // Keep the tokens better than the limit, and as many of the tokens at
+  // the limit as fit, in their original order.
+  int num_equal = num_tokens - num_better;
+  int num_active_tokens = 0;
+  for (int i = 0; i < size; i++) {
+    if (scores[i] > limit || (scores[i] == limit && num_equal-- > 0))
+    {
+      m_active_token_list->move(i, num_active_tokens);
+      num_active_tokens++;
+    }
+    else
+      release_token((*m_active_token_list)[i]);
+  }
+  m_active_token_list->resize(num_active_tokens);
+  if (m_verbose > 1)
+    printf("%d tokens after token budget pruning\n", num_active_tokens);
+}
+
+void TokenPassSearch::update_beams(
+  std::chrono::steady_clock::time_point start_time)
+{
+  double measured;
+  if (m_beam_controller.target() == BeamController::TIME)
+    measured = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start_time).count();
+  else
+    measured = m_active_token_list->size();
+
+  m_current_glob_beam = m_beam_controller.update(
+    m_frame, measured, m_current_glob_beam, m_global_beam);
+  m_current_we_beam = m_current_glob_beam / m_global_beam * m_word_end_beam;
+
+  if (m_verbose > 1)
+    printf("Beam control: measured %g, beam %.1f, word end beam %.1f\n",
+           measured, m_current_glob_beam, m_current_we_beam);
 }
 
 void TokenPassSearch::clear_active_node_token_lists(void)
 {
   for (int i = 0; i < m_active_node_list.size(); i++)
-    m_active_node_list[i]->token_list = NULL;
+    m_node_token_lists[m_active_node_list[i]->node_id] = NULL;
   m_active_node_list.clear();
+  m_recombination_table.clear();
 }
 
 void TokenPassSearch::set_word_classes(const WordClasses * x)
@@ -1716,6 +2315,7 @@ int TokenPassSearch::set_lookahead_ngram(NGram *ngram)
 {
   assert( m_ngram != NULL || m_fsa_lm != NULL);
   m_lookahead_ngram = ngram;
+  m_lm_lookahead_initialized = false;
   return create_word_repository();
 }
 
@@ -1965,14 +2565,22 @@ float TokenPassSearch::compute_ngram_score(LMHistory * history)
 
 float TokenPassSearch::get_ngram_score(LMHistory *lm_hist, int lm_hist_code)
 {
+  SearchProfile::Timer timer(m_profiling ? &m_frame_profile.lm_time : NULL);
   if (!m_use_lm_cache)
     return compute_ngram_score(lm_hist);
+  if (m_lm_cache_type == OPEN_ADDRESSING_CACHE)
+    return get_open_addressing_ngram_score(lm_hist);
 
   float score;
   LMScoreInfo *info, *old = NULL;
   bool collision = false;
   int i;
 
+  // The LM state ids do not identify the n-gram when the recombination
+  // span is shorter than the n-gram, so hash the n-gram instead.
+  if (m_recombination_mode == LM_STATE_RECOMBINATION)
+    lm_hist_code = hash_lm_history(lm_hist, m_ngram->order() + 1);
+
   if (m_lm_score_cache.find(lm_hist_code, &info)) {
     // Check this is correct word history
     LMHistory *wh = lm_hist;
@@ -1991,6 +2599,7 @@ float TokenPassSearch::get_ngram_score(LMHistory *lm_hist, int lm_hist_code)
         goto get_ngram_score_no_cached;
       }
     }
+    m_frame_profile.lm_cache_hits++;
     return info->lm_score;
   }
 get_ngram_score_no_cached: if (collision) {
@@ -1999,6 +2608,7 @@ get_ngram_score_no_cached: if (collision) {
       assert( 0);
     delete old;
   }
+  m_frame_profile.lm_cache_misses++;
   score = compute_ngram_score(lm_hist);
 
   info = new LMScoreInfo;
@@ -2017,6 +2627,186 @@ get_ngram_score_no_cached: if (collision) {
   return score;
 }
 
+int TokenPassSearch::make_lm_score_key(int word_id, LMHistory *history,
+                                       int *key) const
+{
+  // The key contains the same words that are stored in the HashCache.
+  int length = 0;
+  while (length <= m_ngram->order() && word_id != -1) {
+    if (length == LMScoreCache::MAX_KEY_LENGTH)
+      return -1;
+    key[length++] = word_id;
+    if (word_id == m_sentence_start_id)
+      break;
+    word_id = history->last().word_id();
+    history = history->previous;
+  }
+  return length;
+}
+
+float TokenPassSearch::get_open_addressing_ngram_score(LMHistory *lm_hist)
+{
+  int key[LMScoreCache::MAX_KEY_LENGTH];
+  int length = make_lm_score_key(lm_hist->last().word_id(),
+                                 lm_hist->previous, key);
+  if (length < 0)
+    return compute_ngram_score(lm_hist);
+
+  float score;
+  if (m_open_lm_score_cache.find(key, length, &score)) {
+    m_frame_profile.lm_cache_hits++;
+    return score;
+  }
+  m_frame_profile.lm_cache_misses++;
+  score = compute_ngram_score(lm_hist);
+  m_open_lm_score_cache.insert(key, length, score);
+  return score;
+}
+
+void TokenPassSearch::collect_lm_queries(const LMQuery &history,
+                                         const TPLexPrefixTree::Node *node,
+                                         int depth)
+{
+  for (int i = 0; i < node->arcs.size(); i++) {
+    const TPLexPrefixTree::Node *next = m_lexicon.node(node->arcs[i].next);
+    if (next == node)
+      continue;
+
+    // The same conditions as in move_token_to_node() for adding a word to
+    // the history and computing its score.
+    int word_id = next->word_id;
+    if (!(next->flags & NODE_AFTER_WORD_ID) && word_id != -1) {
+      if (m_word_repository[word_id].lm_id() < 0
+          || word_id == m_sentence_start_id
+          || (word_id == m_word_boundary_id && history.length > 0
+              && history.key[0] == m_word_boundary_id))
+        continue;
+
+      m_lm_queries.push_back(LMQuery());
+      LMQuery &query = m_lm_queries.back();
+      query.key[0] = word_id;
+      std::copy(history.key, history.key + history.length, query.key + 1);
+      query.length = history.length + 1;
+    }
+    else if (next->state < 0 && depth < MAX_LM_QUERY_DEPTH) {
+      // Tokens pass through nodes without states in the same frame.
+      collect_lm_queries(history, next, depth + 1);
+    }
+  }
+}
+
+void TokenPassSearch::score_word_ends_in_batch()
+{
+  SearchProfile::Timer timer(m_profiling ? &m_frame_profile.lm_time : NULL);
+
+  const int order = m_ngram->order();
+  if (order + 1 > LMScoreCache::MAX_KEY_LENGTH)
+    return;
+
+  // The keys of the queries are the words followed by the key words of the
+  // token histories, which are the same for all the words of a token.
+  m_lm_queries.clear();
+  LMHistory *previous_history = NULL;
+  LMQuery history;
+  for (int i = 0; i < m_active_token_list->size(); i++) {
+    TPLexPrefixTree::Token *token = (*m_active_token_list)[i];
+    if (token == NULL)
+      continue;
+    if (token->lm_history != previous_history) {
+      previous_history = token->lm_history;
+      history.length = make_lm_score_key(
+        token->lm_history->last().word_id(), token->lm_history->previous,
+        history.key);
+      if (history.length > order)
+        history.length = order;
+    }
+    collect_lm_queries(history, token->node, 0);
+  }
+  if (m_lm_queries.empty())
+    return;
+
+  // Sort the queries by context, then by the last word. The n-gram of a
+  // query is the first min(length, order) words of its key in reverse
+  // order.
+  m_lm_query_order.resize(m_lm_queries.size());
+  for (int i = 0; i < m_lm_queries.size(); i++)
+    m_lm_query_order[i] = i;
+  std::sort(m_lm_query_order.begin(), m_lm_query_order.end(),
+            [&](int a, int b) {
+              const LMQuery &qa = m_lm_queries[a];
+              const LMQuery &qb = m_lm_queries[b];
+              if (qa.length != qb.length)
+                return qa.length < qb.length;
+              for (int i = 1; i < qa.length; i++)
+                if (qa.key[i] != qb.key[i])
+                  return qa.key[i] < qb.key[i];
+              return qa.key[0] < qb.key[0];
+            });
+
+  // Drop the duplicates and the queries that are in the cache already.
+  int num_queries = 0;
+  for (int i = 0; i < m_lm_query_order.size(); i++) {
+    const LMQuery &q = m_lm_queries[m_lm_query_order[i]];
+    if (num_queries > 0) {
+      const LMQuery &prev = m_lm_queries[m_lm_query_order[num_queries - 1]];
+      if (prev.length == q.length
+          && std::equal(q.key, q.key + q.length, prev.key))
+        continue;
+    }
+    float score;
+    if (m_open_lm_score_cache.find(q.key, q.length, &score))
+      continue;
+    m_lm_query_order[num_queries++] = m_lm_query_order[i];
+  }
+  m_lm_query_order.resize(num_queries);
+
+  // Keep room for all the scores of the frame.
+  if (num_queries * 2 > m_open_lm_score_cache.num_entries())
+    m_open_lm_score_cache.resize(num_queries * 4);
+
+  int begin = 0;
+  while (begin < num_queries) {
+    // Find the queries with the same context. Keys that differ only after
+    // the n-gram have the same score.
+    const LMQuery &first = m_lm_queries[m_lm_query_order[begin]];
+    const int n = std::min(first.length, order);
+    int end = begin + 1;
+    while (end < num_queries) {
+      const LMQuery &q = m_lm_queries[m_lm_query_order[end]];
+      if (std::min(q.length, order) != n
+          || !std::equal(q.key + 1, q.key + n, first.key + 1))
+        break;
+      end++;
+    }
+
+    m_lm_query_context.clear();
+    for (int i = n - 1; i >= 1; i--)
+      m_lm_query_context.push_back(m_word_repository[first.key[i]].lm_id());
+    m_lm_query_words.clear();
+    m_lm_query_word_index.resize(end - begin);
+    for (int i = begin; i < end; i++) {
+      int word_id = m_lm_queries[m_lm_query_order[i]].key[0];
+      int lm_id = m_word_repository[word_id].lm_id();
+      std::vector<int>::iterator pos = std::find(
+        m_lm_query_words.begin(), m_lm_query_words.end(), lm_id);
+      m_lm_query_word_index[i - begin] = pos - m_lm_query_words.begin();
+      if (pos == m_lm_query_words.end())
+        m_lm_query_words.push_back(lm_id);
+    }
+    m_lm_query_scores.resize(m_lm_query_words.size());
+    m_ngram->log_prob_batch(m_lm_query_context, m_lm_query_words.data(),
+                            m_lm_query_words.size(),
+                            m_lm_query_scores.data());
+
+    for (int i = begin; i < end; i++) {
+      const LMQuery &q = m_lm_queries[m_lm_query_order[i]];
+      m_open_lm_score_cache.insert(
+        q.key, q.length, m_lm_query_scores[m_lm_query_word_index[i - begin]]);
+    }
+    begin = end;
+  }
+}
+
 void TokenPassSearch::advance_fsa_lm(TPLexPrefixTree::Token & token)
 {
   const LMHistory::Word & word = token.lm_history->last();
@@ -2083,6 +2873,11 @@ float TokenPassSearch::get_lm_lookahead_score(LMHistory *lm_hist,
   }
 
   if (m_lm_lookahead == 1) {
+    if (m_lm_lookahead_table.is_open()) {
+      m_frame_profile.lookahead_hits++;
+      return m_lm_lookahead_table.score(
+        w2, m_lookahead_buffer_index[node->node_id]);
+    }
     return get_lm_bigram_lookahead(w2, node, depth);
   }
 
@@ -2100,64 +2895,202 @@ float TokenPassSearch::get_lm_lookahead_score(LMHistory *lm_hist,
   return get_lm_trigram_lookahead(w1, w2, node, depth);
 }
 
+void TokenPassSearch::create_lookahead_buffers()
+{
+  int num_buffers = 0;
+  m_lookahead_buffer_index.assign(m_lexicon.num_nodes(), -1);
+  for (int i = 0; i < m_lexicon.num_nodes(); i++)
+    if (m_lexicon.node(i)->num_word_ranges > 0)
+      m_lookahead_buffer_index[i] = num_buffers++;
+
+  m_lookahead_buffers.clear();
+  m_lookahead_buffers.resize(num_buffers);
+  for (int i = 0; i < num_buffers; i++)
+    m_lookahead_buffers[i].set_max_items(m_max_node_lookahead_buffer_size);
+}
+
+void TokenPassSearch::create_sparse_lm_lookahead()
+{
+  std::vector<int> lm_ids(m_word_repository.size());
+  for (int i = 0; i < m_word_repository.size(); i++)
+    lm_ids[i] = m_word_repository[i].lookahead_lm_id();
+
+  std::vector<const TPLexPrefixTree::Node*> nodes(m_lookahead_buffers.size());
+  for (int i = 0; i < m_lexicon.num_nodes(); i++) {
+    int index = m_lookahead_buffer_index[i];
+    if (index >= 0)
+      nodes[index] = m_lexicon.node(i);
+  }
+
+  if (!m_sparse_lm_lookahead.build(m_lookahead_ngram, lm_ids, m_lexicon,
+                                   nodes))
+    throw InvalidSetup("Sparse LM lookahead requires a backoff TreeGram "
+                       "lookahead LM.");
+}
+
+void TokenPassSearch::compute_lm_bigram_scores(int prev_word_id,
+                                               std::vector<float> &lm_scores)
+{
+  vector<float> extensions;
+  m_lookahead_ngram->fetch_bigram_list(
+    m_word_repository[prev_word_id].lookahead_lm_id(), extensions);
+  create_lm_score_tree(extensions, lm_scores);
+}
+
+void TokenPassSearch::create_lm_score_tree(const std::vector<float> &extensions,
+                                           std::vector<float> &lm_scores)
+{
+  // Map lookahead LM IDs to the word order of the lexicon.
+  const std::vector<int> &word_order = m_lexicon.word_order();
+  int num_words = word_order.size();
+  lm_scores.resize(2 * num_words);
+  for (int i = 0; i < num_words; i++) {
+    lm_scores[num_words + i] =
+      extensions.at(m_word_repository[word_order[i]].lookahead_lm_id());
+  }
+
+  // Each internal node of the segment tree is the maximum of its children.
+  for (int i = num_words - 1; i > 0; i--)
+    lm_scores[i] = std::max(lm_scores[2 * i], lm_scores[2 * i + 1]);
+}
+
+float TokenPassSearch::max_lm_score(const std::vector<float> &lm_scores,
+                                    const TPLexPrefixTree::Node *node) const
+{
+  int num_words = lm_scores.size() / 2;
+  const TPLexPrefixTree::WordRange *ranges = m_lexicon.word_ranges(node);
+  float score = -1e10;
+  for (int i = 0; i < node->num_word_ranges; i++) {
+    for (int begin = ranges[i].begin + num_words,
+           end = ranges[i].end + num_words;
+         begin < end; begin /= 2, end /= 2)
+    {
+      if (begin & 1) {
+        if (lm_scores[begin] > score)
+          score = lm_scores[begin];
+        begin++;
+      }
+      if (end & 1) {
+        end--;
+        if (lm_scores[end] > score)
+          score = lm_scores[end];
+      }
+    }
+  }
+  return score;
+}
+
+uint32_t TokenPassSearch::lm_lookahead_table_checksum() const
+{
+  // FNV-1a over the fingerprint of the lookahead LM, the possible word ends
+  // of the lookahead nodes and the lookahead LM IDs of the words.
+  uint32_t hash = 2166136261u;
+  std::vector<int> values;
+  values.push_back(
+    m_lookahead_ngram != NULL ? m_lookahead_ngram->fingerprint() : 0);
+  values.push_back(m_word_repository.size());
+  for (int i = 0; i < m_word_repository.size(); i++)
+    values.push_back(m_word_repository[i].lookahead_lm_id());
+  for (int i = 0; i < m_lexicon.num_nodes(); i++) {
+    const TPLexPrefixTree::Node *node = m_lexicon.node(i);
+    if (node->num_word_ranges == 0)
+      continue;
+    values.push_back(i);
+    m_lexicon.get_lookahead_words(node, values);
+  }
+  for (int i = 0; i < values.size(); i++) {
+    hash ^= (uint32_t)values[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+void TokenPassSearch::write_lm_lookahead_table(const std::string &path,
+                                               int bytes_per_score)
+{
+  if (m_lookahead_ngram == NULL)
+    throw InvalidSetup("Lookahead LM has to be set before writing an LM "
+                       "lookahead table.");
+  create_lookahead_buffers();
+
+  std::vector<float> lm_scores;
+  LMLookaheadTable::write(
+    path, m_word_repository.size(), m_lookahead_buffers.size(),
+    bytes_per_score, lm_lookahead_table_checksum(),
+    [&](int word, std::vector<float> &scores) {
+      compute_lm_bigram_scores(word, lm_scores);
+      for (int i = 0; i < m_lexicon.num_nodes(); i++) {
+        int index = m_lookahead_buffer_index[i];
+        if (index < 0)
+          continue;
+        scores[index] = max_lm_score(lm_scores, m_lexicon.node(i));
+      }
+    });
+}
+
+void TokenPassSearch::read_lm_lookahead_table(const std::string &path)
+{
+  m_lm_lookahead_table.open(path);
+  if (m_lm_lookahead_table.checksum() != lm_lookahead_table_checksum()) {
+    m_lm_lookahead_table.close();
+    throw InvalidSetup("LM lookahead table " + path + " does not match the "
+                       "lexicon, the vocabulary and the lookahead LM.");
+  }
+}
+
 float TokenPassSearch::get_lm_bigram_lookahead(int prev_word_id,
                                                TPLexPrefixTree::Node *node, int depth)
 {
-#ifdef COUNT_LM_LA_CACHE_MISS
+  // The deepest nodes share the last counter.
+  depth = std::min(depth, MAX_LEX_TREE_DEPTH - 1);
   lm_la_cache_count[depth]++;
-#endif
 
   float score;
-  if (node->lm_lookahead_buffer.find(prev_word_id, &score))
+  if (lookahead_buffer(node).find(prev_word_id, &score)) {
+    m_frame_profile.lookahead_hits++;
     return score;
+  }
 
-#ifdef COUNT_LM_LA_CACHE_MISS
+  m_frame_profile.lookahead_misses++;
   lm_la_cache_miss[depth]++;
+
+  if (m_lm_lookahead_mode == SPARSE_LM_LOOKAHEAD) {
+    SearchProfile::Timer timer(
+      m_profiling ? &m_frame_profile.lm_time : NULL);
+    score = m_sparse_lm_lookahead.score(
+      -1, m_word_repository[prev_word_id].lookahead_lm_id(),
+      m_lookahead_buffer_index[node->node_id]);
+    lookahead_buffer(node).insert(prev_word_id, score, NULL);
+    return score;
+  }
+
   lm_la_word_cache_count++;
-#endif
 
   // Not found from cache. Compute the LM bigram lookahead score for every
   // word pair starting with prev_word_id (unless the LM scores have been
-  // computed already.
-  LMLookaheadScoreList * score_list = NULL;
-  if (!lm_lookahead_score_list.find(prev_word_id, &score_list)) {
-#ifdef COUNT_LM_LA_CACHE_MISS
+  // computed already, possibly by another search sharing the cache).
+  LMLookaheadCache::ScoreList score_list =
+    m_lm_lookahead_cache->find(prev_word_id);
+  if (!score_list) {
     lm_la_word_cache_miss++;
-#endif
     // FIXME! Is it necessary to compute the scores for all the words?
     if (m_verbose > 2)
       printf("Compute lm lookahead scores for \'%s'\n",
              m_vocabulary.word(prev_word_id).c_str());
-    score_list = new LMLookaheadScoreList;
-    LMLookaheadScoreList * old_score_list = NULL;
-    if (lm_lookahead_score_list.insert(prev_word_id, score_list,
-                                       &old_score_list))
-      delete old_score_list; // Old list was removed
-    score_list->index = prev_word_id;
-    score_list->lm_scores.insert(score_list->lm_scores.end(),
-                                 m_word_repository.size(), 0);
-
-    vector<float> extensions;
-    m_lookahead_ngram->fetch_bigram_list(
-      m_word_repository[prev_word_id].lookahead_lm_id(), extensions);
-
-    // Map lookahead LM IDs to word IDs.
-    for (int i = 0; i < m_word_repository.size(); ++i) {
-      score_list->lm_scores.at(i) =
-        extensions.at(m_word_repository[i].lookahead_lm_id());
-    }
+    SearchProfile::Timer timer(
+      m_profiling ? &m_frame_profile.lm_time : NULL);
+    std::vector<float> *lm_scores = new std::vector<float>;
+    compute_lm_bigram_scores(prev_word_id, *lm_scores);
+    score_list = m_lm_lookahead_cache->insert(
+      prev_word_id, LMLookaheadCache::ScoreList(lm_scores));
   }
 
   // Compute the lookahead score by selecting the maximum LM score of possible
   // word ends.
-  score = -1e10;
-  for (int i = 0; i < node->possible_word_id_list.size(); i++) {
-    if (score_list->lm_scores[node->possible_word_id_list[i]] > score)
-      score = score_list->lm_scores[node->possible_word_id_list[i]];
-  }
+  score = max_lm_score(*score_list, node);
 
   // Add the score to the node's buffer
-  node->lm_lookahead_buffer.insert(prev_word_id, score, NULL);
+  lookahead_buffer(node).insert(prev_word_id, score, NULL);
 
   return score;
 }
@@ -2165,62 +3098,63 @@ float TokenPassSearch::get_lm_bigram_lookahead(int prev_word_id,
 float TokenPassSearch::get_lm_trigram_lookahead(int w1, int w2,
                                                 TPLexPrefixTree::Node *node, int depth)
 {
-#ifdef COUNT_LM_LA_CACHE_MISS
+  // The deepest nodes share the last counter.
+  depth = std::min(depth, MAX_LEX_TREE_DEPTH - 1);
   lm_la_cache_count[depth]++;
-#endif
 
   int index = w1 * m_word_repository.size() + w2;
   float score;
-  if (node->lm_lookahead_buffer.find(index, &score))
+  if (lookahead_buffer(node).find(index, &score)) {
+    m_frame_profile.lookahead_hits++;
     return score;
+  }
 
-#ifdef COUNT_LM_LA_CACHE_MISS
+  m_frame_profile.lookahead_misses++;
   lm_la_cache_miss[depth]++;
+
+  if (m_lm_lookahead_mode == SPARSE_LM_LOOKAHEAD) {
+    SearchProfile::Timer timer(
+      m_profiling ? &m_frame_profile.lm_time : NULL);
+    score = m_sparse_lm_lookahead.score(
+      m_word_repository[w1].lookahead_lm_id(),
+      m_word_repository[w2].lookahead_lm_id(),
+      m_lookahead_buffer_index[node->node_id]);
+    lookahead_buffer(node).insert(index, score, NULL);
+    return score;
+  }
+
   lm_la_word_cache_count++;
-#endif
 
   // Not found from cache. Compute the LM trigram lookahead score for every
   // word triplet starting with w1 w2 (unless the LM scores have been computed
-  // already).
-  LMLookaheadScoreList * score_list = NULL;
-  if (!lm_lookahead_score_list.find(index, &score_list)) {
-#ifdef COUNT_LM_LA_CACHE_MISS
+  // already, possibly by another search sharing the cache).
+  LMLookaheadCache::ScoreList score_list = m_lm_lookahead_cache->find(index);
+  if (!score_list) {
     lm_la_word_cache_miss++;
-#endif
     // FIXME! Is it necessary to compute the scores for all the words?
     if (m_verbose > 2)
       printf("Compute lm lookahead scores for (%s,%s)\n",
              m_vocabulary.word(w1).c_str(),
              m_vocabulary.word(w2).c_str());
-    score_list = new LMLookaheadScoreList;
-    LMLookaheadScoreList * old_score_list = NULL;
-    if (lm_lookahead_score_list.insert(index, score_list, &old_score_list))
-      delete old_score_list; // Old list was removed
-    score_list->index = index;
-    score_list->lm_scores.insert(score_list->lm_scores.end(),
-                                 m_word_repository.size(), 0);
+    SearchProfile::Timer timer(
+      m_profiling ? &m_frame_profile.lm_time : NULL);
+    std::vector<float> *lm_scores = new std::vector<float>;
 
     vector<float> extensions;
     m_lookahead_ngram->fetch_trigram_list(
       m_word_repository[w1].lookahead_lm_id(),
       m_word_repository[w2].lookahead_lm_id(), extensions);
-
-    // Map lookahead LM IDs to word IDs.
-    for (int i = 0; i < m_word_repository.size(); ++i)
-      score_list->lm_scores.at(i) =
-        extensions.at(m_word_repository[i].lookahead_lm_id());
+    create_lm_score_tree(extensions, *lm_scores);
+    score_list = m_lm_lookahead_cache->insert(
+      index, LMLookaheadCache::ScoreList(lm_scores));
   }
 
   // Compute the lookahead score by selecting the maximum LM score of
   // possible word ends.
-  score = -1e10;
-  for (int i = 0; i < node->possible_word_id_list.size(); i++) {
-    if (score_list->lm_scores[node->possible_word_id_list[i]] > score)
-      score = score_list->lm_scores[node->possible_word_id_list[i]];
-  }
+  score = max_lm_score(*score_list, node);
 
   // Add the score to the node's buffer
-  node->lm_lookahead_buffer.insert(index, score, NULL);
+  lookahead_buffer(node).insert(index, score, NULL);
 
   return score;
 }
@@ -2228,15 +3162,7 @@ float TokenPassSearch::get_lm_trigram_lookahead(int w1, int w2,
 TPLexPrefixTree::Token*
 TokenPassSearch::acquire_token(void)
 {
-  if (m_token_pool.size() == 0) {
-    TPLexPrefixTree::Token *tt =
-      new TPLexPrefixTree::Token[TOKEN_RESERVE_BLOCK];
-    m_token_dealloc_table.push_back(tt);
-    for (int i = 0; i < TOKEN_RESERVE_BLOCK; i++)
-      m_token_pool.push_back(&tt[i]);
-  }
-  TPLexPrefixTree::Token *t = m_token_pool.back();
-  m_token_pool.pop_back();
+  TPLexPrefixTree::Token *t = m_token_pool.acquire();
   t->recent_word_graph_node = -1;
   t->word_history = NULL;
   return t;
@@ -2244,22 +3170,7 @@ TokenPassSearch::acquire_token(void)
 
 LMHistory *
 TokenPassSearch::acquire_lmhist(const LMHistory::Word * last_word, LMHistory * previous) {
-  if (m_lmh_pool.size() == 0) {
-    LMHistory * lmh_block = new LMHistory[TOKEN_RESERVE_BLOCK];
-    m_lmhist_dealloc_table.push_back(lmh_block);
-    for (int i = 0; i < TOKEN_RESERVE_BLOCK; i++)
-      m_lmh_pool.push_back(&lmh_block[i]);
-  }
-  LMHistory *lmh = m_lmh_pool.back();
-  m_lmh_pool.pop_back();
-  lmh->last_word = last_word;
-  lmh->previous = previous;
-  lmh->reference_count = 0;
-  lmh->printed = false;
-  lmh->word_start_frame = 0;
-  lmh->word_first_silence_frame=-1;
-  if (previous) hist::link(lmh->previous);
-  return lmh;
+  return new (m_lmh_arena.allocate()) LMHistory(last_word, previous);
 }
 
 void TokenPassSearch::release_token(TPLexPrefixTree::Token *token)
@@ -2267,20 +3178,72 @@ void TokenPassSearch::release_token(TPLexPrefixTree::Token *token)
   if (token->recent_word_graph_node >= 0)
     word_graph.unlink(token->recent_word_graph_node);
   token->recent_word_graph_node = -1;
-  hist::unlink(token->lm_history, &m_lmh_pool);
-  hist::unlink(token->word_history);
-  hist::unlink(token->state_history);
+  hist::unlink(token->lm_history, m_lmh_arena.pool());
+  hist::unlink(token->word_history, m_word_history_arena.pool());
+  hist::unlink(token->state_history, m_state_history_arena.pool());
   //TPLexPrefixTree::PathHistory::unlink(token->token_path);
-  m_token_pool.push_back(token);
+  m_token_pool.release(token);
+}
+
+void TokenPassSearch::discard_token_for_memory()
+{
+  m_budget_dropped_tokens++;
+  if (m_budget_pruning_frame == m_frame)
+    return;
+  m_budget_pruning_frame = m_frame;
+  m_current_glob_beam *= BUDGET_BEAM_FACTOR;
+  m_current_we_beam = m_current_glob_beam / m_global_beam * m_word_end_beam;
+  if (m_verbose > 1)
+    printf("Token memory budget exhausted, beam tightened to %.1f\n",
+           m_current_glob_beam);
 }
 
 void TokenPassSearch::release_lmhist(LMHistory *lmhist) {
   lmhist->last_word=NULL;
   lmhist->previous=NULL;
-  m_lmh_pool.push_back(lmhist);
+  m_lmh_arena.pool()->push_back(lmhist);
 }
 
 
+void TokenPassSearch::print_history_statistics(FILE *file) const
+{
+  fprintf(file, "History structures (live / peak / allocated):\n");
+  fprintf(file, "  LMHistory:    %d / %d / %d\n", m_lmh_arena.num_live(),
+          m_lmh_arena.peak_live(), m_lmh_arena.capacity());
+  fprintf(file, "  WordHistory:  %d / %d / %d\n",
+          m_word_history_arena.num_live(), m_word_history_arena.peak_live(),
+          m_word_history_arena.capacity());
+  fprintf(file, "  StateHistory: %d / %d / %d\n",
+          m_state_history_arena.num_live(), m_state_history_arena.peak_live(),
+          m_state_history_arena.capacity());
+  fprintf(file, "Token memory: %zu bytes, peak %zu bytes, %d tokens dropped\n",
+          m_token_pool.allocated_bytes(), m_token_pool.peak_bytes(),
+          m_budget_dropped_tokens);
+}
+
+void TokenPassSearch::print_lm_lookahead_statistics(FILE *file) const
+{
+  int max_depth = 0;
+  for (int i = 0; i < MAX_LEX_TREE_DEPTH; i++)
+    if (lm_la_cache_count[i] > 0)
+      max_depth = i + 1;
+
+  fprintf(file, "LM lookahead node buffers by depth (lookups / misses):\n");
+  for (int i = 0; i < max_depth; i++)
+    fprintf(file, "  %2d: %d / %d\n", i, lm_la_cache_count[i],
+            lm_la_cache_miss[i]);
+  fprintf(file, "LM lookahead score lists of this search (lookups / misses): %d / %d\n",
+          lm_la_word_cache_count, lm_la_word_cache_miss);
+  fprintf(file, "Score list cache (hits / misses / items): "
+          "%ld / %ld / %d\n", m_lm_lookahead_cache->num_hits(),
+          m_lm_lookahead_cache->num_misses(),
+          m_lm_lookahead_cache->num_items());
+  if (m_lm_lookahead_mode == SPARSE_LM_LOOKAHEAD)
+    fprintf(file, "Sparse lookahead contexts (lookups / misses): %ld / %ld\n",
+            m_sparse_lm_lookahead.num_lookups(),
+            m_sparse_lm_lookahead.num_misses());
+}
+
 void TokenPassSearch::save_token_statistics(int count)
 {
   int *buf = new int[MAX_TREE_DEPTH];
@@ -2366,7 +3329,8 @@ void TokenPassSearch::update_final_tokens()
     // word. Thus, tokens that are in a final node do not have the current
     // word in their word histories.
     if (m_generate_word_graph && token->node->flags & NODE_FINAL) {
-      token->word_history = new TPLexPrefixTree::WordHistory(
+      token->word_history = new (m_word_history_arena.allocate())
+        TPLexPrefixTree::WordHistory(
         token->lm_history->last().word_id(), m_frame,
         token->word_history);
       token->word_history->lex_node_id = token->node->node_id;
@@ -2392,8 +3356,8 @@ void TokenPassSearch::update_final_tokens()
       token->fsa_lm_node = m_fsa_lm->initial_node_id();
     }
     token->word_count++;
-    token->total_log_prob = get_token_log_prob(token->am_log_prob,
-                                               token->lm_log_prob);
+    m_active_token_list->set_score(
+      i, get_token_log_prob(token->am_log_prob, token->lm_log_prob));
 
     // For tokens in a final node, add sentence end also in WordHistory.
     if (m_generate_word_graph && token->node->flags & NODE_FINAL) {
@@ -2402,7 +3366,8 @@ void TokenPassSearch::update_final_tokens()
           > m_best_final_token->total_log_prob)
         m_best_final_token = token;
 
-      token->word_history = new TPLexPrefixTree::WordHistory(
+      token->word_history = new (m_word_history_arena.allocate())
+        TPLexPrefixTree::WordHistory(
         token->lm_history->last().word_id(), m_frame,
         token->word_history);
       token->word_history->lex_node_id = token->node->node_id;
@@ -2477,6 +3442,11 @@ void TokenPassSearch::build_word_graph_aux(TPLexPrefixTree::Token *new_token,
     info.frame = m_frame;
   }
   for (int i = 0; i < info.items.size(); i++) {
+    // The node may have been freed and reused after the item was added.
+    const WordGraph::Node &node = word_graph.nodes[info.items[i].graph_node_id];
+    if (node.reference_count <= 0 || node.symbol != word_id ||
+        node.lex_node_id != word_history->lex_node_id)
+      continue;
     if (info.items[i].lex_node_id == word_history->lex_node_id) {
       // This node matches all (word_id, frame, lex_node_id).
       target_node = info.items[i].graph_node_id;
@@ -2539,6 +3509,11 @@ void TokenPassSearch::write_word_graph(const std::string &file_name)
 
 void TokenPassSearch::write_word_graph(FILE *file)
 {
+  if (m_word_graph_cut_node >= 0) {
+    write_flushed_word_graph(file);
+    return;
+  }
+
   const TPLexPrefixTree::Token & best_token = get_best_final_token();
 
   if (1) {
@@ -2616,6 +3591,439 @@ void TokenPassSearch::write_word_graph(FILE *file)
   }
 }
 
+void TokenPassSearch::get_nbest(int n,
+                                std::vector<NBestHypothesis> &hypotheses)
+{
+  if (!m_generate_word_graph) {
+    throw WordGraphNotGenerated();
+  }
+
+  const TPLexPrefixTree::Token & best_token = get_best_final_token();
+  std::vector<WordGraph::Path> paths;
+  word_graph.find_best_paths(best_token.recent_word_graph_node, n, paths);
+
+  hypotheses.resize(paths.size());
+  for (int i = 0; i < paths.size(); i++) {
+    const std::vector<int> &nodes = paths[i].nodes;
+    NBestHypothesis &hypothesis = hypotheses[i];
+    hypothesis.am_log_prob = paths[i].am_weight;
+    hypothesis.lm_log_prob = paths[i].lm_weight / m_lm_scale;
+    hypothesis.total_log_prob = paths[i].am_weight + paths[i].lm_weight;
+    hypothesis.words.clear();
+
+    // The word of an arc ends in its target node. The initial node is in
+    // frame -1, so the first word starts where the segment started.
+    for (int j = 1; j < nodes.size(); j++) {
+      const WordGraph::Node &source = word_graph.nodes[nodes[j - 1]];
+      const WordGraph::Node &target = word_graph.nodes[nodes[j]];
+      const WordGraph::Arc *arc = NULL;
+      for (int a = target.first_arc; a >= 0;
+           a = word_graph.arcs[a].sibling_arc)
+      {
+        if (word_graph.arcs[a].source_node_id == nodes[j - 1]) {
+          arc = &word_graph.arcs[a];
+          break;
+        }
+      }
+      assert(arc != NULL);
+
+      NBestWord word;
+      word.word_id = target.symbol;
+      word.start_frame = std::max(source.frame, m_segment_start_frame);
+      word.end_frame = target.frame;
+      word.am_log_prob = arc->am_weight;
+      word.lm_log_prob = arc->lm_weight / m_lm_scale;
+      hypothesis.words.push_back(word);
+    }
+  }
+}
+
+static bool word_posterior_less(const TokenPassSearch::WordPosterior &a,
+                                const TokenPassSearch::WordPosterior &b)
+{
+  if (a.start_frame != b.start_frame)
+    return a.start_frame < b.start_frame;
+  if (a.end_frame != b.end_frame)
+    return a.end_frame < b.end_frame;
+  return a.word_id < b.word_id;
+}
+
+static bool frame_posterior_greater(const TokenPassSearch::FramePosterior &a,
+                                    const TokenPassSearch::FramePosterior &b)
+{
+  return a.posterior > b.posterior;
+}
+
+void TokenPassSearch::get_word_posteriors(std::vector<WordPosterior> &words)
+{
+  if (!m_generate_word_graph) {
+    throw WordGraphNotGenerated();
+  }
+
+  const TPLexPrefixTree::Token & best_token = get_best_final_token();
+  float scale = m_posterior_scale > 0 ? m_posterior_scale : 1 / m_lm_scale;
+  std::vector<float> posteriors;
+  word_graph.compute_arc_posteriors(best_token.recent_word_graph_node, scale,
+                                    posteriors);
+
+  // Freed nodes have no arcs, so only the live arcs are visited.
+  words.clear();
+  for (int n = 0; n < word_graph.nodes.size(); n++) {
+    const WordGraph::Node &node = word_graph.nodes[n];
+    for (int a = node.first_arc; a >= 0; a = word_graph.arcs[a].sibling_arc) {
+      if (posteriors[a] <= 0)
+        continue;
+      const WordGraph::Node &source =
+        word_graph.nodes[word_graph.arcs[a].source_node_id];
+      WordPosterior word;
+      word.word_id = node.symbol;
+      word.start_frame = std::max(source.frame, m_segment_start_frame);
+      word.end_frame = node.frame;
+      word.posterior = posteriors[a];
+      words.push_back(word);
+    }
+  }
+
+  // Merge the arcs that differ only in the word history.
+  std::sort(words.begin(), words.end(), word_posterior_less);
+  int num_words = 0;
+  for (int i = 0; i < words.size(); i++) {
+    if (num_words > 0 && !word_posterior_less(words[num_words - 1], words[i]))
+      words[num_words - 1].posterior += words[i].posterior;
+    else
+      words[num_words++] = words[i];
+  }
+  words.resize(num_words);
+}
+
+void TokenPassSearch::get_frame_posteriors(
+  std::vector<std::vector<FramePosterior> > &frames)
+{
+  std::vector<WordPosterior> words;
+  get_word_posteriors(words);
+
+  frames.clear();
+  for (int i = 0; i < words.size(); i++) {
+    // Sentence boundaries may take no frames.
+    int end_frame = std::max(words[i].end_frame, words[i].start_frame + 1);
+    if (frames.size() < end_frame)
+      frames.resize(end_frame);
+    for (int f = words[i].start_frame; f < end_frame; f++) {
+      std::vector<FramePosterior> &frame = frames[f];
+      int k = 0;
+      while (k < frame.size() && frame[k].word_id != words[i].word_id)
+        k++;
+      if (k == frame.size()) {
+        FramePosterior posterior;
+        posterior.word_id = words[i].word_id;
+        posterior.posterior = 0;
+        frame.push_back(posterior);
+      }
+      frame[k].posterior += words[i].posterior;
+    }
+  }
+  for (int f = 0; f < frames.size(); f++)
+    std::sort(frames[f].begin(), frames[f].end(), frame_posterior_greater);
+}
+
+void TokenPassSearch::get_word_confidences(std::vector<WordPosterior> &words)
+{
+  std::vector<std::vector<FramePosterior> > frames;
+  std::vector<NBestHypothesis> best;
+  get_frame_posteriors(frames);
+  get_nbest(1, best);
+
+  words.clear();
+  if (best.empty())
+    return;
+  for (int i = 0; i < best[0].words.size(); i++) {
+    const NBestWord &best_word = best[0].words[i];
+    WordPosterior word;
+    word.word_id = best_word.word_id;
+    word.start_frame = best_word.start_frame;
+    word.end_frame = best_word.end_frame;
+    word.posterior = 0;
+    int end_frame = std::max(word.end_frame, word.start_frame + 1);
+    for (int f = word.start_frame; f < end_frame && f < frames.size(); f++) {
+      const std::vector<FramePosterior> &frame = frames[f];
+      for (int k = 0; k < frame.size(); k++) {
+        if (frame[k].word_id == word.word_id) {
+          word.posterior = std::max(word.posterior, frame[k].posterior);
+          break;
+        }
+      }
+    }
+    words.push_back(word);
+  }
+}
+
+void TokenPassSearch::write_word_graph_binary(const std::string &file_name)
+{
+  if (!m_generate_word_graph) {
+    throw WordGraphNotGenerated();
+  }
+
+  FILE *file = fopen(file_name.c_str(), "wb");
+  if (!file) {
+    throw IOError("Could not open word graph file for writing.");
+  }
+  try {
+    write_word_graph_binary(file);
+  }
+  catch (...) {
+    fclose(file);
+    throw;
+  }
+  if (fclose(file) != 0) {
+    throw IOError("Could not write the word graph file.");
+  }
+}
+
+void TokenPassSearch::write_word_graph_binary(FILE *file)
+{
+  BinaryLattice lattice;
+
+  if (m_word_graph_cut_node >= 0) {
+    get_flushed_word_graph(lattice);
+  }
+  else {
+    const TPLexPrefixTree::Token & best_token = get_best_final_token();
+    word_graph.reset_reachability();
+    word_graph.mark_reachable_nodes(best_token.recent_word_graph_node);
+
+    std::vector<int> node_numbers(word_graph.nodes.size(), -1);
+    for (int n = 0; n < word_graph.nodes.size(); n++)
+      if (word_graph.nodes[n].reachable)
+        node_numbers[n] = lattice.add_node(word_graph.nodes[n].frame);
+
+    // The offsets of the words in the string table, indexed by word ID.
+    std::vector<int> word_offsets;
+    for (int n = 0; n < word_graph.nodes.size(); n++) {
+      const WordGraph::Node &node = word_graph.nodes[n];
+      if (!node.reachable || node.first_arc < 0)
+        continue;
+      if (node.symbol >= word_offsets.size())
+        word_offsets.resize(node.symbol + 1, -1);
+      int &word_offset = word_offsets[node.symbol];
+      if (word_offset < 0) {
+        std::string word = m_vocabulary.word(node.symbol);
+        if (word == "<s>" || word == "</s>")
+          word = "!NULL";
+        word_offset = lattice.add_word(word);
+      }
+      for (int a = node.first_arc; a >= 0; a = word_graph.arcs[a].sibling_arc) {
+        const WordGraph::Arc &arc = word_graph.arcs[a];
+        lattice.add_arc(node_numbers[arc.source_node_id], node_numbers[n],
+                        word_offset, arc.am_weight,
+                        arc.lm_weight / m_lm_scale - m_insertion_penalty);
+      }
+    }
+    lattice.start_node = node_numbers[0];
+    lattice.end_node = node_numbers[best_token.recent_word_graph_node];
+    lattice.lm_scale = m_lm_scale;
+    lattice.insertion_penalty = m_insertion_penalty;
+  }
+
+  try {
+    lattice.write(file);
+  }
+  catch (BinaryLattice::IOError &e) {
+    throw IOError(e.what());
+  }
+}
+
+void TokenPassSearch::flush_word_graph()
+{
+  // Walk the graph backwards from the tokens in decreasing frame order. When
+  // only one node is left to expand, all the paths pass through it. New
+  // arcs are added only to the nodes of the current frame, so the graph
+  // before that node is final.
+  word_graph.reset_reachability();
+  std::priority_queue<std::pair<int, int> > frontier;
+  for (int i = 0; i < m_active_token_list->size(); i++) {
+    TPLexPrefixTree::Token *token = (*m_active_token_list)[i];
+    if (token == NULL)
+      continue;
+    int n = token->recent_word_graph_node;
+    if (!word_graph.nodes[n].reachable) {
+      word_graph.nodes[n].reachable = true;
+      frontier.push(std::make_pair(word_graph.nodes[n].frame, n));
+    }
+  }
+  int cut_node = -1;
+  while (!frontier.empty()) {
+    if (frontier.size() == 1) {
+      cut_node = frontier.top().second;
+      break;
+    }
+    int n = frontier.top().second;
+    frontier.pop();
+    for (int a = word_graph.nodes[n].first_arc; a >= 0;
+         a = word_graph.arcs[a].sibling_arc)
+    {
+      int source = word_graph.arcs[a].source_node_id;
+      if (!word_graph.nodes[source].reachable) {
+        word_graph.nodes[source].reachable = true;
+        frontier.push(std::make_pair(word_graph.nodes[source].frame, source));
+      }
+    }
+  }
+  if (cut_node < 0 || cut_node == m_word_graph_cut_node)
+    return;
+
+  // Write the nodes after the previous cut node, up to the new one.
+  word_graph.reset_reachability();
+  if (m_word_graph_cut_node >= 0)
+    word_graph.nodes[m_word_graph_cut_node].reachable = true;
+  word_graph.mark_reachable_nodes(cut_node);
+  std::vector<int> nodes;
+  for (int n = 0; n < word_graph.nodes.size(); n++)
+    if (word_graph.nodes[n].reachable && n != m_word_graph_cut_node)
+      nodes.push_back(n);
+
+  if (m_word_graph_node_file == NULL) {
+    m_word_graph_node_file = tmpfile();
+    m_word_graph_arc_file = tmpfile();
+    if (m_word_graph_node_file == NULL || m_word_graph_arc_file == NULL)
+      throw IOError("Could not create temporary files for the word graph.");
+  }
+  std::vector<BinaryLattice::Node> part_nodes;
+  std::vector<BinaryLattice::Arc> part_arcs;
+  get_word_graph_part(nodes, part_nodes, part_arcs);
+  if (!part_nodes.empty())
+    fwrite(part_nodes.data(), sizeof(BinaryLattice::Node), part_nodes.size(),
+           m_word_graph_node_file);
+  if (!part_arcs.empty())
+    fwrite(part_arcs.data(), sizeof(BinaryLattice::Arc), part_arcs.size(),
+           m_word_graph_arc_file);
+
+  // The cut node is the start of the rest of the graph.
+  word_graph.remove_incoming_arcs(cut_node);
+  m_word_graph_cut_node = cut_node;
+}
+
+void TokenPassSearch::get_word_graph_part(
+  const std::vector<int> &nodes, std::vector<BinaryLattice::Node> &part_nodes,
+  std::vector<BinaryLattice::Arc> &part_arcs)
+{
+  std::vector<std::pair<int, int> > order;
+  for (int i = 0; i < nodes.size(); i++)
+    order.push_back(std::make_pair(word_graph.nodes[nodes[i]].frame,
+                                   nodes[i]));
+  std::sort(order.begin(), order.end());
+
+  if (m_word_graph_output_ids.size() < word_graph.nodes.size())
+    m_word_graph_output_ids.resize(word_graph.nodes.size(), -1);
+  for (int i = 0; i < order.size(); i++) {
+    int n = order[i].second;
+    m_word_graph_output_ids[n] = m_word_graph_output_nodes++;
+    BinaryLattice::Node node;
+    node.frame = word_graph.nodes[n].frame;
+    part_nodes.push_back(node);
+  }
+
+  for (int i = 0; i < order.size(); i++) {
+    int n = order[i].second;
+    const WordGraph::Node &node = word_graph.nodes[n];
+    for (int a = node.first_arc; a >= 0; a = word_graph.arcs[a].sibling_arc) {
+      const WordGraph::Arc &arc = word_graph.arcs[a];
+      BinaryLattice::Arc part_arc;
+      part_arc.source_node = m_word_graph_output_ids[arc.source_node_id];
+      part_arc.target_node = m_word_graph_output_ids[n];
+      part_arc.word = node.symbol;
+      part_arc.am_log_prob = arc.am_weight;
+      part_arc.lm_log_prob = arc.lm_weight / m_lm_scale - m_insertion_penalty;
+      part_arcs.push_back(part_arc);
+      m_word_graph_output_arcs++;
+    }
+  }
+}
+
+std::string TokenPassSearch::lattice_word(int word_id) const
+{
+  const std::string &word = m_vocabulary.word(word_id);
+  if (word == "<s>" || word == "</s>")
+    return "!NULL";
+  return word;
+}
+
+/// Reads all the records of a temporary file.
+template <class T>
+static void read_records(FILE *file, std::vector<T> &records)
+{
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  rewind(file);
+  records.resize(size / sizeof(T));
+  if (!records.empty()
+      && fread(records.data(), sizeof(T), records.size(), file)
+      != records.size())
+    throw TokenPassSearch::IOError("Could not read the flushed word graph.");
+  fseek(file, 0, SEEK_END);
+}
+
+void TokenPassSearch::get_flushed_word_graph(BinaryLattice &lattice)
+{
+  const TPLexPrefixTree::Token & best_token = get_best_final_token();
+
+  // The rest of the graph follows the flushed part.
+  word_graph.reset_reachability();
+  word_graph.nodes[m_word_graph_cut_node].reachable = true;
+  word_graph.mark_reachable_nodes(best_token.recent_word_graph_node);
+  std::vector<int> nodes;
+  for (int n = 0; n < word_graph.nodes.size(); n++)
+    if (word_graph.nodes[n].reachable && n != m_word_graph_cut_node)
+      nodes.push_back(n);
+
+  lattice.clear();
+  read_records(m_word_graph_node_file, lattice.nodes);
+  read_records(m_word_graph_arc_file, lattice.arcs);
+  int output_nodes = m_word_graph_output_nodes;
+  int output_arcs = m_word_graph_output_arcs;
+  get_word_graph_part(nodes, lattice.nodes, lattice.arcs);
+  lattice.start_node = 0;
+  lattice.end_node =
+    m_word_graph_output_ids[best_token.recent_word_graph_node];
+  lattice.lm_scale = m_lm_scale;
+  lattice.insertion_penalty = m_insertion_penalty;
+
+  // The rest may still change, so forget its numbering.
+  m_word_graph_output_nodes = output_nodes;
+  m_word_graph_output_arcs = output_arcs;
+
+  // The arcs refer to the vocabulary until here.
+  std::vector<int> word_offsets;
+  for (int i = 0; i < lattice.arcs.size(); i++) {
+    BinaryLattice::Arc &arc = lattice.arcs[i];
+    if (arc.word >= word_offsets.size())
+      word_offsets.resize(arc.word + 1, -1);
+    int &word_offset = word_offsets[arc.word];
+    if (word_offset < 0)
+      word_offset = lattice.add_word(lattice_word(arc.word));
+    arc.word = word_offset;
+  }
+}
+
+void TokenPassSearch::write_flushed_word_graph(FILE *file)
+{
+  BinaryLattice lattice;
+  get_flushed_word_graph(lattice);
+  lattice.write_slf(file);
+}
+
+void TokenPassSearch::clear_flushed_word_graph()
+{
+  if (m_word_graph_node_file != NULL)
+    fclose(m_word_graph_node_file);
+  if (m_word_graph_arc_file != NULL)
+    fclose(m_word_graph_arc_file);
+  m_word_graph_node_file = NULL;
+  m_word_graph_arc_file = NULL;
+  m_word_graph_cut_node = -1;
+  m_word_graph_output_nodes = 0;
+  m_word_graph_output_arcs = 0;
+}
+
 // void
 // TokenPassSearch::write_word_graph(FILE *file)
 // {
@@ -2661,11 +4069,9 @@ void TokenPassSearch::debug_print_best_lm_history()
 
   // Find the best token
   for (i = 0; i < m_active_token_list->size(); i++) {
-    if ((*m_active_token_list)[i] != NULL) {
-      if ((*m_active_token_list)[i]->total_log_prob > max_log_prob) {
-        best_token = i;
-        max_log_prob = (*m_active_token_list)[i]->total_log_prob;
-      }
+    if (m_active_token_list->score(i) > max_log_prob) {
+      best_token = i;
+      max_log_prob = m_active_token_list->score(i);
     }
   }
   assert(best_token >= 0);
@@ -2689,18 +4095,8 @@ void TokenPassSearch::debug_print_best_lm_history()
     printf("meas%i: %.3g\n", i, (*m_active_token_list)[best_token]->meas[i]);
 #endif
 
-#ifdef COUNT_LM_LA_CACHE_MISS
-  printf("Count: ");
-  for (i = 0; i < MAX_LEX_TREE_DEPTH; i++)
-    printf("%i ", lm_la_cache_count[i]);
-  printf("\n");
-  printf("Miss: ");
-  for (i = 0; i < MAX_LEX_TREE_DEPTH; i++)
-    printf("%i ", lm_la_cache_miss[i]);
-  printf("\n");
-  printf("WordCount: %d\n", lm_la_word_cache_count);
-  printf("WordMiss: %d\n", lm_la_word_cache_miss);
-#endif
+
+  print_lm_lookahead_statistics(stdout);
 }
 
 void TokenPassSearch::debug_print_token_lm_history(FILE * file,
@@ -2768,3 +4164,507 @@ void TokenPassSearch::debug_print_token_word_history(FILE * file,
 
   fflush(file);
 }
+
+namespace {
+
+const char SEARCH_STATE_MAGIC[8] = { 'T', 'P', 'S', 'T', 'A', 'T', 'E', '3' };
+
+/// Returns the contents of a temporary file that is being appended to.
+std::vector<char> read_file_contents(FILE *file)
+{
+  std::vector<char> contents;
+  char buffer[65536];
+  size_t size;
+  rewind(file);
+  while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    contents.insert(contents.end(), buffer, buffer + size);
+  fseek(file, 0, SEEK_END);
+  return contents;
+}
+
+/// Appends the binary representation of values to a search state.
+class StateWriter {
+public:
+  StateWriter(std::string &state) : m_state(state) { }
+
+  template <class T> void write(const T &value)
+  {
+    m_state.append(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  template <class T> void write_vector(const std::vector<T> &values)
+  {
+    write<int>(values.size());
+    if (!values.empty())
+      m_state.append(reinterpret_cast<const char*>(values.data()),
+                     values.size() * sizeof(T));
+  }
+
+private:
+  std::string &m_state;
+};
+
+/// Reads values written by StateWriter, checking that the state is not
+/// truncated.
+class StateReader {
+public:
+  StateReader(const std::string &state) : m_state(state), m_pos(0) { }
+
+  void read_bytes(void *data, size_t size)
+  {
+    if (m_state.size() - m_pos < size)
+      throw TokenPassSearch::InvalidState("The search state is truncated.");
+    memcpy(data, m_state.data() + m_pos, size);
+    m_pos += size;
+  }
+
+  template <class T> T read()
+  {
+    T value;
+    read_bytes(&value, sizeof(T));
+    return value;
+  }
+
+  template <class T> void read_vector(std::vector<T> &values,
+                                      const T &fill = T())
+  {
+    int size = read_size(sizeof(T));
+    values.assign(size, fill);
+    if (size > 0)
+      read_bytes(values.data(), size * sizeof(T));
+  }
+
+  /// \brief Reads the number of items that take at least \a item_size bytes
+  /// each.
+  ///
+  int read_size(size_t item_size)
+  {
+    int size = read<int>();
+    if (size < 0 || size > (m_state.size() - m_pos) / item_size)
+      throw TokenPassSearch::InvalidState("The search state is truncated.");
+    return size;
+  }
+
+  /// \brief Reads an index that has to be less than \a size, or -1.
+  ///
+  int read_index(int size)
+  {
+    int index = read<int>();
+    if (index < -1 || index >= size)
+      throw TokenPassSearch::InvalidState(
+        "The search state contains an invalid index.");
+    return index;
+  }
+
+  bool at_end() const { return m_pos == m_state.size(); }
+
+private:
+  const std::string &m_state;
+  size_t m_pos;
+};
+
+/// Numbers \a history and the structures before it that have not been
+/// numbered yet, so that each structure comes after its previous structure.
+template <class T>
+int number_history(T *history, std::unordered_map<const T*, int> &indices,
+                   std::vector<const T*> &histories)
+{
+  if (history == NULL)
+    return -1;
+  int first = histories.size();
+  for (T *h = history; h != NULL && indices.count(h) == 0; h = h->previous)
+    histories.push_back(h);
+  std::reverse(histories.begin() + first, histories.end());
+  for (int i = first; i < histories.size(); i++)
+    indices[histories[i]] = i;
+  return indices[history];
+}
+
+template <class T>
+int history_index(const T *history,
+                  const std::unordered_map<const T*, int> &indices)
+{
+  if (history == NULL)
+    return -1;
+  typename std::unordered_map<const T*, int>::const_iterator it =
+    indices.find(history);
+  return it == indices.end() ? -1 : it->second;
+}
+
+}
+
+std::string TokenPassSearch::save_state() const
+{
+  std::string state;
+  StateWriter out(state);
+
+  // The setup that the state depends on.
+  out.write(SEARCH_STATE_MAGIC);
+  out.write<int>(m_lexicon.num_nodes());
+  out.write<int>(m_word_repository.size());
+  out.write<int>(m_fsa_lm != NULL);
+  out.write<int>(m_generate_word_graph);
+  out.write<int>(m_keep_state_segmentation);
+  out.write<int>(m_recombination_mode);
+  out.write<int>(m_similar_lm_hist_span);
+
+  out.write(m_frame);
+  out.write(m_end_frame);
+  out.write(m_segment_start_frame);
+  out.write(m_end_of_utterance);
+  out.write(m_current_glob_beam);
+  out.write(m_current_we_beam);
+  out.write(m_best_log_prob);
+  out.write(m_worst_log_prob);
+  out.write(m_best_we_log_prob);
+  out.write(m_fan_in_log_prob);
+  out.write(m_fan_out_log_prob);
+  out.write(m_fan_out_last_log_prob);
+  out.write(m_wc_llh);
+  out.write(m_depth_llh);
+  out.write(m_min_word_count);
+  out.write(m_endpoint_silence_count);
+  out.write(m_endpoint_detected);
+  out.write(m_restart_pending);
+  out.write(m_budget_pruning_frame);
+  out.write(m_budget_dropped_tokens);
+  out.write(m_token_expansion);
+  out.write(m_budget_survivors);
+  out.write(m_budget_dropped_at_prune);
+
+  // Number the history structures of the active tokens.
+  std::vector<const TPLexPrefixTree::Token*> tokens;
+  std::unordered_map<const LMHistory*, int> lm_indices;
+  std::unordered_map<const TPLexPrefixTree::WordHistory*, int> word_indices;
+  std::unordered_map<const TPLexPrefixTree::StateHistory*, int> state_indices;
+  std::vector<const LMHistory*> lm_histories;
+  std::vector<const TPLexPrefixTree::WordHistory*> word_histories;
+  std::vector<const TPLexPrefixTree::StateHistory*> state_histories;
+  int best_final_token = -1;
+  for (int i = 0; i < m_active_token_list->size(); i++) {
+    const TPLexPrefixTree::Token *token = (*m_active_token_list)[i];
+    if (token == NULL)
+      continue;
+    if (token == m_best_final_token)
+      best_final_token = tokens.size();
+    tokens.push_back(token);
+    number_history(token->lm_history, lm_indices, lm_histories);
+    number_history(token->word_history, word_indices, word_histories);
+    number_history(token->state_history, state_indices, state_histories);
+  }
+
+  out.write<int>(lm_histories.size());
+  for (int i = 0; i < lm_histories.size(); i++) {
+    const LMHistory *h = lm_histories[i];
+    out.write<int>(h->last().word_id());
+    out.write<int>(history_index(h->previous, lm_indices));
+    out.write(h->printed);
+    out.write(h->word_start_frame);
+    out.write(h->word_first_silence_frame);
+  }
+
+  out.write<int>(word_histories.size());
+  for (int i = 0; i < word_histories.size(); i++) {
+    const TPLexPrefixTree::WordHistory *h = word_histories[i];
+    out.write(h->word_id);
+    out.write(h->end_frame);
+    out.write(h->lex_node_id);
+    out.write(h->graph_node_id);
+    out.write(h->lm_log_prob);
+    out.write(h->am_log_prob);
+    out.write(h->cum_lm_log_prob);
+    out.write(h->cum_am_log_prob);
+    out.write(h->printed);
+    out.write<int>(history_index(h->previous, word_indices));
+  }
+
+  out.write<int>(state_histories.size());
+  for (int i = 0; i < state_histories.size(); i++) {
+    const TPLexPrefixTree::StateHistory *h = state_histories[i];
+    out.write(h->hmm_model);
+    out.write(h->start_time);
+    out.write(h->log_prob);
+    out.write<int>(history_index(h->previous, state_indices));
+  }
+
+  if (m_generate_word_graph) {
+    out.write_vector(word_graph.arcs);
+    out.write_vector(word_graph.nodes);
+    out.write_vector(word_graph.free_arc_indices());
+    out.write_vector(word_graph.free_node_indices());
+
+    int num_infos = 0;
+    for (int i = 0; i < m_recent_word_graph_info.size(); i++)
+      if (m_recent_word_graph_info[i].frame != -1)
+        num_infos++;
+    out.write(num_infos);
+    for (int i = 0; i < m_recent_word_graph_info.size(); i++) {
+      const WordGraphInfo &info = m_recent_word_graph_info[i];
+      if (info.frame == -1)
+        continue;
+      out.write(i);
+      out.write(info.frame);
+      out.write_vector(info.items);
+    }
+
+    // The part of the graph that has been flushed to the temporary files.
+    out.write(m_word_graph_cut_node);
+    if (m_word_graph_cut_node >= 0) {
+      out.write(m_word_graph_output_nodes);
+      out.write(m_word_graph_output_arcs);
+      out.write_vector(m_word_graph_output_ids);
+      out.write_vector(read_file_contents(m_word_graph_node_file));
+      out.write_vector(read_file_contents(m_word_graph_arc_file));
+    }
+  }
+
+  out.write<int>(tokens.size());
+  for (int i = 0; i < tokens.size(); i++) {
+    const TPLexPrefixTree::Token *t = tokens[i];
+    out.write(t->node->node_id);
+    out.write(t->am_log_prob);
+    out.write(t->lm_log_prob);
+    out.write(t->cur_am_log_prob);
+    out.write(t->cur_lm_log_prob);
+    out.write(t->total_log_prob);
+    out.write<int>(history_index(t->lm_history, lm_indices));
+    out.write(t->lm_hist_code);
+    out.write(t->fsa_lm_node);
+    out.write(t->recent_word_graph_node);
+    out.write<int>(history_index(t->word_history, word_indices));
+    out.write(t->word_start_frame);
+#ifdef PRUNING_MEASUREMENT
+    out.write(t->meas);
+#endif
+    out.write(t->word_count);
+    out.write<int>(history_index(t->state_history, state_indices));
+    out.write(t->depth);
+    out.write(t->dur);
+  }
+  out.write(best_final_token);
+  out.write<int>(history_index(m_last_stable_history, lm_indices));
+
+  out.write<int>(m_lm_states.size());
+  for (int i = 0; i < m_lm_states.size(); i++) {
+    out.write<int>(m_lm_states.key_length(i));
+    for (int j = 0; j < m_lm_states.key_length(i); j++)
+      out.write(m_lm_states.key(i)[j]);
+  }
+
+  return state;
+}
+
+void TokenPassSearch::load_state(const std::string &state)
+{
+  StateReader in(state);
+
+  char magic[sizeof(SEARCH_STATE_MAGIC)];
+  in.read_bytes(magic, sizeof(magic));
+  if (memcmp(magic, SEARCH_STATE_MAGIC, sizeof(magic)) != 0)
+    throw InvalidState("The data is not a search state.");
+  if (in.read<int>() != m_lexicon.num_nodes()
+      || in.read<int>() != m_word_repository.size()
+      || in.read<int>() != (m_fsa_lm != NULL)
+      || in.read<int>() != m_generate_word_graph
+      || in.read<int>() != m_keep_state_segmentation
+      || in.read<int>() != m_recombination_mode
+      || in.read<int>() != m_similar_lm_hist_span)
+    throw InvalidState("The search state was saved with a different setup.");
+
+  // Initialize the search like for a new utterance, and remove the initial
+  // token.
+  int frame = in.read<int>();
+  reset_search(frame);
+  for (int i = 0; i < m_active_token_list->size(); i++)
+    release_token((*m_active_token_list)[i]);
+  m_active_token_list->clear();
+  m_lmh_arena.reset();
+  m_word_history_arena.reset();
+  m_state_history_arena.reset();
+
+  m_end_frame = in.read<int>();
+  m_segment_start_frame = in.read<int>();
+  m_end_of_utterance = in.read<bool>();
+  m_current_glob_beam = in.read<float>();
+  m_current_we_beam = in.read<float>();
+  m_best_log_prob = in.read<float>();
+  m_worst_log_prob = in.read<float>();
+  m_best_we_log_prob = in.read<float>();
+  m_fan_in_log_prob = in.read<float>();
+  m_fan_out_log_prob = in.read<float>();
+  m_fan_out_last_log_prob = in.read<float>();
+  in.read_bytes(m_wc_llh, sizeof(m_wc_llh));
+  in.read_bytes(m_depth_llh, sizeof(m_depth_llh));
+  m_min_word_count = in.read<int>();
+  m_endpoint_silence_count = in.read<int>();
+  m_endpoint_detected = in.read<bool>();
+  m_restart_pending = in.read<bool>();
+  m_budget_pruning_frame = in.read<int>();
+  m_budget_dropped_tokens = in.read<int>();
+  m_token_expansion = in.read<float>();
+  m_budget_survivors = in.read<int>();
+  m_budget_dropped_at_prune = in.read<int>();
+
+  // The reference counts are rebuilt by linking the structures again.
+  std::vector<LMHistory*> lm_histories(in.read_size(sizeof(int)));
+  for (int i = 0; i < lm_histories.size(); i++) {
+    int word_id = in.read<int>();
+    if (word_id < -1 || word_id >= (int)m_word_repository.size())
+      throw InvalidState("The search state contains an invalid word ID.");
+    const LMHistory::Word *word =
+      word_id == -1 ? &m_null_word : &m_word_repository[word_id];
+    int previous = in.read_index(i);
+    LMHistory *h = acquire_lmhist(
+      word, previous == -1 ? NULL : lm_histories[previous]);
+    h->printed = in.read<bool>();
+    h->word_start_frame = in.read<int>();
+    h->word_first_silence_frame = in.read<int>();
+    lm_histories[i] = h;
+  }
+
+  std::vector<TPLexPrefixTree::WordHistory*> word_histories(
+    in.read_size(sizeof(int)));
+  for (int i = 0; i < word_histories.size(); i++) {
+    TPLexPrefixTree::WordHistory *h =
+      new (m_word_history_arena.allocate())
+        TPLexPrefixTree::WordHistory(-1, -1, NULL);
+    h->word_id = in.read<int>();
+    h->end_frame = in.read<int>();
+    h->lex_node_id = in.read<int>();
+    h->graph_node_id = in.read<int>();
+    h->lm_log_prob = in.read<float>();
+    h->am_log_prob = in.read<float>();
+    h->cum_lm_log_prob = in.read<float>();
+    h->cum_am_log_prob = in.read<float>();
+    h->printed = in.read<bool>();
+    int previous = in.read_index(i);
+    if (previous != -1) {
+      h->previous = word_histories[previous];
+      hist::link(h->previous);
+    }
+    word_histories[i] = h;
+  }
+
+  std::vector<TPLexPrefixTree::StateHistory*> state_histories(
+    in.read_size(sizeof(int)));
+  for (int i = 0; i < state_histories.size(); i++) {
+    TPLexPrefixTree::StateHistory *h =
+      new (m_state_history_arena.allocate())
+        TPLexPrefixTree::StateHistory(0, 0, NULL);
+    h->hmm_model = in.read<int>();
+    h->start_time = in.read<int>();
+    h->log_prob = in.read<float>();
+    int previous = in.read_index(i);
+    if (previous != -1) {
+      h->previous = state_histories[previous];
+      hist::link(h->previous);
+    }
+    state_histories[i] = h;
+  }
+
+  if (m_generate_word_graph) {
+    // The reference counts of the graph nodes include the tokens, so the
+    // tokens are not linked to the graph again.
+    std::vector<int> free_arc_indices;
+    std::vector<int> free_node_indices;
+    in.read_vector(word_graph.arcs);
+    in.read_vector(word_graph.nodes, WordGraph::Node(-1, -1, -1));
+    in.read_vector(free_arc_indices);
+    in.read_vector(free_node_indices);
+    word_graph.set_free_indices(free_arc_indices, free_node_indices);
+
+    m_recent_word_graph_info.clear();
+    m_recent_word_graph_info.resize(m_word_repository.size());
+    int num_infos = in.read_size(2 * sizeof(int));
+    for (int i = 0; i < num_infos; i++) {
+      int word_id = in.read_index(m_word_repository.size());
+      if (word_id == -1)
+        throw InvalidState("The search state contains an invalid word ID.");
+      WordGraphInfo &info = m_recent_word_graph_info[word_id];
+      info.frame = in.read<int>();
+      in.read_vector(info.items);
+    }
+
+    int cut_node = in.read_index(word_graph.nodes.size());
+    if (cut_node >= 0) {
+      std::vector<char> node_records;
+      std::vector<char> arc_records;
+      m_word_graph_output_nodes = in.read<int>();
+      m_word_graph_output_arcs = in.read<int>();
+      in.read_vector(m_word_graph_output_ids);
+      in.read_vector(node_records);
+      in.read_vector(arc_records);
+      m_word_graph_node_file = tmpfile();
+      m_word_graph_arc_file = tmpfile();
+      if (m_word_graph_node_file == NULL || m_word_graph_arc_file == NULL)
+        throw IOError("Could not create temporary files for the word graph.");
+      if (!node_records.empty())
+        fwrite(node_records.data(), 1, node_records.size(),
+               m_word_graph_node_file);
+      if (!arc_records.empty())
+        fwrite(arc_records.data(), 1, arc_records.size(),
+               m_word_graph_arc_file);
+      m_word_graph_cut_node = cut_node;
+    }
+  }
+
+  int num_tokens = in.read_size(sizeof(int));
+  for (int i = 0; i < num_tokens; i++) {
+    TPLexPrefixTree::Token *t = acquire_token();
+    int node_id = in.read_index(m_lexicon.num_nodes());
+    if (node_id == -1)
+      throw InvalidState("The search state contains an invalid node ID.");
+    t->node = m_lexicon.node(node_id);
+    t->next_node_token = NULL;
+    t->am_log_prob = in.read<float>();
+    t->lm_log_prob = in.read<float>();
+    t->cur_am_log_prob = in.read<float>();
+    t->cur_lm_log_prob = in.read<float>();
+    t->total_log_prob = in.read<float>();
+    int lm_history = in.read_index(lm_histories.size());
+    if (lm_history == -1)
+      throw InvalidState("A token in the search state has no LM history.");
+    t->lm_history = lm_histories[lm_history];
+    hist::link(t->lm_history);
+    t->lm_hist_code = in.read<int>();
+    t->fsa_lm_node = in.read<int>();
+    t->recent_word_graph_node = in.read_index(word_graph.nodes.size());
+    int word_history = in.read_index(word_histories.size());
+    t->word_history =
+      word_history == -1 ? NULL : word_histories[word_history];
+    if (t->word_history != NULL)
+      hist::link(t->word_history);
+    t->word_start_frame = in.read<int>();
+#ifdef PRUNING_MEASUREMENT
+    in.read_bytes(t->meas, sizeof(t->meas));
+#endif
+    t->word_count = in.read<int>();
+    int state_history = in.read_index(state_histories.size());
+    t->state_history =
+      state_history == -1 ? NULL : state_histories[state_history];
+    if (t->state_history != NULL)
+      hist::link(t->state_history);
+    t->depth = in.read<unsigned char>();
+    t->dur = in.read<unsigned char>();
+    m_active_token_list->push_back(t);
+  }
+  int best_final_token = in.read_index(num_tokens);
+  m_best_final_token = best_final_token == -1
+    ? NULL : (*m_active_token_list)[best_final_token];
+  int last_stable_history = in.read_index(lm_histories.size());
+  m_last_stable_history = last_stable_history == -1
+    ? NULL : lm_histories[last_stable_history];
+
+  // Adding the states in the same order gives them the same IDs.
+  int num_lm_states = in.read_size(sizeof(int));
+  std::vector<int> key;
+  for (int i = 0; i < num_lm_states; i++) {
+    key.resize(in.read_size(sizeof(int)));
+    for (int j = 0; j < key.size(); j++)
+      key[j] = in.read<int>();
+    m_lm_states.find_or_insert(key.data(), key.size());
+  }
+
+  if (!in.at_end())
+    throw InvalidState("The search state has extra data at the end.");
+}
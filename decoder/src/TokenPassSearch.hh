@@ -12,6 +12,20 @@
 #include "NGram.hh"
 #include "Acoustics.hh"
 #include "LMHistory.hh"
+#include "ThreadPool.hh"
+#include "PruningKernel.hh"
+#include "HistoryArena.hh"
+#include "TokenPool.hh"
+#include "TokenList.hh"
+#include "SimpleHashCache.hh"
+#include "LMLookaheadCache.hh"
+#include "LMLookaheadTable.hh"
+#include "SparseLMLookahead.hh"
+#include "SearchProfile.hh"
+#include "BeamController.hh"
+#include "LMScoreCache.hh"
+#include "RecombinationTable.hh"
+#include "BinaryLattice.hh"
 
 // Visual studio math.h doesn't have log1p function varjokal 17.3.2010
 #ifdef _MSC_VER
@@ -60,6 +74,14 @@ public:
     }
   };
 
+  struct InvalidState: public std::runtime_error
+  {
+    InvalidState(const std::string & message) :
+      std::runtime_error(message)
+    {
+    }
+  };
+
   TokenPassSearch(TPLexPrefixTree &lex, Vocabulary &vocab,
                   Acoustics *acoustics);
   ~TokenPassSearch();
@@ -79,6 +101,94 @@ public:
   ///
   bool run(void);
 
+  /// \brief Serializes the state of the search between two frames.
+  ///
+  /// The state includes the active tokens and their history structures, the
+  /// word graph, the frame counter and the current beams. The caches are not
+  /// included, since they don't affect the results.
+  ///
+  /// \return A binary blob that can be given to load_state().
+  ///
+  std::string save_state() const;
+
+  /// \brief Continues a search from a state saved by save_state().
+  ///
+  /// The search has to be set up with the same lexicon, vocabulary, language
+  /// model and options as the one that saved the state. Decoding continues
+  /// from the saved frame, so the acoustics have to be able to go to that
+  /// frame.
+  ///
+  /// \exception InvalidState If the blob is corrupted or was saved by a
+  /// search with a different setup.
+  ///
+  void load_state(const std::string &state);
+
+  /// \brief A word of a partial recognition result.
+  struct ResultWord
+  {
+    int word_id;
+    int start_frame;
+  };
+
+  /// \brief Receives recognition results while decoding.
+  ///
+  /// \see set_result_listener()
+  ///
+  class ResultListener
+  {
+  public:
+    virtual ~ResultListener() { }
+
+    /// \brief Called for every word that has become common to all active
+    /// tokens, in order. These words will not change anymore.
+    ///
+    virtual void stable_word(const ResultWord &word) = 0;
+
+    /// \brief Called after every frame with the words of the best token that
+    /// follow the stable words. These words may still change.
+    ///
+    virtual void partial_hypothesis(const std::vector<ResultWord> &words) { }
+
+    /// \brief Called when an endpoint has been detected, after the last
+    /// stable words of the segment.
+    ///
+    /// \see set_endpoint_detection()
+    ///
+    virtual void endpoint(int frame) { }
+  };
+
+  /// \brief Enables detecting the end of an utterance from the state of the
+  /// search.
+  ///
+  /// An endpoint is detected when, after at least one word, the best token
+  /// in a final (silence) node has stayed within \a margin of the best
+  /// token for \a silence_frames frames.
+  ///
+  /// If \a reset is true, the segment is then finished like at the end of
+  /// the input, so the results can be read after run() returns, and the next
+  /// call to run() starts a new segment in place. Unlike reset_search(), that
+  /// keeps the LM caches and the acoustics. Otherwise the endpoint is only
+  /// reported and the search continues unchanged.
+  ///
+  /// \param silence_frames The number of frames, or 0 to disable.
+  ///
+  void set_endpoint_detection(int silence_frames, float margin, bool reset)
+  {
+    m_endpoint_silence_frames = silence_frames;
+    m_endpoint_margin = margin;
+    m_reset_on_endpoint = reset;
+  }
+
+  /// \brief Returns true if an endpoint was detected in the frame decoded by
+  /// the last call to run().
+  ///
+  bool endpoint_detected() const { return m_endpoint_detected; }
+
+  /// \brief Returns true if the next call to run() starts a new segment
+  /// after an endpoint.
+  ///
+  bool new_segment_pending() const { return m_restart_pending; }
+
   /// \brief Prints the best path from the word_history structure, including
   /// the probabilities.
   ///
@@ -102,6 +212,33 @@ public:
   ///
   void print_lm_history(FILE *file = stdout, bool get_best_path = true);
 
+  /// \brief Finds the words that have become common to all active tokens
+  /// since the previous call, or since the search was reset.
+  ///
+  /// At the end of the utterance (after run() has returned false), returns
+  /// the rest of the best path.
+  ///
+  /// \return A reference to a vector that is reused by the next call.
+  ///
+  const std::vector<ResultWord> &get_stable_words();
+
+  /// \brief Finds the words of the best active token that follow the words
+  /// returned by get_stable_words().
+  ///
+  /// \return A reference to a vector that is reused by the next call.
+  ///
+  const std::vector<ResultWord> &get_partial_hypothesis();
+
+  /// \brief Sets an object that receives the stable words and the partial
+  /// hypothesis after every frame, or NULL to stop sending them.
+  ///
+  /// The listener consumes the same stable words as get_stable_words().
+  ///
+  void set_result_listener(ResultListener *listener)
+  {
+    m_result_listener = listener;
+  }
+
   /// \brief Writes the best state history into a file.
   ///
   /// Finds the active token that is in the NODE_FINAL state i.e. at the end
@@ -112,6 +249,41 @@ public:
   ///
   void print_state_history(FILE *file = stdout);
 
+  /// \brief Writes the numbers of live, peak and allocated history
+  /// structures of each type.
+  ///
+  /// The peak is the maximum number of live structures since the search was
+  /// reset. With verbose output, the statistics of an utterance are written
+  /// to stderr in reset_search().
+  ///
+  void print_history_statistics(FILE *file = stdout) const;
+
+  /// \brief Makes the search use a lookahead score cache that is shared with
+  /// other searches.
+  ///
+  /// The searches that share the cache may run in different threads, but
+  /// they have to use the same vocabulary and lookahead language model. A
+  /// shared cache is not cleared by reset_search(), and it has to outlive
+  /// the search.
+  ///
+  /// \param cache The shared cache, or NULL to use a cache of this search
+  /// only.
+  ///
+  void set_lm_lookahead_cache(LMLookaheadCache *cache)
+  {
+    m_lm_lookahead_cache = cache ? cache : &m_own_lm_lookahead_cache;
+  }
+
+  LMLookaheadCache *lm_lookahead_cache() { return m_lm_lookahead_cache; }
+
+  /// \brief Writes the LM lookahead cache hits and misses.
+  ///
+  /// The node buffers are counted per search since reset_search() and by
+  /// the depth of the node. The score list cache is counted since it was
+  /// created, including the lookups of the other searches that share it.
+  ///
+  void print_lm_lookahead_statistics(FILE *file = stdout) const;
+
   /// \brief Writes the best state history into a text string.
   ///
   /// Finds the active token that is in the NODE_FINAL state i.e. at the end
@@ -156,11 +328,116 @@ public:
   void set_state_beam(float beam) { m_state_beam = beam; }
   
   void set_similar_lm_history_span(int n) { m_similar_lm_hist_span = n; }
+
+  /// \brief How the tokens that enter the same node are recombined.
+  ///
+  /// HISTORY_RECOMBINATION compares the LM histories of the tokens in the
+  /// node one by one. LM_STATE_RECOMBINATION gives each distinct history of
+  /// m_similar_lm_hist_span words (or each FSA LM node) a state id, and finds
+  /// the token with the same state from a hash table, so the time does not
+  /// grow with the number of tokens in the node. Both recombine the same
+  /// tokens.
+  ///
+  enum RecombinationMode { HISTORY_RECOMBINATION, LM_STATE_RECOMBINATION };
+
+  /// \brief Selects the recombination mode. Should be called before
+  /// reset_search().
+  ///
+  void set_recombination_mode(RecombinationMode mode)
+  {
+    m_recombination_mode = mode;
+  }
+
+  RecombinationMode recombination_mode() const { return m_recombination_mode; }
   void set_lm_scale(float lm_scale) { m_lm_scale = lm_scale; }
   void set_duration_scale(float dur_scale) { m_duration_scale = dur_scale; }
   void set_transition_scale(float trans_scale) { m_transition_scale = trans_scale; }
   void set_max_num_tokens(int tokens) { m_max_num_tokens = tokens; }
 
+  /// \brief Limits the memory allocated for the tokens to \a bytes. Zero
+  /// means no limit, which is the default.
+  ///
+  /// The number of tokens that survive pruning is limited like with
+  /// set_max_num_tokens(), so that the propagation of the next frame has
+  /// room for the new tokens, as estimated from the recent frames. The
+  /// survivors get at most half of the budget. If the propagation still runs
+  /// out of memory, the new tokens that would need more memory are discarded, and
+  /// the beams are tightened for the rest of the frame. The beams then
+  /// recover as after histogram pruning.
+  ///
+  void set_token_memory_budget(size_t bytes) { m_token_pool.set_budget(bytes); }
+
+  /// \brief Sets how much of the token memory is kept when the search is
+  /// reset. The rest is returned to the system when the search is reset or
+  /// a new segment is started, so that one long utterance does not keep the
+  /// memory allocated. The default is 64 MB.
+  ///
+  void set_token_memory_retained(size_t bytes)
+  {
+    m_token_memory_retained = bytes;
+  }
+
+  /// \brief Returns the number of bytes currently allocated for the tokens.
+  ///
+  size_t token_memory_usage() const { return m_token_pool.allocated_bytes(); }
+
+  /// \brief Returns the maximum number of bytes allocated for the tokens
+  /// since the search was reset.
+  ///
+  size_t token_memory_peak() const { return m_token_pool.peak_bytes(); }
+
+  /// \brief Returns the number of tokens that have been discarded, because
+  /// the token memory budget was exhausted, since the search was reset.
+  ///
+  int num_budget_dropped_tokens() const { return m_budget_dropped_tokens; }
+
+  /// \brief Sets the number of threads used for propagating tokens.
+  ///
+  /// With more than one thread, the scores of the moves inside words are
+  /// computed in parallel for separate parts of the active token list. The
+  /// new tokens are still added to the nodes in the original order, so the
+  /// results are identical to decoding with one thread.
+  ///
+  void set_num_threads(int num_threads);
+  int get_num_threads() const { return m_num_threads; }
+
+  /// \brief Selects whether to use AVX2 instructions for pruning, if the
+  /// processor supports them. They are used by default.
+  ///
+  /// \return false if AVX2 was requested but is not supported.
+  ///
+  bool set_simd_pruning(bool value)
+  {
+    return m_pruning_kernel.set_type(
+      value ? PruningKernel::AVX2 : PruningKernel::SCALAR);
+  }
+
+  /// \brief Returns the time in seconds that pruning took in the last frame.
+  ///
+  double get_prune_time() const { return m_prune_time; }
+
+  /// \brief Enables or disables collecting per-frame counters and timings
+  /// into profile(). Disabled by default.
+  ///
+  void set_profiling(bool value) { m_profiling = value; }
+
+  bool get_profiling() const { return m_profiling; }
+
+  /// \brief The counters and timings of the frames decoded while profiling
+  /// was enabled.
+  ///
+  SearchProfile &profile() { return m_profile; }
+
+  /// \brief The controller that adapts the beams to a target number of
+  /// tokens or time per frame. Disabled by default.
+  ///
+  /// When enabled, the controller replaces the gradual widening of the beam
+  /// after histogram pruning. The word end beam is scaled in proportion to
+  /// the global beam. The trajectory is cleared in reset_search() and keeps
+  /// at most BeamController::max_steps() of the last frames.
+  ///
+  BeamController &beam_controller() { return m_beam_controller; }
+
 #ifdef ENABLE_MULTIWORD_SUPPORT
   void set_split_multiwords(bool value)
   {
@@ -202,6 +479,23 @@ public:
   ///
   void set_lm_lookahead(int order) { m_lm_lookahead = order; }
 
+  enum LMLookaheadMode { DENSE_LM_LOOKAHEAD, SPARSE_LM_LOOKAHEAD };
+
+  /// \brief Selects how the lookahead scores are computed when they are not
+  /// in the node buffers.
+  ///
+  /// DENSE_LM_LOOKAHEAD computes the score of every word after the context
+  /// and takes the maximum over the possible words of the node.
+  /// SPARSE_LM_LOOKAHEAD computes the same scores from the backoff structure
+  /// of the lookahead LM (see SparseLMLookahead), which requires a backoff
+  /// TreeGram. The score lists are then not stored in the LM lookahead cache.
+  ///
+  void set_lm_lookahead_mode(LMLookaheadMode mode)
+  {
+    m_lm_lookahead_mode = mode;
+    m_lm_lookahead_initialized = false;
+  }
+
   void set_insertion_penalty(float ip) { m_insertion_penalty = ip; }
 
   void set_require_sentence_end(bool s) { m_require_sentence_end = s; }
@@ -256,6 +550,30 @@ public:
   ///
   int set_lookahead_ngram(NGram *ngram);
 
+  /// \brief Precomputes the bigram lookahead score of every lookahead node
+  /// after every word, and writes them into a table file.
+  ///
+  /// The lexicon, the vocabulary and the lookahead LM have to be set up the
+  /// same way as when decoding with the table.
+  ///
+  /// \param bytes_per_score 1 or 2 bytes for each quantized score.
+  ///
+  /// \exception LMLookaheadTable::IOError If unable to write the file.
+  ///
+  void write_lm_lookahead_table(const std::string &path,
+                                int bytes_per_score = 1);
+
+  /// \brief Reads a table of precomputed bigram lookahead scores, which is
+  /// then used instead of computing the scores from the lookahead LM.
+  ///
+  /// The table is used only with bigram lookahead. It has to be read after
+  /// the lexicon, the vocabulary and the lookahead LM have been set up.
+  ///
+  /// \exception InvalidSetup If the table was created for a different
+  /// lexicon or vocabulary.
+  ///
+  void read_lm_lookahead_table(const std::string &path);
+
   /// \brief If set to true, generates a word graph of the hypotheses during
   /// decoding (requires memory).
   ///
@@ -271,6 +589,25 @@ public:
     return m_generate_word_graph;
   }
 
+  /// \brief Keeps the memory used by the word graph bounded in long
+  /// utterances.
+  ///
+  /// Every \a interval frames, finds the newest word graph node that all
+  /// the paths of the active tokens pass through. The part of the graph
+  /// before that node cannot change anymore, so it is written to temporary
+  /// files and freed. write_word_graph() combines the written parts with the
+  /// rest of the graph. The nodes are numbered in the order they are
+  /// written, so the lattice is the same as without flushing, but the node
+  /// numbers differ.
+  ///
+  /// \param interval The number of frames, or 0 to keep the whole graph in
+  /// memory.
+  ///
+  void set_word_graph_flush_interval(int interval)
+  {
+    m_word_graph_flush_interval = interval;
+  }
+
   /// \brief Enables or disables word pair approximation when building a word
   /// graph.
   ///
@@ -281,9 +618,35 @@ public:
     m_use_word_pair_approximation = value;
   }
 
-  void set_use_lm_cache(bool value)
+  enum LMCacheType { HASH_CACHE, OPEN_ADDRESSING_CACHE };
+
+  /// \brief Enables or disables caching the n-gram scores.
+  ///
+  /// \param type HASH_CACHE stores the histories in a HashCache, allocating
+  /// memory for every new entry. OPEN_ADDRESSING_CACHE uses a fixed-size
+  /// LMScoreCache, which never allocates memory while decoding.
+  ///
+  void set_use_lm_cache(bool value, LMCacheType type = HASH_CACHE)
   {
     m_use_lm_cache = value;
+    m_lm_cache_type = type;
+  }
+
+  /// \brief Enables or disables computing the n-gram scores of the word
+  /// ends of each frame in one batch before propagating the tokens.
+  ///
+  /// The queries are deduplicated and sorted by context, so that the
+  /// context is looked up from the language model only once. The scores are
+  /// stored in the open addressing LM cache, which is selected when batch
+  /// scoring is enabled.
+  ///
+  void set_batch_lm_scoring(bool value)
+  {
+    m_batch_lm_scoring = value;
+    if (value) {
+      m_use_lm_cache = true;
+      m_lm_cache_type = OPEN_ADDRESSING_CACHE;
+    }
   }
 
   int frame(void)
@@ -300,6 +663,104 @@ public:
   void write_word_graph(const std::string &file_name);
   void write_word_graph(FILE *file);
 
+  /// \brief Writes the same lattice as write_word_graph() in the binary
+  /// format of BinaryLattice, which is much faster to write and read. The
+  /// nodes are numbered from zero without gaps.
+  ///
+  /// \exception WordGraphNotGenerated If word graph has not been generated.
+  /// \exception IOError If unable to write the file.
+  ///
+  void write_word_graph_binary(const std::string &file_name);
+  void write_word_graph_binary(FILE *file);
+
+  /// \brief A word of an N-best hypothesis.
+  struct NBestWord
+  {
+    int word_id;
+    int start_frame;
+    int end_frame; //!< The frame where the next word starts.
+    float am_log_prob;
+    float lm_log_prob;
+  };
+
+  /// \brief A hypothesis of an N-best list.
+  struct NBestHypothesis
+  {
+    std::vector<NBestWord> words;
+    float am_log_prob;
+    float lm_log_prob;
+    float total_log_prob; //!< am_log_prob + LM scale * lm_log_prob
+  };
+
+  /// \brief Finds the \a n best paths of the word graph that end in the
+  /// best final token.
+  ///
+  /// The paths are searched in memory, so this is much faster than writing
+  /// the lattice with write_word_graph() and processing it with an external
+  /// tool. Paths that differ only in the word boundaries are separate
+  /// hypotheses. The LM log probabilities include the insertion penalty,
+  /// like get_lm_log_prob().
+  ///
+  /// If the word graph has been flushed, the hypotheses begin from the
+  /// newest flushed node.
+  ///
+  /// \exception WordGraphNotGenerated If word graph has not been generated.
+  ///
+  void get_nbest(int n, std::vector<NBestHypothesis> &hypotheses);
+
+  /// \brief Sets the scale of the path weights when computing posteriors.
+  ///
+  /// \param scale The scale, or 0 to use the inverse of the LM scale, which
+  /// is the default.
+  ///
+  void set_posterior_scale(float scale) { m_posterior_scale = scale; }
+
+  /// \brief The posterior probability of a word in the word graph.
+  struct WordPosterior
+  {
+    int word_id;
+    int start_frame;
+    int end_frame; //!< The frame where the next word starts.
+    float posterior;
+  };
+
+  /// \brief The posterior probability of a word in one frame.
+  struct FramePosterior
+  {
+    int word_id;
+    float posterior;
+  };
+
+  /// \brief Computes the posteriors of the words of the word graph on the
+  /// paths that end in the best final token.
+  ///
+  /// The arc posteriors are computed with the forward-backward algorithm.
+  /// Arcs that have the same word and times are merged. If the word graph
+  /// has been flushed, the paths begin from the newest flushed node.
+  ///
+  /// \exception WordGraphNotGenerated If word graph has not been generated.
+  ///
+  void get_word_posteriors(std::vector<WordPosterior> &words);
+
+  /// \brief Computes the posterior of each word in each frame, i.e. the sum
+  /// of the posteriors of the word graph arcs of the word that span the
+  /// frame.
+  ///
+  /// \param frames The posteriors of the words in each frame, indexed by the
+  /// frame number, the most probable word first.
+  ///
+  /// \exception WordGraphNotGenerated If word graph has not been generated.
+  ///
+  void get_frame_posteriors(std::vector<std::vector<FramePosterior> > &frames);
+
+  /// \brief Computes a confidence for each word of the best path of the word
+  /// graph, which is the highest posterior of the word in a frame that the
+  /// word spans.
+  ///
+  /// \exception WordGraphNotGenerated If word graph has not been generated.
+  ///
+  void get_word_confidences(std::vector<WordPosterior> &words);
+
   void debug_ensure_all_paths_contain_history(LMHistory *limit);
 
   /// \brief Returns the logarithmic AM probability of an active token.
@@ -340,8 +801,32 @@ public:
   const WordClasses * get_word_classes() const;
   const Vocabulary & get_vocabulary() const;
   const NGram * get_ngram() const;
+  NGram * get_lookahead_ngram() const;
+
+  /// \brief Computes the lookahead LM bigram score of \a node after
+  /// \a prev_word_id from a score tree, without using the caches. For unit
+  /// testing.
+  ///
+  float compute_lm_bigram_lookahead(int prev_word_id,
+                                    const TPLexPrefixTree::Node *node);
 
 private:
+  enum { MOVE_READY, MOVE_DISCARDED, MOVE_COMPLEX };
+
+  /// The scores of a token moved along one arc, as computed by
+  /// compute_simple_move().
+  struct TokenMove
+  {
+    float am_log_prob;
+    float cur_am_log_prob;
+    float cur_lm_log_prob;
+    float total_log_prob;
+    int word_start_frame;
+    unsigned char depth;
+    unsigned char dur;
+    unsigned char status;
+  };
+
   /// \brief Creates a lookup table for LMHistory::Word structures.
   ///
   /// \return The number of vocabulary entries that were not found in the
@@ -430,9 +915,61 @@ private:
 			    TPLexPrefixTree::WordHistory *word_history);
   void build_word_graph(TPLexPrefixTree::Token *new_token);
 
+  /// \brief Appends the part of the word graph that all the active tokens
+  /// share to the temporary files, and frees it.
+  ///
+  void flush_word_graph();
+
+  /// \brief Appends the nodes in \a nodes and the arcs coming to them to
+  /// lattice tables, numbering the nodes from
+  /// \ref m_word_graph_output_nodes.
+  ///
+  /// The source nodes of the arcs have to be either in \a nodes or in
+  /// \ref m_word_graph_output_ids already. The word of an arc is its word
+  /// ID, not an offset in a string table.
+  ///
+  void get_word_graph_part(const std::vector<int> &nodes,
+                           std::vector<BinaryLattice::Node> &part_nodes,
+                           std::vector<BinaryLattice::Arc> &part_arcs);
+
+  /// \brief Returns the word of \a word_id as written in lattices.
+  ///
+  std::string lattice_word(int word_id) const;
+
+  /// \brief Creates a lattice from the flushed parts and the rest of the
+  /// word graph.
+  ///
+  void get_flushed_word_graph(BinaryLattice &lattice);
+
+  /// \brief Writes the lattice of get_flushed_word_graph() in SLF.
+  ///
+  void write_flushed_word_graph(FILE *file);
+
+  /// \brief Closes the temporary files of the flushed word graph.
+  ///
+  void clear_flushed_word_graph();
+
+  /// \brief Sends the new stable words and the partial hypothesis to
+  /// \ref m_result_listener.
+  ///
+  void report_results();
+
+  /// \brief Propagates the active tokens using \ref m_thread_pool.
+  ///
+  /// The worker threads compute the moves that don't modify the search state
+  /// using compute_simple_move(), each for a separate range of the active
+  /// token list. Then the tokens are propagated in the original order, using
+  /// the precomputed moves where available.
+  ///
+  void propagate_tokens_parallel(void);
+
   /// \brief Moves the token towards all the arcs leaving the token's node.
   ///
-  void propagate_token(TPLexPrefixTree::Token *token);
+  /// \param moves If not NULL, the moves precomputed with
+  /// compute_simple_move() for each arc leaving the token's node.
+  ///
+  void propagate_token(TPLexPrefixTree::Token *token,
+                       const TokenMove *moves = NULL);
 
   /// \brief Appends a word to the LMHistory of a token.
   ///
@@ -450,11 +987,73 @@ private:
                           TPLexPrefixTree::Node *node,
                           float transition_score);
 
+  /// \brief Computes the scores of \a token moved to \a node, if the move
+  /// does not create or modify any history structures.
+  ///
+  /// This is the case with self transitions and transitions inside words,
+  /// except to nodes that need LM lookahead. Does not modify the search state,
+  /// so it can be called from several threads at the same time.
+  ///
+  /// \param move Will be set to the scores of the new token. move.status is
+  /// MOVE_COMPLEX if the move has to be done using move_token_to_node().
+  ///
+  void compute_simple_move(const TPLexPrefixTree::Token *token,
+                           const TPLexPrefixTree::Node *node,
+                           float transition_score,
+                           TokenMove &move) const;
+
+  /// \brief Moves token to \a node using the scores computed by
+  /// compute_simple_move().
+  ///
+  void apply_simple_move(TPLexPrefixTree::Token *token,
+                         TPLexPrefixTree::Node *node,
+                         const TokenMove &move);
+
+  /// \brief Adds a token with the scores of \a updated_token to its node,
+  /// unless it's pruned.
+  ///
+  /// Applies beam pruning and recombines the token with a token in the node
+  /// that has a similar LM history. Adds new tokens to \ref m_new_token_list
+  /// or \ref m_word_end_token_list.
+  ///
+  /// \param token The token that was moved to the node.
+  ///
+  void add_token_to_node(TPLexPrefixTree::Token *token,
+                         TPLexPrefixTree::Token &updated_token);
+
   /// \brief Copes new tokens from \ref m_new_token_list to
   /// \ref m_active_token_list.
   ///
   void prune_tokens(void);
 
+  /// \brief Rebuilds \ref m_lm_states from the states of the active
+  /// tokens, renumbering the states of the tokens.
+  ///
+  void compact_lm_states();
+
+  /// \brief Keeps the \a num_tokens best tokens of \ref m_active_token_list
+  /// and releases the rest.
+  ///
+  void keep_best_tokens(int num_tokens);
+
+  /// \brief Lets the beam controller set the beams for the next frame.
+  ///
+  /// \param start_time When the decoding of the frame started.
+  ///
+  void update_beams(std::chrono::steady_clock::time_point start_time);
+
+  /// \brief Clears the tokens and the histories and creates the initial
+  /// token, keeping the caches. Used by reset_search() and when a new
+  /// segment is started after an endpoint.
+  ///
+  void start_segment(int start_frame);
+
+  /// \brief Updates the endpoint condition after pruning.
+  ///
+  /// \return true if an endpoint was detected in this frame.
+  ///
+  bool detect_endpoint();
+
 #ifdef PRUNING_MEASUREMENT
   void analyze_tokens(void);
 #endif
@@ -486,7 +1085,23 @@ private:
   /// in the LMHistory. The code will be used for recombination of similar
   /// histories.
   ///
-  int compute_lm_hist_hash_code(LMHistory *wh) const;
+  /// With LM_STATE_RECOMBINATION the code is the state id of the words,
+  /// plus one. Zero is the code of the history of the initial token.
+  ///
+  int compute_lm_hist_hash_code(LMHistory *wh);
+
+  /// \brief Computes a hash code from the \a num_words last words in the
+  /// LMHistory, stopping at the sentence start.
+  ///
+  int hash_lm_history(LMHistory *wh, int num_words) const;
+
+  /// \brief Returns the state that is used for recombining \a token with
+  /// LM_STATE_RECOMBINATION.
+  ///
+  int recombination_state(const TPLexPrefixTree::Token &token) const
+  {
+    return m_fsa_lm ? token.fsa_lm_node : token.lm_hist_code;
+  }
 
   // language model scoring
 
@@ -519,6 +1134,38 @@ private:
   ///
   float get_ngram_score(LMHistory *lm_hist, int lm_hist_code);
 
+  /// \brief Returns the probability for the n-gram in the LM history from
+  /// \ref m_open_lm_score_cache, computing it on a cache miss.
+  ///
+  float get_open_addressing_ngram_score(LMHistory *lm_hist);
+
+  /// \brief Fills \a key with the words that identify the n-gram score of
+  /// \a word_id after \a history in \ref m_open_lm_score_cache.
+  ///
+  /// \return The length of the key, or -1 if the key does not fit.
+  ///
+  int make_lm_score_key(int word_id, LMHistory *history, int *key) const;
+
+  /// An n-gram score to be computed by score_word_ends_in_batch().
+  struct LMQuery {
+    int key[LMScoreCache::MAX_KEY_LENGTH];
+    int length;
+  };
+
+  /// \brief Computes the n-gram scores of the words that the active tokens
+  /// can reach in this frame, and stores them in
+  /// \ref m_open_lm_score_cache.
+  ///
+  void score_word_ends_in_batch();
+
+  /// \brief Adds a query for each word that can be reached from \a node
+  /// without passing through an HMM state.
+  ///
+  /// \param history The key words of the LM history of the token.
+  ///
+  void collect_lm_queries(const LMQuery &history,
+                          const TPLexPrefixTree::Node *node, int depth);
+
   /// \brief Moves a token to the next FSA language model node, and adds the
   /// transition probability to the LM log probability of the token.
   ///
@@ -538,6 +1185,54 @@ private:
   float get_lm_lookahead_score(LMHistory *lm_hist,
                                 TPLexPrefixTree::Node *node, int depth);
 
+  /// \brief Creates an LM lookahead score cache for every node of the lexical
+  /// prefix tree that has possible word ends.
+  ///
+  void create_lookahead_buffers();
+
+  /// \brief Prepares \ref m_sparse_lm_lookahead for the lookahead nodes.
+  ///
+  /// \exception InvalidSetup If the lookahead LM does not support sparse
+  /// score lists.
+  ///
+  void create_sparse_lm_lookahead();
+
+  SimpleHashCache<float> &lookahead_buffer(const TPLexPrefixTree::Node *node)
+  {
+    return m_lookahead_buffers[m_lookahead_buffer_index[node->node_id]];
+  }
+
+  /// \brief Computes the bigram probability of every word after
+  /// \a prev_word_id using the lookahead LM, as a score tree (see
+  /// create_lm_score_tree()).
+  ///
+  void compute_lm_bigram_scores(int prev_word_id,
+                                std::vector<float> &lm_scores);
+
+  /// \brief Creates a segment tree of the lookahead LM scores of the words,
+  /// for finding the maximum score of a range of words in logarithmic time.
+  ///
+  /// If the lexicon has \a n words, the scores of the words are in
+  /// \a lm_scores[n] to \a lm_scores[2n - 1], in the word order of the
+  /// lexicon, and \a lm_scores[i] is the maximum of \a lm_scores[2i] and
+  /// \a lm_scores[2i + 1].
+  ///
+  /// \param extensions The lookahead LM scores indexed by lookahead LM ID.
+  ///
+  void create_lm_score_tree(const std::vector<float> &extensions,
+                            std::vector<float> &lm_scores);
+
+  /// \brief Returns the maximum score of the possible word ends of a
+  /// lookahead node from a score tree.
+  ///
+  float max_lm_score(const std::vector<float> &lm_scores,
+                     const TPLexPrefixTree::Node *node) const;
+
+  /// \brief Returns a checksum of the lookahead nodes of the lexicon, the
+  /// vocabulary and the lookahead LM, which a lookahead table has to match.
+  ///
+  uint32_t lm_lookahead_table_checksum() const;
+
   /// \brief Computes bi-gram probabilities for every word pair starting with
   /// \a prev_word_id, using the lookahead LM, and returns the maximum.
   ///
@@ -552,7 +1247,7 @@ private:
 
   void clear_active_node_token_lists(void);
 
-  inline float get_token_log_prob(float am_score, float lm_score)
+  inline float get_token_log_prob(float am_score, float lm_score) const
   {
     return (am_score + m_lm_scale * lm_score);
   }
@@ -565,10 +1260,11 @@ private:
   void save_token_statistics(int count);
   //void print_token_path(TPLexPrefixTree::PathHistory *hist);
 
-  // Help variables to cope with memory leaks
-  // Vector of pointers to memory blocks for m_token_pool, this is only for freeing up memory at the destructor
-  std::vector<TPLexPrefixTree::Token *> m_token_dealloc_table;
-  std::vector<LMHistory *> m_lmhist_dealloc_table;
+  /// \brief Counts a token that is discarded because the token memory
+  /// budget has been exhausted, and tightens the beams for the rest of the
+  /// frame, once per frame.
+  ///
+  void discard_token_for_memory();
 
 public:
 
@@ -576,6 +1272,27 @@ public:
   WordGraph word_graph;
 
 private:
+  int m_word_graph_flush_interval;
+  float m_posterior_scale;
+
+  /// The newest word graph node that has been flushed, or -1. The nodes
+  /// before it have been freed and it has no incoming arcs.
+  int m_word_graph_cut_node;
+
+  /// The number of nodes and arcs in the temporary files.
+  int m_word_graph_output_nodes;
+  int m_word_graph_output_arcs;
+
+  /// Temporary files for the node and arc records of the flushed part of
+  /// the word graph, or NULL. The records are in the format of
+  /// get_word_graph_part().
+  FILE *m_word_graph_node_file;
+  FILE *m_word_graph_arc_file;
+
+  /// The number of each word graph node in the lattice file, valid for the
+  /// nodes that are being written and \ref m_word_graph_cut_node.
+  std::vector<int> m_word_graph_output_ids;
+
   TPLexPrefixTree &m_lexicon;
   Vocabulary &m_vocabulary;
 #ifdef ENABLE_WORDCLASS_SUPPORT
@@ -583,22 +1300,104 @@ private:
 #endif
   Acoustics *m_acoustics;
 
-  typedef std::vector<TPLexPrefixTree::Token *> token_list_type;
+  typedef TokenList token_list_type;
   token_list_type * m_active_token_list;
   token_list_type * m_new_token_list;
   token_list_type * m_word_end_token_list;
-  token_list_type m_token_pool;
-  std::vector<LMHistory*> m_lmh_pool;
+  TokenPool m_token_pool;
+  size_t m_token_memory_retained;
+
+  /// The last frame in which the beams were tightened because of the token
+  /// memory budget, or -1.
+  int m_budget_pruning_frame;
+  int m_budget_dropped_tokens;
+
+  /// The estimated number of new tokens propagated from each token that
+  /// survives pruning, the number of tokens that survived the last pruning,
+  /// and \ref m_budget_dropped_tokens at the last pruning, for leaving room
+  /// for the new tokens within the token memory budget.
+  float m_token_expansion;
+  int m_budget_survivors;
+  int m_budget_dropped_at_prune;
+
+  /// Storage for the history structures of the current utterance. All the
+  /// structures are freed in reset_search().
+  HistoryArena<LMHistory> m_lmh_arena;
+  HistoryArena<TPLexPrefixTree::WordHistory> m_word_history_arena;
+  HistoryArena<TPLexPrefixTree::StateHistory> m_state_history_arena;
 
   std::vector<TPLexPrefixTree::Node*> m_active_node_list;
 
-  class LMLookaheadScoreList
-  {
-  public:
-    int index;
-    std::vector<float> lm_scores;
-  };
-  HashCache<LMLookaheadScoreList*> lm_lookahead_score_list;
+  /// The first token in each node of the lexical prefix tree, indexed by
+  /// node ID. The rest are linked by next_node_token. Keeping these outside
+  /// the tree allows several searches to share the same tree.
+  std::vector<TPLexPrefixTree::Token*> m_node_token_lists;
+
+  /// The index in \ref m_lookahead_buffers of the LM lookahead score cache
+  /// of each node, or -1 if the node has no possible word ends.
+  std::vector<int> m_lookahead_buffer_index;
+  std::vector<SimpleHashCache<float> > m_lookahead_buffers;
+
+  /// Precomputed bigram lookahead scores, if a table has been read.
+  LMLookaheadTable m_lm_lookahead_table;
+
+  LMLookaheadMode m_lm_lookahead_mode;
+  SparseLMLookahead m_sparse_lm_lookahead;
+
+  /// Indices of the tokens accepted by \ref m_pruning_kernel.
+  std::vector<int> m_token_indices;
+
+  PruningKernel m_pruning_kernel;
+  double m_prune_time;
+
+  bool m_profiling;
+  SearchProfile m_profile;
+
+  /// The counters of the current frame. They are updated even when
+  /// profiling is disabled, but timed only when it is enabled.
+  SearchProfile::Frame m_frame_profile;
+
+  /// The number of times reset_search() has been called.
+  int m_utterance_count;
+
+  BeamController m_beam_controller;
+
+  /// The newest LMHistory returned by get_stable_words().
+  LMHistory *m_last_stable_history;
+
+  /// Set when run() has reached the end of the utterance.
+  bool m_end_of_utterance;
+  ResultListener *m_result_listener;
+
+  int m_endpoint_silence_frames;
+  float m_endpoint_margin;
+  bool m_reset_on_endpoint;
+
+  /// The number of consecutive frames that have satisfied the endpoint
+  /// condition.
+  int m_endpoint_silence_count;
+
+  bool m_endpoint_detected;
+
+  /// Set when run() should start a new segment before the next frame.
+  bool m_restart_pending;
+  std::vector<ResultWord> m_stable_words;
+  std::vector<ResultWord> m_partial_words;
+  std::vector<LMHistory*> m_result_history_stack;
+
+  int m_num_threads;
+  ThreadPool *m_thread_pool;
+
+  /// Moves precomputed by the worker threads in propagate_tokens_parallel().
+  std::vector<TokenMove> m_token_moves;
+
+  /// The index of the first move of each active token in m_token_moves.
+  std::vector<int> m_token_move_offsets;
+
+  /// The cache of lookahead score lists, pointing to
+  /// m_own_lm_lookahead_cache unless a shared cache has been set.
+  LMLookaheadCache *m_lm_lookahead_cache;
+  LMLookaheadCache m_own_lm_lookahead_cache;
 
   class LMScoreInfo
   {
@@ -607,9 +1406,20 @@ private:
     std::vector<int> lm_hist;
   };
   HashCache<LMScoreInfo*> m_lm_score_cache;
+  LMScoreCache m_open_lm_score_cache;
+  LMCacheType m_lm_cache_type;
+
+  bool m_batch_lm_scoring;
+  std::vector<LMQuery> m_lm_queries;
+  std::vector<int> m_lm_query_order;
+  std::vector<int> m_lm_query_words;
+  std::vector<int> m_lm_query_word_index;
+  std::vector<float> m_lm_query_scores;
+  NGram::Gram m_lm_query_context;
 
   int m_end_frame;
   int m_frame; // Current frame
+  int m_segment_start_frame; // The frame where start_segment() was called
 
   float m_best_log_prob; // The best total_log_prob in active tokens
   float m_worst_log_prob;
@@ -663,6 +1473,10 @@ private:
   float m_global_beam;
   float m_word_end_beam;
   int m_similar_lm_hist_span;
+  RecombinationMode m_recombination_mode;
+  LMStateTable m_lm_states;
+  std::vector<int> m_lm_state_key;
+  RecombinationTable m_recombination_table;
   float m_lm_scale;
   float m_duration_scale;
   float m_transition_scale; // Temporary scaling used for self transitions
@@ -704,8 +1518,12 @@ private:
 
   bool m_lm_lookahead_initialized;
 
+  /// Lookups and misses of the node lookahead buffers by node depth. The
+  /// last element counts also the deeper nodes.
   int lm_la_cache_count[MAX_LEX_TREE_DEPTH];
   int lm_la_cache_miss[MAX_LEX_TREE_DEPTH];
+
+  /// Lookups and misses of the score lists, counted by this search.
   int lm_la_word_cache_count;
   int lm_la_word_cache_miss;
 
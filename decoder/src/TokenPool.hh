@@ -0,0 +1,145 @@
+#ifndef TOKENPOOL_HH
+#define TOKENPOOL_HH
+
+#include <stddef.h>
+#include <new>
+#include <vector>
+#include "TPLexPrefixTree.hh"
+
+/// \brief Block allocator for the search tokens with an optional limit on
+/// the memory used.
+///
+/// Tokens are allocated in blocks of \a block_size tokens. Released tokens
+/// are kept in a free list, and the blocks are freed only by trim() or the
+/// destructor. The blocks are large, so the C library usually maps them from
+/// the system directly and returns the memory when they are freed.
+///
+class TokenPool {
+public:
+  typedef TPLexPrefixTree::Token Token;
+
+  TokenPool(int block_size = 4096)
+    : m_block_size(block_size), m_budget(0), m_peak_live(0),
+      m_peak_bytes(0) { }
+
+  ~TokenPool()
+  {
+    for (int i = 0; i < m_blocks.size(); i++)
+      free_block(m_blocks[i]);
+  }
+
+  /// \brief Limits the memory allocated for the tokens to \a bytes, rounded
+  /// down to whole blocks but at least one block. Zero means no limit.
+  ///
+  /// The limit is not checked by acquire(), so that the caller can decide
+  /// what to do when full() returns true.
+  ///
+  void set_budget(size_t bytes) { m_budget = bytes; }
+  size_t budget() const { return m_budget; }
+
+  /// \brief Returns the number of tokens that fit in the budget, or zero if
+  /// there is no limit.
+  ///
+  int max_tokens() const
+  {
+    if (m_budget == 0)
+      return 0;
+    size_t blocks = m_budget / block_bytes();
+    return (blocks > 0 ? blocks : 1) * m_block_size;
+  }
+
+  /// \brief Returns true if there are no free tokens and allocating another
+  /// block would exceed the budget.
+  ///
+  bool full() const
+  {
+    return m_free.empty() && m_budget > 0 && !m_blocks.empty()
+      && (m_blocks.size() + 1) * block_bytes() > m_budget;
+  }
+
+  /// \brief Returns a token from the free list, allocating a new block if
+  /// necessary. The token has whatever contents it had when released.
+  ///
+  Token *acquire()
+  {
+    if (m_free.empty())
+      add_block();
+    Token *t = m_free.back();
+    m_free.pop_back();
+    if (num_live() > m_peak_live)
+      m_peak_live = num_live();
+    return t;
+  }
+
+  void release(Token *token) { m_free.push_back(token); }
+
+  /// \brief Frees the blocks that do not fit in \a keep_bytes. All the
+  /// tokens must have been released.
+  ///
+  void trim(size_t keep_bytes)
+  {
+    size_t keep_blocks = keep_bytes / block_bytes();
+    if (m_blocks.size() <= keep_blocks)
+      return;
+    for (int i = keep_blocks; i < m_blocks.size(); i++)
+      free_block(m_blocks[i]);
+    m_blocks.resize(keep_blocks);
+    m_free.clear();
+    for (int i = 0; i < m_blocks.size(); i++)
+      for (int j = 0; j < m_block_size; j++)
+        m_free.push_back(&m_blocks[i][j]);
+  }
+
+  /// \brief Resets the peak counters to the current usage.
+  ///
+  void reset_peak()
+  {
+    m_peak_live = num_live();
+    m_peak_bytes = allocated_bytes();
+  }
+
+  /// \brief Returns the number of tokens currently in use.
+  ///
+  int num_live() const { return m_blocks.size() * m_block_size - m_free.size(); }
+
+  /// \brief Returns the maximum number of tokens in use at the same time
+  /// since the last reset_peak().
+  ///
+  int peak_live() const { return m_peak_live; }
+
+  /// \brief Returns the number of bytes allocated for the tokens.
+  ///
+  size_t allocated_bytes() const { return m_blocks.size() * block_bytes(); }
+
+  /// \brief Returns the maximum of allocated_bytes() since the last
+  /// reset_peak().
+  ///
+  size_t peak_bytes() const { return m_peak_bytes; }
+
+private:
+  size_t block_bytes() const { return m_block_size * sizeof(Token); }
+
+  void add_block()
+  {
+    Token *block = static_cast<Token*>(::operator new(block_bytes()));
+    for (int i = 0; i < m_block_size; i++)
+      new (&block[i]) Token();
+    m_blocks.push_back(block);
+    for (int i = 0; i < m_block_size; i++)
+      m_free.push_back(&block[i]);
+    if (allocated_bytes() > m_peak_bytes)
+      m_peak_bytes = allocated_bytes();
+  }
+
+  // Tokens have no destructor, so the block can be freed as it is.
+  void free_block(Token *block) { ::operator delete(block); }
+
+  int m_block_size;
+  size_t m_budget;
+  std::vector<Token*> m_blocks;
+  std::vector<Token*> m_free;
+  int m_peak_live;
+  size_t m_peak_bytes;
+};
+
+#endif // TOKENPOOL_HH
@@ -10,6 +10,8 @@
 #include "io.hh"
 #include "misc/str.hh"
 #include "HTKLatticeGrammar.hh"
+#include "LexTreeFile.hh"
+#include "BatchDecoder.hh"
 
 using namespace std;
 
@@ -37,7 +39,10 @@ Toolbox::Toolbox(int decoder, const char * hmm_path, const char * dur_path)
 
     m_expander(NULL),
     m_search(NULL),
-    m_last_guaranteed_history(NULL)
+    m_last_guaranteed_history(NULL),
+    m_parent(NULL),
+    m_batch_decoder(NULL),
+    m_stream_threads(1)
 {
     hmm_read(hmm_path);
     if (dur_path != NULL) {
@@ -46,8 +51,57 @@ Toolbox::Toolbox(int decoder, const char * hmm_path, const char * dur_path)
     reinitialize_search();
 }
 
+Toolbox::Toolbox(Toolbox &parent)
+  : m_use_stack_decoder(0),
+
+    m_hmm_reader(NULL),
+    m_hmm_map(parent.m_hmm_map),
+    m_hmms(parent.m_hmms),
+
+    m_lexicon_reader(NULL),
+    m_lexicon(NULL),
+    m_vocabulary(NULL),
+    m_tp_lexicon(parent.m_tp_lexicon),
+    m_tp_lexicon_reader(parent.m_tp_lexicon_reader),
+    m_lexicon_read(true),
+    m_tp_vocabulary(parent.m_tp_vocabulary),
+    m_tp_search(NULL),
+
+    m_acoustics(NULL),
+    m_lna_reader(new LnaReaderCircular),
+    m_one_frame_acoustics(),
+    m_word_boundary(parent.m_word_boundary),
+    m_fsa_lm(NULL),
+    m_lookahead_ngram(NULL),
+
+    m_expander(NULL),
+    m_search(NULL),
+    m_last_guaranteed_history(NULL),
+    m_parent(&parent),
+    m_batch_decoder(NULL),
+    m_stream_threads(1)
+{
+  m_tp_search = new TokenPassSearch(*m_tp_lexicon, *m_tp_vocabulary,
+                                    m_lna_reader);
+  if (!m_word_boundary.empty()) {
+    m_tp_search->set_word_boundary(m_word_boundary);
+  }
+}
+
 Toolbox::~Toolbox()
 {
+  // The batch decoder does not own the searches of the streams, and the
+  // streams use the lexicon of this toolbox.
+  delete m_batch_decoder;
+  for (int i = 0; i < m_streams.size(); i++)
+    delete m_streams[i];
+
+  if (m_parent != NULL) {
+    m_tp_lexicon = NULL;
+    m_tp_lexicon_reader = NULL;
+    m_tp_vocabulary = NULL;
+  }
+
   while (!m_ngrams.empty()) {
     delete m_ngrams.back();
     m_ngrams.pop_back();
@@ -212,6 +266,9 @@ Toolbox::reinitialize_search() {
 void
 Toolbox::lex_read(const char *filename)
 {
+  if (m_parent != NULL || !m_streams.empty())
+    throw std::logic_error("Toolbox::lex_read: The lexicon cannot be read "
+                           "when it is shared with streams.");
   if (!m_tp_search) {
     reinitialize_search();
   }
@@ -234,6 +291,82 @@ Toolbox::lex_read(const char *filename)
   m_lexicon_read = true;
 }
 
+void
+Toolbox::lex_tree_read(const char *filename)
+{
+  if (m_use_stack_decoder)
+    throw std::logic_error("Toolbox::lex_tree_read: Lexical prefix tree "
+                           "files are supported only by the token pass "
+                           "decoder.");
+  if (m_parent != NULL || !m_streams.empty())
+    throw std::logic_error("Toolbox::lex_tree_read: The lexicon cannot be "
+                           "read when it is shared with streams.");
+  if (!m_tp_search) {
+    reinitialize_search();
+  }
+
+  LexTreeFile::read(filename, *m_tp_lexicon, *m_tp_vocabulary, *m_hmms);
+  if (!m_word_boundary.empty()) {
+    m_tp_search->set_word_boundary(m_word_boundary);
+  }
+  m_lexicon_read = true;
+}
+
+void
+Toolbox::lex_tree_write(const char *filename)
+{
+  if (m_use_stack_decoder || !m_lexicon_read)
+    throw std::logic_error("Toolbox::lex_tree_write: The lexicon has to be "
+                           "read with the token pass decoder first.");
+  LexTreeFile::write(filename, *m_tp_lexicon, *m_tp_vocabulary, *m_hmms);
+}
+
+Toolbox *
+Toolbox::add_stream()
+{
+  if (m_use_stack_decoder || m_parent != NULL || !m_lexicon_read)
+    throw std::logic_error("Toolbox::add_stream: Streams can be added only "
+                           "to a token pass toolbox that has read the "
+                           "lexicon.");
+
+  Toolbox *stream = new Toolbox(*this);
+  m_streams.push_back(stream);
+  if (m_batch_decoder == NULL)
+    create_batch_decoder();
+  else
+    m_batch_decoder->add_stream(stream->m_tp_search);
+  return stream;
+}
+
+void
+Toolbox::set_stream_threads(int num_threads)
+{
+  m_stream_threads = num_threads;
+  delete m_batch_decoder;
+  m_batch_decoder = NULL;
+  if (!m_streams.empty())
+    create_batch_decoder();
+}
+
+void
+Toolbox::create_batch_decoder()
+{
+  m_batch_decoder = new BatchDecoder(*m_tp_lexicon, *m_tp_vocabulary,
+                                     m_stream_threads);
+  for (int i = 0; i < m_streams.size(); i++)
+    m_batch_decoder->add_stream(m_streams[i]->m_tp_search);
+}
+
+void
+Toolbox::run_streams()
+{
+  if (m_batch_decoder == NULL)
+    return;
+  for (int i = 0; i < m_streams.size(); i++)
+    m_batch_decoder->resume(i);
+  m_batch_decoder->run();
+}
+
 const std::string & Toolbox::lex_word() const
 {
   if (m_use_stack_decoder)
@@ -431,6 +564,28 @@ Toolbox::lna_close()
   m_lna_reader->close();
 }
 
+void
+Toolbox::save_search_state(const std::string &file)
+{
+  std::string state = m_tp_search->save_state();
+  io::Stream out(file, "w");
+  if (fwrite(state.data(), 1, state.size(), out.file) != state.size())
+    throw TokenPassSearch::IOError("Could not write the search state.");
+}
+
+void
+Toolbox::load_search_state(const std::string &file)
+{
+  std::string state;
+  io::Stream in(file, "r");
+  char buffer[65536];
+  size_t size;
+  while ((size = fread(buffer, 1, sizeof(buffer), in.file)) > 0)
+    state.append(buffer, size);
+  m_tp_search->load_state(state);
+  m_last_guaranteed_history = NULL;
+}
+
 void
 Toolbox::print_hypo(Hypo &hypo)
 {
@@ -522,6 +677,71 @@ const bytestype& Toolbox::best_hypo_string(bool print_all, bool output_time) {
   return retval;
 }
 
+static void append_result_words(
+  std::string &str, const std::vector<TokenPassSearch::ResultWord> &words,
+  const Vocabulary &vocabulary, bool output_time)
+{
+  for (int i = 0; i < words.size(); i++) {
+    if (output_time)
+      str += str::fmt(256, "<time=%d> ", words[i].start_frame);
+    str += vocabulary.word(words[i].word_id) + " ";
+  }
+}
+
+const bytestype& Toolbox::stable_words_string(bool output_time)
+{
+  static std::string retval;
+  retval.clear();
+  append_result_words(retval, m_tp_search->get_stable_words(),
+                      *m_tp_vocabulary, output_time);
+  return retval;
+}
+
+const bytestype& Toolbox::partial_hypothesis_string(bool output_time)
+{
+  static std::string retval;
+  retval.clear();
+  append_result_words(retval, m_tp_search->get_partial_hypothesis(),
+                      *m_tp_vocabulary, output_time);
+  return retval;
+}
+
+const bytestype& Toolbox::nbest_string(int n, bool output_time)
+{
+  static std::string retval;
+  std::vector<TokenPassSearch::NBestHypothesis> hypotheses;
+  retval.clear();
+  m_tp_search->get_nbest(n, hypotheses);
+  for (int i = 0; i < hypotheses.size(); i++) {
+    const TokenPassSearch::NBestHypothesis &hypothesis = hypotheses[i];
+    retval += str::fmt(256, "%.3f %.3f %.3f", hypothesis.total_log_prob,
+                       hypothesis.am_log_prob, hypothesis.lm_log_prob);
+    for (int j = 0; j < hypothesis.words.size(); j++) {
+      const TokenPassSearch::NBestWord &word = hypothesis.words[j];
+      if (output_time)
+        retval += str::fmt(256, " <time=%d>", word.start_frame);
+      retval += " " + m_tp_vocabulary->word(word.word_id);
+    }
+    retval += "\n";
+  }
+  return retval;
+}
+
+const bytestype& Toolbox::word_confidences_string()
+{
+  static std::string retval;
+  std::vector<TokenPassSearch::WordPosterior> words;
+  retval.clear();
+  m_tp_search->get_word_confidences(words);
+  for (int i = 0; i < words.size(); i++) {
+    retval += str::fmt(256, "%d %d ", words[i].start_frame,
+                       words[i].end_frame);
+    retval += m_tp_vocabulary->word(words[i].word_id);
+    retval += str::fmt(256, " %.4f\n", words[i].posterior);
+  }
+  return retval;
+}
+
 void Toolbox::set_lm_scale(float lm_scale)
 {
   if (m_use_stack_decoder) {
@@ -17,6 +17,8 @@
 
 typedef std::string bytestype;
 
+class BatchDecoder;
+
 class Toolbox {
 public:
   /// \brief Loads the acoustic model. It cannot be changed at a later time.
@@ -43,6 +45,23 @@ public:
   ///
   void lex_read(const char *file);
 
+  /// \brief Reads a lexical prefix tree and its vocabulary that were built
+  /// from a dictionary by the lex_tree tool or lex_tree_write(), instead of
+  /// reading the dictionary.
+  ///
+  /// The lexicon options have no effect on a tree read from a file. The
+  /// file is mapped into memory and used in place, so the decoders that read
+  /// the same file share the memory of the tree, and the file must not be
+  /// rewritten while it is in use.
+  ///
+  void lex_tree_read(const char *file);
+
+  /// \brief Writes the lexical prefix tree and the vocabulary into a file.
+  ///
+  /// Has to be called after lex_read() and before set_sentence_boundary().
+  ///
+  void lex_tree_write(const char *file);
+
   const std::string &lex_word() const;
   const std::string &lex_phone() const;
   const std::string &word(int index) const 
@@ -75,6 +94,19 @@ public:
   ///
   void read_lookahead_ngram(const char *file, bool binary=true, bool quiet=false);
 
+  /// \brief Reads a table of precomputed bigram lookahead scores, created by
+  /// the lookahead_table tool or write_lm_lookahead_table().
+  ///
+  /// The lexicon and the language models have to be read first.
+  ///
+  void read_lm_lookahead_table(const char *file) { m_tp_search->read_lm_lookahead_table(file); }
+
+  /// \brief Precomputes the bigram lookahead scores for the current lexicon
+  /// and lookahead LM, and writes them into a table file.
+  ///
+  void write_lm_lookahead_table(const char *file, int bytes_per_score = 1)
+  { m_tp_search->write_lm_lookahead_table(file, bytes_per_score); }
+
   /// \brief Reads several lookahead n-gram models for interpolation
   void interpolated_lookahead_ngram_read(const std::vector<std::string>, const std::vector<float>);
 
@@ -147,17 +179,87 @@ public:
   ///
   /// \return true if a frame was available, false if there are no more frames.
   ///
-  bool run() { return (m_use_stack_decoder?m_search->run():m_tp_search->run()); }
+  bool run()
+  {
+    if (m_use_stack_decoder)
+      return m_search->run();
+    if (m_tp_search->new_segment_pending())
+      m_last_guaranteed_history = NULL;
+    return m_tp_search->run();
+  }
+
+  /// \brief Enables endpoint detection in the token pass search.
+  ///
+  /// \see TokenPassSearch::set_endpoint_detection()
+  ///
+  void set_endpoint_detection(int silence_frames, float margin, bool reset)
+  { m_tp_search->set_endpoint_detection(silence_frames, margin, reset); }
+
+  /// \brief Returns true if the last frame ended a segment.
+  ///
+  bool endpoint_detected() const { return m_tp_search->endpoint_detected(); }
 
   // Token pass search
   WordGraph &tp_word_graph() { return m_tp_search->word_graph; } 
   void write_word_graph(const std::string &file_name)
   { m_tp_search->write_word_graph(file_name); }
+
+  /// \brief Writes the word graph in the binary lattice format.
+  ///
+  /// \see TokenPassSearch::write_word_graph_binary()
+  ///
+  void write_word_graph_binary(const std::string &file_name)
+  { m_tp_search->write_word_graph_binary(file_name); }
   void print_best_lm_history(FILE *out=stdout) 
   { 
     m_tp_search->print_lm_history(out, true); 
   }
   void print_best_lm_history_to_file(FILE *out) {print_best_lm_history(out);}
+  void print_history_statistics(FILE *out=stdout) { m_tp_search->print_history_statistics(out); }
+  void print_lm_lookahead_statistics(FILE *out=stdout) { m_tp_search->print_lm_lookahead_statistics(out); }
+
+  /// \brief Makes the search use the LM lookahead cache of another toolbox.
+  ///
+  /// Both toolboxes have to use the same vocabulary and lookahead language
+  /// model, and \a other has to outlive this toolbox.
+  ///
+  void share_lm_lookahead_cache(Toolbox &other)
+  { m_tp_search->set_lm_lookahead_cache(other.m_tp_search->lm_lookahead_cache()); }
+
+  // Batch decoding
+
+  /// \brief Creates a toolbox for decoding another stream over the lexicon
+  /// of this toolbox, at the same time with the other streams in
+  /// run_streams().
+  ///
+  /// The stream shares the acoustic model, the lexical prefix tree and the
+  /// vocabulary with this toolbox, so the lexicon options have to be set and
+  /// the lexicon read here first, and the lexicon cannot be read again. The
+  /// stream has its own search, acoustics and language models. The n-gram
+  /// models keep lookup state in member variables and cannot be shared
+  /// between threads, so every stream has to read its own language models
+  /// with ngram_read() and read_lookahead_ngram(). The search options have
+  /// to be set for every stream too. set_sentence_boundary() adds the
+  /// sentence end node to the shared tree only on its first call, so every
+  /// stream has to use the same sentence boundary words, and the first call
+  /// has to be made before any stream is decoded.
+  ///
+  /// \return The stream, which is owned by this toolbox.
+  ///
+  Toolbox *add_stream();
+
+  int num_streams() const { return m_streams.size(); }
+  Toolbox *stream(int index) { return m_streams.at(index); }
+
+  /// \brief Sets the number of threads used by run_streams(), including the
+  /// calling thread. The default is 1.
+  ///
+  void set_stream_threads(int num_threads);
+
+  /// \brief Decodes all the streams until the end of their input, a few
+  /// frames of each stream at a time. Each stream has to be reset first.
+  ///
+  void run_streams();
 
   // Miscellaneous
   void segment(const std::string &str, int start_frame, int end_frame);
@@ -173,6 +275,46 @@ public:
 
   const bytestype &best_hypo_string(bool print_all, bool output_time);
 
+  /// \brief Returns the words that have become common to all active tokens
+  /// since the previous call, separated by spaces.
+  ///
+  /// \param output_time If true, the start frame of each word is written
+  /// before the word as "<time=frame>".
+  ///
+  const bytestype &stable_words_string(bool output_time);
+
+  /// \brief Returns the words of the best active token that follow the
+  /// words returned by stable_words_string().
+  ///
+  const bytestype &partial_hypothesis_string(bool output_time);
+
+  /// \brief Returns the \a n best hypotheses of the word graph, one per
+  /// line.
+  ///
+  /// Each line contains the total, acoustic and language model log
+  /// probabilities followed by the words.
+  ///
+  /// \see TokenPassSearch::get_nbest()
+  ///
+  const bytestype &nbest_string(int n, bool output_time);
+
+  /// \brief Returns the words of the best path of the word graph with their
+  /// confidences, one word per line.
+  ///
+  /// Each line contains the start frame, the end frame, the word and the
+  /// confidence.
+  ///
+  /// \see TokenPassSearch::get_word_confidences()
+  ///
+  const bytestype &word_confidences_string();
+
+  /// \brief Sets the scale of the path weights when computing confidences.
+  ///
+  /// \see TokenPassSearch::set_posterior_scale()
+  ///
+  void set_posterior_scale(float scale)
+  { m_tp_search->set_posterior_scale(scale); }
+
   // Options
   void set_forced_end(bool forced_end) { m_expander->set_forced_end(forced_end); }
   void set_hypo_limit(int hypo_limit) { m_search->set_hypo_limit(hypo_limit); } 
@@ -185,6 +327,16 @@ public:
   ///
   void set_prune_similar(int prune_similar) { m_use_stack_decoder?m_search->set_prune_similar(prune_similar):m_tp_search->set_similar_lm_history_span(prune_similar); }
 
+  /// \brief Recombines tokens by LM state ids from a hash table instead of
+  /// comparing their LM histories.
+  ///
+  void set_lm_state_recombination(bool value)
+  {
+    m_tp_search->set_recombination_mode(
+      value ? TokenPassSearch::LM_STATE_RECOMBINATION
+            : TokenPassSearch::HISTORY_RECOMBINATION);
+  }
+
   void set_word_limit(int word_limit) { m_search->set_word_limit(word_limit); }
   void set_word_beam(float word_beam) { m_search->set_word_beam(word_beam); }
 
@@ -198,6 +350,14 @@ public:
   void set_lm_offset(float lm_offset) { m_search->set_lm_offset(lm_offset); }
   void set_unk_offset(float unk_offset) { m_search->set_unk_offset(unk_offset); }
   void set_token_limit(int limit) { m_use_stack_decoder?m_expander->set_token_limit(limit):m_tp_search->set_max_num_tokens(limit); }
+  void set_token_memory_budget(size_t bytes) { m_tp_search->set_token_memory_budget(bytes); }
+  void set_token_memory_retained(size_t bytes) { m_tp_search->set_token_memory_retained(bytes); }
+  size_t token_memory_usage() const { return m_tp_search->token_memory_usage(); }
+  size_t token_memory_peak() const { return m_tp_search->token_memory_peak(); }
+  int num_budget_dropped_tokens() const { return m_tp_search->num_budget_dropped_tokens(); }
+  void set_num_threads(int num_threads) { m_tp_search->set_num_threads(num_threads); }
+  bool set_simd_pruning(bool value) { return m_tp_search->set_simd_pruning(value); }
+  double prune_time() const { return m_tp_search->get_prune_time(); }
   void set_state_beam(float beam) { m_expander->set_beam(beam); }
   void set_duration_scale(float scale) { m_use_stack_decoder?m_expander->set_duration_scale(scale):m_tp_search->set_duration_scale(scale); }
   void set_transition_scale(float scale) { m_use_stack_decoder?m_expander->set_transition_scale(scale):m_tp_search->set_transition_scale(scale); }
@@ -233,10 +393,27 @@ public:
   ///
   void set_lm_lookahead(int lmlh) { m_tp_lexicon->set_lm_lookahead(lmlh); m_tp_search->set_lm_lookahead(lmlh); }
 
+  /// \brief Computes the lookahead scores from the backoff structure of the
+  /// lookahead LM instead of scoring every word after each context.
+  ///
+  /// \see TokenPassSearch::set_lm_lookahead_mode()
+  ///
+  void set_sparse_lm_lookahead(bool value)
+  {
+    m_tp_search->set_lm_lookahead_mode(
+      value ? TokenPassSearch::SPARSE_LM_LOOKAHEAD
+            : TokenPassSearch::DENSE_LM_LOOKAHEAD);
+  }
+
   void set_cross_word_triphones(bool cw_triphones) { m_tp_lexicon->set_cross_word_triphones(cw_triphones);
  }
   void set_insertion_penalty(float ip) { m_tp_search->set_insertion_penalty(ip); }
   void set_silence_is_word(bool b) { m_tp_lexicon->set_silence_is_word(b); m_tp_lexicon_reader->set_silence_is_word(b); }
+
+  /// \brief Sets the number of threads used for building the lexical prefix
+  /// tree in lex_read(). The tree is the same with any number of threads.
+  ///
+  void set_lex_num_threads(int num_threads) { m_tp_lexicon_reader->set_num_threads(num_threads); }
   void set_ignore_case(bool b) { m_tp_lexicon->set_ignore_case(b);}
   void set_verbose(int verbose) { if (m_use_stack_decoder) m_search->set_verbose(verbose); else {m_tp_lexicon->set_verbose(verbose); m_tp_search->set_verbose(verbose);}}
   void set_print_text_result(int print) { m_tp_search->set_print_text_result(print); }
@@ -299,6 +476,14 @@ public:
   bool get_generate_word_graph() const
   { return m_tp_search->get_generate_word_graph(); }
 
+  /// \brief Writes the final part of the word graph to temporary files
+  /// during decoding.
+  ///
+  /// \see TokenPassSearch::set_word_graph_flush_interval()
+  ///
+  void set_word_graph_flush_interval(int interval)
+  { m_tp_search->set_word_graph_flush_interval(interval); }
+
   /// \brief Enables or disables word pair approximation when building a word
   /// graph.
   ///
@@ -307,8 +492,22 @@ public:
   void set_use_word_pair_approximation(bool b)
   { m_tp_search->set_use_word_pair_approximation(b); }
 
-  void set_use_lm_cache(bool value)
-  { m_tp_search->set_use_lm_cache(value); }
+  /// \brief Enables or disables caching the n-gram scores.
+  ///
+  /// \param open_addressing Use a fixed-size cache that does not allocate
+  /// memory while decoding, instead of the default hash cache.
+  ///
+  void set_use_lm_cache(bool value, bool open_addressing = false)
+  {
+    m_tp_search->set_use_lm_cache(
+      value, open_addressing ? TokenPassSearch::OPEN_ADDRESSING_CACHE
+                             : TokenPassSearch::HASH_CACHE);
+  }
+
+  void set_batch_lm_scoring(bool value)
+  {
+    m_tp_search->set_batch_lm_scoring(value);
+  }
 
   // Debug
   void print_prunings()
@@ -326,6 +525,64 @@ public:
     m_tp_search->print_state_history(io::Stream(file, "w").file);
   }
 
+  /// \brief Enables or disables collecting per-frame search counters and
+  /// timings. Can be switched at any time, e.g. to sample some utterances.
+  ///
+  void set_profiling(bool value) { m_tp_search->set_profiling(value); }
+
+  /// \brief Sets how many of the last frames the profile keeps.
+  ///
+  /// \see SearchProfile::set_max_frames()
+  ///
+  void set_max_profile_frames(int frames)
+  { m_tp_search->profile().set_max_frames(frames); }
+
+  void clear_profile() { m_tp_search->profile().clear(); }
+
+  /// \brief Writes the collected profile.
+  ///
+  /// \param format "jsonl" for one JSON object per frame, or "chrome" for
+  /// the Chrome trace event format.
+  ///
+  void write_profile(const std::string &file, const std::string &format = "jsonl")
+  {
+    m_tp_search->profile().write(io::Stream(file, "w").file,
+                                 SearchProfile::parse_format(format));
+  }
+
+  /// \brief Adapts the beam after every frame to keep the number of active
+  /// tokens near \a tokens. 0 disables the beam control.
+  ///
+  void set_target_tokens(int tokens)
+  { m_tp_search->beam_controller().set_target(tokens > 0 ? BeamController::TOKENS : BeamController::NONE, tokens); }
+
+  /// \brief Adapts the beam after every frame to keep the decoding time of a
+  /// frame near \a seconds. 0 disables the beam control.
+  ///
+  void set_target_frame_time(double seconds)
+  { m_tp_search->beam_controller().set_target(seconds > 0 ? BeamController::TIME : BeamController::NONE, seconds); }
+
+  /// \brief Sets the range of the adapted beam. A maximum of 0 means the
+  /// global beam.
+  ///
+  void set_beam_bounds(float min_beam, float max_beam) { m_tp_search->beam_controller().set_bounds(min_beam, max_beam); }
+  void set_beam_hysteresis(double hysteresis) { m_tp_search->beam_controller().set_hysteresis(hysteresis); }
+  void set_max_beam_trajectory_steps(int steps) { m_tp_search->beam_controller().set_max_steps(steps); }
+  void write_beam_trajectory(const std::string &file)
+  { m_tp_search->beam_controller().write_trajectory(io::Stream(file, "w").file); }
+
+  /// \brief Writes the state of the token pass search between two frames.
+  ///
+  /// Another decoder that has been set up the same way can continue the
+  /// search after load_search_state().
+  ///
+  void save_search_state(const std::string &file);
+
+  /// \brief Continues the token pass search from a saved state. The
+  /// acoustics have to be opened first.
+  ///
+  void load_search_state(const std::string &file);
+
   TokenPassSearch &debug_get_tp() { return *m_tp_search; }
   TPLexPrefixTree &debug_get_tp_lex() { return *m_tp_lexicon; }
   void debug_print_best_lm_history() 
@@ -376,6 +633,20 @@ private:
 
   LMHistory *m_last_guaranteed_history;
 
+  /// The toolbox that owns the lexicon of a stream, or NULL.
+  Toolbox *m_parent;
+  std::vector<Toolbox*> m_streams;
+  BatchDecoder *m_batch_decoder;
+  int m_stream_threads;
+
+  /// \brief Creates a stream that shares the lexicon of \a parent.
+  ///
+  Toolbox(Toolbox &parent);
+
+  /// \brief Creates the batch decoder for the current streams.
+  ///
+  void create_batch_decoder();
+
   /// \brief Reads the acoustic model from a file.
   ///
   void hmm_read(const char *file);
@@ -590,6 +590,109 @@ TreeGram::fetch_trigram_list(int w1, int w2,
   }
 }
 
+bool
+TreeGram::fetch_unigram_list(std::vector<float> &log_probs)
+{
+  if (m_type != BACKOFF)
+    return false;
+
+  log_probs.resize(m_words.size());
+  for (int i = 0; i < m_words.size(); i++)
+    log_probs[i] = m_nodes[i].log_prob;
+  return true;
+}
+
+uint32_t
+TreeGram::fingerprint()
+{
+  uint32_t hash = NGram::fingerprint();
+  for (int i = 0; i < m_order_count.size(); i++)
+    hash_value(hash, m_order_count[i]);
+
+  int num_nodes = 0;
+  for (int i = 0; i < m_order_count.size() && i < 2; i++)
+    num_nodes += m_order_count[i];
+  for (int i = 0; i < num_nodes && i < m_nodes.size(); i++) {
+    hash_value(hash, m_nodes[i].word);
+    hash_value(hash, m_nodes[i].log_prob);
+    hash_value(hash, m_nodes[i].back_off);
+    hash_value(hash, m_nodes[i].child_index);
+  }
+  return hash;
+}
+
+bool
+TreeGram::fetch_sparse_bigram_list(int prev_word_id, float &back_off,
+                                   std::vector<int> &words,
+                                   std::vector<float> &log_probs)
+{
+  if (m_type != BACKOFF)
+    return false;
+
+  back_off = m_nodes[prev_word_id].back_off;
+  words.clear();
+  log_probs.clear();
+  int child_index = m_nodes[prev_word_id].child_index;
+  int next_child_index = m_nodes[prev_word_id+1].child_index;
+  if (child_index != -1 && next_child_index > child_index)
+  {
+    for (int i = child_index; i < next_child_index; i++) {
+      words.push_back(m_nodes[i].word);
+      log_probs.push_back(m_nodes[i].log_prob);
+    }
+  }
+  return true;
+}
+
+bool
+TreeGram::fetch_sparse_trigram_list(int w1, int w2, float &back_off,
+                                    std::vector<int> &words,
+                                    std::vector<float> &log_probs)
+{
+  if (m_type != BACKOFF)
+    return false;
+
+  // Check if bigram (w1,w2) exists
+  int bigram_index = find_child(w2, w1);
+  if (bigram_index == -1)
+    return fetch_sparse_bigram_list(w2, back_off, words, log_probs);
+
+  float bigram_back_off_w = m_nodes[bigram_index].back_off;
+  back_off = bigram_back_off_w + m_nodes[w2].back_off;
+  words.clear();
+  log_probs.clear();
+
+  // Merge the bigrams (w2, next_word_id) and the trigrams, which are both
+  // sorted by word. A trigram replaces the bigram of the same word.
+  int b = m_nodes[w2].child_index;
+  int b_end = m_nodes[w2+1].child_index;
+  if (b == -1 || b_end < b)
+    b = b_end = 0;
+  int t = -1;
+  int t_end = -1;
+  if (bigram_index < m_nodes.size() - 1) {
+    t = m_nodes[bigram_index].child_index;
+    t_end = m_nodes[bigram_index+1].child_index;
+  }
+  if (t == -1 || t_end < t)
+    t = t_end = 0;
+  while (b < b_end || t < t_end) {
+    if (t == t_end || (b < b_end && m_nodes[b].word < m_nodes[t].word)) {
+      words.push_back(m_nodes[b].word);
+      log_probs.push_back(bigram_back_off_w + m_nodes[b].log_prob);
+      b++;
+    }
+    else {
+      if (b < b_end && m_nodes[b].word == m_nodes[t].word)
+        b++;
+      words.push_back(m_nodes[t].word);
+      log_probs.push_back(m_nodes[t].log_prob);
+      t++;
+    }
+  }
+  return true;
+}
+
 float
 TreeGram::log_prob_bo(const Gram &gram)
 {
@@ -625,6 +728,51 @@ TreeGram::log_prob_bo(const Gram &gram)
   return log_prob;
 }
 
+void
+TreeGram::log_prob_batch(const Gram &context, const int *words,
+                         int num_words, float *log_probs)
+{
+  if (m_type != BACKOFF) {
+    NGram::log_prob_batch(context, words, num_words, log_probs);
+    return;
+  }
+
+  // Find the node of each suffix (w(n) ... w(N-1)) of the context, or -2 if
+  // the suffix is not in the model. The empty suffix is the root (-1).
+  const int context_size = context.size();
+  m_batch_context_nodes.resize(context_size + 1);
+  for (int n = 0; n < context_size; n++) {
+    int node = -1;
+    for (int i = n; i < context_size && node != -2; i++) {
+      node = find_child(context[i], node);
+      if (node < 0)
+        node = -2;
+    }
+    m_batch_context_nodes[n] = node;
+  }
+  m_batch_context_nodes[context_size] = -1;
+
+  // The same back-off as in log_prob_bo(): if (w(n) ... w(N)) is not found,
+  // add the back-off of (w(n) ... w(N-1)) if it is found, and try a shorter
+  // gram.
+  for (int w = 0; w < num_words; w++) {
+    float log_prob = 0.0;
+    for (int n = 0; n <= context_size; n++) {
+      int context_node = m_batch_context_nodes[n];
+      if (context_node == -2)
+        continue;
+      int node = find_child(words[w], context_node);
+      if (node >= 0) {
+        log_prob += m_nodes[node].log_prob;
+        m_last_order = context_size + 1 - n;
+        break;
+      }
+      log_prob += m_nodes[context_node].back_off;
+    }
+    log_probs[w] = log_prob;
+  }
+}
+
 float
 TreeGram::log_prob_i(const Gram &gram) {
   float prob=0.0;
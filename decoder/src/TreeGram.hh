@@ -76,6 +76,12 @@ public:
   void write_real(FILE *file, bool reflip);
 
   float log_prob_bo(const Gram &gram); // Keep this version lean and mean
+
+  /// \brief Computes backoff probabilities of several words after the same
+  /// context, finding the nodes of the context only once.
+  ///
+  void log_prob_batch(const Gram &context, const int *words, int num_words,
+                      float *log_probs);
   float log_prob_bo_cl(const Gram &gram); // Clustered backoff
   float log_prob_i(const Gram &gram); // Interpolated
   float log_prob_i_cl(const Gram &gram); //Interpolated backoff
@@ -156,6 +162,22 @@ public:
   void fetch_trigram_list(int w1, int w2,
                           std::vector<float> &result_buffer);
 
+  /// \brief Sparse versions of the lists above, for backoff models. See
+  /// NGram::fetch_sparse_bigram_list().
+  ///
+  bool fetch_unigram_list(std::vector<float> &log_probs);
+
+  /// \brief Covers also the n-gram counts, and the words, log
+  /// probabilities and backoff weights of the unigrams and bigrams.
+  ///
+  uint32_t fingerprint();
+  bool fetch_sparse_bigram_list(int prev_word_id, float &back_off,
+                                std::vector<int> &words,
+                                std::vector<float> &log_probs);
+  bool fetch_sparse_trigram_list(int w1, int w2, float &back_off,
+                                 std::vector<int> &words,
+                                 std::vector<float> &log_probs);
+
   void print_debuglist();
   void finalize(bool add_missing_unigrams=false);
   void convert_to_backoff();
@@ -171,6 +193,7 @@ private:
   std::vector<int> m_order_count;	// number of grams in each order
   std::vector<Node> m_nodes;		// storage for the nodes
   std::vector<int> m_fetch_stack;	// indices of the gram requested
+  std::vector<int> m_batch_context_nodes; // context suffixes in log_prob_batch()
   //int m_last_order;			// order of the last hit
 
   // For creating the model
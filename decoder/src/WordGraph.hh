@@ -3,8 +3,11 @@
 
 #include <cstddef>  // NULL
 #include <cfloat>
+#include <cmath>
 #include <assert.h>
 #include <vector>
+#include <queue>
+#include <algorithm>
 
 /** A structure for maintaining WordGraphs during recognition.  Each
  * node of the graph stores the incoming arcs.  Weights are stored in
@@ -66,6 +69,13 @@ struct WordGraph {
     int reference_count; //!< Reference count for garbage collection
   };
 
+  /** A path through the graph, found by find_best_paths(). */
+  struct Path {
+    std::vector<int> nodes; //!< The nodes of the path in time order.
+    float am_weight; //!< The sum of the acoustic weights of the arcs.
+    float lm_weight; //!< The sum of the language model weights of the arcs.
+  };
+
 
   /** The default constructor. */
   WordGraph() { }
@@ -236,6 +246,159 @@ struct WordGraph {
     }
   }
 
+  /** Remove the arcs coming to a node, and unlink their source nodes
+   * recursively. */
+  void remove_incoming_arcs(int node_index)
+  {
+    while (nodes[node_index].first_arc >= 0) {
+      int a = nodes[node_index].first_arc;
+      nodes[node_index].first_arc = arcs[a].sibling_arc;
+      m_free_arc_indices.push_back(a);
+      unlink(arcs[a].source_node_id);
+    }
+  }
+
+  /** Find the best paths that end in the given node.
+   *
+   * Performs an A* search backwards from the end node.  The weight of
+   * the best path reaching a node is used as the estimate of the rest
+   * of the path.  It is exact, or an upper bound if arcs have been
+   * removed, so complete paths are found in the order of their
+   * weights.  Each node is expanded at most \a max_paths times,
+   * because only its best suffixes can be a part of the best paths.
+   *
+   * A path starts from a node without incoming arcs, which is the
+   * initial node of the graph, or the node where the graph has been
+   * cut.
+   *
+   * \param end_node = the last node of the paths
+   * \param max_paths = the maximum number of paths to find
+   * \param paths = the paths found, the best first
+   */
+  void find_best_paths(int end_node, int max_paths,
+                       std::vector<Path> &paths) const
+  {
+    paths.clear();
+    if (max_paths <= 0)
+      return;
+
+    std::vector<PathItem> items;
+    std::vector<int> num_expanded(nodes.size(), 0);
+    std::priority_queue<std::pair<float, int> > queue;
+    items.push_back(PathItem(end_node, -1, 0, 0));
+    queue.push(std::make_pair(nodes[end_node].path_weight, 0));
+
+    while (!queue.empty() && (int)paths.size() < max_paths) {
+      int i = queue.top().second;
+      queue.pop();
+      const PathItem item = items[i];
+      const Node &node = nodes[item.node];
+
+      /* No incoming arcs, so the path is complete. */
+      if (node.first_arc < 0) {
+        paths.push_back(Path());
+        Path &path = paths.back();
+        path.am_weight = item.am_weight;
+        path.lm_weight = item.lm_weight;
+        for (int j = i; j >= 0; j = items[j].next_item)
+          path.nodes.push_back(items[j].node);
+        continue;
+      }
+
+      if (num_expanded[item.node]++ >= max_paths)
+        continue;
+      for (int a = node.first_arc; a >= 0; a = arcs[a].sibling_arc) {
+        const Arc &arc = arcs[a];
+        float am_weight = item.am_weight + arc.am_weight;
+        float lm_weight = item.lm_weight + arc.lm_weight;
+        items.push_back(PathItem(arc.source_node_id, i, am_weight, lm_weight));
+        queue.push(std::make_pair(nodes[arc.source_node_id].path_weight
+                                  + am_weight + lm_weight,
+                                  (int)items.size() - 1));
+      }
+    }
+  }
+
+  /** Compute the posterior probabilities of the arcs on the paths
+   * that end in the given node.
+   *
+   * Performs a forward-backward pass in the log semiring.  The weight
+   * of an arc is the sum of its acoustic and language model weights,
+   * multiplied by \a scale.  The paths start from the nodes without
+   * incoming arcs.
+   *
+   * \param end_node = the last node of the paths
+   * \param scale = the scale of the arc weights
+   * \param posteriors = the posterior of each arc index, zero for the
+   * arcs that are not on the paths
+   * \return the total log weight of the paths
+   */
+  double compute_arc_posteriors(int end_node, double scale,
+                                std::vector<float> &posteriors) const
+  {
+    /* Order the nodes so that the source node of an arc comes before
+     * its target node, with a depth-first search backwards from the
+     * end node. */
+    std::vector<int> order;
+    std::vector<bool> visited(nodes.size(), false);
+    std::vector<std::pair<int, int> > stack; // node and next arc
+    visited[end_node] = true;
+    stack.push_back(std::make_pair(end_node, nodes[end_node].first_arc));
+    while (!stack.empty()) {
+      int node = stack.back().first;
+      int a = stack.back().second;
+      if (a < 0) {
+        order.push_back(node);
+        stack.pop_back();
+        continue;
+      }
+      stack.back().second = arcs[a].sibling_arc;
+      int source = arcs[a].source_node_id;
+      if (!visited[source]) {
+        visited[source] = true;
+        stack.push_back(std::make_pair(source, nodes[source].first_arc));
+      }
+    }
+
+    /* Forward pass. */
+    std::vector<double> alpha(nodes.size(), -HUGE_VAL);
+    for (size_t i = 0; i < order.size(); i++) {
+      int node = order[i];
+      if (nodes[node].first_arc < 0)
+        alpha[node] = 0;
+      for (int a = nodes[node].first_arc; a >= 0; a = arcs[a].sibling_arc) {
+        const Arc &arc = arcs[a];
+        alpha[node] = log_add(alpha[node], alpha[arc.source_node_id] +
+                              scale * (arc.am_weight + arc.lm_weight));
+      }
+    }
+
+    /* Backward pass. */
+    std::vector<double> beta(nodes.size(), -HUGE_VAL);
+    beta[end_node] = 0;
+    for (int i = (int)order.size() - 1; i >= 0; i--) {
+      int node = order[i];
+      for (int a = nodes[node].first_arc; a >= 0; a = arcs[a].sibling_arc) {
+        const Arc &arc = arcs[a];
+        beta[arc.source_node_id] = log_add(
+          beta[arc.source_node_id],
+          beta[node] + scale * (arc.am_weight + arc.lm_weight));
+      }
+    }
+
+    double total = alpha[end_node];
+    posteriors.assign(arcs.size(), 0);
+    for (size_t i = 0; i < order.size(); i++) {
+      int node = order[i];
+      for (int a = nodes[node].first_arc; a >= 0; a = arcs[a].sibling_arc) {
+        const Arc &arc = arcs[a];
+        posteriors[a] = exp(alpha[arc.source_node_id] + beta[node] +
+                            scale * (arc.am_weight + arc.lm_weight) - total);
+      }
+    }
+    return total;
+  }
+
   /** Reset the structure to initial state. */
   void reset()
   {
@@ -245,10 +408,46 @@ struct WordGraph {
     m_free_arc_indices.clear();
   }
 
+  /** The indices of the arcs that can be reused. */
+  const std::vector<int> &free_arc_indices() const { return m_free_arc_indices; }
+
+  /** The indices of the nodes that can be reused. */
+  const std::vector<int> &free_node_indices() const { return m_free_node_indices; }
+
+  /** Replace the lists of reusable arcs and nodes, when the graph has
+   * been restored from a saved state. */
+  void set_free_indices(const std::vector<int> &arc_indices,
+                        const std::vector<int> &node_indices)
+  {
+    m_free_arc_indices = arc_indices;
+    m_free_node_indices = node_indices;
+  }
+
   std::vector<Arc> arcs; //!< All arcs of the graph.
   std::vector<Node> nodes; //!< All nodes of the graph.
 
 private:
+  /** Return log(exp(a) + exp(b)). */
+  static double log_add(double a, double b)
+  {
+    if (a < b)
+      std::swap(a, b);
+    if (b == -HUGE_VAL)
+      return a;
+    return a + log1p(exp(b - a));
+  }
+
+  /** A partial path of find_best_paths() from a node to the end node. */
+  struct PathItem {
+    PathItem(int node, int next_item, float am_weight, float lm_weight)
+      : node(node), next_item(next_item), am_weight(am_weight),
+        lm_weight(lm_weight) { }
+    int node; //!< The first node of the partial path.
+    int next_item; //!< The rest of the path, or -1 at the end node.
+    float am_weight; //!< The acoustic weight of the partial path.
+    float lm_weight; //!< The language model weight of the partial path.
+  };
+
   std::vector<int> m_free_arc_indices; //!< Indices of the reusable arcs
   std::vector<int> m_free_node_indices; //!< Indices of the reusable nodes
 
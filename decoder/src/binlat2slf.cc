@@ -0,0 +1,20 @@
+#include <stdio.h>
+
+#include "BinaryLattice.hh"
+
+int main(int argc, char *argv[])
+{
+  BinaryLattice lattice;
+
+  fputs("reading binary lattice from stdin, writing SLF to stdout\n", stderr);
+
+  try {
+    lattice.read(stdin);
+    lattice.write_slf(stdout);
+  }
+  catch (std::exception &e) {
+    fprintf(stderr, "binlat2slf: %s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
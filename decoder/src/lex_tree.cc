@@ -0,0 +1,84 @@
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+#include "Toolbox.hh"
+
+static void usage(const char *program)
+{
+  fprintf(stderr,
+          "Use: %s [options] model.ph dictionary.lex tree\n"
+          "Builds the lexical prefix tree of a dictionary and writes it into a\n"
+          "file that the decoder can read with lex_tree_read().\n"
+          "\n"
+          "The lexicon options have to be the same as in the decoder:\n"
+          "  -C       no cross-word triphones\n"
+          "  -O       no optional short silence\n"
+          "  -W       silence is not a word\n"
+          "  -L N     LM lookahead, 0=none, 1=first subtree nodes, 2=full\n"
+          "           (default 1)\n"
+          "  -w WORD  word boundary symbol\n"
+          "  -p D,N   prune lookahead buffers with min delta D and max depth N\n"
+          "Other options:\n"
+          "  -t N     build the tree in N threads\n"
+          "  -v       print the size of the tree\n",
+          program);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  bool cross_word_triphones = true;
+  bool optional_short_silence = true;
+  bool silence_is_word = true;
+  int lm_lookahead = 1;
+  std::string word_boundary;
+  int prune_min_delta = -1, prune_max_depth = -1;
+  int num_threads = 1;
+  int verbose = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "COWL:w:p:t:v")) != -1) {
+    switch (opt) {
+    case 'C': cross_word_triphones = false; break;
+    case 'O': optional_short_silence = false; break;
+    case 'W': silence_is_word = false; break;
+    case 'L': lm_lookahead = atoi(optarg); break;
+    case 'w': word_boundary = optarg; break;
+    case 'p':
+      if (sscanf(optarg, "%d,%d", &prune_min_delta, &prune_max_depth) != 2)
+        usage(argv[0]);
+      break;
+    case 't': num_threads = atoi(optarg); break;
+    case 'v': verbose = 1; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (argc - optind != 3)
+    usage(argv[0]);
+  const char *hmm_path = argv[optind];
+  const char *lex_path = argv[optind + 1];
+  const char *tree_path = argv[optind + 2];
+
+  try {
+    Toolbox t(0, hmm_path, NULL);
+    t.set_verbose(verbose);
+    t.set_lm_lookahead(lm_lookahead);
+    t.set_cross_word_triphones(cross_word_triphones);
+    t.set_optional_short_silence(optional_short_silence);
+    t.set_silence_is_word(silence_is_word);
+    t.set_lex_num_threads(num_threads);
+    if (!word_boundary.empty())
+      t.set_word_boundary(word_boundary);
+    t.lex_read(lex_path);
+    if (prune_max_depth >= 0)
+      t.prune_lm_lookahead_buffers(prune_min_delta, prune_max_depth);
+
+    t.lex_tree_write(tree_path);
+  }
+  catch (std::exception &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
@@ -7,7 +7,7 @@ typedef TPLexPrefixTree::Node Node;
 Toolbox t;
 
 void
-print_tree(Node *root)
+print_tree(TPLexPrefixTree &tree, Node *root)
 {
   std::vector<Node*> stack(1, root);
 
@@ -18,18 +18,18 @@ print_tree(Node *root)
     if (node->flags & NODE_DEBUG_PRINTED)
       continue;
 
-    const char *color = node->state == NULL ? "red" : "blue";
+    const char *color = node->state < 0 ? "red" : "blue";
     const char *fill_color = node->word_id == -1 ? "white" : "gray";
     
     printf("\t%d [label=\"%d\\n%s\\n%04X\",style=filled,color=%s,fillcolor=%s];\n", 
-	   node->node_id, node->state == NULL ? -1 : node->state->model,
+	   node->node_id, node->state < 0 ? -1 : tree.state(node)->model,
 	   node->word_id == -1 ? "-" : t.word(node->word_id).c_str(), 
 	   node->flags & 0x3fff, color, fill_color);
     node->flags |= NODE_DEBUG_PRINTED;
 
     for (int i = 0; i < node->arcs.size(); i++) {
-      printf("\t\t%d -> %d;\n", node->node_id, node->arcs[i].next->node_id);
-      stack.push_back(node->arcs[i].next);
+      printf("\t\t%d -> %d;\n", node->node_id, node->arcs[i].next);
+      stack.push_back(tree.node(node->arcs[i].next));
     }
   }
   printf("}\n");
@@ -60,7 +60,7 @@ main(int argc, char *argv[])
     TPLexPrefixTree &lex = t.debug_get_tp_lex();
     Node *root = lex.start_node();
     lex.debug_prune_dead_ends(root);
-    print_tree(root);
+    print_tree(lex, root);
   }
   catch (std::exception &e) {
     fprintf(stderr, "exception: %s\n", e.what());
@@ -0,0 +1,90 @@
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+#include "Toolbox.hh"
+
+static void usage(const char *program)
+{
+  fprintf(stderr,
+          "Use: %s [options] model.ph dictionary.lex lm table [lookahead_lm]\n"
+          "Precomputes the bigram lookahead scores of the lexical prefix tree\n"
+          "nodes after every word of the vocabulary.\n"
+          "\n"
+          "The lexicon options have to be the same as in the decoder:\n"
+          "  -C       no cross-word triphones\n"
+          "  -O       no optional short silence\n"
+          "  -W       silence is not a word\n"
+          "  -s S,E   sentence start and end words\n"
+          "  -p D,N   prune lookahead buffers with min delta D and max depth N\n"
+          "Other options:\n"
+          "  -a       the language models are in ARPA format\n"
+          "  -b N     bytes per quantized score, 1 or 2 (default 1)\n",
+          program);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  bool cross_word_triphones = true;
+  bool optional_short_silence = true;
+  bool silence_is_word = true;
+  std::string sentence_start, sentence_end;
+  int prune_min_delta = -1, prune_max_depth = -1;
+  bool binary = true;
+  int bytes_per_score = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "COWs:p:ab:")) != -1) {
+    switch (opt) {
+    case 'C': cross_word_triphones = false; break;
+    case 'O': optional_short_silence = false; break;
+    case 'W': silence_is_word = false; break;
+    case 's': {
+      std::string arg(optarg);
+      size_t comma = arg.find(',');
+      if (comma == std::string::npos)
+        usage(argv[0]);
+      sentence_start = arg.substr(0, comma);
+      sentence_end = arg.substr(comma + 1);
+      break;
+    }
+    case 'p':
+      if (sscanf(optarg, "%d,%d", &prune_min_delta, &prune_max_depth) != 2)
+        usage(argv[0]);
+      break;
+    case 'a': binary = false; break;
+    case 'b': bytes_per_score = atoi(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (argc - optind < 4 || argc - optind > 5)
+    usage(argv[0]);
+  const char *hmm_path = argv[optind];
+  const char *lex_path = argv[optind + 1];
+  const char *lm_path = argv[optind + 2];
+  const char *table_path = argv[optind + 3];
+  const char *lookahead_lm_path = argc - optind > 4 ? argv[optind + 4] : "";
+
+  try {
+    Toolbox t(0, hmm_path, NULL);
+    t.set_lm_lookahead(1);
+    t.set_cross_word_triphones(cross_word_triphones);
+    t.set_optional_short_silence(optional_short_silence);
+    t.set_silence_is_word(silence_is_word);
+    t.lex_read(lex_path);
+    if (!sentence_start.empty())
+      t.set_sentence_boundary(sentence_start, sentence_end);
+    t.ngram_read(lm_path, binary);
+    t.read_lookahead_ngram(lookahead_lm_path, binary);
+    if (prune_max_depth >= 0)
+      t.prune_lm_lookahead_buffers(prune_min_delta, prune_max_depth);
+
+    t.write_lm_lookahead_table(table_path, bytes_per_score);
+  }
+  catch (std::exception &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
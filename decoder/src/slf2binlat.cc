@@ -0,0 +1,29 @@
+#include <stdio.h>
+
+#include "BinaryLattice.hh"
+
+int main(int argc, char *argv[])
+{
+  BinaryLattice lattice;
+
+  if (argc > 1) {
+    fputs("usage: slf2binlat < input.slf > output.binlat\n"
+          "Converts an SLF lattice to a binary lattice. The node times (t=) "
+          "have to be\nframe numbers, as in the lattices written by the "
+          "decoder. Lattices with times\nin seconds, as in standard HTK SLF, "
+          "are rejected.\n", stderr);
+    return 1;
+  }
+
+  fputs("reading SLF from stdin, writing binary lattice to stdout\n", stderr);
+
+  try {
+    lattice.read_slf(stdin);
+    lattice.write(stdout);
+  }
+  catch (std::exception &e) {
+    fprintf(stderr, "slf2binlat: %s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
@@ -107,6 +107,9 @@ public:
 
   const std::vector<Hmm> &hmms();
   void lex_read(const char *file);
+  void lex_tree_read(const char *file);
+  void lex_tree_write(const char *file);
+  void set_lex_num_threads(int num_threads);
   const std::string &lex_word();
   const std::string &lex_phone();
 
@@ -123,6 +126,9 @@ public:
   void read_lookahead_ngram(const char *file, const bool binary, bool quiet);
   void read_lookahead_ngram(const char *file, const bool binary);
   void read_lookahead_ngram(const char *file);
+  void read_lm_lookahead_table(const char *file);
+  void write_lm_lookahead_table(const char *file, int bytes_per_score);
+  void write_lm_lookahead_table(const char *file);
 
   // Lna
   void lna_open(const char *file, int size);
@@ -147,6 +153,8 @@ public:
 	void expand_words(int frame, const std::string &words);
   void go(int frame);
   bool run();
+  void set_endpoint_detection(int silence_frames, float margin, bool reset);
+  bool endpoint_detected() const;
   bool runto(int frame);
 	bool recognize_segment(int start_frame, int end_frame);
 
@@ -157,20 +165,56 @@ public:
   int paths();
 
   void write_word_graph(const std::string &file_name);
+  void write_word_graph_binary(const std::string &file_name);
   void print_best_lm_history();
   void print_best_lm_history_to_file(FILE *out);
+  void print_history_statistics();
+  void print_lm_lookahead_statistics();
+  void share_lm_lookahead_cache(Toolbox &other);
+  Toolbox *add_stream();
+  int num_streams() const;
+  Toolbox *stream(int index);
+  void set_stream_threads(int num_threads);
+  void run_streams();
   const bytestype &best_hypo_string(bool print_all, bool output_time);
+  const bytestype &stable_words_string(bool output_time);
+  const bytestype &partial_hypothesis_string(bool output_time);
+  const bytestype &nbest_string(int n, bool output_time);
+  const bytestype &word_confidences_string();
+  void set_posterior_scale(float scale);
   void write_state_segmentation(const std::string &file);
+  void set_profiling(bool value);
+  void set_max_profile_frames(int frames);
+  void clear_profile();
+  void write_profile(const std::string &file, const std::string &format);
+  void write_profile(const std::string &file);
+  void set_target_tokens(int tokens);
+  void set_target_frame_time(double seconds);
+  void set_beam_bounds(float min_beam, float max_beam);
+  void set_beam_hysteresis(double hysteresis);
+  void set_max_beam_trajectory_steps(int steps);
+  void write_beam_trajectory(const std::string &file);
+  void save_search_state(const std::string &file);
+  void load_search_state(const std::string &file);
 
   void set_forced_end(bool forced_end);
   void set_hypo_limit(int hypo_limit);
   void set_prune_similar(int prune_similar);
+  void set_lm_state_recombination(bool value);
   void set_word_limit(int word_limit);
   void set_word_beam(float word_beam);
   void set_lm_scale(float lm_scale);
   void set_lm_offset(float lm_offset);
   void set_unk_offset(float unk_offset);
   void set_token_limit(int limit);
+  void set_token_memory_budget(size_t bytes);
+  void set_token_memory_retained(size_t bytes);
+  size_t token_memory_usage() const;
+  size_t token_memory_peak() const;
+  int num_budget_dropped_tokens() const;
+  void set_num_threads(int num_threads);
+  bool set_simd_pruning(bool value);
+  double prune_time() const;
   void set_state_beam(float beam);
   void set_duration_scale(float scale);
   void set_transition_scale(float scale);
@@ -189,6 +233,7 @@ public:
   void set_silence_is_word(bool b);
 	void set_ignore_case(bool b);		
   void set_lm_lookahead(int lmlh);
+  void set_sparse_lm_lookahead(bool value);
 	void set_insertion_penalty(float ip);
   void set_print_text_result(int print);
   void set_print_state_segmentation(int print);
@@ -204,8 +249,11 @@ public:
   void add_hesitation_word(const std::string &word);
   void set_dummy_word_boundaries(bool value);
   void set_generate_word_graph(bool value);
+  void set_word_graph_flush_interval(int interval);
   void set_use_word_pair_approximation(bool value);
+  void set_use_lm_cache(bool value, bool open_addressing);
   void set_use_lm_cache(bool value);
+  void set_batch_lm_scoring(bool value);
   void set_require_sentence_end(bool s);
   void set_remove_pronunciation_id(bool remove);
 
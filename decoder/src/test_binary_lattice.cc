@@ -0,0 +1,386 @@
+// Tests the conversions between SLF and binary lattices, and that truncated
+// and corrupt binary lattices are rejected.
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "BinaryLattice.hh"
+#include "test_check.hh"
+
+using namespace std;
+
+static FILE *
+file_with_contents(const string &contents)
+{
+  FILE *file = tmpfile();
+  if (file == NULL) {
+    perror("tmpfile");
+    exit(2);
+  }
+  if (!contents.empty())
+    fwrite(contents.data(), 1, contents.size(), file);
+  rewind(file);
+  return file;
+}
+
+static string
+file_contents(FILE *file)
+{
+  string contents;
+  char buffer[4096];
+  rewind(file);
+  size_t count;
+  while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    contents.append(buffer, count);
+  return contents;
+}
+
+static string
+to_slf(const BinaryLattice &lattice)
+{
+  FILE *file = file_with_contents("");
+  lattice.write_slf(file);
+  string result = file_contents(file);
+  fclose(file);
+  return result;
+}
+
+static string
+to_binary(const BinaryLattice &lattice)
+{
+  FILE *file = file_with_contents("");
+  lattice.write(file);
+  string result = file_contents(file);
+  fclose(file);
+  return result;
+}
+
+static void
+read_slf(const string &slf, BinaryLattice &lattice)
+{
+  FILE *file = file_with_contents(slf);
+  try {
+    lattice.read_slf(file);
+  }
+  catch (...) {
+    fclose(file);
+    throw;
+  }
+  fclose(file);
+}
+
+static void
+read_binary(const string &binary, BinaryLattice &lattice)
+{
+  FILE *file = file_with_contents(binary);
+  try {
+    lattice.read(file);
+  }
+  catch (...) {
+    fclose(file);
+    throw;
+  }
+  fclose(file);
+}
+
+static bool
+binary_is_rejected(const string &binary)
+{
+  BinaryLattice lattice;
+  try {
+    read_binary(binary, lattice);
+  }
+  catch (BinaryLattice::FormatError &) {
+    return true;
+  }
+  return false;
+}
+
+static bool
+slf_is_rejected(const string &slf)
+{
+  BinaryLattice lattice;
+  try {
+    read_slf(slf, lattice);
+  }
+  catch (BinaryLattice::FormatError &) {
+    return true;
+  }
+  return false;
+}
+
+static bool
+mapped_is_rejected(const string &binary)
+{
+  char path[] = "/tmp/test_binary_lattice.XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    perror("mkstemp");
+    exit(2);
+  }
+  if (write(fd, binary.data(), binary.size()) != (ssize_t)binary.size()) {
+    perror("write");
+    exit(2);
+  }
+  close(fd);
+
+  bool rejected = false;
+  MappedBinaryLattice lattice;
+  try {
+    lattice.open(path);
+  }
+  catch (BinaryLattice::FormatError &) {
+    rejected = true;
+  }
+  lattice.close();
+  unlink(path);
+  return rejected;
+}
+
+// Returns a copy of the binary lattice with the 32-bit value at the given
+// byte offset replaced.
+static string
+patched(const string &binary, size_t offset, int32_t value)
+{
+  string result = binary;
+  memcpy(&result[offset], &value, sizeof(value));
+  return result;
+}
+
+static const char *test_slf =
+  "VERSION=1.1\n"
+  "base=10\n"
+  "dir=f\n"
+  "lmscale=30.000000 wdpenalty=-5.000000\n"
+  "N=5\tL=6\n"
+  "start=0 end=4\n"
+  "I=0\tt=0\n"
+  "I=1\tt=12\n"
+  "I=2\tt=15\n"
+  "I=3\tt=40\n"
+  "I=4\tt=52\n"
+  "J=0\tS=0\tE=1\tW=<s>\tv=0\ta=-1.250000e+02\tl=0.000000e+00\n"
+  "J=1\tS=1\tE=2\tW=kissa\tv=0\ta=-8.500000e+01\tl=-2.302585e+00\n"
+  "J=2\tS=1\tE=3\tW=kissat\tv=0\ta=-3.125000e+02\tl=-4.605170e+00\n"
+  "J=3\tS=2\tE=3\tW=istuu\tv=0\ta=-2.500000e+02\tl=-1.151293e+00\n"
+  "J=4\tS=3\tE=4\tW=</s>\tv=0\ta=-9.000000e+01\tl=-6.931472e-01\n"
+  "J=5\tS=2\tE=4\tW=kissa\tv=0\ta=-4.000000e+02\tl=-9.210340e+00\n";
+
+static void
+test_round_trip()
+{
+  BinaryLattice slf_lattice;
+  read_slf(test_slf, slf_lattice);
+  check(slf_lattice.nodes.size() == 5, "number of nodes read from SLF");
+  check(slf_lattice.arcs.size() == 6, "number of arcs read from SLF");
+  check(slf_lattice.start_node == 0 && slf_lattice.end_node == 4,
+        "start and end nodes read from SLF");
+  check(slf_lattice.arcs[1].word == slf_lattice.arcs[5].word,
+        "the same word is stored once in the string table");
+
+  string slf = to_slf(slf_lattice);
+  check(slf == test_slf, "SLF is written back as it was read");
+
+  string binary = to_binary(slf_lattice);
+  BinaryLattice binary_lattice;
+  read_binary(binary, binary_lattice);
+  check(to_slf(binary_lattice) == slf, "SLF -> binary -> SLF round trip");
+  check(to_binary(binary_lattice) == binary,
+        "binary -> binary round trip");
+  check(binary_lattice.lm_scale == 30 &&
+        binary_lattice.insertion_penalty == -5,
+        "lm_scale and insertion_penalty survive the round trip");
+
+  BinaryLattice reread;
+  read_slf(to_slf(binary_lattice), reread);
+  check(to_binary(reread) == binary, "binary -> SLF -> binary round trip");
+
+  check(!mapped_is_rejected(binary), "a valid lattice can be mapped");
+}
+
+// A lattice in the format of TokenPassSearch::write_word_graph(). The
+// initial node is at frame -1.
+static const char *word_graph_slf =
+  "VERSION=1.1\n"
+  "base=10\n"
+  "dir=f\n"
+  "lmscale=30.000000 wdpenalty=0.000000\n"
+  "N=3\tL=2\n"
+  "start=0 end=2\n"
+  "I=0\tt=-1\n"
+  "I=1\tt=37\n"
+  "I=2\tt=80\n"
+  "J=0\tS=0\tE=1\tW=kissa\tv=0\ta=-2.125000e+02\tl=-2.302585e+00\n"
+  "J=1\tS=1\tE=2\tW=!NULL\tv=0\ta=-1.500000e+02\tl=-6.931472e-01\n";
+
+static void
+test_word_graph()
+{
+  BinaryLattice lattice;
+  read_slf(word_graph_slf, lattice);
+  check(lattice.nodes.size() == 3 && lattice.nodes[0].frame == -1,
+        "the initial node of a word graph is read from SLF");
+  check(to_slf(lattice) == word_graph_slf,
+        "a word graph is written back as it was read");
+
+  BinaryLattice binary_lattice;
+  read_binary(to_binary(lattice), binary_lattice);
+  BinaryLattice reread;
+  read_slf(to_slf(binary_lattice), reread);
+  check(to_slf(reread) == word_graph_slf,
+        "a word graph survives SLF -> binary -> SLF -> SLF");
+}
+
+static void
+test_empty_lattice()
+{
+  BinaryLattice lattice;
+  string binary = to_binary(lattice);
+  check(binary.size() == sizeof(BinaryLattice::Header),
+        "an empty lattice is only a header");
+  check(!binary_is_rejected(binary), "an empty lattice can be read");
+  check(!mapped_is_rejected(binary), "an empty lattice can be mapped");
+}
+
+static void
+test_truncated()
+{
+  BinaryLattice lattice;
+  read_slf(test_slf, lattice);
+  string binary = to_binary(lattice);
+
+  for (size_t size = 0; size < binary.size(); size++) {
+    string truncated = binary.substr(0, size);
+    char message[100];
+    sprintf(message, "a lattice truncated to %d bytes is rejected",
+            (int)size);
+    check(binary_is_rejected(truncated), message);
+    check(mapped_is_rejected(truncated), string("mapped: ") + message);
+  }
+
+  string extended = binary + "x";
+  check(mapped_is_rejected(extended),
+        "mapped: a lattice with trailing bytes is rejected");
+}
+
+static void
+test_corrupt()
+{
+  BinaryLattice lattice;
+  read_slf(test_slf, lattice);
+  string binary = to_binary(lattice);
+
+  const size_t header_size = sizeof(BinaryLattice::Header);
+  const size_t arcs_offset =
+    header_size + lattice.nodes.size() * sizeof(BinaryLattice::Node);
+
+  string bad_magic = binary;
+  bad_magic[1] ^= 1;
+  check(binary_is_rejected(bad_magic), "a bad magic is rejected");
+  check(mapped_is_rejected(bad_magic), "mapped: a bad magic is rejected");
+
+  string bad_version =
+    patched(binary, offsetof(BinaryLattice::Header, version), 999);
+  check(binary_is_rejected(bad_version), "an unknown version is rejected");
+  check(mapped_is_rejected(bad_version),
+        "mapped: an unknown version is rejected");
+
+  check(binary_is_rejected(
+          patched(binary, offsetof(BinaryLattice::Header, num_nodes), -1)),
+        "a negative number of nodes is rejected");
+  check(binary_is_rejected(
+          patched(binary, offsetof(BinaryLattice::Header, num_arcs), -1)),
+        "a negative number of arcs is rejected");
+  check(binary_is_rejected(
+          patched(binary, offsetof(BinaryLattice::Header, string_table_size),
+                  -1)),
+        "a negative string table size is rejected");
+  check(binary_is_rejected(
+          patched(binary, offsetof(BinaryLattice::Header, num_arcs),
+                  0x7fffffff)),
+        "a huge number of arcs is rejected");
+  check(binary_is_rejected(
+          patched(binary, offsetof(BinaryLattice::Header, start_node), 5)),
+        "a start node out of range is rejected");
+  check(binary_is_rejected(
+          patched(binary, offsetof(BinaryLattice::Header, end_node), -2)),
+        "an end node out of range is rejected");
+
+  const size_t arc_size = sizeof(BinaryLattice::Arc);
+  check(binary_is_rejected(
+          patched(binary, arcs_offset + 2 * arc_size +
+                  offsetof(BinaryLattice::Arc, source_node), -1)),
+        "an arc from a negative node is rejected");
+  check(binary_is_rejected(
+          patched(binary, arcs_offset + 3 * arc_size +
+                  offsetof(BinaryLattice::Arc, target_node), 5)),
+        "an arc to a node out of range is rejected");
+  check(binary_is_rejected(
+          patched(binary, arcs_offset + 4 * arc_size +
+                  offsetof(BinaryLattice::Arc, word),
+                  lattice.strings.size())),
+        "a word out of the string table is rejected");
+
+  string unterminated = binary;
+  unterminated[unterminated.size() - 1] = 'x';
+  check(binary_is_rejected(unterminated),
+        "an unterminated string table is rejected");
+
+  check(binary_is_rejected(test_slf), "SLF is not read as a binary lattice");
+  check(!BinaryLattice::is_binary(test_slf[0]),
+        "SLF is not detected as a binary lattice");
+  check(BinaryLattice::is_binary((unsigned char)binary[0]),
+        "a binary lattice is detected as one");
+}
+
+static void
+test_corrupt_slf()
+{
+  check(slf_is_rejected("N=1 L=1\nI=0 t=0\nJ=0 S=0 E=1 W=a\n"),
+        "SLF with an arc to an undefined node is rejected");
+  check(slf_is_rejected("N=2 L=1\nI=0 t=0\nI=1 t=1\nJ=0 S=0 E=1\n"),
+        "SLF with an arc without a word is rejected");
+  check(slf_is_rejected("N=1 L=0\nI=x t=0\n"),
+        "SLF with an invalid node number is rejected");
+  check(slf_is_rejected("N=1 L=0\nI=0 t=0.5s\n"),
+        "SLF with an invalid time is rejected");
+  check(slf_is_rejected("N=1 L=0\nI=0 t=0.37\n"),
+        "SLF with a time in seconds is rejected");
+  check(slf_is_rejected("N=1 L=0\nI=0 t=-2\n"),
+        "SLF with a time before the initial node is rejected");
+  check(slf_is_rejected("N=1 L=0\nI=0 t\n"),
+        "SLF with a field without a value is rejected");
+
+  BinaryLattice lattice;
+  read_slf("# A comment\nstart=3 end=7\nI=7 t=2\nI=3 t=1\n"
+           "J=0 S=3 E=7 W=a # another comment\n", lattice);
+  check(lattice.nodes.size() == 2 && lattice.start_node == 1 &&
+        lattice.end_node == 0 && lattice.arcs.size() == 1 &&
+        lattice.arcs[0].source_node == 1 && lattice.arcs[0].target_node == 0,
+        "SLF nodes are renumbered in the order they are defined");
+}
+
+int
+main(int argc, char *argv[])
+{
+  try {
+    test_round_trip();
+    test_word_graph();
+    test_empty_lattice();
+    test_truncated();
+    test_corrupt();
+    test_corrupt_slf();
+  }
+  catch (std::exception &e) {
+    cerr << "FAILED: " << e.what() << endl;
+    return 1;
+  }
+
+  return test_result();
+}
@@ -0,0 +1,43 @@
+#ifndef TEST_CHECK_HH
+#define TEST_CHECK_HH
+
+#include <iostream>
+#include <string>
+
+/** Checks shared by the test programs. Each test program is a single
+ * translation unit, so the failure count can live in the header.
+ *
+ * Example:
+ * \code
+ * check(list.size() == 3, "list: size");
+ * ...
+ * return test_result();
+ * \endcode
+ */
+
+static int failures = 0;
+
+/** Reports a failed check on the standard error and counts it. */
+static void
+check(bool condition, const std::string &message)
+{
+  if (!condition) {
+    std::cerr << "FAILED: " << message << std::endl;
+    failures++;
+  }
+}
+
+/** Prints the summary of the checks and returns the exit status of the
+ * test program. */
+static int
+test_result()
+{
+  if (failures > 0) {
+    std::cerr << failures << " checks failed" << std::endl;
+    return 1;
+  }
+  std::cout << "All tests passed" << std::endl;
+  return 0;
+}
+
+#endif /* TEST_CHECK_HH */
@@ -0,0 +1,212 @@
+// Tests that HistoryArena reuses the history structures that are released
+// with hist::unlink(), and that resetting the arena at the start of a
+// segment releases all of them without allocating new blocks.
+//
+// If the models are given, also checks that the arenas of a search stop
+// growing when the same utterance is decoded again, and that only the
+// histories of the initial token are live after start_segment().
+//
+// Usage: test_history_arena [HMMS LEXICON LM LNA]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "HistoryArena.hh"
+#include "LMHistory.hh"
+#include "Toolbox.hh"
+#include "test_check.hh"
+
+using namespace std;
+
+static LMHistory *
+new_history(HistoryArena<LMHistory> &arena, LMHistory *previous)
+{
+  return new (arena.allocate()) LMHistory(NULL, previous);
+}
+
+// Creates histories that branch like the word histories of tokens, and
+// returns the linked heads.
+static vector<LMHistory*>
+create_histories(HistoryArena<LMHistory> &arena, int num_heads, int length)
+{
+  vector<LMHistory*> heads;
+  LMHistory *root = new_history(arena, NULL);
+  hist::link(root);
+  for (int i = 0; i < num_heads; i++) {
+    LMHistory *head = root;
+    for (int j = 0; j < length; j++)
+      head = new_history(arena, head);
+    hist::link(head);
+    heads.push_back(head);
+  }
+  hist::unlink(root, arena.pool());
+  return heads;
+}
+
+static void
+test_reuse()
+{
+  HistoryArena<LMHistory> arena(8);
+  vector<LMHistory*> heads = create_histories(arena, 5, 4);
+  check(arena.num_live() == 21, "live histories after creating them");
+  check(arena.peak_live() == 21, "peak after creating the histories");
+  int capacity = arena.capacity();
+  check(capacity == 24, "the histories are allocated in blocks");
+
+  // Releasing a head releases its branch, but not the shared root.
+  set<LMHistory*> released;
+  for (LMHistory *h = heads[0]; h->previous != NULL; h = h->previous)
+    released.insert(h);
+  hist::unlink(heads[0], arena.pool());
+  check(arena.num_live() == 17, "live histories after releasing a branch");
+
+  // The released structures are used again before new blocks.
+  for (int i = 0; i < 4; i++)
+    check(released.count(new_history(arena, NULL)) == 1,
+          "a released history is reused");
+  check(arena.capacity() == capacity, "no blocks allocated for reuse");
+  check(arena.peak_live() == 21, "the peak is kept until reset");
+
+  // Releasing everything else releases the root too.
+  for (int i = 1; i < heads.size(); i++)
+    hist::unlink(heads[i], arena.pool());
+  check(arena.num_live() == 4, "the root is released with its last branch");
+}
+
+static void
+test_reset()
+{
+  HistoryArena<LMHistory> arena(8);
+  set<LMHistory*> storage;
+  int capacity = 0;
+  for (int segment = 0; segment < 5; segment++) {
+    unsigned int generation = arena.generation();
+
+    // Some histories are left referenced at the end of the segment, like
+    // the histories of the final tokens.
+    vector<LMHistory*> heads = create_histories(arena, 6, 3);
+    check(arena.num_live() == 19, "live histories in a segment");
+    for (int i = 0; i < 3; i++)
+      hist::unlink(heads[i], arena.pool());
+
+    if (segment == 0)
+      capacity = arena.capacity();
+    check(arena.capacity() == capacity,
+          "no blocks allocated after the first segment");
+
+    arena.reset();
+    check(arena.num_live() == 0, "no live histories after reset");
+    check(arena.peak_live() == 0, "the peak is cleared by reset");
+    check(arena.generation() == generation + 1,
+          "reset starts a new generation");
+    check(arena.capacity() == capacity, "reset keeps the blocks");
+
+    // All the storage is free after reset, including the histories that
+    // were left referenced.
+    set<LMHistory*> free_storage;
+    for (int i = 0; i < capacity; i++)
+      free_storage.insert(static_cast<LMHistory*>(arena.allocate()));
+    check(arena.capacity() == capacity, "all the storage is free after reset");
+    if (segment == 0)
+      storage = free_storage;
+    else
+      check(free_storage == storage, "the same storage is used in every "
+            "segment");
+    arena.reset();
+  }
+}
+
+// Reads the live and allocated counts of the arenas of a search.
+static void
+read_history_statistics(TokenPassSearch &search, vector<int> &live,
+                        vector<int> &allocated)
+{
+  FILE *file = tmpfile();
+  search.print_history_statistics(file);
+  rewind(file);
+  live.clear();
+  allocated.clear();
+  char line[256];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    char name[64];
+    int num_live, peak, num_allocated;
+    if (sscanf(line, " %63[A-Za-z]: %d / %d / %d", name, &num_live, &peak,
+               &num_allocated) == 4)
+    {
+      live.push_back(num_live);
+      allocated.push_back(num_allocated);
+    }
+  }
+  fclose(file);
+}
+
+static void
+test_search(char *argv[])
+{
+  Toolbox t(0, argv[0], NULL);
+  t.set_verbose(0);
+  t.set_lm_lookahead(1);
+  t.set_optional_short_silence(1);
+  t.set_cross_word_triphones(1);
+  t.set_require_sentence_end(1);
+  t.set_silence_is_word(0);
+  t.lex_read(argv[1]);
+  t.set_sentence_boundary("<s>", "</s>");
+  t.ngram_read(argv[2], 0, true);
+  t.read_lookahead_ngram("", false, true);
+  t.set_global_beam(120);
+  t.set_word_end_beam(80);
+  t.set_token_limit(3000);
+  t.set_prune_similar(3);
+  t.set_lm_scale(10);
+  t.set_generate_word_graph(true);
+
+  vector<int> live, allocated, first_allocated;
+  for (int utterance = 0; utterance < 3; utterance++) {
+    t.lna_open(argv[3], 1024);
+    t.reset(0);
+    read_history_statistics(t.tp_search(), live, allocated);
+    check(live.size() == 3, "history statistics of the search");
+    // The initial token has the sentence start and its empty history.
+    for (int i = 0; i < live.size(); i++)
+      check(live[i] <= 2, "only the initial token has histories after "
+            "start_segment()");
+
+    t.set_end(-1);
+    while (t.run())
+      ;
+
+    read_history_statistics(t.tp_search(), live, allocated);
+    if (utterance == 0)
+      first_allocated = allocated;
+    else
+      check(allocated == first_allocated, "the arenas do not grow when "
+            "the same utterance is decoded again");
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  if (argc != 1 && argc != 5) {
+    cerr << "usage: " << argv[0] << " [HMMS LEXICON LM LNA]" << endl;
+    return 2;
+  }
+
+  try {
+    test_reuse();
+    test_reset();
+    if (argc == 5)
+      test_search(argv + 1);
+  }
+  catch (std::exception &e) {
+    cerr << "FAILED: " << e.what() << endl;
+    failures++;
+  }
+
+  return test_result();
+}
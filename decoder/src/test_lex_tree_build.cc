@@ -0,0 +1,103 @@
+// Tests that building the lexical prefix tree in parallel gives the same
+// nodes and arcs as adding the words one at a time, with and without
+// cross-word triphones.
+//
+// Usage: test_lex_tree_build HMMS LEXICON...
+
+#include <stdio.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "Toolbox.hh"
+
+using namespace std;
+
+static const char *hmm_path;
+
+// Writes the nodes of the tree one per line: the word ID, the model of the
+// state, the flags, and the target and log probability of each arc.
+static string
+dump_tree(const TPLexPrefixTree &tree)
+{
+  ostringstream out;
+  char buffer[64];
+  for (int i = 0; i < tree.num_nodes(); i++) {
+    const TPLexPrefixTree::Node *node = tree.node(i);
+    out << i << " w" << node->word_id
+        << " m" << (node->state >= 0 ? tree.state(node)->model : -1)
+        << " f" << node->flags << ":";
+    for (int j = 0; j < node->arcs.size(); j++) {
+      snprintf(buffer, sizeof(buffer), " %d/%.4f", node->arcs[j].next,
+               node->arcs[j].log_prob);
+      out << buffer;
+    }
+    out << "\n";
+  }
+  return out.str();
+}
+
+static string
+build_tree(const char *lexicon_path, bool cross_word, int num_threads)
+{
+  Toolbox t(0, hmm_path, NULL);
+  t.set_verbose(0);
+  t.set_lm_lookahead(0);
+  t.set_optional_short_silence(1);
+  t.set_cross_word_triphones(cross_word);
+  t.set_silence_is_word(0);
+  t.set_lex_num_threads(num_threads);
+  t.lex_read(lexicon_path);
+  return dump_tree(t.debug_get_tp_lex());
+}
+
+static int
+test_lexicon(const char *lexicon_path)
+{
+  int failures = 0;
+  for (int cross_word = 0; cross_word <= 1; cross_word++) {
+    string serial = build_tree(lexicon_path, cross_word, 1);
+    string parallel = build_tree(lexicon_path, cross_word, 4);
+    if (parallel != serial) {
+      // Show the first node that differs.
+      istringstream serial_lines(serial), parallel_lines(parallel);
+      string serial_line, parallel_line;
+      while (getline(serial_lines, serial_line) &&
+             getline(parallel_lines, parallel_line) &&
+             serial_line == parallel_line);
+      cerr << "FAILED: " << lexicon_path << ", cross-word triphones "
+           << cross_word << ":" << endl
+           << "serial:   " << serial_line << endl
+           << "parallel: " << parallel_line << endl;
+      failures++;
+    }
+  }
+  return failures;
+}
+
+int
+main(int argc, char *argv[])
+{
+  if (argc < 3) {
+    cerr << "usage: " << argv[0] << " HMMS LEXICON..." << endl;
+    return 2;
+  }
+  hmm_path = argv[1];
+
+  int failures = 0;
+  try {
+    for (int i = 2; i < argc; i++)
+      failures += test_lexicon(argv[i]);
+  }
+  catch (std::exception &e) {
+    cerr << "FAILED: " << e.what() << endl;
+    failures++;
+  }
+
+  if (failures > 0) {
+    cerr << failures << " checks failed" << endl;
+    return 1;
+  }
+  cout << "All tests passed" << endl;
+  return 0;
+}
@@ -0,0 +1,100 @@
+// Tests that the LM lookahead scores that are queried from the score trees
+// as word ranges are the same as the maximums of scans over the possible
+// word ends of the lookahead nodes.
+//
+// Usage: test_lm_lookahead HMMS LEXICON LM
+
+#include <iostream>
+#include <vector>
+
+#include "Toolbox.hh"
+
+using namespace std;
+
+int
+main(int argc, char *argv[])
+{
+  if (argc != 4) {
+    cerr << "usage: " << argv[0] << " HMMS LEXICON LM" << endl;
+    return 2;
+  }
+
+  int failures = 0;
+  try {
+    Toolbox t(0, argv[1], NULL);
+    t.set_verbose(0);
+    t.set_lm_lookahead(1);
+    t.set_optional_short_silence(1);
+    // The lookahead nodes of the cross-word network can have several word
+    // ranges.
+    t.set_cross_word_triphones(1);
+    t.set_silence_is_word(0);
+    t.lex_read(argv[2]);
+    t.set_sentence_boundary("<s>", "</s>");
+    t.ngram_read(argv[3], 0, true);
+    t.read_lookahead_ngram("", false, true);
+
+    TokenPassSearch &search = t.tp_search();
+    const TPLexPrefixTree &lexicon = t.debug_get_tp_lex();
+    const vector<LMHistory::Word> &words = search.get_word_repository();
+    NGram *lookahead_ngram = search.get_lookahead_ngram();
+
+    int num_nodes = 0, num_multi_range_nodes = 0;
+    int step = words.size() / 100 + 1;
+    vector<float> extensions;
+    vector<int> node_words;
+    for (int prev_word = 0; prev_word < words.size(); prev_word += step) {
+      lookahead_ngram->fetch_bigram_list(words[prev_word].lookahead_lm_id(),
+                                         extensions);
+
+      for (int i = 0; i < lexicon.num_nodes(); i++) {
+        const TPLexPrefixTree::Node *node = lexicon.node(i);
+        if (node == NULL || node->num_word_ranges == 0)
+          continue;
+
+        node_words.clear();
+        lexicon.get_lookahead_words(node, node_words);
+        float expected = -1e10;
+        for (int j = 0; j < node_words.size(); j++) {
+          float score = extensions.at(
+            words[node_words[j]].lookahead_lm_id());
+          if (score > expected)
+            expected = score;
+        }
+
+        float score = search.compute_lm_bigram_lookahead(prev_word, node);
+        if (score != expected) {
+          cerr << "FAILED: node " << i << " with " << node->num_word_ranges
+               << " word ranges after word " << prev_word << ": expected "
+               << expected << ", got " << score << endl;
+          failures++;
+        }
+
+        if (prev_word == 0) {
+          num_nodes++;
+          if (node->num_word_ranges > 1)
+            num_multi_range_nodes++;
+        }
+      }
+    }
+
+    cout << num_nodes << " lookahead nodes, " << num_multi_range_nodes
+         << " with several word ranges" << endl;
+    if (num_multi_range_nodes == 0) {
+      cerr << "FAILED: the lexicon has no lookahead nodes with several word "
+           << "ranges" << endl;
+      failures++;
+    }
+  }
+  catch (std::exception &e) {
+    cerr << "FAILED: " << e.what() << endl;
+    failures++;
+  }
+
+  if (failures > 0) {
+    cerr << failures << " checks failed" << endl;
+    return 1;
+  }
+  cout << "All tests passed" << endl;
+  return 0;
+}
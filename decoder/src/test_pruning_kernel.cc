@@ -0,0 +1,147 @@
+// Tests that the scalar and AVX2 implementations of PruningKernel give the
+// same survivors and histograms for the same scores.
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "PruningKernel.hh"
+#include "test_check.hh"
+
+using namespace std;
+
+static string
+with_scores(const char *message, int num_scores)
+{
+  return string(message) + " with " + to_string(num_scores) + " scores";
+}
+
+// Scores around the limit, with some ties and some impossible scores, like
+// in the active token list.
+static vector<float>
+random_scores(int num_scores, float limit)
+{
+  vector<float> scores(num_scores);
+  for (int i = 0; i < num_scores; i++) {
+    int r = rand() % 100;
+    if (r < 10)
+      scores[i] = limit;
+    else if (r < 15)
+      scores[i] = -1e10;
+    else if (r < 17)
+      scores[i] = -INFINITY;
+    else
+      scores[i] = limit + (rand() % 20001 - 10000) / 100.0;
+  }
+  return scores;
+}
+
+static void
+compare_compact(const PruningKernel &scalar, const PruningKernel &avx2,
+                const vector<float> &scores, float limit)
+{
+  int num_scores = scores.size();
+  vector<float> scalar_scores(scores), avx2_scores(scores);
+  vector<int> scalar_indices(num_scores + 1), avx2_indices(num_scores + 1);
+
+  int scalar_kept = scalar.compact(scalar_scores.data(), num_scores, limit,
+                                   scalar_indices.data());
+  int avx2_kept = avx2.compact(avx2_scores.data(), num_scores, limit,
+                               avx2_indices.data());
+
+  int expected_kept = 0;
+  for (int i = 0; i < num_scores; i++)
+    if (!(scores[i] < limit))
+      expected_kept++;
+  check(scalar_kept == expected_kept,
+        with_scores("scalar compact: number kept", num_scores));
+  check(avx2_kept == scalar_kept,
+        with_scores("compact: number kept", num_scores));
+  if (avx2_kept != scalar_kept)
+    return;
+
+  bool same = true;
+  for (int i = 0; i < scalar_kept; i++) {
+    if (scalar_indices[i] != avx2_indices[i] ||
+        memcmp(&scalar_scores[i], &avx2_scores[i], sizeof(float)) != 0 ||
+        memcmp(&scalar_scores[i], &scores[scalar_indices[i]],
+               sizeof(float)) != 0)
+    {
+      same = false;
+    }
+  }
+  check(same, with_scores("compact: survivors", num_scores));
+}
+
+static void
+compare_histogram(const PruningKernel &scalar, const PruningKernel &avx2,
+                  const vector<float> &scores, float bin_width)
+{
+  int num_scores = scores.size();
+  float min_score = 0, max_score = 0;
+  vector<float> finite_scores;
+  for (int i = 0; i < num_scores; i++) {
+    if (scores[i] > -1e9) {
+      if (finite_scores.empty() || scores[i] < min_score)
+        min_score = scores[i];
+      if (finite_scores.empty() || scores[i] > max_score)
+        max_score = scores[i];
+      finite_scores.push_back(scores[i]);
+    }
+  }
+  int num_bins = (int)floorf((max_score - min_score) / bin_width) + 1;
+
+  vector<int> scalar_bins(num_bins), avx2_bins(num_bins);
+  scalar.histogram(finite_scores.data(), finite_scores.size(), min_score,
+                   bin_width, scalar_bins.data());
+  avx2.histogram(finite_scores.data(), finite_scores.size(), min_score,
+                 bin_width, avx2_bins.data());
+
+  int total = 0;
+  for (int i = 0; i < num_bins; i++)
+    total += scalar_bins[i];
+  check(total == (int)finite_scores.size(),
+        with_scores("scalar histogram: total", num_scores));
+  check(scalar_bins == avx2_bins, with_scores("histogram: bins", num_scores));
+}
+
+int
+main(int argc, char *argv[])
+{
+  PruningKernel scalar;
+  scalar.set_type(PruningKernel::SCALAR);
+  PruningKernel avx2;
+  if (!avx2.set_type(PruningKernel::AVX2)) {
+    cout << "AVX2 is not supported, comparing the scalar implementation "
+         << "with itself" << endl;
+  }
+
+  srand(1);
+  for (int round = 0; round < 20; round++) {
+    for (int num_scores = 0; num_scores < 70; num_scores++) {
+      float limit = -(rand() % 100000) / 10.0;
+      vector<float> scores = random_scores(num_scores, limit);
+      compare_compact(scalar, avx2, scores, limit);
+      compare_histogram(scalar, avx2, scores, 0.5 + rand() % 50);
+    }
+  }
+
+  for (int num_scores = 1000; num_scores <= 100000; num_scores *= 10) {
+    float limit = -2500;
+    vector<float> scores = random_scores(num_scores, limit);
+    compare_compact(scalar, avx2, scores, limit);
+    compare_histogram(scalar, avx2, scores, 3.7);
+  }
+
+  // NaN scores are not below any limit, so both implementations keep them.
+  vector<float> nan_scores(19, -10);
+  for (int i = 0; i < nan_scores.size(); i += 3)
+    nan_scores[i] = NAN;
+  compare_compact(scalar, avx2, nan_scores, 0);
+  compare_compact(scalar, avx2, nan_scores, -20);
+
+  return test_result();
+}
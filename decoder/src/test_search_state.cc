@@ -0,0 +1,179 @@
+// Tests that a search that is saved with save_search_state() and restored
+// with load_search_state() in another decoder finds the same result as a
+// search that was never interrupted, with and without a token memory
+// budget.
+//
+// Usage: test_search_state HMMS LEXICON LM LNA...
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+
+#include "Toolbox.hh"
+
+using namespace std;
+
+struct Result {
+  int frames;
+  string best_path;
+  string word_graph;
+  double total_log_prob;
+  int dropped_tokens;
+  size_t token_memory_peak;
+};
+
+static const char *hmm_path;
+static const char *lexicon_path;
+static const char *lm_path;
+static char state_path[] = "/tmp/test_search_state.XXXXXX";
+
+static string
+file_contents(FILE *file)
+{
+  string contents;
+  char buffer[4096];
+  rewind(file);
+  size_t count;
+  while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    contents.append(buffer, count);
+  return contents;
+}
+
+static void
+setup(Toolbox &t, size_t budget)
+{
+  t.set_verbose(0);
+  t.set_lm_lookahead(1);
+  t.set_optional_short_silence(1);
+  t.set_cross_word_triphones(1);
+  t.set_require_sentence_end(1);
+  t.set_silence_is_word(0);
+  t.lex_read(lexicon_path);
+  t.set_sentence_boundary("<s>", "</s>");
+  t.ngram_read(lm_path, 0, true);
+  t.read_lookahead_ngram("", false, true);
+  t.prune_lm_lookahead_buffers(0, 4);
+  t.set_global_beam(120);
+  t.set_word_end_beam(80);
+  t.set_token_limit(3000);
+  t.set_prune_similar(3);
+  t.set_duration_scale(0);
+  t.set_transition_scale(1);
+  t.set_lm_scale(10);
+  t.set_insertion_penalty(-0.5);
+  t.set_generate_word_graph(true);
+  t.tp_search().set_token_memory_budget(budget);
+}
+
+// Decodes an utterance. If checkpoint_frame is positive, the search is
+// saved at that frame and continued in another decoder.
+static Result
+decode(const char *lna_path, size_t budget, int checkpoint_frame)
+{
+  Toolbox first(0, hmm_path, NULL);
+  setup(first, budget);
+  Toolbox second(0, hmm_path, NULL);
+  setup(second, budget);
+
+  Toolbox *t = &first;
+  first.lna_open(lna_path, 1024);
+  first.reset(0);
+  first.set_end(-1);
+  while (t->run()) {
+    if (t == &first && first.frame() == checkpoint_frame) {
+      first.save_search_state(state_path);
+      second.lna_open(lna_path, 1024);
+      second.load_search_state(state_path);
+      t = &second;
+    }
+  }
+
+  Result result;
+  result.frames = t->frame();
+  FILE *file = tmpfile();
+  t->print_best_lm_history(file);
+  result.best_path = file_contents(file);
+  fclose(file);
+  file = tmpfile();
+  t->tp_search().write_word_graph(file);
+  result.word_graph = file_contents(file);
+  fclose(file);
+  result.total_log_prob = t->tp_search().get_total_log_prob(true);
+  result.dropped_tokens = t->tp_search().num_budget_dropped_tokens();
+  result.token_memory_peak = first.tp_search().token_memory_peak();
+  return result;
+}
+
+static int
+test_checkpoints(const char *lna_path, size_t budget,
+                 const Result &uninterrupted)
+{
+  int failures = 0;
+  for (int part = 1; part <= 3; part++) {
+    int frame = uninterrupted.frames * part / 4;
+    Result restored = decode(lna_path, budget, frame);
+    if (restored.frames != uninterrupted.frames ||
+        restored.best_path != uninterrupted.best_path ||
+        restored.word_graph != uninterrupted.word_graph ||
+        restored.total_log_prob != uninterrupted.total_log_prob ||
+        restored.dropped_tokens != uninterrupted.dropped_tokens)
+    {
+      cerr << "FAILED: " << lna_path << ", budget " << budget
+           << ", restored at frame " << frame << ":" << endl
+           << "uninterrupted: " << uninterrupted.best_path
+           << "restored:      " << restored.best_path;
+      failures++;
+    }
+  }
+  return failures;
+}
+
+int
+main(int argc, char *argv[])
+{
+  if (argc < 5) {
+    cerr << "usage: " << argv[0] << " HMMS LEXICON LM LNA..." << endl;
+    return 2;
+  }
+  hmm_path = argv[1];
+  lexicon_path = argv[2];
+  lm_path = argv[3];
+
+  int fd = mkstemp(state_path);
+  if (fd < 0) {
+    perror("mkstemp");
+    return 2;
+  }
+  close(fd);
+
+  int failures = 0;
+  try {
+    for (int i = 4; i < argc; i++) {
+      Result uninterrupted = decode(argv[i], 0, -1);
+      failures += test_checkpoints(argv[i], 0, uninterrupted);
+
+      // A budget of a quarter of the peak token memory makes the search
+      // drop tokens, so the budget state has to be restored too.
+      size_t budget = uninterrupted.token_memory_peak / 4;
+      Result budgeted = decode(argv[i], budget, -1);
+      if (budgeted.dropped_tokens == 0)
+        cerr << "warning: " << argv[i] << ": the budget of " << budget
+             << " bytes did not drop tokens" << endl;
+      failures += test_checkpoints(argv[i], budget, budgeted);
+    }
+  }
+  catch (std::exception &e) {
+    cerr << "FAILED: " << e.what() << endl;
+    failures++;
+  }
+  unlink(state_path);
+
+  if (failures > 0) {
+    cerr << failures << " checks failed" << endl;
+    return 1;
+  }
+  cout << "All tests passed" << endl;
+  return 0;
+}
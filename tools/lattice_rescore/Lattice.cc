@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include "str.hh"
 #include "Lattice.hh"
+#include "BinaryLattice.hh"
 
 Lattice::Arc::Arc(int target_node_id, std::string label, float ac_log_prob,
 		  float lm_log_prob)
@@ -45,6 +46,14 @@ Lattice::new_arc(int S, int E, std::string W, float a, float l)
 void
 Lattice::read(FILE *file)
 {
+  int c = getc(file);
+  if (c != EOF)
+    ungetc(c, file);
+  if (BinaryLattice::is_binary(c)) {
+    read_binary(file);
+    return;
+  }
+
   m_nodes.clear();
   m_num_arcs = 0;
   final_node_id = -1;
@@ -153,3 +162,56 @@ Lattice::write(FILE *file)
     }
   }
 }
+
+void
+Lattice::read_binary(FILE *file)
+{
+  BinaryLattice binary;
+  try {
+    binary.read(file);
+  }
+  catch (BinaryLattice::FormatError &e) {
+    fprintf(stderr, "ERROR: %s\n", e.what());
+    exit(1);
+  }
+  if (binary.start_node < 0 || binary.end_node < 0) {
+    fprintf(stderr, "ERROR: start and end not specified in binary lattice\n");
+    exit(1);
+  }
+
+  clear();
+  for (int n = 0; n < (int)binary.nodes.size(); n++)
+    new_node();
+  for (int a = 0; a < (int)binary.arcs.size(); a++) {
+    const BinaryLattice::Arc &arc = binary.arcs[a];
+    new_arc(arc.source_node, arc.target_node, binary.word(arc),
+	    arc.am_log_prob, arc.lm_log_prob);
+  }
+  initial_node_id = binary.start_node;
+  final_node_id = binary.end_node;
+}
+
+void
+Lattice::write_binary(FILE *file)
+{
+  // The nodes do not have times, so they are written as -1.
+  BinaryLattice binary;
+  for (int n = 0; n < (int)m_nodes.size(); n++)
+    binary.add_node(-1);
+  for (int n = 0; n < (int)m_nodes.size(); n++) {
+    for (int a = 0; a < (int)m_nodes[n].arcs.size(); a++) {
+      Arc &arc = m_nodes[n].arcs[a];
+      binary.add_arc(n, arc.target_node_id, arc.label, arc.ac_log_prob,
+		     arc.lm_log_prob);
+    }
+  }
+  binary.start_node = initial_node_id;
+  binary.end_node = final_node_id;
+  try {
+    binary.write(file);
+  }
+  catch (BinaryLattice::IOError &e) {
+    fprintf(stderr, "ERROR: %s\n", e.what());
+    exit(1);
+  }
+}
@@ -48,12 +48,19 @@ public:
   /** Create an arc. */
   void new_arc(int S, int E, std::string W, float a, float l);
 
-  /** Read lattice from file in HTK format */
+  /** Read lattice from file in HTK format, or in the binary format if
+   * the file starts with the binary lattice magic. */
   void read(FILE *file);
   
   /** Write lattice in HTK format */
   void write(FILE *file);
 
+  /** Read lattice from file in the binary format (see BinaryLattice) */
+  void read_binary(FILE *file);
+
+  /** Write lattice in the binary format (see BinaryLattice) */
+  void write_binary(FILE *file);
+
   int initial_node_id; //!< Initial node id;
   int final_node_id; //!< Final node id;
 
@@ -54,6 +54,7 @@ main(int argc, char *argv[])
 {
   config("usage: lattice_rescore [OPTION...]\n")
     ('C', "config=FILE", "arg", "", "configuration file")
+    ('b', "binary", "", "", "write output lattices in the binary format")
     ('f', "force", "", "", "force overwriting existing files")
     ('h', "help", "", "", "display help")
     ('l', "lm=FILE", "arg must", "", "language model used in rescoring")
@@ -134,7 +135,11 @@ main(int argc, char *argv[])
 
     if (!quiet)
       fprintf(stderr, "writing %s...", output_file.c_str());
-    rescore.rescored_lattice().write(io::Stream(output_file, "w").file);
+    if (config["binary"].specified)
+      rescore.rescored_lattice().write_binary(
+        io::Stream(output_file, "w").file);
+    else
+      rescore.rescored_lattice().write(io::Stream(output_file, "w").file);
     if (!quiet)
       fprintf(stderr, "\n");
 
@@ -6,10 +6,26 @@
 
 Latticer::Latticer() : 
   morph_set(NULL), 
+  binary(false),
   word_boundary_label("<w>") 
 { 
 }
 
+void
+Latticer::output_arc(FILE *output, int source_pos, int target_pos,
+		     const std::string &label)
+{
+  if (!binary) {
+    fprintf(output, "%d %d %s\n", source_pos, target_pos, label.c_str());
+    return;
+  }
+
+  // The nodes are the positions in the text.
+  while ((int)m_binary_lattice.nodes.size() <= target_pos)
+    m_binary_lattice.add_node(m_binary_lattice.nodes.size());
+  m_binary_lattice.add_arc(source_pos, target_pos, label, 0, 0);
+}
+
 void
 Latticer::create_lattice(FILE *input, FILE *output)
 {
@@ -20,7 +36,8 @@ Latticer::create_lattice(FILE *input, FILE *output)
   bool eof_reached = false;
   bool was_word_boundary = false;
 
-  fprintf(output, "0 1 %s\n", word_boundary_label.c_str());
+  m_binary_lattice.clear();
+  output_arc(output, 0, 1, word_boundary_label);
 
   while (1) {
 
@@ -50,8 +67,8 @@ Latticer::create_lattice(FILE *input, FILE *output)
     if (strchr(" \n\r\t", text[0]) != NULL) {
       text.erase(text.begin());
       if (!was_word_boundary) {
-	fprintf(output, "%d %d %s\n", src_node_pos, src_node_pos + 1,
-		word_boundary_label.c_str());
+	output_arc(output, src_node_pos, src_node_pos + 1,
+		   word_boundary_label);
 	src_node_pos++;
 	if (src_node_pos > last_pos)
 	  last_pos = src_node_pos;
@@ -73,8 +90,7 @@ Latticer::create_lattice(FILE *input, FILE *output)
       // Output a possible morph 
       if (arc->morph.length() > 0) {
 	int tgt_node_pos = src_node_pos + pos + 1;
-	fprintf(output, "%d %d %s\n", src_node_pos, tgt_node_pos,
-		arc->morph.c_str());
+	output_arc(output, src_node_pos, tgt_node_pos, arc->morph);
 	if (tgt_node_pos > last_pos)
 	  last_pos = tgt_node_pos;
       }
@@ -87,5 +103,13 @@ Latticer::create_lattice(FILE *input, FILE *output)
     src_node_pos++;
     text.erase(text.begin());
   }
-  fprintf(output, "%d\n", last_pos);
+  if (!binary) {
+    fprintf(output, "%d\n", last_pos);
+    return;
+  }
+
+  m_binary_lattice.start_node = 0;
+  m_binary_lattice.end_node = last_pos;
+  m_binary_lattice.write(output);
+  m_binary_lattice.clear();
 }
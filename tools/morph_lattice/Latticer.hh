@@ -4,6 +4,7 @@
 #include <string>
 #include <stdio.h>
 #include "MorphSet.hh"
+#include "BinaryLattice.hh"
 
 /** A class for segmenting a text corpus into a morph lattice that
  * contains all possible morph paths through the text. */ 
@@ -16,10 +17,18 @@ public:
   void create_lattice(FILE *input = stdin, FILE *output = stdout);
 
   MorphSet *morph_set; //!< The morph set to use for segmenting the text
+  bool binary; //!< Write a binary lattice instead of the text format
   FILE *input; //!< The file from which the text corpus is read
 
   std::string word_boundary_label; //!< Label for word boundary symbol
   std::string text; //!< A buffer containing part of the text
+
+private:
+  /** Output an arc in the text format or add it to the binary lattice. */
+  void output_arc(FILE *output, int source_pos, int target_pos,
+		  const std::string &label);
+
+  BinaryLattice m_binary_lattice; //!< The lattice when writing binary
 };
 
 #endif /* LATTICER_HH */
@@ -11,6 +11,7 @@ main(int argc, char *argv[])
   config("usage: morph-lattice MORPHSET [INPUT [OUTPUT]]\n")
     ('h', "help", "", "", "display help")
     ('v', "verbosity=INT", "arg", "0", "verbosity level (default 0)")
+    ('b', "binary", "", "", "write a binary lattice instead of FSM text")
     ('C', "config=FILE", "arg", "", "configuration file");
   config.parse(argc, argv);
   if (config["help"].specified) {
@@ -44,6 +45,7 @@ main(int argc, char *argv[])
 
     Latticer latticer;
     latticer.morph_set = &morph_set;
+    latticer.binary = config["binary"].specified;
     io::Stream input_stream(input, "r");
     io::Stream output_stream(output, "w");
     latticer.create_lattice(input_stream.file, output_stream.file);